@@ -0,0 +1,279 @@
+#! /usr/bin/env python3
+"""
+Spawn-latency and pipeline-throughput benchmarks for the core extension,
+each compared against subprocess and os.posix_spawn doing the same work.
+
+Run after building the extension:  python3 bench/bench_core.py
+(or `python3 setup.py bench`, which builds it first and runs every
+benchmark). Prints one JSON object per line. With --baseline FILE, results
+more than --tolerance worse than the same entry in an earlier run are
+reported as "regression" lines and the exit status is 1.
+"""
+
+import argparse
+import json
+import os
+import statistics
+import subprocess
+import sys
+import time
+import tracemalloc
+
+import core
+
+TRUE = "/bin/true"
+REPO = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+
+# The number each bench is judged by for regressions, and which way is better
+PRIMARY = {
+    "spawn": ("p50_us", "lower"),
+    "pipeline": ("mb_per_s", "higher"),
+    "alloc": ("arena_mallocs_per_call", "lower"),
+    "startup": ("ms", "lower"),
+}
+
+
+def percentiles(samples_ns):
+    samples = sorted(samples_ns)
+    p99 = samples[min(len(samples) - 1, int(len(samples) * 0.99))]
+    return round(statistics.median(samples) / 1000, 1), round(p99 / 1000, 1)
+
+
+def time_calls(fn, iterations):
+    fn() # Warm caches (PATH lookup, envp, page faults) before measuring
+    samples = []
+    for _ in range(iterations):
+        start = time.perf_counter_ns()
+        fn()
+        samples.append(time.perf_counter_ns() - start)
+    return samples
+
+
+# --- Spawn latency: /bin/true, launch to reap ---
+
+def posix_spawn_true():
+    pid = os.posix_spawn(TRUE, ["true"], os.environ)
+    os.waitpid(pid, 0)
+
+
+def spawn_impls():
+    fork_shell = core.Shell()
+    posix_shell = core.Shell(spawn_engine="posix_spawn")
+    server_shell = core.Shell(spawn_engine="server")
+    return {
+        "core-fork": lambda: fork_shell.execute([TRUE]),
+        "core-posix_spawn": lambda: posix_shell.execute([TRUE]),
+        "core-server": lambda: server_shell.execute([TRUE]), # Forked by the helper process
+        "core-builtin": lambda: fork_shell.execute(["true"]), # In-process, nothing spawned
+        "subprocess.run": lambda: subprocess.run([TRUE]),
+        "os.posix_spawn": posix_spawn_true,
+    }
+
+
+def bench_spawn(iterations):
+    results = []
+    for impl, fn in spawn_impls().items():
+        p50, p99 = percentiles(time_calls(fn, iterations))
+        results.append({"bench": "spawn", "impl": impl, "iterations": iterations,
+                        "p50_us": p50, "p99_us": p99})
+    return results
+
+
+# --- Pipeline throughput: head -c N /dev/zero | cat x k | wc -c ---
+# core-throughput is the same Shell with pipe_size raised from the default 64 KB
+
+def chain(nbytes, cats):
+    return [["head", "-c", str(nbytes), "/dev/zero"]] + [["cat"]] * cats + [["wc", "-c"]]
+
+
+def core_pipeline(shell, stages):
+    exit_code, error, out = shell.execute_pipeline(stages, capture=True)
+    return bytes(out)
+
+
+def subprocess_pipeline(stages):
+    procs = []
+    stdin = None
+    for i, argv in enumerate(stages):
+        last = i == len(stages) - 1
+        proc = subprocess.Popen(argv, stdin=stdin, stdout=subprocess.PIPE)
+        if stdin is not None:
+            stdin.close() # Only the child reads it now
+        stdin = proc.stdout
+        procs.append(proc)
+        if last:
+            out = proc.stdout.read()
+    for proc in procs:
+        proc.wait()
+    return out
+
+
+def posix_spawn_pipeline(stages):
+    pids = []
+    stdin = None
+    for argv in stages:
+        r, w = os.pipe() # Close-on-exec: children only get the dup2'd copies
+        actions = [(os.POSIX_SPAWN_DUP2, w, 1)]
+        if stdin is not None:
+            actions.append((os.POSIX_SPAWN_DUP2, stdin, 0))
+        pids.append(os.posix_spawnp(argv[0], argv, os.environ, file_actions=actions))
+        os.close(w)
+        if stdin is not None:
+            os.close(stdin)
+        stdin = r
+    with os.fdopen(stdin, "rb") as last:
+        out = last.read()
+    for pid in pids:
+        os.waitpid(pid, 0)
+    return out
+
+
+THROUGHPUT_PIPE_SIZE = 1 << 20 # The unprivileged ceiling (fs.pipe-max-size)
+
+
+def bench_pipeline(megabytes, rounds):
+    nbytes = megabytes << 20
+    shell = core.Shell()
+    throughput = core.Shell()
+    throughput.pipe_size = THROUGHPUT_PIPE_SIZE
+    results = []
+    for cats in (2, 4, 8):
+        stages = chain(nbytes, cats)
+        impls = {
+            "core": lambda: core_pipeline(shell, stages),
+            "core-throughput": lambda: core_pipeline(throughput, stages),
+            "subprocess.Popen": lambda: subprocess_pipeline(stages),
+            "os.posix_spawn": lambda: posix_spawn_pipeline(stages),
+        }
+        for impl, fn in impls.items():
+            if int(fn()) != nbytes:
+                raise RuntimeError(f"{impl}: pipeline lost data")
+            best = min(time_calls(fn, rounds))
+            results.append({"bench": "pipeline", "impl": impl, "stages": cats + 2, "cats": cats,
+                            "mb": megabytes, "mb_per_s": round(megabytes / (best / 1e9), 1)})
+    return results
+
+
+# --- Allocations per call on the binding ---
+
+def bench_alloc(iterations):
+    results = []
+    shell = core.Shell()
+    impls = {
+        "core-execute": lambda: shell.execute([TRUE]),
+        "core-execute_pipeline": lambda: shell.execute_pipeline([[TRUE], [TRUE]]),
+        "subprocess.run": lambda: subprocess.run([TRUE]),
+    }
+    for impl, fn in impls.items():
+        fn()
+        mallocs = shell.argv_arena_mallocs
+        blocks = sys.getallocatedblocks()
+        tracemalloc.start()
+        for _ in range(iterations):
+            fn()
+        _, peak = tracemalloc.get_traced_memory()
+        tracemalloc.stop()
+        results.append({
+            "bench": "alloc", "impl": impl, "iterations": iterations,
+            # Only the core calls draw on the per-Shell argv arena
+            "arena_mallocs_per_call": round((shell.argv_arena_mallocs - mallocs) / iterations, 3),
+            # Python objects still alive afterwards: anything above 0 is a leak
+            "py_blocks_per_call": round((sys.getallocatedblocks() - blocks) / iterations, 3),
+            "py_peak_bytes": peak,
+        })
+    return results
+
+
+# --- LLMShell startup ---
+
+STARTUP = "import shell; shell.LLMShell()"
+
+
+def bench_startup(rounds):
+    # Startup no longer reads the key; a placeholder keeps older trees measurable
+    env = dict(os.environ, GOOGLE_API_KEY=os.environ.get("GOOGLE_API_KEY", "bench"))
+    results = []
+    cold = []
+    for _ in range(rounds):
+        start = time.perf_counter_ns()
+        proc = subprocess.run([sys.executable, "-c", STARTUP], cwd=REPO, env=env,
+                              stdin=subprocess.DEVNULL, stdout=subprocess.DEVNULL,
+                              stderr=subprocess.PIPE)
+        cold.append(time.perf_counter_ns() - start)
+        if proc.returncode != 0:
+            error = proc.stderr.decode(errors="replace").strip().splitlines()
+            return [{"bench": "startup", "impl": "cold", "skipped": error[-1] if error else "failed"}]
+    results.append({"bench": "startup", "impl": "cold", "rounds": rounds,
+                    "ms": round(statistics.median(cold) / 1e6, 1)})
+
+    # Modules already imported: only the construction itself
+    os.environ.setdefault("GOOGLE_API_KEY", env["GOOGLE_API_KEY"])
+    sys.path.insert(0, REPO)
+    import shell
+    warm = time_calls(shell.LLMShell, rounds)
+    results.append({"bench": "startup", "impl": "warm", "rounds": rounds,
+                    "ms": round(statistics.median(warm) / 1e6, 2)})
+    return results
+
+
+# --- Regression check ---
+
+def key(result):
+    return tuple((k, result[k]) for k in ("bench", "impl", "cats") if k in result)
+
+
+def regressions(results, baseline_path, tolerance):
+    with open(baseline_path) as f:
+        baseline = {key(r): r for r in map(json.loads, filter(str.strip, f))}
+    found = []
+    for result in results:
+        before = baseline.get(key(result))
+        metric, better = PRIMARY.get(result["bench"], (None, None))
+        if not before or metric not in result or metric not in before or not before[metric]:
+            continue
+        ratio = result[metric] / before[metric]
+        worse = ratio > 1 + tolerance if better == "lower" else ratio < 1 - tolerance
+        if worse:
+            found.append({"regression": dict(key(result)), "metric": metric,
+                          "baseline": before[metric], "now": result[metric], "ratio": round(ratio, 2)})
+    return found
+
+
+def main(argv=None):
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument("--iterations", type=int, default=2000, help="spawns per implementation")
+    parser.add_argument("--megabytes", type=int, default=64, help="data pushed through each pipeline")
+    parser.add_argument("--rounds", type=int, default=5, help="repeats for pipelines and startup")
+    parser.add_argument("--only", choices=sorted(PRIMARY), action="append", help="run only these benches")
+    parser.add_argument("--output", help="also append the JSON lines to this file")
+    parser.add_argument("--baseline", help="earlier output to compare against")
+    parser.add_argument("--tolerance", type=float, default=0.2, help="allowed slowdown (0.2 = 20%%)")
+    args = parser.parse_args(argv)
+
+    benches = {
+        "spawn": lambda: bench_spawn(args.iterations),
+        "pipeline": lambda: bench_pipeline(args.megabytes, args.rounds),
+        "alloc": lambda: bench_alloc(args.iterations),
+        "startup": lambda: bench_startup(args.rounds),
+    }
+    results = []
+    for name, bench in benches.items():
+        if args.only and name not in args.only:
+            continue
+        for result in bench():
+            results.append(result)
+            print(json.dumps(result), flush=True)
+
+    if args.output:
+        with open(args.output, "a") as f:
+            f.writelines(json.dumps(r) + "\n" for r in results)
+    if args.baseline:
+        found = regressions(results, args.baseline, args.tolerance)
+        for r in found:
+            print(json.dumps(r))
+        return 1 if found else 0
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
@@ -0,0 +1,58 @@
+#! /usr/bin/env python3
+"""
+Command-line parsing benchmark: native core parser vs. the old
+str.split('|') + shlex.split pipeline from handle_command.
+
+Run after building the extension:  python3 bench/bench_parse.py
+Prints one JSON object per line so results can be diffed or collected.
+"""
+
+import json
+import shlex
+import sys
+import time
+
+import core
+
+LINES = [
+    "ls -la",
+    "ls -la --color=auto *.py | grep -v 'foo bar' | wc -l",
+    'git commit -m "fix: handle \\"quoted\\" | pipes" --author "A U Thor <a@example.com>"',
+    " | ".join(f"sed -e 's/{i}/x/g'" for i in range(16)),
+]
+
+
+def python_parse(line):
+    # What handle_command used to do (alias lookup split, pipe split, shlex per stage)
+    line.split(None, 1)
+    try:
+        return [shlex.split(stage) for stage in line.split('|')]
+    except ValueError:
+        return None # A '|' inside quotes splits the quote in two
+
+
+def time_per_call(fn, arg, iterations):
+    start = time.perf_counter_ns()
+    for _ in range(iterations):
+        fn(arg)
+    return (time.perf_counter_ns() - start) / iterations
+
+
+def main(iterations=20000):
+    for line in LINES:
+        native = core.bench_parse(line, iterations)
+        result = {
+            "bench": "parse",
+            "line_bytes": len(line),
+            "native_ns": round(native["ns_per_line"], 1),
+            "native_mallocs": native["mallocs_per_line"],
+            "native_arena_bytes": native["bytes_per_line"],
+            "core_parse_ns": round(time_per_call(core.parse, line, iterations), 1),
+            "shlex_ns": round(time_per_call(python_parse, line, iterations // 10), 1),
+            "shlex_ok": python_parse(line) is not None,
+        }
+        print(json.dumps(result))
+
+
+if __name__ == "__main__":
+    main(int(sys.argv[1]) if len(sys.argv) > 1 else 20000)
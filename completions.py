@@ -5,6 +5,7 @@ Command completion module for shell command suggestions.
 import os
 import glob
 import threading
+import core
 from prompt_toolkit.completion import Completer, Completion
 
 # Debug mode - disabled by default
@@ -20,14 +21,15 @@ class ShellCompleter(Completer):
     
     def __init__(self, core_shell):
         self.core_shell = core_shell  # Store the C shell instance
-        self._path_dirs = os.environ.get('PATH', '').split(os.pathsep)
         
-        # Start with common commands (fast startup)
-        self._command_cache = set([
+        # Start with common commands (fast startup). The index is an
+        # immutable snapshot: the scan builds a new one and swaps it in.
+        self._common_commands = [
             "cd", "exit", "ls", "grep", "cat", "echo", "find",
             "mkdir", "rm", "cp", "mv", "pwd", "touch", "git",
             "python", "pip", "apt", "sudo", "vim", "nano", "ssh"
-        ])
+        ]
+        self._command_index = core.CommandIndex(self._common_commands)
         
         # Scan PATH in background for additional commands
         self._command_cache_complete = False
@@ -42,22 +44,9 @@ class ShellCompleter(Completer):
         }
 
     def _scan_path(self):
-        """Scan PATH directories for executables (runs in background)."""
-        cache = set()
-        for dir_path in self._path_dirs:
-            if not dir_path or not os.path.isdir(dir_path):
-                continue
-            try:
-                for filename in os.listdir(dir_path):
-                    file_path = os.path.join(dir_path, filename)
-                    try:
-                        if os.path.isfile(file_path) and os.access(file_path, os.X_OK):
-                            cache.add(filename)
-                    except OSError:
-                        continue
-            except OSError:
-                continue
-        self._command_cache.update(cache)
+        """Load PATH executables from the C shell's command index (runs in background)."""
+        # Same per-directory cache command lookup uses, built from the shell's PATH
+        self._command_index = self.core_shell.command_index(extra=self._common_commands)
         self._command_cache_complete = True
 
     def _complete_command(self, word_prefix):
@@ -65,11 +54,9 @@ class ShellCompleter(Completer):
         if not word_prefix:
             word_prefix = ""
             
-        results = []
-        for cmd in self._command_cache:
-            if cmd.startswith(word_prefix):
-                results.append(Completion(cmd, start_position=-len(word_prefix)))
-        return results
+        # Binary search over the current snapshot, however large PATH is
+        return [Completion(cmd, start_position=-len(word_prefix))
+                for cmd in self._command_index.complete(word_prefix)]
 
     def _complete_path(self, document):
         """Complete file and directory paths."""
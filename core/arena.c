@@ -0,0 +1,66 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdalign.h>
+#include "arena.h"
+
+#define ARENA_ALIGN alignof(max_align_t)
+
+void arena_init(ShellArena *arena, size_t block_size) {
+    memset(arena, 0, sizeof(*arena));
+    arena->block_size = block_size;
+}
+
+void arena_free(ShellArena *arena) {
+    ArenaBlock *block = arena->first;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->head = arena->first = NULL;
+    arena->bytes = 0;
+}
+
+void arena_reset(ShellArena *arena) {
+    if (!arena->first) return;
+    // Blocks past the first were only needed for an unusually big line
+    ArenaBlock *block = arena->first->next;
+    while (block) {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+    arena->first->next = NULL;
+    arena->first->used = 0;
+    arena->head = arena->first;
+    arena->bytes = 0;
+}
+
+void* arena_alloc(ShellArena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+    ArenaBlock *block = arena->head;
+    if (!block || block->size - block->used < size) {
+        size_t block_size = size > arena->block_size ? size : arena->block_size;
+        ArenaBlock *fresh = malloc(sizeof(ArenaBlock) + block_size);
+        if (!fresh) return NULL;
+        fresh->next = NULL;
+        fresh->size = block_size;
+        fresh->used = 0;
+        if (block) block->next = fresh;
+        else arena->first = fresh;
+        arena->head = block = fresh;
+        arena->mallocs++;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    arena->bytes += size;
+    return ptr;
+}
+
+char* arena_strndup(ShellArena *arena, const char *s, size_t len) {
+    char *copy = arena_alloc(arena, len + 1);
+    if (!copy) return NULL;
+    memcpy(copy, s, len);
+    copy[len] = '\0';
+    return copy;
+}
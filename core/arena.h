@@ -0,0 +1,40 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+#include <stdalign.h>
+
+// One chunk of arena memory; data follows the header
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;           // Usable bytes in this block
+    size_t used;
+    alignas(max_align_t) char data[];
+} ArenaBlock;
+
+// Bump allocator for data that lives exactly as long as one command line.
+// Nothing is freed individually; arena_reset() drops everything at once and
+// keeps the first block, so a reused arena stops calling malloc once warm.
+typedef struct {
+    ArenaBlock *head;      // Block currently allocated from
+    ArenaBlock *first;     // Kept across resets
+    size_t block_size;     // Default size for new blocks
+    size_t mallocs;        // Blocks obtained from malloc so far
+    size_t bytes;          // Bytes handed out since the last reset
+} ShellArena;
+
+void arena_init(ShellArena *arena, size_t block_size);
+
+// Free every block
+void arena_free(ShellArena *arena);
+
+// Forget all allocations, keeping the first block for reuse
+void arena_reset(ShellArena *arena);
+
+// size bytes aligned for any type, or NULL on allocation failure
+void* arena_alloc(ShellArena *arena, size_t size);
+
+// Copy of the first len bytes of s, NUL-terminated
+char* arena_strndup(ShellArena *arena, const char *s, size_t len);
+
+#endif // ARENA_H
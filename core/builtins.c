@@ -0,0 +1,682 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "builtins.h"
+
+// --- Output buffers ---
+
+static void buf_add(BuiltinBuf *b, const char *s, size_t n) {
+    if (b->len + n + 1 > b->cap) {
+        size_t cap = b->cap ? b->cap : 256;
+        while (cap < b->len + n + 1) cap *= 2;
+        char *grown = realloc(b->data, cap);
+        if (!grown) return; // Output is lost, the exit status still stands
+        b->data = grown;
+        b->cap = cap;
+    }
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
+}
+
+static void buf_puts(BuiltinBuf *b, const char *s) {
+    buf_add(b, s, strlen(s));
+}
+
+static void buf_putc(BuiltinBuf *b, char c) {
+    buf_add(b, &c, 1);
+}
+
+static void buf_printf(BuiltinBuf *b, const char *fmt, ...) {
+    char small[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(small, sizeof(small), fmt, ap);
+    va_end(ap);
+    if (n < 0) return;
+    if ((size_t) n < sizeof(small)) { buf_add(b, small, (size_t) n); return; }
+
+    char *big = malloc((size_t) n + 1);
+    if (!big) return;
+    va_start(ap, fmt);
+    vsnprintf(big, (size_t) n + 1, fmt, ap);
+    va_end(ap);
+    buf_add(b, big, (size_t) n);
+    free(big);
+}
+
+// "name: message\n" on the builtin's stderr
+static void builtin_error(BuiltinIO *io, const char *name, const char *fmt, ...) {
+    char msg[512];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    buf_printf(&io->err, "%s: %s\n", name, msg);
+}
+
+// Backslash escape at s (just past the backslash) for echo -e, printf's
+// format and printf %b. Appends the character and returns how many bytes of
+// s it used; sets *stop for \c. octal0: octal needs a leading 0 (\0nnn, echo
+// and %b) rather than being any 1-3 octal digits (\nnn, printf formats).
+static size_t put_escape(BuiltinBuf *b, const char *s, bool octal0, bool *stop) {
+    static const char from[] = "abefnrtv\\\"", to[] = "\a\b\033\f\n\r\t\v\\\"";
+    const char *hit = *s ? strchr(from, *s) : NULL;
+    if (hit) { buf_putc(b, to[hit - from]); return 1; }
+    if (*s == 'c') { *stop = true; return 1; }
+
+    size_t used = 0;
+    int value = 0;
+    if (*s == 'x' && isxdigit((unsigned char) s[1])) {
+        for (used = 1; used < 3 && isxdigit((unsigned char) s[used]); used++) {
+            int c = tolower((unsigned char) s[used]);
+            value = value * 16 + (isdigit(c) ? c - '0' : c - 'a' + 10);
+        }
+        buf_putc(b, (char) value);
+        return used;
+    }
+    if (octal0 ? *s == '0' : (*s >= '0' && *s <= '7')) {
+        size_t start = octal0 ? 1 : 0;
+        for (used = start; used < start + 3 && s[used] >= '0' && s[used] <= '7'; used++) value = value * 8 + (s[used] - '0');
+        buf_putc(b, (char) value);
+        return used;
+    }
+    // Not an escape: keep the backslash
+    buf_putc(b, '\\');
+    return 0;
+}
+
+// Append s with escapes interpreted. Returns false if \c stopped the output.
+static bool put_escaped(BuiltinBuf *b, const char *s, bool octal0) {
+    bool stop = false;
+    while (*s && !stop) {
+        if (*s != '\\') { buf_putc(b, *s++); continue; }
+        s++;
+        s += put_escape(b, s, octal0, &stop);
+    }
+    return !stop;
+}
+
+// Shell variable name: [A-Za-z_][A-Za-z0-9_]*
+static bool valid_name(const char *s, size_t len) {
+    if (len == 0 || !(isalpha((unsigned char) s[0]) || s[0] == '_')) return false;
+    for (size_t i = 1; i < len; i++) {
+        if (!(isalnum((unsigned char) s[i]) || s[i] == '_')) return false;
+    }
+    return true;
+}
+
+// --- Builtins ---
+
+static int bi_true(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    return 0;
+}
+
+static int bi_false(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    return 1;
+}
+
+static int bi_cd(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    if (argc > 2) { builtin_error(io, "cd", "too many arguments"); return 1; }
+    // argv[1], or HOME when there is none
+    const char *path = argc > 1 ? argv[1] : shell_getenv(ctx, "HOME");
+    if (path == NULL) { builtin_error(io, "cd", "HOME not set"); return 1; }
+    if (shell_cd(ctx, path) != 0) {
+        builtin_error(io, "cd", "%s: %s", path, strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+static int bi_pwd(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-L") != 0 && strcmp(argv[i], "-P") != 0) {
+            builtin_error(io, "pwd", "%s: invalid option", argv[i]);
+            return 2;
+        }
+    }
+    // ctx->cwd comes from getcwd(), so it is already the physical path
+    buf_puts(&io->out, ctx->cwd ? ctx->cwd : "");
+    buf_putc(&io->out, '\n');
+    return 0;
+}
+
+static int bi_echo(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    bool newline = true, escapes = false;
+    int i = 1;
+    // Only words made entirely of n, e and E are options, like bash
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strspn(argv[i] + 1, "neE") != strlen(argv[i] + 1)) break;
+        for (const char *p = argv[i] + 1; *p; p++) {
+            if (*p == 'n') newline = false;
+            else escapes = *p == 'e';
+        }
+    }
+    for (int first = i; i < argc; i++) {
+        if (i > first) buf_putc(&io->out, ' ');
+        if (!escapes) buf_puts(&io->out, argv[i]);
+        else if (!put_escaped(&io->out, argv[i], true)) return 0; // \c: nothing more, not even the newline
+    }
+    if (newline) buf_putc(&io->out, '\n');
+    return 0;
+}
+
+// Append value as a double-quoted word for `export -p`
+static void put_quoted(BuiltinBuf *b, const char *value) {
+    buf_putc(b, '"');
+    for (; *value; value++) {
+        if (strchr("\"\\$`", *value)) buf_putc(b, '\\');
+        buf_putc(b, *value);
+    }
+    buf_putc(b, '"');
+}
+
+static int compare_entries(const void *a, const void *b) {
+    return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+// export -p: every variable as `declare -x NAME="value"`, sorted by name
+static int export_list(ShellContext *ctx, BuiltinIO *io) {
+    char *const *envp = env_envp(&ctx->env);
+    size_t n = 0;
+    while (envp && envp[n]) n++;
+    char **sorted = malloc(sizeof(char*) * (n ? n : 1));
+    if (!envp || !sorted) { free(sorted); builtin_error(io, "export", "%s", strerror(ENOMEM)); return 1; }
+    memcpy(sorted, envp, sizeof(char*) * n);
+    qsort(sorted, n, sizeof(char*), compare_entries);
+    for (size_t i = 0; i < n; i++) {
+        const char *eq = strchr(sorted[i], '=');
+        buf_puts(&io->out, "declare -x ");
+        buf_add(&io->out, sorted[i], (size_t) (eq - sorted[i]));
+        buf_putc(&io->out, '=');
+        put_quoted(&io->out, eq + 1);
+        buf_putc(&io->out, '\n');
+    }
+    free(sorted);
+    return 0;
+}
+
+static int bi_export(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    bool remove = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        if (strcmp(argv[i], "-p") == 0) continue;
+        if (strcmp(argv[i], "-n") == 0) { remove = true; continue; }
+        builtin_error(io, "export", "%s: invalid option", argv[i]);
+        return 2;
+    }
+    if (i == argc) return export_list(ctx, io);
+
+    int status = 0;
+    for (; i < argc; i++) {
+        const char *word = argv[i];
+        const char *eq = strchr(word, '=');
+        size_t name_len = eq ? (size_t) (eq - word) : strlen(word);
+        bool append = eq && name_len > 0 && word[name_len - 1] == '+';
+        if (append) name_len--;
+        if (!valid_name(word, name_len)) {
+            builtin_error(io, "export", "`%s': not a valid identifier", word);
+            status = 1;
+            continue;
+        }
+        char name[name_len + 1];
+        memcpy(name, word, name_len);
+        name[name_len] = '\0';
+
+        int r = 0;
+        if (remove) {
+            // There are no unexported shell variables, so -n just unsets
+            r = shell_unsetenv(ctx, name);
+        } else if (eq && append) {
+            const char *old = shell_getenv(ctx, name);
+            size_t old_len = old ? strlen(old) : 0;
+            char *value = malloc(old_len + strlen(eq + 1) + 1);
+            if (!value) { r = -1; errno = ENOMEM; }
+            else {
+                memcpy(value, old ? old : "", old_len);
+                strcpy(value + old_len, eq + 1);
+                r = shell_setenv(ctx, name, value);
+                free(value);
+            }
+        } else if (eq) {
+            r = shell_setenv(ctx, name, eq + 1);
+        }
+        // A bare NAME is already exported if it is set at all
+        if (r < 0) {
+            builtin_error(io, "export", "%s: %s", name, strerror(errno));
+            status = 1;
+        }
+    }
+    return status;
+}
+
+static int bi_unset(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        // -v (the default) and -f: there are no functions, so nothing to do for those
+        if (strcmp(argv[i], "-v") == 0 || strcmp(argv[i], "-f") == 0) continue;
+        builtin_error(io, "unset", "%s: invalid option", argv[i]);
+        return 2;
+    }
+    int status = 0;
+    for (; i < argc; i++) {
+        if (!valid_name(argv[i], strlen(argv[i]))) {
+            builtin_error(io, "unset", "`%s': not a valid identifier", argv[i]);
+            status = 1;
+            continue;
+        }
+        shell_unsetenv(ctx, argv[i]);
+    }
+    return status;
+}
+
+static int bi_type(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    bool terse = false, path_only = false, force_path = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++) {
+        if (strcmp(argv[i], "--") == 0) { i++; break; }
+        for (const char *p = argv[i] + 1; *p; p++) {
+            if (*p == 't') terse = true;
+            else if (*p == 'p') path_only = true;
+            else if (*p == 'P') force_path = true;
+            else if (*p != 'a') { builtin_error(io, "type", "-%c: invalid option", *p); return 2; }
+        }
+    }
+    int status = 0;
+    for (; i < argc; i++) {
+        const char *name = argv[i];
+        if (!force_path && builtin_lookup(name)) {
+            if (terse) buf_puts(&io->out, "builtin\n");
+            else if (!path_only) buf_printf(&io->out, "%s is a shell builtin\n", name);
+            continue;
+        }
+        const char *path = shell_which(ctx, name);
+        if (path) {
+            if (terse) buf_puts(&io->out, "file\n");
+            else if (path_only || force_path) buf_printf(&io->out, "%s\n", path);
+            else buf_printf(&io->out, "%s is %s\n", name, path);
+            continue;
+        }
+        if (!terse && !path_only && !force_path) builtin_error(io, "type", "%s: not found", name);
+        status = 1;
+    }
+    return status;
+}
+
+// --- test / [ ---
+
+typedef struct {
+    char *const *argv;     // Operands, without the command name (and `]`)
+    int end;
+    int pos;
+    const char *name;      // "test" or "[", for messages
+    BuiltinIO *io;
+    int dirfd;             // Relative file operands resolve against it (shell_dirfd)
+    bool failed;           // Syntax or integer error: exit status 2
+} TestParser;
+
+static bool test_error(TestParser *t, const char *fmt, const char *arg) {
+    if (!t->failed) {
+        if (arg) builtin_error(t->io, t->name, fmt, arg);
+        else builtin_error(t->io, t->name, "%s", fmt);
+    }
+    t->failed = true;
+    return false;
+}
+
+static bool is_unary(const char *op) {
+    return op[0] == '-' && op[1] && !op[2] && strchr("bcdefghknprstuwxzGLOS", op[1]);
+}
+
+static const char *const binary_ops[] = {
+    "=", "==", "!=", "<", ">", "-eq", "-ne", "-lt", "-le", "-gt", "-ge", "-nt", "-ot", "-ef", NULL,
+};
+
+static bool is_binary(const char *op) {
+    for (int i = 0; binary_ops[i]; i++) {
+        if (strcmp(op, binary_ops[i]) == 0) return true;
+    }
+    return false;
+}
+
+// Decimal integer operand, surrounding blanks allowed
+static bool test_integer(TestParser *t, const char *s, long long *value) {
+    char *end;
+    errno = 0;
+    *value = strtoll(s, &end, 10);
+    while (*end == ' ' || *end == '\t') end++;
+    const char *p = s;
+    while (*p == ' ' || *p == '\t') p++;
+    if (end == p || *end || errno == ERANGE) return test_error(t, "%s: integer expression expected", s);
+    return true;
+}
+
+static bool test_unary(TestParser *t, char op, const char *arg) {
+    struct stat st;
+    switch (op) {
+    case 'z': return arg[0] == '\0';
+    case 'n': return arg[0] != '\0';
+    case 't': {
+        long long fd;
+        return test_integer(t, arg, &fd) && fd >= 0 && fd <= 1024 && isatty((int) fd);
+    }
+    case 'r': return faccessat(t->dirfd, arg, R_OK, 0) == 0;
+    case 'w': return faccessat(t->dirfd, arg, W_OK, 0) == 0;
+    case 'x': return faccessat(t->dirfd, arg, X_OK, 0) == 0;
+    case 'h':
+    case 'L': return fstatat(t->dirfd, arg, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISLNK(st.st_mode);
+    }
+    if (fstatat(t->dirfd, arg, &st, 0) != 0) return false;
+    switch (op) {
+    case 'e': return true;
+    case 'f': return S_ISREG(st.st_mode);
+    case 'd': return S_ISDIR(st.st_mode);
+    case 'b': return S_ISBLK(st.st_mode);
+    case 'c': return S_ISCHR(st.st_mode);
+    case 'p': return S_ISFIFO(st.st_mode);
+    case 'S': return S_ISSOCK(st.st_mode);
+    case 's': return st.st_size > 0;
+    case 'g': return (st.st_mode & S_ISGID) != 0;
+    case 'u': return (st.st_mode & S_ISUID) != 0;
+    case 'k': return (st.st_mode & S_ISVTX) != 0;
+    case 'O': return st.st_uid == geteuid();
+    case 'G': return st.st_gid == getegid();
+    }
+    return false;
+}
+
+static bool test_binary(TestParser *t, const char *a, const char *op, const char *b) {
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(a, b) == 0;
+    if (strcmp(op, "!=") == 0) return strcmp(a, b) != 0;
+    if (strcmp(op, "<") == 0) return strcmp(a, b) < 0;
+    if (strcmp(op, ">") == 0) return strcmp(a, b) > 0;
+
+    if (op[1] == 'n' || op[1] == 'o' || (op[1] == 'e' && op[2] == 'f')) {
+        // -nt, -ot, -ef: compare the files
+        struct stat sa, sb;
+        bool has_a = fstatat(t->dirfd, a, &sa, 0) == 0, has_b = fstatat(t->dirfd, b, &sb, 0) == 0;
+        if (strcmp(op, "-ef") == 0) return has_a && has_b && sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino;
+        if (!has_a || !has_b) return strcmp(op, "-nt") == 0 ? has_a : has_b;
+        long long ta = (long long) sa.st_mtim.tv_sec * 1000000000 + sa.st_mtim.tv_nsec;
+        long long tb = (long long) sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+        return strcmp(op, "-nt") == 0 ? ta > tb : ta < tb;
+    }
+
+    long long x, y;
+    if (!test_integer(t, a, &x) || !test_integer(t, b, &y)) return false;
+    if (strcmp(op, "-eq") == 0) return x == y;
+    if (strcmp(op, "-ne") == 0) return x != y;
+    if (strcmp(op, "-lt") == 0) return x < y;
+    if (strcmp(op, "-le") == 0) return x <= y;
+    if (strcmp(op, "-gt") == 0) return x > y;
+    return x >= y;
+}
+
+static bool test_or(TestParser *t);
+
+static bool test_primary(TestParser *t) {
+    if (t->pos >= t->end) return test_error(t, "argument expected", NULL);
+    const char *a = t->argv[t->pos];
+    // `a OP b` wins over everything else when it fits, so [ "(" = "(" ] compares strings
+    if (t->pos + 2 < t->end && is_binary(t->argv[t->pos + 1])) {
+        t->pos += 3;
+        return test_binary(t, a, t->argv[t->pos - 2], t->argv[t->pos - 1]);
+    }
+    if (strcmp(a, "(") == 0 && t->pos + 1 < t->end) {
+        t->pos++;
+        bool value = test_or(t);
+        if (t->pos >= t->end || strcmp(t->argv[t->pos], ")") != 0) return test_error(t, "`)' expected", NULL);
+        t->pos++;
+        return value;
+    }
+    if (is_unary(a) && t->pos + 1 < t->end) {
+        t->pos += 2;
+        return test_unary(t, a[1], t->argv[t->pos - 1]);
+    }
+    // A lone word (operators included) is true if it isn't empty
+    t->pos++;
+    return a[0] != '\0';
+}
+
+static bool test_not(TestParser *t) {
+    // `! a OP b` with nothing after is still a negation, but `! OP b` is a comparison
+    if (t->pos + 1 < t->end && strcmp(t->argv[t->pos], "!") == 0
+        && !(t->end - t->pos == 3 && is_binary(t->argv[t->pos + 1]))) {
+        t->pos++;
+        return !test_not(t);
+    }
+    return test_primary(t);
+}
+
+static bool test_and(TestParser *t) {
+    bool value = test_not(t);
+    while (!t->failed && t->pos < t->end && strcmp(t->argv[t->pos], "-a") == 0) {
+        t->pos++;
+        bool rhs = test_not(t); // Parsed even when value is false, to find syntax errors
+        value = value && rhs;
+    }
+    return value;
+}
+
+static bool test_or(TestParser *t) {
+    bool value = test_and(t);
+    while (!t->failed && t->pos < t->end && strcmp(t->argv[t->pos], "-o") == 0) {
+        t->pos++;
+        bool rhs = test_and(t);
+        value = value || rhs;
+    }
+    return value;
+}
+
+static int bi_test(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    TestParser t = { .argv = argv + 1, .end = argc - 1, .name = argv[0], .io = io,
+                     .dirfd = shell_dirfd(ctx) };
+    if (strcmp(argv[0], "[") == 0) {
+        if (argc < 2 || strcmp(argv[argc - 1], "]") != 0) {
+            builtin_error(io, "[", "missing `]'");
+            return 2;
+        }
+        t.end--;
+    }
+    if (t.end == 0) return 1; // No expression is false
+    bool value = test_or(&t);
+    if (!t.failed && t.pos < t.end) test_error(&t, "%s: unexpected argument", t.argv[t.pos]);
+    if (t.failed) return 2;
+    return value ? 0 : 1;
+}
+
+// --- printf ---
+
+// Numeric printf argument: C integer syntax (0x.., 0..), or 'c for a character code
+static long long printf_integer(BuiltinIO *io, const char *arg, int *status) {
+    if (!arg || !*arg) return 0;
+    if (arg[0] == '\'' || arg[0] == '"') return (unsigned char) arg[1];
+    char *end;
+    errno = 0;
+    long long value = strtoll(arg, &end, 0);
+    if (*end || end == arg || errno == ERANGE) {
+        builtin_error(io, "printf", "%s: invalid number", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+static double printf_double(BuiltinIO *io, const char *arg, int *status) {
+    if (!arg || !*arg) return 0;
+    if (arg[0] == '\'' || arg[0] == '"') return (unsigned char) arg[1];
+    char *end;
+    double value = strtod(arg, &end);
+    if (*end || end == arg) {
+        builtin_error(io, "printf", "%s: invalid number", arg);
+        *status = 1;
+    }
+    return value;
+}
+
+static int bi_printf(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io) {
+    int first = argc > 1 && strcmp(argv[1], "--") == 0 ? 2 : 1;
+    if (first >= argc) {
+        builtin_error(io, "printf", "usage: printf format [arguments]");
+        return 2;
+    }
+    const char *format = argv[first];
+    int next = first + 1, status = 0;
+
+    // The format is reused until every argument has been consumed
+    do {
+        int start_next = next;
+        for (const char *p = format; *p; ) {
+            if (*p == '\\') {
+                bool stop = false;
+                p++;
+                p += put_escape(&io->out, p, false, &stop);
+                if (stop) return status;
+                continue;
+            }
+            if (*p != '%') { buf_putc(&io->out, *p++); continue; }
+            if (p[1] == '%') { buf_putc(&io->out, '%'); p += 2; continue; }
+
+            // %[flags][width][.precision]conversion, handed to snprintf with a length modifier
+            const char *spec = p++;
+            p += strspn(p, "-+ #0");
+            p += strspn(p, "0123456789");
+            if (*p == '.') { p++; p += strspn(p, "0123456789"); }
+            char conv = *p;
+            size_t spec_len = (size_t) (p - spec);
+            if (!conv) { builtin_error(io, "printf", "`%s': missing format character", spec); return 1; }
+            if (spec_len > 24) { builtin_error(io, "printf", "`%s': format too long", spec); return 1; }
+            p++;
+            char fmt[32];
+            memcpy(fmt, spec, spec_len);
+            const char *arg = next < argc ? argv[next++] : NULL;
+
+            switch (conv) {
+            case 's':
+            case 'b': {
+                BuiltinBuf text = { 0 };
+                bool go_on = true;
+                if (conv == 'b' && arg) go_on = put_escaped(&text, arg, true);
+                strcpy(fmt + spec_len, "s");
+                buf_printf(&io->out, fmt, conv == 'b' ? (text.data ? text.data : "") : (arg ? arg : ""));
+                free(text.data);
+                if (!go_on) return status; // \c in %b ends the output
+                break;
+            }
+            case 'c': {
+                char c[2] = { arg ? arg[0] : '\0', '\0' };
+                strcpy(fmt + spec_len, "s");
+                buf_printf(&io->out, fmt, c);
+                break;
+            }
+            case 'd':
+            case 'i':
+                strcpy(fmt + spec_len, "lld");
+                buf_printf(&io->out, fmt, printf_integer(io, arg, &status));
+                break;
+            case 'u':
+            case 'o':
+            case 'x':
+            case 'X':
+                fmt[spec_len] = 'l';
+                fmt[spec_len + 1] = 'l';
+                fmt[spec_len + 2] = conv;
+                fmt[spec_len + 3] = '\0';
+                buf_printf(&io->out, fmt, (unsigned long long) printf_integer(io, arg, &status));
+                break;
+            case 'f': case 'F': case 'e': case 'E': case 'g': case 'G': case 'a': case 'A':
+                fmt[spec_len] = conv;
+                fmt[spec_len + 1] = '\0';
+                buf_printf(&io->out, fmt, printf_double(io, arg, &status));
+                break;
+            default:
+                builtin_error(io, "printf", "`%c': invalid format character", conv);
+                return 1;
+            }
+        }
+        // A format without conversions prints once, whatever the arguments
+        if (next == start_next) break;
+    } while (next < argc);
+    return status;
+}
+
+// --- Dispatch ---
+
+// Perfect hash over the names below, found by search: distinct for each of
+// them, and anything longer than the longest name is rejected up front
+#define BUILTIN_SLOTS 16
+#define BUILTIN_MAX_NAME 6
+
+static unsigned builtin_hash(const char *name, size_t len) {
+    return ((unsigned char) name[0] * 5u + (unsigned char) name[1] * 15u + (unsigned) len) & (BUILTIN_SLOTS - 1);
+}
+
+static const ShellBuiltin builtin_table[BUILTIN_SLOTS] = {
+    [0]  = { "unset", bi_unset },
+    [2]  = { "false", bi_false },
+    [3]  = { "test", bi_test },
+    [4]  = { "printf", bi_printf },
+    [6]  = { "true", bi_true },
+    [7]  = { "export", bi_export },
+    [8]  = { "[", bi_test },
+    [10] = { "echo", bi_echo },
+    [12] = { "pwd", bi_pwd },
+    [13] = { "cd", bi_cd },
+    [15] = { "type", bi_type },
+};
+
+const ShellBuiltin* builtin_lookup(const char *name) {
+    if (!name || !name[0]) return NULL;
+    size_t len = strnlen(name, BUILTIN_MAX_NAME + 1);
+    if (len > BUILTIN_MAX_NAME) return NULL;
+    const ShellBuiltin *slot = &builtin_table[builtin_hash(name, len)];
+    return slot->name && strcmp(slot->name, name) == 0 ? slot : NULL;
+}
+
+// write() all of buf, retrying short writes
+static int write_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t) n;
+    }
+    return 0;
+}
+
+int builtin_run(ShellContext *ctx, const ShellBuiltin *builtin, int argc, char *const argv[],
+                int out_fd, int err_fd, char **error) {
+    BuiltinIO io = { { 0 }, { 0 } };
+    int status = builtin->fn(ctx, argc, argv, &io);
+
+    // Whatever ends up on the run's own stderr becomes the error message
+    BuiltinBuf text = { 0 };
+    if (out_fd < 0) {
+        text = io.out; // 1>&2
+    } else {
+        if (io.out.len > 0 && write_all(out_fd, io.out.data, io.out.len) < 0) {
+            builtin_error(&io, argv[0], "write error: %s", strerror(errno));
+            status = 1;
+        }
+        free(io.out.data);
+    }
+    if (err_fd < 0) {
+        if (io.err.len > 0) buf_add(&text, io.err.data, io.err.len);
+    } else if (io.err.len > 0 && write_all(err_fd, io.err.data, io.err.len) < 0) {
+        status = 1; // 2>file: nowhere left to report it
+    }
+    free(io.err.data);
+    *error = text.data; // NULL if nothing was written to it
+    return status;
+}
@@ -0,0 +1,40 @@
+#ifndef BUILTINS_H
+#define BUILTINS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "shell.h"
+
+// Growable output buffer: a builtin's stdout or stderr, written out (or
+// kept as the error message) once it returns
+typedef struct {
+    char *data;
+    size_t len;
+    size_t cap;
+} BuiltinBuf;
+
+typedef struct {
+    BuiltinBuf out;        // Goes to the run's stdout (or its capture memfd)
+    BuiltinBuf err;        // Becomes the run's error message
+} BuiltinIO;
+
+// A builtin gets the whole argv (argv[0] is its name) and returns its exit status
+typedef int (*BuiltinFn)(ShellContext *ctx, int argc, char *const argv[], BuiltinIO *io);
+
+typedef struct {
+    const char *name;
+    BuiltinFn fn;
+} ShellBuiltin;
+
+// Builtin called name, or NULL. One hash and one strcmp: the table is
+// perfect-hashed over the fixed set of names.
+const ShellBuiltin* builtin_lookup(const char *name);
+
+// Run a builtin in-process, writing its output to out_fd and its messages
+// to err_fd. Returns its exit status. With err_fd < 0, *error is its stderr
+// text (malloc'd), NULL if it printed none; out_fd < 0 sends the output
+// there too (1>&2).
+int builtin_run(ShellContext *ctx, const ShellBuiltin *builtin, int argc, char *const argv[],
+                int out_fd, int err_fd, char **error);
+
+#endif // BUILTINS_H
@@ -0,0 +1,280 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cmd_cache.h"
+
+#define CMD_CACHE_MIN_CAP 64
+#define DEFAULT_PATH "/bin:/usr/bin" // What execvp uses when PATH is unset
+
+// FNV-1a, same as the environment table
+static uint32_t cmd_hash(const char *name) {
+    uint32_t h = 2166136261u;
+    for (; *name; name++) {
+        h ^= (unsigned char) *name;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void free_listing(CmdDir *dir) {
+    for (size_t i = 0; i < dir->num_names; i++) free(dir->names[i]);
+    free(dir->names);
+    dir->names = NULL;
+    dir->num_names = 0;
+}
+
+static void free_entries(ShellCmdCache *cache) {
+    for (size_t i = 0; i < cache->cap; i++) {
+        free(cache->entries[i].name);
+        free(cache->entries[i].path);
+    }
+    memset(cache->entries, 0, sizeof(CmdEntry) * cache->cap);
+    cache->count = 0;
+}
+
+static void free_dirs(ShellCmdCache *cache) {
+    for (int i = 0; i < cache->num_dirs; i++) {
+        free(cache->dirs[i].path);
+        free_listing(&cache->dirs[i]);
+    }
+    free(cache->dirs);
+    free(cache->path_value);
+    cache->dirs = NULL;
+    cache->num_dirs = 0;
+    cache->path_value = NULL;
+}
+
+// Slot holding name, or the empty slot it would go in
+static CmdEntry* find_slot(const ShellCmdCache *cache, const char *name, uint32_t hash) {
+    size_t mask = cache->cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        CmdEntry *e = &cache->entries[i];
+        if (!e->name || (e->hash == hash && strcmp(e->name, name) == 0)) return e;
+    }
+}
+
+// Rebuild the table without the entries found in dir or later, which are
+// the ones a change to dir can make stale. Rare, so no tombstones needed.
+static void drop_from_dir(ShellCmdCache *cache, int dir) {
+    CmdEntry *old = cache->entries;
+    CmdEntry *fresh = calloc(cache->cap, sizeof(CmdEntry));
+    if (!fresh) { free_entries(cache); return; } // Dropping everything is always correct
+    cache->entries = fresh;
+    cache->count = 0;
+    for (size_t i = 0; i < cache->cap; i++) {
+        if (!old[i].name) continue;
+        if (old[i].dir >= dir) {
+            free(old[i].name);
+            free(old[i].path);
+            continue;
+        }
+        *find_slot(cache, old[i].name, old[i].hash) = old[i];
+        cache->count++;
+    }
+    free(old);
+}
+
+// stat() a PATH directory and invalidate what depends on it if it changed.
+// Returns true if it changed since the previous check.
+static bool check_dir(ShellCmdCache *cache, int d) {
+    CmdDir *dir = &cache->dirs[d];
+    struct stat st;
+    bool exists = stat(dir->path, &st) == 0 && S_ISDIR(st.st_mode);
+    struct timespec mtime = exists ? st.st_mtim : (struct timespec) { 0, 0 };
+
+    bool changed = dir->checked && (exists != dir->exists ||
+                                    mtime.tv_sec != dir->mtime.tv_sec ||
+                                    mtime.tv_nsec != dir->mtime.tv_nsec);
+    dir->checked = true;
+    dir->exists = exists;
+    dir->mtime = mtime;
+    if (changed) {
+        drop_from_dir(cache, d);
+        free_listing(dir);
+    }
+    return changed;
+}
+
+static bool is_executable_file(int dirfd, const char *name) {
+    struct stat st;
+    return fstatat(dirfd, name, &st, 0) == 0 && S_ISREG(st.st_mode) &&
+           faccessat(dirfd, name, X_OK, 0) == 0;
+}
+
+int cmd_cache_set_path(ShellCmdCache *cache, const char *path_value) {
+    free_dirs(cache);
+    free_entries(cache);
+    if (!path_value) path_value = DEFAULT_PATH;
+
+    cache->path_value = strdup(path_value);
+    if (!cache->path_value) return -1;
+
+    int n = 1;
+    for (const char *p = path_value; *p; p++) if (*p == ':') n++;
+    cache->dirs = calloc(n, sizeof(CmdDir));
+    if (!cache->dirs) return -1;
+
+    const char *start = path_value;
+    for (int i = 0; i < n; i++) {
+        const char *end = strchr(start, ':');
+        size_t len = end ? (size_t) (end - start) : strlen(start);
+        // An empty entry means the current directory, as in execvp
+        cache->dirs[i].path = len ? strndup(start, len) : strdup(".");
+        if (!cache->dirs[i].path) return -1;
+        cache->dirs[i].absolute = cache->dirs[i].path[0] == '/';
+        cache->num_dirs++;
+        start = end ? end + 1 : start + len;
+    }
+    return 0;
+}
+
+int cmd_cache_init(ShellCmdCache *cache, const char *path_value) {
+    memset(cache, 0, sizeof(*cache));
+    cache->entries = calloc(CMD_CACHE_MIN_CAP, sizeof(CmdEntry));
+    if (!cache->entries) return -1;
+    cache->cap = CMD_CACHE_MIN_CAP;
+    if (cmd_cache_set_path(cache, path_value) < 0) {
+        cmd_cache_free(cache);
+        return -1;
+    }
+    return 0;
+}
+
+void cmd_cache_free(ShellCmdCache *cache) {
+    if (cache->entries) free_entries(cache);
+    free(cache->entries);
+    free_dirs(cache);
+    memset(cache, 0, sizeof(*cache));
+}
+
+static int grow(ShellCmdCache *cache) {
+    CmdEntry *old = cache->entries;
+    size_t old_cap = cache->cap;
+    CmdEntry *fresh = calloc(old_cap * 2, sizeof(CmdEntry));
+    if (!fresh) return -1;
+    cache->entries = fresh;
+    cache->cap = old_cap * 2;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].name) *find_slot(cache, old[i].name, old[i].hash) = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+const char* cmd_cache_lookup(ShellCmdCache *cache, const char *name) {
+    if (!name || !*name || strchr(name, '/')) return NULL; // exec uses it as given
+
+    uint32_t hash = cmd_hash(name);
+    CmdEntry *e = find_slot(cache, name, hash);
+    if (e->name) {
+        // Still valid if neither its directory nor any before it changed
+        bool stale = false;
+        for (int d = 0; d <= e->dir && !stale; d++) stale = check_dir(cache, d);
+        if (!stale) {
+            cache->hits++;
+            return e->path;
+        }
+    }
+
+    // Walk PATH like execvp would
+    cache->misses++;
+    for (int d = 0; d < cache->num_dirs; d++) {
+        CmdDir *dir = &cache->dirs[d];
+        if (!dir->absolute) return NULL; // Depends on the cwd, leave it to exec
+        check_dir(cache, d);
+        if (!dir->exists) continue;
+
+        char *path;
+        if (asprintf(&path, "%s/%s", dir->path, name) < 0) return NULL;
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode) || access(path, X_OK) != 0) {
+            free(path);
+            continue;
+        }
+
+        if ((cache->count + 1) * 4 > cache->cap * 3 && grow(cache) < 0) {
+            free(path);
+            return NULL;
+        }
+        e = find_slot(cache, name, hash);
+        e->name = strdup(name);
+        if (!e->name) { free(path); return NULL; }
+        e->path = path;
+        e->dir = d;
+        e->hash = hash;
+        cache->count++;
+        return e->path;
+    }
+    return NULL; // Not found; exec reports ENOENT
+}
+
+// Read the executables in one directory into dir->names
+static int list_dir(CmdDir *dir) {
+    DIR *dp = opendir(dir->path);
+    if (!dp) return 0; // Unreadable directories just contribute nothing
+
+    size_t cap = 64;
+    dir->names = malloc(sizeof(char*) * cap);
+    if (!dir->names) { closedir(dp); return -1; }
+
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        if (de->d_name[0] == '.' && (de->d_name[1] == '\0' || (de->d_name[1] == '.' && de->d_name[2] == '\0'))) continue;
+        if (de->d_type != DT_REG && de->d_type != DT_LNK && de->d_type != DT_UNKNOWN) continue;
+        if (!is_executable_file(dirfd(dp), de->d_name)) continue;
+        if (dir->num_names == cap) {
+            char **grown = realloc(dir->names, sizeof(char*) * cap * 2);
+            if (!grown) { closedir(dp); return -1; }
+            dir->names = grown;
+            cap *= 2;
+        }
+        if (!(dir->names[dir->num_names] = strdup(de->d_name))) { closedir(dp); return -1; }
+        dir->num_names++;
+    }
+    closedir(dp);
+    return 0;
+}
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+int cmd_cache_list(ShellCmdCache *cache, const char ***names, size_t *count) {
+    size_t total = 0;
+    for (int d = 0; d < cache->num_dirs; d++) {
+        CmdDir *dir = &cache->dirs[d];
+        if (dir->absolute) {
+            check_dir(cache, d);
+        } else {
+            free_listing(dir); // Depends on the cwd, so never reused
+        }
+        if (!dir->names && (dir->exists || !dir->absolute) && list_dir(dir) < 0) {
+            free_listing(dir);
+            return -1;
+        }
+        total += dir->num_names;
+    }
+
+    const char **all = malloc(sizeof(char*) * (total ? total : 1));
+    if (!all) return -1;
+    size_t n = 0;
+    for (int d = 0; d < cache->num_dirs; d++) {
+        for (size_t i = 0; i < cache->dirs[d].num_names; i++) all[n++] = cache->dirs[d].names[i];
+    }
+    qsort(all, n, sizeof(char*), compare_names);
+
+    // Same name in several directories: keep one
+    size_t unique = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (unique == 0 || strcmp(all[unique - 1], all[i]) != 0) all[unique++] = all[i];
+    }
+    *names = all;
+    *count = unique;
+    return 0;
+}
@@ -0,0 +1,65 @@
+#ifndef CMD_CACHE_H
+#define CMD_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// A resolved command: name -> absolute path
+typedef struct {
+    char *name;            // Command name (key), NULL if the slot is empty
+    char *path;            // Absolute path it resolved to
+    int dir;               // Index of the PATH directory it was found in
+    uint32_t hash;         // Hash of name
+} CmdEntry;
+
+// One PATH directory and what we last saw of it
+typedef struct {
+    char *path;            // Directory as written in PATH
+    bool absolute;         // Relative entries depend on the cwd and are never cached
+    bool checked;          // stat() has been done since PATH was set
+    bool exists;           // Directory existed at the last check
+    struct timespec mtime; // Its mtime at the last check
+    char **names;          // Executables in it (from cmd_cache_list), NULL until listed
+    size_t num_names;
+} CmdDir;
+
+// Command resolution cache, like bash's `hash` table.
+// Lookups go to the PATH directory a command was found in without walking
+// PATH again. Entries are dropped when PATH changes, and when the mtime of
+// the directory they live in, or of any directory before it, changes
+// (a new file there would now shadow them).
+typedef struct {
+    char *path_value;      // PATH the directories were parsed from
+    CmdDir *dirs;
+    int num_dirs;
+    CmdEntry *entries;     // Open-addressing table, cap is a power of two
+    size_t cap;
+    size_t count;
+    unsigned long hits;    // Lookups answered from the table
+    unsigned long misses;  // Lookups that had to walk PATH
+} ShellCmdCache;
+
+// Start with the given PATH (NULL = the exec default "/bin:/usr/bin").
+// Returns 0, or -1 on allocation failure.
+int cmd_cache_init(ShellCmdCache *cache, const char *path_value);
+
+// Free everything
+void cmd_cache_free(ShellCmdCache *cache);
+
+// Forget every resolution and directory listing, and re-parse PATH
+int cmd_cache_set_path(ShellCmdCache *cache, const char *path_value);
+
+// Absolute path of an executable called name, or NULL if it is not found in
+// an absolute PATH directory (names containing '/' are never looked up;
+// NULL means "let exec search for it"). Valid until the next cache call.
+const char* cmd_cache_lookup(ShellCmdCache *cache, const char *name);
+
+// Every executable name in PATH, sorted and without duplicates.
+// *names is malloc'd (free() it), the strings belong to the cache and stay
+// valid until the next cache call. Directories whose mtime hasn't changed
+// since they were last listed are not read again. Returns 0 or -1.
+int cmd_cache_list(ShellCmdCache *cache, const char ***names, size_t *count);
+
+#endif // CMD_CACHE_H
@@ -0,0 +1,68 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cmd_index.h"
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(const char *const *) a, *(const char *const *) b);
+}
+
+CmdIndex* cmd_index_build(const char *const *names, size_t count) {
+    CmdIndex *index = calloc(1, sizeof(CmdIndex));
+    const char **sorted = malloc(sizeof(char*) * (count + 1));
+    if (!index || !sorted) goto fail;
+    memcpy(sorted, names, sizeof(char*) * count);
+    qsort(sorted, count, sizeof(char*), compare_names);
+
+    size_t unique = 0, bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (unique > 0 && strcmp(sorted[unique - 1], sorted[i]) == 0) continue;
+        sorted[unique++] = sorted[i];
+        bytes += strlen(sorted[i]) + 1;
+    }
+    if (bytes > UINT32_MAX) goto fail;
+    index->names = malloc(bytes ? bytes : 1);
+    index->offsets = malloc(sizeof(uint32_t) * (unique ? unique : 1));
+    if (!index->names || !index->offsets) goto fail;
+    size_t at = 0;
+    for (size_t i = 0; i < unique; i++) {
+        size_t len = strlen(sorted[i]) + 1;
+        memcpy(index->names + at, sorted[i], len);
+        index->offsets[i] = (uint32_t) at;
+        at += len;
+    }
+    index->count = unique;
+    free(sorted);
+    return index;
+fail:
+    free(sorted);
+    cmd_index_free(index);
+    return NULL;
+}
+
+void cmd_index_free(CmdIndex *index) {
+    if (!index) return;
+    free(index->names);
+    free(index->offsets);
+    free(index);
+}
+
+// First name >= prefix (upper = false), or first name past the ones starting
+// with it (upper = true)
+static size_t bound(const CmdIndex *index, const char *prefix, size_t len, int upper) {
+    size_t lo = 0, hi = index->count;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        int c = strncmp(cmd_index_name(index, mid), prefix, len);
+        if (c < 0 || (upper && c == 0)) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+size_t cmd_index_range(const CmdIndex *index, const char *prefix, size_t len, size_t *first) {
+    // Names starting with prefix compare equal to it over len bytes, and
+    // sorted order keeps them together
+    size_t lo = bound(index, prefix, len, 0);
+    *first = lo;
+    return bound(index, prefix, len, 1) - lo;
+}
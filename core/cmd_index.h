@@ -0,0 +1,32 @@
+#ifndef CMD_INDEX_H
+#define CMD_INDEX_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Immutable, sorted set of command names for prefix completion.
+// The names sit back to back in one block in sorted order, with a parallel
+// array of offsets, so a prefix query is two binary searches and the
+// matches are one contiguous run. A snapshot is never changed after it is
+// built: rebuilding makes a new one, and readers keep whichever they hold.
+typedef struct {
+    char *names;           // NUL-terminated names, sorted, back to back
+    uint32_t *offsets;     // offsets[i] is where name i starts
+    size_t count;
+} CmdIndex;
+
+// Build a snapshot from names in any order (duplicates are dropped).
+// Returns NULL on allocation failure.
+CmdIndex* cmd_index_build(const char *const *names, size_t count);
+
+void cmd_index_free(CmdIndex *index);
+
+static inline const char* cmd_index_name(const CmdIndex *index, size_t i) {
+    return index->names + index->offsets[i];
+}
+
+// Number of names starting with prefix (len bytes); *first is set to the
+// first of them. O(log n * len).
+size_t cmd_index_range(const CmdIndex *index, const char *prefix, size_t len, size_t *first);
+
+#endif // CMD_INDEX_H
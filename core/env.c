@@ -0,0 +1,217 @@
+#define _GNU_SOURCE
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "env.h"
+
+#define ENV_MIN_CAP 64
+
+// FNV-1a over the variable name
+static uint32_t env_hash(const char *name, size_t len) {
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) name[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Slot holding name, or the slot where it would be inserted (first tombstone
+// on the probe path if any). Linear probing; cap is a power of two.
+static EnvSlot* env_find(const EnvTable *t, const char *name, size_t len, uint32_t hash, bool *found) {
+    size_t mask = t->cap - 1;
+    EnvSlot *tombstone = NULL;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        EnvSlot *slot = &t->slots[i];
+        if (!slot->entry) {
+            if (slot->deleted) {
+                if (!tombstone) tombstone = slot;
+                continue;
+            }
+            *found = false;
+            return tombstone ? tombstone : slot;
+        }
+        if (slot->hash == hash && slot->name_len == len && memcmp(slot->entry, name, len) == 0) {
+            *found = true;
+            return slot;
+        }
+    }
+}
+
+// Rehash into a table of new_cap slots (also clears tombstones)
+static int env_resize(EnvTable *t, size_t new_cap) {
+    EnvSlot *old = t->slots;
+    size_t old_cap = t->cap;
+    t->slots = calloc(new_cap, sizeof(EnvSlot));
+    if (!t->slots) { t->slots = old; return -1; }
+    t->cap = new_cap;
+    t->used = t->count;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (!old[i].entry) continue;
+        bool found;
+        EnvSlot *slot = env_find(t, old[i].entry, old[i].name_len, old[i].hash, &found);
+        *slot = old[i];
+    }
+    free(old);
+    return 0;
+}
+
+static EnvTable* table_new(size_t cap) {
+    EnvTable *t = calloc(1, sizeof(EnvTable));
+    if (!t) return NULL;
+    t->slots = calloc(cap, sizeof(EnvSlot));
+    if (!t->slots) { free(t); return NULL; }
+    t->cap = cap;
+    atomic_init(&t->refs, 1);
+    return t;
+}
+
+static void table_release(EnvTable *t) {
+    if (!t || atomic_fetch_sub_explicit(&t->refs, 1, memory_order_acq_rel) != 1) return;
+    for (size_t i = 0; i < t->cap; i++) free(t->slots[i].entry);
+    free(t->slots);
+    free(t->envp);
+    free(t);
+}
+
+// Make env's table its own before writing to it: a shared one is copied
+// (tombstones dropped) and this reference to it released. Only the holder
+// of the last reference writes, so refs == 1 needs no more care than that.
+static int env_own(ShellEnv *env) {
+    EnvTable *t = env->table;
+    if (atomic_load_explicit(&t->refs, memory_order_acquire) == 1) return 0;
+    EnvTable *copy = table_new(t->cap);
+    if (!copy) return -1;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (!t->slots[i].entry) continue;
+        char *entry = strdup(t->slots[i].entry);
+        if (!entry) { table_release(copy); return -1; }
+        bool found;
+        EnvSlot *slot = env_find(copy, entry, t->slots[i].name_len, t->slots[i].hash, &found);
+        *slot = t->slots[i];
+        slot->entry = entry;
+        copy->count++;
+    }
+    copy->used = copy->count;
+    table_release(t);
+    env->table = copy;
+    return 0;
+}
+
+// Insert or replace a ready-made "NAME=VALUE" string; takes ownership of entry
+static int env_put(ShellEnv *env, char *entry, size_t name_len) {
+    if (env_own(env) < 0) { free(entry); return -1; }
+    EnvTable *t = env->table;
+    // Keep the load factor (tombstones included) under 3/4
+    if ((t->used + 1) * 4 > t->cap * 3) {
+        size_t new_cap = t->count * 2 >= t->cap ? t->cap * 2 : t->cap;
+        if (env_resize(t, new_cap) < 0) { free(entry); return -1; }
+    }
+    uint32_t hash = env_hash(entry, name_len);
+    bool found;
+    EnvSlot *slot = env_find(t, entry, name_len, hash, &found);
+    if (found) {
+        free(slot->entry); // Replace the old NAME=VALUE string
+    } else {
+        if (!slot->deleted) t->used++;
+        t->count++;
+    }
+    slot->entry = entry;
+    slot->name_len = name_len;
+    slot->hash = hash;
+    slot->deleted = false;
+    t->envp_valid = false;
+    env->generation++;
+    return 0;
+}
+
+int env_init(ShellEnv *env, char *const *initial) {
+    memset(env, 0, sizeof(*env));
+    size_t n = 0;
+    while (initial && initial[n]) n++;
+
+    size_t cap = ENV_MIN_CAP;
+    while (cap * 3 < n * 4 + 4) cap *= 2;
+    env->table = table_new(cap);
+    if (!env->table) return -1;
+
+    for (size_t i = 0; i < n; i++) {
+        const char *equals = strchr(initial[i], '=');
+        if (!equals || equals == initial[i]) continue; // Not NAME=VALUE, skip
+        char *entry = strdup(initial[i]);
+        if (!entry || env_put(env, entry, (size_t) (equals - initial[i])) < 0) {
+            env_free(env);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int env_share(ShellEnv *dst, ShellEnv *src) {
+    // Build envp now: once shared, nobody may write to the table
+    if (!env_envp(src)) return -1;
+    atomic_fetch_add_explicit(&src->table->refs, 1, memory_order_relaxed);
+    dst->table = src->table;
+    dst->generation = src->generation;
+    return 0;
+}
+
+void env_free(ShellEnv *env) {
+    table_release(env->table);
+    memset(env, 0, sizeof(*env));
+}
+
+const char* env_get(const ShellEnv *env, const char *name) {
+    size_t len = strlen(name);
+    bool found;
+    EnvSlot *slot = env_find(env->table, name, len, env_hash(name, len), &found);
+    return found ? slot->entry + len + 1 : NULL;
+}
+
+int env_set(ShellEnv *env, const char *name, const char *value) {
+    size_t name_len = strlen(name);
+    if (name_len == 0 || strchr(name, '=')) { errno = EINVAL; return -1; }
+
+    char *entry;
+    if (asprintf(&entry, "%s=%s", name, value) < 0) return -1;
+    return env_put(env, entry, name_len);
+}
+
+int env_unset(ShellEnv *env, const char *name) {
+    size_t len = strlen(name);
+    bool found;
+    env_find(env->table, name, len, env_hash(name, len), &found);
+    if (!found) return 0;
+    if (env_own(env) < 0) return -1; // Copying a shared table failed
+    EnvTable *t = env->table;
+    EnvSlot *slot = env_find(t, name, len, env_hash(name, len), &found);
+    free(slot->entry);
+    slot->entry = NULL;
+    slot->deleted = true;
+    t->count--;
+    t->envp_valid = false;
+    env->generation++;
+    return 0;
+}
+
+char *const* env_envp(ShellEnv *env) {
+    EnvTable *t = env->table;
+    if (t->envp_valid) {
+        return t->envp; // Unchanged since the last launch, reuse it (always so when shared)
+    }
+    if (t->envp_cap < t->count + 1) {
+        char **grown = realloc(t->envp, sizeof(char*) * (t->count + 1));
+        if (!grown) return NULL;
+        t->envp = grown;
+        t->envp_cap = t->count + 1;
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < t->cap; i++) {
+        if (t->slots[i].entry) t->envp[n++] = t->slots[i].entry;
+    }
+    t->envp[n] = NULL;
+    t->envp_valid = true;
+    return t->envp;
+}
@@ -0,0 +1,66 @@
+#ifndef ENV_H
+#define ENV_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// One slot of the open-addressing table
+typedef struct {
+    char *entry;           // "NAME=VALUE" (malloc'd), NULL if the slot is empty
+    size_t name_len;       // Length of NAME
+    uint32_t hash;         // Hash of NAME
+    bool deleted;          // Tombstone left by unset, keeps probe chains intact
+} EnvSlot;
+
+// The slots and envp of one or more ShellEnvs. A table with more than one
+// reference is never written: the first set/unset through any of them
+// copies it (env_share).
+typedef struct {
+    atomic_uint refs;
+    EnvSlot *slots;
+    size_t cap;            // Number of slots, always a power of two
+    size_t count;          // Live variables
+    size_t used;           // Live variables + tombstones
+    char **envp;           // Cached NULL-terminated "NAME=VALUE" array
+    size_t envp_cap;
+    bool envp_valid;       // envp matches the slots
+} EnvTable;
+
+// Environment table keyed by variable name.
+// Lookups are O(1); every mutation bumps generation, and the envp array
+// handed to children is only rebuilt when the table has changed.
+typedef struct {
+    EnvTable *table;
+    uint64_t generation;   // Incremented by every set/unset
+} ShellEnv;
+
+// Populate from a NULL-terminated "NAME=VALUE" array (e.g. environ).
+// Returns 0, or -1 if allocation failed.
+int env_init(ShellEnv *env, char *const *initial);
+
+// Make dst (uninitialized) an environment with src's variables, sharing
+// src's table until either side changes: O(1), no entries are copied.
+// Returns 0, or -1 if building src's envp failed.
+int env_share(ShellEnv *dst, ShellEnv *src);
+
+// Drop env's table reference, freeing the entries and the cached envp with the last one
+void env_free(ShellEnv *env);
+
+// Value of name, or NULL if unset
+const char* env_get(const ShellEnv *env, const char *name);
+
+// Set or replace name. Returns 0, or -1 (errno set) on invalid name or allocation failure.
+int env_set(ShellEnv *env, const char *name, const char *value);
+
+// Remove name. Returns 0 whether or not it was set, -1 if env had to copy
+// a shared table first and couldn't.
+int env_unset(ShellEnv *env, const char *name);
+
+// NULL-terminated envp for exec; rebuilt only if the table changed since the
+// last call. Valid until the next mutation of env (a snapshot sharing the
+// table changing its own copy doesn't affect it). Returns NULL on allocation failure.
+char *const* env_envp(ShellEnv *env);
+
+#endif // ENV_H
@@ -0,0 +1,177 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "jobs.h"
+#include "shell.h"
+#include "trace.h"
+
+int jobs_init(ShellJobTable *table) {
+    memset(table, 0, sizeof(*table));
+    table->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return table->epoll_fd < 0 ? -1 : 0;
+}
+
+void jobs_free(ShellJobTable *table) {
+    for (size_t i = 0; i < table->count; i++) {
+        shell_run_free(table->jobs[i].run);
+        free(table->jobs[i].command);
+    }
+    free(table->jobs);
+    if (table->epoll_fd >= 0) close(table->epoll_fd);
+    memset(table, 0, sizeof(*table));
+    table->epoll_fd = -1;
+}
+
+// Stop watching a stage's pidfd (it has been reaped, or the job is leaving the table)
+static void unwatch_stage(ShellJobTable *table, ShellStage *stage) {
+    if (table->epoll_fd >= 0 && stage->pidfd >= 0) epoll_ctl(table->epoll_fd, EPOLL_CTL_DEL, stage->pidfd, NULL);
+}
+
+int jobs_add(ShellJobTable *table, ShellRun *run, pid_t pgid, const char *command) {
+    if (table->count == table->cap) {
+        size_t cap = table->cap ? table->cap * 2 : 8;
+        ShellJob *grown = realloc(table->jobs, sizeof(ShellJob) * cap);
+        if (!grown) return -1;
+        table->jobs = grown;
+        table->cap = cap;
+    }
+    char *copy = strdup(command ? command : "");
+    if (!copy) return -1;
+
+    // Like bash: one more than the highest job number in use
+    int id = 1;
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->jobs[i].id >= id) id = table->jobs[i].id + 1;
+    }
+
+    if (table->epoll_fd >= 0) {
+        if (shell_run_open_pidfds(run) < 0) {
+            // Kernel without pidfds: callers have to poll jobs_reap instead
+            close(table->epoll_fd);
+            table->epoll_fd = -1;
+        } else {
+            for (int i = 0; i < run->num_stages; i++) {
+                if (run->stages[i].reaped) continue;
+                struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t) id };
+                epoll_ctl(table->epoll_fd, EPOLL_CTL_ADD, run->stages[i].pidfd, &ev);
+            }
+        }
+    }
+
+    ShellJob *job = &table->jobs[table->count++];
+    job->id = id;
+    job->pgid = pgid;
+    job->run = run;
+    job->command = copy;
+    job->done = false;
+    job->exit_code = 0;
+    return id;
+}
+
+// Record a wait4() result on the stage it belongs to
+static void record_exit(ShellJobTable *table, ShellJob *job, pid_t pid, int status, const struct rusage *ru) {
+    ShellRun *run = job->run;
+    for (int i = 0; i < run->num_stages; i++) {
+        ShellStage *stage = &run->stages[i];
+        if (stage->reaped || stage->pid != pid) continue;
+        shell_stage_exited(stage, status, ru);
+        TRACE(reap, TRACE_REAP, run->trace_run, i, pid, status);
+        unwatch_stage(table, stage);
+        return;
+    }
+}
+
+int jobs_reap(ShellJobTable *table) {
+    // epoll_fd is level-triggered: it stays readable until the pidfds of
+    // the processes reaped here are removed from it
+    int finished = 0;
+    for (size_t j = 0; j < table->count; j++) {
+        ShellJob *job = &table->jobs[j];
+        if (job->done) continue;
+        ShellRun *run = job->run;
+
+        // One call per exited process of this job, none for the job's other processes.
+        // wait4(-pgid) is waitid(P_PGID) plus the child's rusage.
+        while (job->pgid > 0) {
+            int status;
+            struct rusage ru;
+            pid_t pid = wait4(-job->pgid, &status, WNOHANG, &ru);
+            if (pid < 0) {
+                if (errno == EINTR) continue;
+                break; // ECHILD: nothing of ours left in the group
+            }
+            if (pid == 0) break; // Rest still running
+            record_exit(table, job, pid, status, &ru);
+        }
+
+        // A stage that left the group (setsid) isn't seen by wait4(-pgid);
+        // wait for whatever is left by pid, or its pidfd stays readable
+        for (int i = 0; i < run->num_stages; i++) {
+            ShellStage *stage = &run->stages[i];
+            if (stage->reaped || stage->pid <= 0) continue;
+            int status;
+            struct rusage ru;
+            pid_t pid;
+            do pid = wait4(stage->pid, &status, WNOHANG, &ru); while (pid < 0 && errno == EINTR);
+            if (pid == 0) continue; // Still running
+            if (pid > 0) {
+                record_exit(table, job, pid, status, &ru);
+            } else {
+                shell_stage_lost(stage, "exit status lost: reaped by someone else");
+                unwatch_stage(table, stage);
+            }
+        }
+
+        bool all_reaped = true;
+        for (int i = 0; i < run->num_stages; i++) {
+            if (!run->stages[i].reaped) all_reaped = false;
+        }
+        if (!all_reaped) continue;
+        if (run->num_stages == 0 || run->setup_failed) {
+            job->exit_code = run->exit_code; // Builtin, or a stage that couldn't be set up
+        } else {
+            int status = run->stages[run->num_stages - 1].status;
+            job->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        }
+        job->done = true;
+        finished++;
+    }
+    return finished;
+}
+
+ShellJob* jobs_find(ShellJobTable *table, int id) {
+    for (size_t i = 0; i < table->count; i++) {
+        if (table->jobs[i].id == id) return &table->jobs[i];
+    }
+    return NULL;
+}
+
+// Remove the job at index i, keeping the rest in start order
+static void remove_at(ShellJobTable *table, size_t i) {
+    free(table->jobs[i].command);
+    memmove(&table->jobs[i], &table->jobs[i + 1], sizeof(ShellJob) * (table->count - i - 1));
+    table->count--;
+}
+
+ShellRun* jobs_take(ShellJobTable *table, int id) {
+    ShellJob *job = jobs_find(table, id);
+    if (!job) return NULL;
+    ShellRun *run = job->run;
+    for (int i = 0; i < run->num_stages; i++) unwatch_stage(table, &run->stages[i]);
+    remove_at(table, (size_t) (job - table->jobs));
+    return run;
+}
+
+void jobs_forget_done(ShellJobTable *table) {
+    for (size_t i = table->count; i-- > 0;) {
+        if (!table->jobs[i].done) continue;
+        shell_run_free(table->jobs[i].run);
+        remove_at(table, i);
+    }
+}
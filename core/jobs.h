@@ -0,0 +1,52 @@
+#ifndef JOBS_H
+#define JOBS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+struct ShellRun;
+
+// A pipeline running in the background in its own process group
+typedef struct {
+    int id;                // Job number, as in %1
+    pid_t pgid;            // Process group of every stage (shell_job_kill signals it)
+    struct ShellRun *run;  // Stages; stderr isn't captured for jobs
+    char *command;         // Command line, for listings
+    bool done;             // Every stage has been reaped
+    int exit_code;         // Last stage's exit code once done, -1 if it was killed
+} ShellJob;
+
+// Job table. Job processes are reaped with wait4(-pgid), one process
+// group at a time, so children that belong to the host program (Python's
+// subprocess, asyncio) are never collected by mistake.
+typedef struct {
+    ShellJob *jobs;        // In start order
+    size_t count;
+    size_t cap;
+    int epoll_fd;          // Every live job stage's pidfd: readable once one exits, -1 if unsupported
+} ShellJobTable;
+
+int jobs_init(ShellJobTable *table);
+
+// Kill nothing, but forget every job (the processes keep running)
+void jobs_free(ShellJobTable *table);
+
+// Take ownership of a started run as a new job. Returns its id, or -1.
+int jobs_add(ShellJobTable *table, struct ShellRun *run, pid_t pgid, const char *command);
+
+// Collect every job process that has exited, without blocking. Returns the
+// number of jobs that finished during this call.
+int jobs_reap(ShellJobTable *table);
+
+// Job with the given id, NULL if there is none
+ShellJob* jobs_find(ShellJobTable *table, int id);
+
+// Remove a job from the table and return its run (now owned by the caller),
+// e.g. to wait for it in the foreground. NULL if there is no such job.
+struct ShellRun* jobs_take(ShellJobTable *table, int id);
+
+// Drop finished jobs from the table
+void jobs_forget_done(ShellJobTable *table);
+
+#endif // JOBS_H
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/types.h>
+#include "parser.h"
+
+#define MAX_FD_DIGITS 4 // Longer digit runs before < or > are ordinary words
+
+// What read_word() saw while copying a word
+typedef struct {
+    bool has_glob;         // Unquoted * or ?, or an unquoted [...]
+    bool quoted_meta;      // A quoted wildcard character or backslash is in the word
+    bool quoted;           // Any quoting at all ('' is still a word, 2'>' is no fd)
+    bool digits;           // Nothing but unquoted digits
+} WordInfo;
+
+typedef struct {
+    ShellArena *arena;
+    const char *line;
+    const char *p;         // Current position in line
+    char *text;            // Where the next dequoted word is written
+    char **slots;          // Flat argv storage, each command's argv is a slice
+    size_t num_slots;
+    const char **glob_slots; // Parallel to slots, allocated on the first wildcard
+    size_t max_slots;
+    int cap_commands;
+    ShellPipeline *out;
+} Parser;
+
+static bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n';
+}
+
+static bool is_word_end(char c) {
+    return c == '\0' || is_space(c) || c == '|' || c == '&' || c == '<' || c == '>';
+}
+
+static bool is_glob_char(char c) {
+    return c == '*' || c == '?' || c == '[';
+}
+
+static int fail(Parser *ps, const char *at, const char *message) {
+    ps->out->error = message;
+    ps->out->error_pos = (size_t) (at - ps->line);
+    return -1;
+}
+
+static int out_of_memory(Parser *ps) {
+    errno = ENOMEM;
+    return fail(ps, ps->p, "out of memory");
+}
+
+// Append a character that came from inside quotes (or after a backslash).
+// In pattern mode, characters fnmatch would treat specially are escaped.
+static char* emit_quoted(char *o, char c, WordInfo *info, bool pattern) {
+    if (is_glob_char(c) || c == '\\') {
+        info->quoted_meta = true;
+        if (pattern) *o++ = '\\';
+    }
+    *o++ = c;
+    return o;
+}
+
+// Copy the word at ps->p into out, dequoting it. Returns the number of bytes
+// written (out is not NUL-terminated), or -1 on an unterminated quote.
+static ssize_t read_word(Parser *ps, char *out, WordInfo *info, bool pattern) {
+    const char *p = ps->p;
+    char *o = out;
+    bool open_bracket = false;
+
+    memset(info, 0, sizeof(*info));
+    info->digits = true;
+    while (!is_word_end(*p)) {
+        char c = *p;
+        if (c == '\'') {
+            info->quoted = true;
+            const char *end = strchr(p + 1, '\'');
+            if (!end) return fail(ps, p, "No closing quotation");
+            for (p++; p < end; p++) o = emit_quoted(o, *p, info, pattern);
+            p++;
+        } else if (c == '"') {
+            info->quoted = true;
+            for (p++; *p != '"'; p++) {
+                if (*p == '\0') return fail(ps, ps->p, "No closing quotation");
+                if (*p == '\\' && p[1] == '\n') { p++; continue; } // Line continuation
+                // Inside "...", backslash only escapes these; elsewhere it is literal
+                if (*p == '\\' && (p[1] == '"' || p[1] == '\\' || p[1] == '$' || p[1] == '`')) p++;
+                o = emit_quoted(o, *p, info, pattern);
+            }
+            p++;
+        } else if (c == '\\') {
+            info->quoted = true;
+            if (p[1] == '\0') return fail(ps, p, "No escaped character");
+            if (p[1] != '\n') o = emit_quoted(o, p[1], info, pattern);
+            p += 2;
+        } else {
+            if (c == '*' || c == '?') info->has_glob = true;
+            else if (c == '[') open_bracket = true;
+            else if (c == ']' && open_bracket) info->has_glob = true;
+            *o++ = c;
+            p++;
+        }
+        if (c < '0' || c > '9') info->digits = false;
+    }
+    ps->p = p;
+    return o - out;
+}
+
+static ShellCommand* new_command(Parser *ps) {
+    ShellPipeline *out = ps->out;
+    if (out->num_commands == ps->cap_commands) {
+        int cap = ps->cap_commands ? ps->cap_commands * 2 : 4;
+        ShellCommand *grown = arena_alloc(ps->arena, sizeof(ShellCommand) * cap);
+        if (!grown) return NULL;
+        if (out->num_commands) memcpy(grown, out->commands, sizeof(ShellCommand) * out->num_commands);
+        out->commands = grown;
+        ps->cap_commands = cap;
+    }
+    ShellCommand *cmd = &out->commands[out->num_commands++];
+    memset(cmd, 0, sizeof(*cmd));
+    cmd->argv = ps->slots + ps->num_slots;
+    return cmd;
+}
+
+static ShellRedir* add_redir(Parser *ps, ShellCommand *cmd) {
+    // Doubling capacity: 1, 2, 4, ... (a power of two count means it's full)
+    int n = cmd->num_redirs;
+    if (n == 0 || (n & (n - 1)) == 0) {
+        ShellRedir *grown = arena_alloc(ps->arena, sizeof(ShellRedir) * (n ? n * 2 : 1));
+        if (!grown) return NULL;
+        if (n) memcpy(grown, cmd->redirs, sizeof(ShellRedir) * n);
+        cmd->redirs = grown;
+    }
+    return &cmd->redirs[cmd->num_redirs++];
+}
+
+// Read the word after a redirection operator. Returns its text (in the arena)
+// and sets *info, or NULL with the error set.
+static const char* read_target(Parser *ps, const char *op, WordInfo *info) {
+    while (is_space(*ps->p)) ps->p++;
+    char *start = ps->text;
+    ssize_t n = read_word(ps, start, info, false);
+    if (n < 0) return NULL;
+    if (n == 0 && !info->quoted) {
+        fail(ps, op, "missing file name after redirection");
+        return NULL;
+    }
+    start[n] = '\0';
+    ps->text += n + 1;
+    return start;
+}
+
+// Parse a redirection operator at ps->p applying to fd (-1 = the operator's default)
+static int parse_redir(Parser *ps, ShellCommand *cmd, int fd) {
+    const char *op = ps->p;
+    bool both = false; // &> and &>>: stdout and stderr
+    if (*ps->p == '&') {
+        both = true;
+        ps->p++;
+    }
+
+    ShellRedirKind kind;
+    bool dup = false;
+    if (*ps->p == '<') {
+        ps->p++;
+        if (*ps->p == '&') { dup = true; ps->p++; }
+        else if (*ps->p == '<' || *ps->p == '>') return fail(ps, op, "here-documents and <> are not supported");
+        kind = SHELL_REDIR_READ;
+        if (fd < 0) fd = 0;
+    } else {
+        ps->p++;
+        kind = SHELL_REDIR_WRITE;
+        if (*ps->p == '>') { kind = SHELL_REDIR_APPEND; ps->p++; }
+        else if (*ps->p == '|') ps->p++; // >| is > (there is no noclobber)
+        else if (*ps->p == '&' && !both) { dup = true; ps->p++; }
+        if (fd < 0) fd = 1;
+    }
+
+    WordInfo info;
+    const char *target = read_target(ps, op, &info);
+    if (!target) return -1;
+
+    if (dup) {
+        size_t len = strlen(target);
+        if (info.digits && len > 0 && len <= MAX_FD_DIGITS) {
+            ShellRedir *r = add_redir(ps, cmd);
+            if (!r) return out_of_memory(ps);
+            *r = (ShellRedir) { .fd = fd, .kind = SHELL_REDIR_DUP, .dup_fd = atoi(target) };
+            return 0;
+        }
+        // >&- closes fd 1 in bash, which isn't supported: not a file named -
+        if (kind == SHELL_REDIR_READ || fd != 1 || strcmp(target, "-") == 0) {
+            return fail(ps, op, "file descriptor expected after >& or <&");
+        }
+        both = true; // >&file is &>file, as in bash
+    }
+
+    ShellRedir *r = add_redir(ps, cmd);
+    if (!r) return out_of_memory(ps);
+    *r = (ShellRedir) { .fd = fd, .kind = kind, .target = target };
+    if (both) {
+        r = add_redir(ps, cmd);
+        if (!r) return out_of_memory(ps);
+        *r = (ShellRedir) { .fd = 2, .kind = SHELL_REDIR_DUP, .dup_fd = 1 };
+    }
+    return 0;
+}
+
+// Add the word just read (at word, n bytes) to cmd; start is where it began in the line
+static int add_word(Parser *ps, ShellCommand *cmd, char *word, size_t n, const WordInfo *info, const char *start) {
+    word[n] = '\0';
+    ps->text += n + 1;
+
+    size_t slot = ps->num_slots++;
+    ps->slots[slot] = word;
+    cmd->argc++;
+    if (!info->has_glob) return 0;
+
+    if (!ps->glob_slots) {
+        ps->glob_slots = arena_alloc(ps->arena, sizeof(char*) * ps->max_slots);
+        if (!ps->glob_slots) return out_of_memory(ps);
+        memset(ps->glob_slots, 0, sizeof(char*) * ps->max_slots);
+    }
+    if (!cmd->globs) cmd->globs = ps->glob_slots + (cmd->argv - ps->slots);
+
+    if (!info->quoted_meta) {
+        ps->glob_slots[slot] = word; // Nothing quoted to escape, the word is the pattern
+        return 0;
+    }
+    // Rare: wildcards mixed with quoted specials. Re-read just this word, escaping them.
+    const char *end = ps->p;
+    ps->p = start;
+    char *pattern = arena_alloc(ps->arena, 2 * (size_t) (end - start) + 1);
+    if (!pattern) return out_of_memory(ps);
+    WordInfo again;
+    ssize_t len = read_word(ps, pattern, &again, true);
+    pattern[len] = '\0';
+    ps->glob_slots[slot] = pattern;
+    return 0;
+}
+
+// Close the current command's argv
+static void end_command(Parser *ps) {
+    ps->slots[ps->num_slots++] = NULL;
+}
+
+int shell_parse(ShellArena *arena, const char *line, ShellPipeline *out) {
+    memset(out, 0, sizeof(*out));
+    Parser ps = { .arena = arena, .line = line, .p = line, .out = out };
+
+    // Dequoted words never take more room than the line itself, and words
+    // plus one NULL per command never outnumber its characters plus one.
+    size_t len = strlen(line);
+    ps.max_slots = len + 2;
+    ps.text = arena_alloc(arena, len + 1);
+    ps.slots = arena_alloc(arena, sizeof(char*) * ps.max_slots);
+    if (!ps.text || !ps.slots) return out_of_memory(&ps);
+
+    ShellCommand *cmd = NULL;
+    const char *pipe_at = NULL; // Position of a '|' still waiting for its command
+    for (;;) {
+        while (is_space(*ps.p)) ps.p++;
+        char c = *ps.p;
+
+        if (c == '\0') break;
+
+        if (c == '|') {
+            if (ps.p[1] == '|') return fail(&ps, ps.p, "'||' is not supported");
+            if (!cmd || (cmd->argc == 0 && cmd->num_redirs == 0)) return fail(&ps, ps.p, "missing command before '|'");
+            if (cmd->argc == 0) return fail(&ps, ps.p, "missing command");
+            end_command(&ps);
+            cmd = NULL;
+            pipe_at = ps.p++;
+            continue;
+        }
+
+        if (c == '&' && ps.p[1] != '>') {
+            if (ps.p[1] == '&') return fail(&ps, ps.p, "'&&' is not supported");
+            const char *amp = ps.p++;
+            while (is_space(*ps.p)) ps.p++;
+            if (*ps.p != '\0') return fail(&ps, amp, "'&' is only allowed at the end of the line");
+            if (!cmd) return fail(&ps, amp, "missing command before '&'");
+            out->background = true;
+            break;
+        }
+
+        if (!cmd) {
+            cmd = new_command(&ps);
+            if (!cmd) return out_of_memory(&ps);
+        }
+
+        if (c == '<' || c == '>' || c == '&') {
+            if (parse_redir(&ps, cmd, -1) < 0) return -1;
+            continue;
+        }
+
+        const char *start = ps.p;
+        WordInfo info;
+        char *word = ps.text;
+        ssize_t n = read_word(&ps, word, &info, false);
+        if (n < 0) return -1;
+
+        // 2>file, 10<&0: a short run of plain digits glued to < or > is an fd number
+        if (info.digits && n > 0 && n <= MAX_FD_DIGITS && (*ps.p == '<' || *ps.p == '>')) {
+            word[n] = '\0';
+            if (parse_redir(&ps, cmd, atoi(word)) < 0) return -1;
+            continue;
+        }
+        if (add_word(&ps, cmd, word, (size_t) n, &info, start) < 0) return -1;
+    }
+
+    if (cmd) {
+        if (cmd->argc == 0) return fail(&ps, ps.p, "missing command");
+        end_command(&ps);
+    } else if (pipe_at) {
+        return fail(&ps, pipe_at, "missing command after '|'");
+    }
+
+    if (out->num_commands > 0) {
+        out->argvs = arena_alloc(arena, sizeof(char**) * out->num_commands);
+        if (!out->argvs) return out_of_memory(&ps);
+        for (int i = 0; i < out->num_commands; i++) out->argvs[i] = out->commands[i].argv;
+    }
+    return 0;
+}
@@ -0,0 +1,52 @@
+#ifndef PARSER_H
+#define PARSER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include "arena.h"
+
+// Kinds of I/O redirection
+typedef enum {
+    SHELL_REDIR_READ,      // fd < target
+    SHELL_REDIR_WRITE,     // fd > target
+    SHELL_REDIR_APPEND,    // fd >> target
+    SHELL_REDIR_DUP,       // fd >& dup_fd (also fd <& dup_fd)
+} ShellRedirKind;
+
+// One redirection, in the order written (order matters: 2>&1 >f != >f 2>&1)
+typedef struct {
+    int fd;                // fd in the child being redirected
+    ShellRedirKind kind;
+    const char *target;    // File name for READ/WRITE/APPEND
+    int dup_fd;            // fd copied for DUP
+} ShellRedir;
+
+// One stage of a pipeline
+typedef struct {
+    char **argv;           // NULL-terminated, dequoted words
+    int argc;
+    const char **globs;    // globs[i]: fnmatch pattern for argv[i] if it has unquoted
+                           // wildcards (quoted ones backslash-escaped), else NULL.
+                           // NULL when no word of this command has wildcards.
+    ShellRedir *redirs;
+    int num_redirs;
+} ShellCommand;
+
+// Result of parsing one command line
+typedef struct {
+    ShellCommand *commands;
+    int num_commands;      // 0 for a blank line
+    char ***argvs;         // argvs[i] == commands[i].argv, for shell_start_pipeline()
+    bool background;       // Line ended with '&'
+    const char *error;     // Syntax error message (static string), NULL on success
+    size_t error_pos;      // Byte offset of the error in the line
+} ShellPipeline;
+
+// Parse line in a single pass: words with '...', "..." and \ quoting, '|'
+// between stages, redirections (<, >, >>, N>, N>>, N>&M, N<&M, &>, &>>),
+// wildcard markers and a trailing '&'. Everything, including the argv
+// strings, is allocated from arena and lives until it is reset.
+// Returns 0, or -1 with out->error set (syntax error, or "out of memory").
+int shell_parse(ShellArena *arena, const char *line, ShellPipeline *out);
+
+#endif // PARSER_H
@@ -0,0 +1,66 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include "redir.h"
+
+// Whether fd is open in the child by the time redirs[j] runs: the standard
+// three always are, anything else only if an earlier redirection set it up
+static bool redir_fd_open(const ShellRedir *redirs, int j, int fd) {
+    if (fd >= 0 && fd <= 2) return true;
+    for (int k = 0; k < j; k++) {
+        if (redirs[k].fd == fd) return true;
+    }
+    return false;
+}
+
+int redir_open(int dirfd, const ShellRedir *redirs, int num_redirs, int *fds, char **error) {
+    *error = NULL;
+    if (num_redirs > SHELL_MAX_REDIRS) {
+        *error = strdup("too many redirections");
+        return -1;
+    }
+    for (int j = 0; j < num_redirs; j++) fds[j] = -1;
+
+    for (int j = 0; j < num_redirs; j++) {
+        const ShellRedir *r = &redirs[j];
+        if (r->kind == SHELL_REDIR_DUP) {
+            if (redir_fd_open(redirs, j, r->dup_fd)) continue;
+            if (asprintf(error, "%d: Bad file descriptor", r->dup_fd) < 0) *error = NULL;
+            redir_close(fds, j);
+            return -1;
+        }
+
+        int flags = O_CLOEXEC | O_NOCTTY;
+        if (r->kind == SHELL_REDIR_READ) flags |= O_RDONLY;
+        else flags |= O_WRONLY | O_CREAT | (r->kind == SHELL_REDIR_APPEND ? O_APPEND : O_TRUNC);
+        fds[j] = openat(dirfd, r->target, flags, 0666);
+        if (fds[j] < 0) {
+            if (asprintf(error, "%s: %s", r->target, strerror(errno)) < 0) *error = NULL;
+            redir_close(fds, j);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void redir_close(int *fds, int num_redirs) {
+    for (int j = 0; j < num_redirs; j++) {
+        if (fds[j] >= 0) close(fds[j]);
+        fds[j] = -1;
+    }
+}
+
+int redir_resolve(const ShellRedir *redirs, int num_redirs, const int *fds, int fd) {
+    // The last redirection of fd decides. A DUP makes it whatever dup_fd
+    // was at that point, so keep following dup_fd through the earlier ones.
+    for (int j = num_redirs - 1; j >= 0; j--) {
+        if (redirs[j].fd != fd) continue;
+        if (redirs[j].kind != SHELL_REDIR_DUP) return fds[j];
+        fd = redirs[j].dup_fd;
+    }
+    return fd;
+}
@@ -0,0 +1,32 @@
+#ifndef REDIR_H
+#define REDIR_H
+
+#include "parser.h"
+
+#define SHELL_MAX_REDIRS 13  // Per command; each one is a dup2 in the spawn plan
+
+// Redirections of one command, applied in order once its pipes are in place
+typedef struct {
+    const ShellRedir *redirs;
+    int num_redirs;
+} ShellRedirList;
+
+// Open the files a command's redirections name, in order, before it is
+// launched. fds[j] (room for num_redirs) gets redirs[j]'s fd, close-on-exec
+// so only the dup2 in the child survives exec, or -1 for a DUP. Files are
+// created 0666 (less the umask), relative to dirfd (shell_dirfd: the
+// shell's cwd). Returns 0, or
+// -1 with everything closed again and *error set to the message bash would
+// print ("out.txt: Permission denied", "5: Bad file descriptor"); *error is
+// NULL only if allocation failed.
+int redir_open(int dirfd, const ShellRedir *redirs, int num_redirs, int *fds, char **error);
+
+// Close what redir_open opened
+void redir_close(int *fds, int num_redirs);
+
+// Where output to fd goes once the redirections are applied, for builtins
+// that run in-process: an fd from fds, or 0-2 for the command's own stdin,
+// stdout or stderr (what fd started out as, when nothing redirected it)
+int redir_resolve(const ShellRedir *redirs, int num_redirs, const int *fds, int fd);
+
+#endif // REDIR_H
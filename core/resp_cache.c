@@ -0,0 +1,558 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "resp_cache.h"
+
+#define LOG_MAGIC "RCLOG\0\0\1"
+#define INDEX_MAGIC "RCIDX\0\0\1"
+#define INDEX_MIN_CAP 1024
+
+static uint64_t record_check(const uint8_t *key, const void *value, size_t len) {
+    // FNV-1a, 64-bit
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < RESP_CACHE_KEY_LEN; i++) {
+        h ^= key[i];
+        h *= 1099511628211ull;
+    }
+    const uint8_t *p = value;
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static uint64_t record_size(uint64_t value_len) {
+    return (sizeof(RespRecord) + value_len + 7) & ~(uint64_t) 7;
+}
+
+static uint64_t new_log_id(void) {
+    uint64_t id;
+    if (getrandom(&id, sizeof(id), GRND_NONBLOCK) == sizeof(id) && id) return id;
+    return ((uint64_t) time(NULL) << 20) ^ (uint64_t) getpid() ^ (uint64_t) (uintptr_t) &id;
+}
+
+static char* path_with(const char *path, const char *suffix) {
+    size_t n = strlen(path), m = strlen(suffix);
+    char *out = malloc(n + m + 1);
+    if (!out) return NULL;
+    memcpy(out, path, n);
+    memcpy(out + n, suffix, m + 1);
+    return out;
+}
+
+static int write_full(int fd, const void *buf, size_t len, off_t at) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = pwrite(fd, p, len, at);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        p += n;
+        len -= (size_t) n;
+        at += n;
+    }
+    return 0;
+}
+
+static RespIndexSlot* index_slots(const RespIndexHeader *index) {
+    return (RespIndexSlot *) (index + 1);
+}
+
+// Slot holding key, or the empty slot it would go in. Digests are already
+// uniform, but folding every word in keeps other keys from clustering.
+static RespIndexSlot* find_slot(const RespIndexHeader *index, const uint8_t *key) {
+    uint64_t words[RESP_CACHE_KEY_LEN / 8];
+    memcpy(words, key, sizeof(words));
+    uint64_t h = words[0] ^ words[1] ^ words[2] ^ words[3];
+    h = (h ^ (h >> 31)) * 0x9e3779b97f4a7c15ull;
+    h ^= h >> 29;
+    RespIndexSlot *slots = index_slots(index);
+    uint32_t mask = index->capacity - 1;
+    for (uint32_t i = (uint32_t) h & mask;; i = (i + 1) & mask) {
+        if (!slots[i].offset || memcmp(slots[i].key, key, RESP_CACHE_KEY_LEN) == 0) return &slots[i];
+    }
+}
+
+// --- Log ---
+
+// Make the mapping cover the log up to end (the file may have grown since,
+// in this process or another one)
+static int log_cover(RespCache *cache, uint64_t end) {
+    if (end <= cache->log_mapped) return 0;
+    struct stat st;
+    if (fstat(cache->log_fd, &st) < 0) return -1;
+    if ((uint64_t) st.st_size < end) {
+        errno = ERANGE;
+        return -1;
+    }
+    void *map = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, cache->log_fd, 0);
+    if (map == MAP_FAILED) return -1;
+    if (cache->log_map) munmap((void *) cache->log_map, cache->log_mapped);
+    cache->log_map = map;
+    cache->log_mapped = (size_t) st.st_size;
+    return 0;
+}
+
+// The intact record at offset, or NULL if there isn't one
+static const RespRecord* record_at(RespCache *cache, uint64_t offset, uint64_t log_end) {
+    if (offset < sizeof(RespLogHeader) || offset + sizeof(RespRecord) > log_end) return NULL;
+    if (log_cover(cache, offset + sizeof(RespRecord)) < 0) return NULL;
+    const RespRecord *rec = (const RespRecord *) (cache->log_map + offset);
+    uint64_t size = record_size(rec->value_len);
+    if (offset + size > log_end || log_cover(cache, offset + size) < 0) return NULL;
+    rec = (const RespRecord *) (cache->log_map + offset);
+    if (record_check(rec->key, rec + 1, rec->value_len) != rec->check) return NULL;
+    return rec;
+}
+
+// --- Index ---
+
+static size_t index_bytes(uint32_t capacity) {
+    return sizeof(RespIndexHeader) + (size_t) capacity * sizeof(RespIndexSlot);
+}
+
+static uint32_t index_capacity_for(uint64_t count) {
+    uint32_t cap = INDEX_MIN_CAP;
+    while ((uint64_t) cap < count * 2) cap *= 2;
+    return cap;
+}
+
+// A new, empty index in a temporary file next to the real one
+typedef struct {
+    char *tmp_path;
+    int fd;
+    RespIndexHeader *index;
+    size_t mapped;
+} NewIndex;
+
+static int index_new(RespCache *cache, NewIndex *out, uint32_t capacity, uint64_t log_id) {
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".idx.tmp.%ld", (long) getpid());
+    out->tmp_path = path_with(cache->path, suffix);
+    if (!out->tmp_path) return -1;
+    out->mapped = index_bytes(capacity);
+    out->fd = open(out->tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (out->fd < 0) goto fail;
+    if (ftruncate(out->fd, (off_t) out->mapped) < 0) goto fail;
+    void *map = mmap(NULL, out->mapped, PROT_READ | PROT_WRITE, MAP_SHARED, out->fd, 0);
+    if (map == MAP_FAILED) goto fail;
+    out->index = map;
+    memcpy(out->index->magic, INDEX_MAGIC, sizeof(out->index->magic));
+    out->index->log_id = log_id;
+    out->index->log_end = sizeof(RespLogHeader);
+    out->index->capacity = capacity;
+    return 0;
+fail:;
+    int saved = errno;
+    if (out->fd >= 0) {
+        close(out->fd);
+        unlink(out->tmp_path);
+    }
+    free(out->tmp_path);
+    errno = saved;
+    return -1;
+}
+
+static void index_discard(NewIndex *n) {
+    munmap(n->index, n->mapped);
+    close(n->fd);
+    unlink(n->tmp_path);
+    free(n->tmp_path);
+}
+
+static void index_unmap(RespCache *cache) {
+    if (cache->index) munmap(cache->index, cache->index_mapped);
+    if (cache->index_fd >= 0) close(cache->index_fd);
+    cache->index = NULL;
+    cache->index_fd = -1;
+}
+
+// Move a new index into place. Other processes still map the old file, so
+// it is flagged stale to make them reopen.
+static int index_install(RespCache *cache, NewIndex *n) {
+    char *index_path = path_with(cache->path, ".idx");
+    if (!index_path || rename(n->tmp_path, index_path) < 0) {
+        free(index_path);
+        index_discard(n);
+        return -1;
+    }
+    free(index_path);
+    free(n->tmp_path);
+    if (cache->index) cache->index->stale = 1;
+    index_unmap(cache);
+    cache->index = n->index;
+    cache->index_fd = n->fd;
+    cache->index_mapped = n->mapped;
+    return 0;
+}
+
+static void slot_set(RespIndexHeader *index, RespIndexSlot *slot, const uint8_t *key, uint64_t offset,
+                     uint64_t size, uint64_t last_used, uint64_t replaced_size) {
+    if (!slot->offset) {
+        memcpy(slot->key, key, RESP_CACHE_KEY_LEN);
+        index->count++;
+    }
+    index->live_bytes += size - replaced_size;
+    slot->offset = offset;
+    slot->last_used = last_used;
+}
+
+// Point key at the record at offset, doubling the table first if it would
+// pass half full
+static int index_insert(RespCache *cache, const uint8_t *key, uint64_t offset, uint64_t size) {
+    RespIndexHeader *index = cache->index;
+    if ((uint64_t) index->count + 1 > index->capacity / 2) {
+        NewIndex grown;
+        if (index_new(cache, &grown, index->capacity * 2, index->log_id) < 0) return -1;
+        RespIndexSlot *slots = index_slots(index);
+        for (uint32_t i = 0; i < index->capacity; i++) {
+            if (!slots[i].offset) continue;
+            *find_slot(grown.index, slots[i].key) = slots[i];
+        }
+        grown.index->count = index->count;
+        grown.index->live_bytes = index->live_bytes;
+        grown.index->log_end = index->log_end;
+        grown.index->clock = index->clock;
+        if (index_install(cache, &grown) < 0) return -1;
+        index = cache->index;
+    }
+    RespIndexSlot *slot = find_slot(index, key);
+    uint64_t replaced = 0;
+    if (slot->offset) {
+        const RespRecord *old = record_at(cache, slot->offset, index->log_end);
+        if (old) replaced = record_size(old->value_len);
+    }
+    slot_set(index, slot, key, offset, size, ++index->clock, replaced);
+    return 0;
+}
+
+// Index the records from the index's log_end on. The first one that fails
+// its check is a torn append: the log is cut off there.
+static int index_replay(RespCache *cache) {
+    struct stat st;
+    if (fstat(cache->log_fd, &st) < 0) return -1;
+    uint64_t end = (uint64_t) st.st_size;
+    uint64_t at = cache->index->log_end;
+    while (at < end) {
+        const RespRecord *rec = record_at(cache, at, end);
+        if (!rec) break;
+        uint64_t size = record_size(rec->value_len);
+        uint8_t key[RESP_CACHE_KEY_LEN];
+        memcpy(key, rec->key, sizeof(key));
+        if (index_insert(cache, key, at, size) < 0) return -1;
+        at += size;
+        cache->index->log_end = at;
+    }
+    if (at < end && ftruncate(cache->log_fd, (off_t) at) < 0) return -1;
+    return 0;
+}
+
+static int index_rebuild(RespCache *cache, uint64_t log_id) {
+    NewIndex n;
+    if (index_new(cache, &n, INDEX_MIN_CAP, log_id) < 0) return -1;
+    if (index_install(cache, &n) < 0) return -1;
+    return index_replay(cache);
+}
+
+// Map <path>.idx if it describes this log, otherwise build a new one
+static int index_open(RespCache *cache, uint64_t log_id, uint64_t log_size) {
+    char *index_path = path_with(cache->path, ".idx");
+    if (!index_path) return -1;
+    int fd = open(index_path, O_RDWR | O_CLOEXEC);
+    free(index_path);
+    if (fd < 0 && errno != ENOENT) return -1;
+    if (fd >= 0) {
+        struct stat st;
+        void *map = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(RespIndexHeader)) {
+            map = mmap(NULL, (size_t) st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+        if (map != MAP_FAILED) {
+            RespIndexHeader *index = map;
+            uint32_t cap = index->capacity;
+            bool valid = memcmp(index->magic, INDEX_MAGIC, sizeof(index->magic)) == 0 &&
+                         index->log_id == log_id && cap && (cap & (cap - 1)) == 0 &&
+                         index_bytes(cap) == (size_t) st.st_size && index->count < cap &&
+                         index->log_end >= sizeof(RespLogHeader) && index->log_end <= log_size &&
+                         !index->stale;
+            if (valid) {
+                cache->index = index;
+                cache->index_fd = fd;
+                cache->index_mapped = (size_t) st.st_size;
+                return index_replay(cache);
+            }
+            munmap(map, (size_t) st.st_size);
+        }
+        close(fd);
+    }
+    return index_rebuild(cache, log_id);
+}
+
+// --- Open / close ---
+
+static void files_close(RespCache *cache) {
+    index_unmap(cache);
+    if (cache->log_map) munmap((void *) cache->log_map, cache->log_mapped);
+    if (cache->log_fd >= 0) close(cache->log_fd);
+    cache->log_map = NULL;
+    cache->log_mapped = 0;
+    cache->log_fd = -1;
+}
+
+// Open the log and its index by path. Called with the lock held.
+static int files_open(RespCache *cache) {
+    cache->log_fd = open(cache->path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (cache->log_fd < 0) return -1;
+    struct stat st;
+    if (fstat(cache->log_fd, &st) < 0) return -1;
+    RespLogHeader header;
+    if ((size_t) st.st_size < sizeof(header)) {
+        // New, or a crash while it was being created
+        memset(&header, 0, sizeof(header));
+        memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+        header.log_id = new_log_id();
+        if (ftruncate(cache->log_fd, 0) < 0 || write_full(cache->log_fd, &header, sizeof(header), 0) < 0) {
+            return -1;
+        }
+        st.st_size = sizeof(header);
+    } else {
+        ssize_t n = pread(cache->log_fd, &header, sizeof(header), 0);
+        if (n != (ssize_t) sizeof(header) || memcmp(header.magic, LOG_MAGIC, sizeof(header.magic)) != 0) {
+            errno = EINVAL;
+            return -1;
+        }
+    }
+    return index_open(cache, header.log_id, (uint64_t) st.st_size);
+}
+
+static int cache_lock(RespCache *cache) {
+    while (flock(cache->lock_fd, LOCK_EX) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    // Another process compacted or rebuilt, so our files are no longer the
+    // ones at path (or an earlier reopen failed)
+    if (!cache->index || cache->index->stale) {
+        files_close(cache);
+        if (files_open(cache) < 0) {
+            int saved = errno;
+            files_close(cache);
+            flock(cache->lock_fd, LOCK_UN);
+            errno = saved;
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void cache_unlock(RespCache *cache) {
+    flock(cache->lock_fd, LOCK_UN);
+}
+
+int resp_cache_open(RespCache *cache, const char *path, uint64_t max_bytes) {
+    memset(cache, 0, sizeof(*cache));
+    cache->lock_fd = cache->log_fd = cache->index_fd = -1;
+    cache->max_bytes = max_bytes;
+    cache->path = strdup(path);
+    char *lock_path = path_with(path, ".lock");
+    if (!cache->path || !lock_path) goto fail;
+    cache->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (cache->lock_fd < 0 || cache_lock(cache) < 0) goto fail;
+    cache_unlock(cache);
+    free(lock_path);
+    return 0;
+fail:;
+    int saved = errno;
+    free(lock_path);
+    resp_cache_close(cache);
+    errno = saved;
+    return -1;
+}
+
+void resp_cache_close(RespCache *cache) {
+    files_close(cache);
+    if (cache->lock_fd >= 0) close(cache->lock_fd);
+    cache->lock_fd = -1;
+    free(cache->path);
+    cache->path = NULL;
+}
+
+// --- Operations ---
+
+int resp_cache_get(RespCache *cache, const uint8_t *key, const void **value, size_t *len) {
+    if (cache_lock(cache) < 0) return -1;
+    RespIndexSlot *slot = find_slot(cache->index, key);
+    const RespRecord *rec = slot->offset ? record_at(cache, slot->offset, cache->index->log_end) : NULL;
+    if (rec) {
+        slot->last_used = ++cache->index->clock;
+        *value = rec + 1;
+        *len = rec->value_len;
+        cache->hits++;
+    } else {
+        cache->misses++;
+    }
+    cache_unlock(cache);
+    return rec ? 1 : 0;
+}
+
+typedef struct {
+    uint64_t offset;
+    uint64_t last_used;
+    uint64_t size;
+} LiveEntry;
+
+static int by_recent_use(const void *a, const void *b) {
+    uint64_t x = ((const LiveEntry *) a)->last_used, y = ((const LiveEntry *) b)->last_used;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static int compact_locked(RespCache *cache, uint64_t target) {
+    RespIndexHeader *index = cache->index;
+    RespIndexSlot *slots = index_slots(index);
+    LiveEntry *live = malloc(sizeof(LiveEntry) * (index->count + 1));
+    if (!live) return -1;
+    size_t n = 0;
+    for (uint32_t i = 0; i < index->capacity; i++) {
+        if (!slots[i].offset) continue;
+        const RespRecord *rec = record_at(cache, slots[i].offset, index->log_end);
+        if (!rec) continue;
+        live[n++] = (LiveEntry) {slots[i].offset, slots[i].last_used, record_size(rec->value_len)};
+    }
+    qsort(live, n, sizeof(LiveEntry), by_recent_use);
+    size_t keep = 0;
+    uint64_t total = sizeof(RespLogHeader);
+    while (keep < n && total + live[keep].size <= target) total += live[keep++].size;
+
+    // The new log goes next to the old one and replaces it in one rename
+    char suffix[48];
+    snprintf(suffix, sizeof(suffix), ".tmp.%ld", (long) getpid());
+    char *tmp_path = path_with(cache->path, suffix);
+    int fd = tmp_path ? open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600) : -1;
+    if (fd < 0) {
+        free(live);
+        free(tmp_path);
+        return -1;
+    }
+    RespLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, sizeof(header.magic));
+    header.log_id = new_log_id();
+    NewIndex ni;
+    bool have_index = false;
+    if (write_full(fd, &header, sizeof(header), 0) < 0) goto fail;
+    if (index_new(cache, &ni, index_capacity_for(keep + 1), header.log_id) < 0) goto fail;
+    have_index = true;
+    uint64_t at = sizeof(header);
+    for (size_t i = 0; i < keep; i++) {
+        const RespRecord *rec = (const RespRecord *) (cache->log_map + live[i].offset);
+        if (write_full(fd, rec, live[i].size, (off_t) at) < 0) goto fail;
+        slot_set(ni.index, find_slot(ni.index, rec->key), rec->key, at, live[i].size, live[i].last_used, 0);
+        at += live[i].size;
+    }
+    ni.index->log_end = at;
+    ni.index->clock = index->clock;
+    if (fsync(fd) < 0 || rename(tmp_path, cache->path) < 0) goto fail;
+    // A crash from here until the index is installed leaves an index for
+    // the old log_id, which the next open rebuilds
+    if (index_install(cache, &ni) < 0) {
+        // The log at path is the new one: reopening by path sorts it out
+        int saved = errno;
+        if (cache->index) cache->index->stale = 1;
+        close(fd);
+        free(live);
+        free(tmp_path);
+        errno = saved;
+        return -1;
+    }
+    if (cache->log_map) munmap((void *) cache->log_map, cache->log_mapped);
+    close(cache->log_fd);
+    cache->log_map = NULL;
+    cache->log_mapped = 0;
+    cache->log_fd = fd;
+    cache->compactions++;
+    free(live);
+    free(tmp_path);
+    return 0;
+fail:;
+    int saved = errno;
+    if (have_index) index_discard(&ni);
+    close(fd);
+    unlink(tmp_path);
+    free(live);
+    free(tmp_path);
+    errno = saved;
+    return -1;
+}
+
+int resp_cache_put(RespCache *cache, const uint8_t *key, const void *value, size_t len) {
+    if (len > UINT32_MAX) {
+        errno = EFBIG;
+        return -1;
+    }
+    if (cache_lock(cache) < 0) return -1;
+    RespRecord rec = {.value_len = (uint32_t) len, .check = record_check(key, value, len)};
+    memcpy(rec.key, key, RESP_CACHE_KEY_LEN);
+    uint64_t size = record_size(len);
+    static const uint8_t pad[8];
+    struct iovec iov[3] = {
+        {&rec, sizeof(rec)},
+        {(void *) value, len},
+        {(void *) pad, size - sizeof(rec) - len},
+    };
+    uint64_t at = cache->index->log_end;
+    ssize_t written;
+    do {
+        written = pwritev(cache->log_fd, iov, 3, (off_t) at);
+    } while (written < 0 && errno == EINTR);
+    int rc = -1;
+    if (written == (ssize_t) size) {
+        rc = index_insert(cache, key, at, size);
+        if (rc == 0) cache->index->log_end = at + size;
+    } else if (written >= 0) {
+        errno = ENOSPC;
+    }
+    if (rc < 0) {
+        // Drop the partial record so the next append lands where the index expects
+        // If this fails too, the record fails its check and the next open cuts it off
+        int saved = errno;
+        (void) !ftruncate(cache->log_fd, (off_t) at);
+        errno = saved;
+    } else if (cache->max_bytes && cache->index->log_end > cache->max_bytes) {
+        // Leave room to grow so compactions stay rare. The entry is stored
+        // either way; a failed compaction is retried by the next put.
+        if (compact_locked(cache, cache->max_bytes / 2) < 0) rc = 1;
+    }
+    int saved = errno;
+    cache_unlock(cache);
+    errno = saved;
+    return rc;
+}
+
+int resp_cache_compact(RespCache *cache, uint64_t target_bytes) {
+    if (cache_lock(cache) < 0) return -1;
+    int rc = compact_locked(cache, target_bytes);
+    int saved = errno;
+    cache_unlock(cache);
+    errno = saved;
+    return rc;
+}
+
+int resp_cache_stat(RespCache *cache, uint64_t *entries, uint64_t *log_bytes, uint64_t *live_bytes) {
+    if (cache_lock(cache) < 0) return -1;
+    *entries = cache->index->count;
+    *log_bytes = cache->index->log_end;
+    *live_bytes = cache->index->live_bytes;
+    cache_unlock(cache);
+    return 0;
+}
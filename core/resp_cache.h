@@ -0,0 +1,92 @@
+#ifndef RESP_CACHE_H
+#define RESP_CACHE_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESP_CACHE_KEY_LEN 32  // Keys are SHA-256 digests
+
+// --- On-disk layout ---
+// <path>      the log: RespLogHeader, then records (RespRecord + value,
+//             padded to 8 bytes), only ever appended to
+// <path>.idx  the index: RespIndexHeader, then capacity RespIndexSlots
+//             (open addressing, linear probing). Rebuilt from the log
+//             whenever it doesn't match it.
+// <path>.lock flock()ed around every operation, so several shells can
+//             share one cache
+
+typedef struct {
+    char magic[8];
+    uint64_t log_id;       // Random, new each time the log is rewritten
+    uint64_t reserved[2];
+} RespLogHeader;
+
+typedef struct {
+    uint32_t value_len;
+    uint32_t reserved;
+    uint64_t check;        // FNV-1a of key and value: torn records fail it
+    uint8_t key[RESP_CACHE_KEY_LEN];
+} RespRecord;
+
+typedef struct {
+    char magic[8];
+    uint64_t log_id;       // Log this index describes
+    uint64_t log_end;      // Log bytes it covers; records past it are replayed on open
+    uint64_t live_bytes;   // Bytes of the records it points at
+    uint64_t clock;        // Ticks on every hit and insert, for LRU order
+    uint32_t capacity;     // Slots, a power of two
+    uint32_t count;
+    uint32_t stale;        // Another file replaced this one: reopen by path
+    uint32_t reserved;
+} RespIndexHeader;
+
+typedef struct {
+    uint8_t key[RESP_CACHE_KEY_LEN];
+    uint64_t offset;       // Record's offset in the log, 0 = empty slot
+    uint64_t last_used;    // clock at the last hit or insert
+} RespIndexSlot;
+
+// An open cache
+typedef struct {
+    char *path;
+    int lock_fd;
+    int log_fd;
+    int index_fd;
+    const uint8_t *log_map; // Read-only view of the log, remapped as it grows
+    size_t log_mapped;
+    RespIndexHeader *index; // Shared with every process that has the cache open
+    size_t index_mapped;
+    uint64_t max_bytes;    // Compact once the log grows past this, 0 = never
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t compactions;
+} RespCache;
+
+// Open (creating if needed) the cache at path. A torn record at the end of
+// the log (a crash mid-append) is cut off, and a missing or mismatched
+// index is rebuilt. Returns 0, or -1 with errno set (EINVAL: path is
+// something other than a cache).
+int resp_cache_open(RespCache *cache, const char *path, uint64_t max_bytes);
+
+void resp_cache_close(RespCache *cache);
+
+// Look a key up. Returns 1 with *value/*len pointing into the mapped log
+// (valid until the next call on this cache), 0 if it isn't cached, or -1
+// with errno set.
+int resp_cache_get(RespCache *cache, const uint8_t *key, const void **value, size_t *len);
+
+// Append a value for key, replacing any earlier one. The record is written
+// before the index points at it, so a crash never leaves a bad entry.
+// Compacts the log when it outgrows max_bytes. Returns 0; 1 with errno set
+// if the value was stored but that compaction failed; or -1 with errno set.
+int resp_cache_put(RespCache *cache, const uint8_t *key, const void *value, size_t len);
+
+// Rewrite the log with only the most recently used entries that fit in
+// target_bytes, dropping replaced values too. Returns 0, or -1 with errno set.
+int resp_cache_compact(RespCache *cache, uint64_t target_bytes);
+
+// Entries, log size and live bytes right now (taken under the lock)
+int resp_cache_stat(RespCache *cache, uint64_t *entries, uint64_t *log_bytes, uint64_t *live_bytes);
+
+#endif // RESP_CACHE_H
@@ -0,0 +1,86 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "ring.h"
+
+int ring_init(ShellRing *ring, size_t cap) {
+    memset(ring, 0, sizeof(*ring));
+    if (cap == 0) return 0;
+    ring->buf = malloc(cap);
+    if (!ring->buf) return -1;
+    ring->cap = cap;
+    return 0;
+}
+
+void ring_free(ShellRing *ring) {
+    free(ring->buf);
+    memset(ring, 0, sizeof(*ring));
+}
+
+void ring_clear(ShellRing *ring) {
+    ring->head = 0;
+    ring->len = 0;
+    ring->total = 0;
+}
+
+// Account for n bytes that were just placed at the write position
+static void ring_commit(ShellRing *ring, size_t n) {
+    ring->total += n;
+    ring->len += n;
+    if (ring->len > ring->cap) {
+        // Oldest bytes were overwritten; the tail now starts after the write position
+        ring->head = (ring->head + (ring->len - ring->cap)) % ring->cap;
+        ring->len = ring->cap;
+    }
+}
+
+void ring_write(ShellRing *ring, const char *data, size_t n) {
+    if (ring->cap == 0) { ring->total += n; return; }
+    // Only the last cap bytes can survive
+    if (n > ring->cap) {
+        ring->total += n - ring->cap;
+        data += n - ring->cap;
+        n = ring->cap;
+    }
+    size_t wpos = (ring->head + ring->len) % ring->cap;
+    size_t first = ring->cap - wpos < n ? ring->cap - wpos : n;
+    memcpy(ring->buf + wpos, data, first);
+    memcpy(ring->buf, data + first, n - first);
+    ring_commit(ring, n);
+}
+
+ssize_t ring_read_fd(ShellRing *ring, int fd) {
+    if (ring->cap == 0) {
+        char discard[4096];
+        ssize_t n = read(fd, discard, sizeof(discard));
+        if (n > 0) ring->total += (size_t) n;
+        return n;
+    }
+    // Read straight into the contiguous space after the write position;
+    // once full this overwrites the oldest bytes in place
+    size_t wpos = (ring->head + ring->len) % ring->cap;
+    ssize_t n = read(fd, ring->buf + wpos, ring->cap - wpos);
+    if (n > 0) ring_commit(ring, (size_t) n);
+    return n;
+}
+
+char* ring_dup(const ShellRing *ring) {
+    if (ring->len == 0) return NULL;
+    char *out = malloc(ring->len + 1);
+    if (!out) return NULL;
+    size_t first = ring->cap - ring->head < ring->len ? ring->cap - ring->head : ring->len;
+    memcpy(out, ring->buf + ring->head, first);
+    memcpy(out + first, ring->buf, ring->len - first);
+    out[ring->len] = '\0';
+
+    // Output was truncated: start at a line boundary if there is one
+    if (ring->total > ring->len) {
+        char *nl = memchr(out, '\n', ring->len);
+        if (nl && nl + 1 < out + ring->len) {
+            size_t skip = (size_t) (nl + 1 - out);
+            memmove(out, nl + 1, ring->len - skip + 1);
+        }
+    }
+    return out;
+}
@@ -0,0 +1,37 @@
+#ifndef RING_H
+#define RING_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+// Fixed-size byte ring that keeps the most recent bytes written to it.
+// Used for stderr tails: memory stays constant however much a child writes.
+typedef struct {
+    char *buf;
+    size_t cap;            // Capacity in bytes (0 = disabled, everything is discarded)
+    size_t head;           // Index of the oldest byte
+    size_t len;            // Bytes currently stored (<= cap)
+    size_t total;          // Bytes ever written, so truncation can be detected
+} ShellRing;
+
+// Allocate a ring of cap bytes. Returns 0, or -1 if allocation failed.
+int ring_init(ShellRing *ring, size_t cap);
+
+// Release the ring's buffer
+void ring_free(ShellRing *ring);
+
+// Forget the contents but keep the buffer
+void ring_clear(ShellRing *ring);
+
+// Append bytes, overwriting the oldest ones once full
+void ring_write(ShellRing *ring, const char *data, size_t n);
+
+// Perform one read() from fd straight into the ring. Returns what read() returned.
+ssize_t ring_read_fd(ShellRing *ring, int fd);
+
+// Copy the contents out as a NUL-terminated malloc'd string (NULL if empty).
+// When older output was dropped, the partial first line is skipped as well.
+char* ring_dup(const ShellRing *ring);
+
+#endif // RING_H
@@ -8,13 +8,49 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <signal.h>
+#include <sys/syscall.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <limits.h>
 #include "shell.h"
+#include "spawn_engine.h"
+#include "builtins.h"
+#include "trace.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434 // Same number on every architecture
+#endif
 
 #define MAX_ARGS 256
 #define MAX_ENV 1024
-#define MAX_ERROR_LEN 4096
 #define MAX_ARG_LEN 1024 // Define a maximum length for a single argument
 
+// Everything but the cwd, env and command cache, which a new context gets
+// from the process (shell_init) or from the context it snapshots
+static void init_state(ShellContext *ctx) {
+    glob_cache_init(&ctx->globs);
+    if (jobs_init(&ctx->jobs) < 0) {
+        // Still usable: jobs are reaped on request instead of announced through the fd
+        ctx->jobs.epoll_fd = -1;
+    }
+    ctx->last_job = 0;
+    stats_init(&ctx->stats);// No usage table until a capacity is set
+    
+    ctx->last_exit_code = 0;// Initialize last exit code to 0
+    ctx->interactive = isatty(STDIN_FILENO);// Check if the shell is interactive
+    ctx->last_error = NULL;// Initialize last error to NULL
+    ctx->last_stages = NULL;// No run yet
+    ctx->num_last_stages = 0;
+    ctx->spawn_engine = SHELL_SPAWN_FORK;// fork+exec unless the caller opts in to posix_spawn
+    ctx->stderr_tail_size = MAX_ERROR_LEN;// Keep the last 4 KB of a command's stderr
+    ctx->pipe_size = 0;// Stage pipes keep the kernel's 64 KB unless asked for more
+    spawn_server_init(&ctx->server);// Not started until the server engine is chosen
+    pthread_rwlock_init(&ctx->lock, NULL);
+}
+
 // Initialize shell context
 ShellContext* shell_init(void) {
     ShellContext *ctx = malloc(sizeof(ShellContext));
@@ -22,122 +58,718 @@ ShellContext* shell_init(void) {
 
     // Get current working directory
     ctx->cwd = getcwd(NULL, 0);
+    ctx->cwd_fd = -1;// Children inherit the process's cwd, which shell_cd changes
+    ctx->cwd_generation = 0;
     
-    // Copy environment
+    // Copy environment into the hashed table children are launched with
     extern char **environ;
-    int env_count = 0;
-    while (environ[env_count]) env_count++;
-    // Allocate memory for environment variables
-    ctx->env = malloc(sizeof(char*) * (env_count + 1));
-    for (int i = 0; i < env_count; i++) {
-        ctx->env[i] = strdup(environ[i]);
-    }
-    ctx->env[env_count] = NULL;// Null-terminate the environment array
-    
-    ctx->last_exit_code = 0;// Initialize last exit code to 0
-    ctx->interactive = isatty(STDIN_FILENO);// Check if the shell is interactive
-    ctx->last_error = NULL;// Initialize last error to NULL
+    if (env_init(&ctx->env, environ) < 0) {
+        free(ctx->cwd);
+        free(ctx);
+        return NULL;
+    }
+    // Resolve commands against the shell's PATH, not the process's
+    if (cmd_cache_init(&ctx->cmds, env_get(&ctx->env, "PATH")) < 0) {
+        env_free(&ctx->env);
+        free(ctx->cwd);
+        free(ctx);
+        return NULL;
+    }
+    init_state(ctx);
     
     return ctx;
 }
 
-// Execute a single command, taking pre-parsed arguments
-// Executes directly using execvp
-int shell_execute(ShellContext *ctx, char *const argv[]) {
-    if (!argv || !argv[0]) return -1;
-    int argc = 0;
-    while(argv[argc] != NULL) argc++;
-    if (argc == 0) return -1;
+ShellContext* shell_snapshot(ShellContext *ctx) {
+    ShellContext *snap = malloc(sizeof(ShellContext));
+    if (!snap) return NULL;
 
-    if (ctx->last_error) { free(ctx->last_error); ctx->last_error = NULL; }
+    // Hold the directory itself, not its path: later cd's in either context
+    // (or the process's cwd changing) don't move the snapshot
+    snap->cwd_fd = ctx->cwd_fd >= 0 ? fcntl(ctx->cwd_fd, F_DUPFD_CLOEXEC, 3)
+                                    : open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (snap->cwd_fd < 0) { free(snap); return NULL; }
+    snap->cwd = ctx->cwd ? strdup(ctx->cwd) : NULL;
+    snap->cwd_generation = 0;
+    if ((ctx->cwd && !snap->cwd) || env_share(&snap->env, &ctx->env) < 0) {
+        free(snap->cwd);
+        close(snap->cwd_fd);
+        free(snap);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (cmd_cache_init(&snap->cmds, env_get(&snap->env, "PATH")) < 0) {
+        env_free(&snap->env);
+        free(snap->cwd);
+        close(snap->cwd_fd);
+        free(snap);
+        return NULL;
+    }
+    init_state(snap);
+    snap->interactive = ctx->interactive;
+    // The helper belongs to ctx (and launches in its cwd)
+    snap->spawn_engine = ctx->spawn_engine == SHELL_SPAWN_SERVER ? SHELL_SPAWN_POSIX : ctx->spawn_engine;
+    snap->stderr_tail_size = ctx->stderr_tail_size;
+    snap->pipe_size = ctx->pipe_size;
+    return snap;
+}
 
-    if (strcmp(argv[0], "cd") == 0) {
-        // Determine path: argv[1] or HOME if argv[1] is NULL or missing
-        const char *path_to_cd = (argc > 1 && argv[1] != NULL) ? argv[1] : getenv("HOME");
-        if (path_to_cd == NULL) { // Handle case where HOME is not set
-             ctx->last_error = strdup("cd: HOME not set");
-             return -1; // Or some other error code
+int shell_dirfd(const ShellContext *ctx) {
+    return ctx->cwd_fd >= 0 ? ctx->cwd_fd : AT_FDCWD;
+}
+
+// --- Runs ---
+// A ShellRun tracks launched processes until all of them are reaped, so the
+// same launch code serves the blocking API and event-loop driven callers.
+
+static ShellRun* run_alloc(int num_stages, size_t err_tail) {
+    ShellRun *run = calloc(1, sizeof(ShellRun));
+    if (!run) return NULL;
+    run->num_stages = num_stages;
+    run->epoll_fd = -1;
+    run->out_fd = -1;
+    run->trace_run = trace_new_run();
+    if (num_stages > 0) {
+        run->stages = calloc(num_stages, sizeof(ShellStage));
+        if (!run->stages) { free(run); return NULL; }
+        for (int i = 0; i < num_stages; i++) {
+            ShellStage *stage = &run->stages[i];
+            stage->pid = -1;
+            stage->pidfd = -1;
+            stage->reaped = true; // Nothing to wait for until started
+            stage->err_fd = -1;
+            stage->err_eof = true; // Until a stderr pipe is attached
+            if (ring_init(&stage->err, err_tail) < 0) {
+                run->num_stages = i;
+                shell_run_free(run);
+                return NULL;
+            }
         }
-        int ret = shell_cd(ctx, path_to_cd);
-        if (ret != 0) {
-            // Use strerror_r for thread safety if this were multithreaded,
-            // but strerror is fine for now. Capture error before it's overwritten.
-            const char *err_msg = strerror(errno);
-            ctx->last_error = strdup(err_msg ? err_msg : "Unknown error");
+    }
+    return run;
+}
+
+// Give a stage its own stderr pipe. Returns the write end for the child, or -1.
+// Both ends are close-on-exec: the child gets its copy through the dup2 onto
+// fd 2, and no other stage inherits it.
+static int run_open_stderr(ShellRun *run, int i) {
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+    fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+    run->stages[i].err_fd = fds[0];
+    run->stages[i].err_eof = false;
+    return fds[1];
+}
+
+// Record a stage's spawn result
+static void run_set_stage(ShellRun *run, int i, pid_t pid, int64_t started_ns) {
+    run->stages[i].pid = pid;
+    run->stages[i].started_ns = started_ns;
+    if (pid > 0) {
+        run->stages[i].reaped = false;
+    } else {
+        // Exec failed and was already reported on the stage's stderr
+        run->stages[i].status = W_EXITCODE(127, 0);
+    }
+}
+
+// Trace points for shell_spawn()'s return (errno is left as it was)
+static void trace_spawned(const ShellRun *run, int i, pid_t pid, int64_t started_ns) {
+    int err = errno;
+    TRACE(spawn, TRACE_SPAWN, run->trace_run, i, pid, stats_now_ns() - started_ns);
+    if (pid == 0) TRACE(exec_failed, TRACE_EXEC_FAILED, run->trace_run, i, 0, err);
+    errno = err;
+}
+
+// A stage that was never launched because a redirection failed: exit 1
+// with the message as its stderr (the terminal's, for a background run)
+static void run_fail_stage(ShellRun *run, int i, const char *message, bool background) {
+    run->stages[i].pid = 0;
+    run->stages[i].started_ns = stats_now_ns();
+    run->stages[i].status = W_EXITCODE(1, 0);
+    if (background) dprintf(STDERR_FILENO, "%s\n", message);
+    else ring_write(&run->stages[i].err, message, strlen(message));
+}
+
+// Stage i's redirections, NULL if it has none
+static const ShellRedirList* stage_redirs(const ShellRunOptions *opts, int i) {
+    if (!opts || !opts->redirs || opts->redirs[i].num_redirs == 0) return NULL;
+    return &opts->redirs[i];
+}
+
+static const ShellLimits* stage_limits(const ShellRunOptions *opts, int i) {
+    return opts && opts->limits ? opts->limits[i] : NULL;
+}
+
+void shell_run_free(ShellRun *run) {
+    if (!run) return;
+    for (int i = 0; i < run->num_stages; i++) {
+        if (run->stages[i].pidfd >= 0) close(run->stages[i].pidfd);
+        if (run->stages[i].err_fd >= 0) close(run->stages[i].err_fd);
+        ring_free(&run->stages[i].err);
+    }
+    if (run->epoll_fd >= 0) close(run->epoll_fd);
+    if (run->out_fd >= 0) close(run->out_fd);
+    free(run->stages);
+    free(run->error);
+    free(run->command);
+    free(run);
+}
+
+int shell_run_open_pidfds(ShellRun *run) {
+    for (int i = 0; i < run->num_stages; i++) {
+        ShellStage *stage = &run->stages[i];
+        if (stage->reaped || stage->pidfd >= 0) continue;
+        stage->pidfd = (int) syscall(SYS_pidfd_open, stage->pid, 0);
+        if (stage->pidfd < 0) {
+            int saved = errno;
+            for (int j = 0; j < i; j++) {
+                if (run->stages[j].pidfd >= 0) { close(run->stages[j].pidfd); run->stages[j].pidfd = -1; }
+            }
+            errno = saved;
+            return -1;
         }
-        // No need to free argv here, Python wrapper owns it
-        return ret;
     }
+    return 0;
+}
+
+int shell_run_drain(ShellRun *run, int i) {
+    ShellStage *stage = &run->stages[i];
+    if (stage->err_fd < 0 || stage->err_eof) return 0;
+
+    // Everything is read, only the tail is kept, so the child never
+    // blocks on a full pipe and memory stays bounded
+    ssize_t n;
+    do {
+        n = ring_read_fd(&stage->err, stage->err_fd);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0) {
+        TRACE(stderr_read, TRACE_STDERR_READ, run->trace_run, i, stage->pid, n);
+        return 1;
+    }
+    if (n < 0 && errno == EAGAIN) return -1; // Non-blocking fd with nothing buffered
+    stage->err_eof = true; // EOF or a real error, either way we're done reading
+    return 0;
+}
 
-    // --- Execute via execvp --- 
-    int error_pipe[2];
-    if (pipe(error_pipe) == -1) { return -1; }
+void shell_run_close_stderr(ShellRun *run) {
+    for (int i = 0; i < run->num_stages; i++) {
+        ShellStage *stage = &run->stages[i];
+        if (stage->err_fd < 0) continue;
+        while (shell_run_drain(run, i) > 0)
+            ;
+        close(stage->err_fd); // Also removes it from the epoll set
+        stage->err_fd = -1;
+        stage->err_eof = true;
+    }
+}
 
-    pid_t pid = fork();
-    if (pid < 0) { close(error_pipe[0]); close(error_pipe[1]); return -1; }
+void shell_stage_lost(ShellStage *stage, const char *why) {
+    stage->status = W_EXITCODE(127, 0);
+    stage->reaped = true;
+    ring_write(&stage->err, why, strlen(why));
+}
 
-    if (pid == 0) {
-        // --- Child Process ---
-        close(error_pipe[0]); // Close read end
-        dup2(error_pipe[1], STDERR_FILENO); // Redirect stderr to pipe
-        close(error_pipe[1]);
+bool shell_run_reap(ShellRun *run, int i, bool block) {
+    ShellStage *stage = &run->stages[i];
+    if (stage->reaped) return true;
 
-        // === Execute directly using execvp ===
-        execvp(argv[0], argv);
+    pid_t r;
+    int status;
+    struct rusage ru;
+    if (stage->server) {
+        int found = spawn_server_reap(stage->server, stage->pid, stage->pidfd, block, &status, &ru);
+        if (found == 0) return false;
+        if (found < 0) {
+            shell_stage_lost(stage, "exit status lost: the spawn server went away");
+            return true;
+        }
+        shell_stage_exited(stage, status, &ru);
+        TRACE(reap, TRACE_REAP, run->trace_run, i, stage->pid, status);
+        return true;
+    }
+    do {
+        r = wait4(stage->pid, &status, block ? 0 : WNOHANG, &ru);
+    } while (r < 0 && errno == EINTR);
 
-        // If execvp returns, it failed.
-        // Format a more complete error message with the full strerror text
-        char error_buf[MAX_ERROR_LEN];
-        snprintf(error_buf, sizeof(error_buf), "%s: %s", argv[0], strerror(errno));
-        write(STDERR_FILENO, error_buf, strlen(error_buf));
-        _exit(127); // Exit child immediately
+    if (r == 0) return false; // Still running
+    if (r < 0) {
+        // ECHILD: reaped elsewhere (SIGCHLD ignored, a stray waitpid(-1)),
+        // so how it ended is unknown. That must not read as success.
+        shell_stage_lost(stage, "exit status lost: reaped by someone else");
+        return true;
+    }
+    shell_stage_exited(stage, status, &ru);
+    TRACE(reap, TRACE_REAP, run->trace_run, i, stage->pid, status);
+    return true;
+}
 
-    } else {
-        // --- Parent Process ---
-        close(error_pipe[1]);
-        char error_buffer[MAX_ERROR_LEN] = {0};
-        ssize_t bytes_read = read(error_pipe[0], error_buffer, sizeof(error_buffer) - 1);
-        close(error_pipe[0]);
-        int status;
-        waitpid(pid, &status, 0);
-        ctx->last_exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
-        if (ctx->last_exit_code != 0 && bytes_read > 0) {
-            if (ctx->last_error) free(ctx->last_error);
-            error_buffer[bytes_read] = '\0';
-            ctx->last_error = strdup(error_buffer);
+void shell_stage_exited(ShellStage *stage, int status, const struct rusage *ru) {
+    stage->status = status;
+    stage->reaped = true;
+    stats_usage_set(&stage->usage, ru, stage->started_ns, stats_now_ns());
+}
+
+// epoll_event.data for a stage's pidfd (even) or stderr pipe (odd)
+#define WATCH_PID(i) ((uint64_t) (i) << 1)
+#define WATCH_ERR(i) (((uint64_t) (i) << 1) | 1)
+
+int shell_run_watch(ShellRun *run) {
+    if (run->epoll_fd >= 0) return run->epoll_fd;
+    if (shell_run_open_pidfds(run) < 0) return -1;
+
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    if (ep < 0) return -1;
+    for (int i = 0; i < run->num_stages; i++) {
+        ShellStage *stage = &run->stages[i];
+        struct epoll_event ev = { .events = EPOLLIN };
+        if (!stage->reaped) {
+            ev.data.u64 = WATCH_PID(i);
+            if (epoll_ctl(ep, EPOLL_CTL_ADD, stage->pidfd, &ev) < 0) goto fail;
+        }
+        if (stage->err_fd >= 0 && !stage->err_eof) {
+            ev.data.u64 = WATCH_ERR(i);
+            if (epoll_ctl(ep, EPOLL_CTL_ADD, stage->err_fd, &ev) < 0) goto fail;
+        }
+    }
+    run->epoll_fd = ep;
+    return ep;
+
+fail:
+    close(ep);
+    return -1;
+}
+
+static int run_live_stages(const ShellRun *run) {
+    int live = 0;
+    for (int i = 0; i < run->num_stages; i++) {
+        if (!run->stages[i].reaped) live++;
+    }
+    return live;
+}
+
+int shell_run_poll(ShellRun *run, int timeout_ms) {
+    struct epoll_event events[16];
+    int n = epoll_wait(run->epoll_fd, events, 16, timeout_ms);
+    if (n < 0) return errno == EINTR ? run_live_stages(run) : -1;
+
+    for (int j = 0; j < n; j++) {
+        int i = (int) (events[j].data.u64 >> 1);
+        ShellStage *stage = &run->stages[i];
+        if (events[j].data.u64 & 1) {
+            // Level-triggered: a pipe stays in the set until it reaches EOF
+            if (shell_run_drain(run, i) == 0) epoll_ctl(run->epoll_fd, EPOLL_CTL_DEL, stage->err_fd, NULL);
         } else {
-             if (ctx->last_error) { free(ctx->last_error); ctx->last_error = NULL; }
+            TRACE(stage_exit, TRACE_STAGE_EXIT, run->trace_run, i, stage->pid, 0);
+            if (shell_run_reap(run, i, false)) epoll_ctl(run->epoll_fd, EPOLL_CTL_DEL, stage->pidfd, NULL);
+        }
+    }
+    return run_live_stages(run);
+}
+
+static void free_last_stages(ShellContext *ctx) {
+    for (int i = 0; i < ctx->num_last_stages; i++) free(ctx->last_stages[i].error);
+    free(ctx->last_stages);
+    ctx->last_stages = NULL;
+    ctx->num_last_stages = 0;
+}
+
+// A stage that didn't exit with status 0 (signals included)
+static bool stage_failed(const ShellStage *stage) {
+    return !WIFEXITED(stage->status) || WEXITSTATUS(stage->status) != 0;
+}
+
+// Store every stage's exit code, signal and stderr tail in ctx->last_stages
+static void record_stages(ShellContext *ctx, const ShellRun *run) {
+    free_last_stages(ctx);
+    int n = run->num_stages > 0 && !run->setup_failed ? run->num_stages : 1;
+    ctx->last_stages = calloc(n, sizeof(ShellResult));
+    if (!ctx->last_stages) return; // Only the per-stage detail is lost
+    ctx->num_last_stages = n;
+
+    if (run->num_stages == 0 || run->setup_failed) {
+        // A builtin or setup error counts as one stage, like bash's PIPESTATUS
+        ctx->last_stages[0].exit_code = run->exit_code;
+        ctx->last_stages[0].error = run->error ? strdup(run->error) : NULL;
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        int status = run->stages[i].status;
+        ShellResult *result = &ctx->last_stages[i];
+        result->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+        result->signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+        result->error = ring_dup(&run->stages[i].err);
+        result->usage = run->stages[i].usage;
+    }
+}
+
+// Usage of a whole run: wall time from the first spawn to the last reap,
+// everything else summed over the stages (peak RSS: the largest)
+static void run_usage_total(const ShellRun *run, ShellUsage *total) {
+    memset(total, 0, sizeof(*total));
+    int64_t first = 0, last = 0;
+    for (int i = 0; i < run->num_stages; i++) {
+        const ShellStage *stage = &run->stages[i];
+        stats_usage_add(total, &stage->usage);
+        if (stage->started_ns <= 0) continue;
+        int64_t end = stage->started_ns + stage->usage.wall_ns;
+        if (!first || stage->started_ns < first) first = stage->started_ns;
+        if (end > last) last = end;
+    }
+    total->wall_ns = last - first;
+}
+
+// Add a finished run to ctx->stats
+static void record_stats(ShellContext *ctx, const ShellRun *run, int exit_code) {
+    if (ctx->stats.cap == 0 || run->num_stages == 0) return;
+    ShellUsage total;
+    run_usage_total(run, &total);
+    stats_add(&ctx->stats, run->command, exit_code, run->num_stages, &total);
+}
+
+int shell_run_result(const ShellRun *run, ShellResult *result) {
+    memset(result, 0, sizeof(*result));
+
+    // Builtins and failed setups carry their result directly
+    if (run->num_stages == 0 || run->setup_failed) {
+        result->exit_code = run->exit_code;
+        result->error = run->error ? strdup(run->error) : NULL;
+        return result->exit_code;
+    }
+    run_usage_total(run, &result->usage);
+
+    // Pipelines report the status of the *last* command
+    int status = run->stages[run->num_stages - 1].status;
+    result->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : -1; // -1: killed by a signal
+    result->signal = WIFSIGNALED(status) ? WTERMSIG(status) : 0;
+
+    if (!run->is_pipeline) {
+        if (result->exit_code != 0) result->error = ring_dup(&run->stages[0].err);
+        return result->exit_code;
+    }
+
+    // The first failing stage that said why is usually the cause: consumers
+    // of a failed producer tend to fail too, with less to say. It is reported
+    // even when the last stage succeeded, since its stderr isn't shown anywhere else.
+    for (int i = 0; i < run->num_stages && !result->error; i++) {
+        if (stage_failed(&run->stages[i])) result->error = ring_dup(&run->stages[i].err);
+    }
+    if (!result->error && result->exit_code != 0) {
+        // Nothing on stderr: say how it ended
+        result->error = strdup(WIFEXITED(status) ? "Pipeline command failed"
+                                                 : "Pipeline command terminated abnormally");
+    }
+    return result->exit_code;
+}
+
+void shell_result_free(ShellResult *result) {
+    free(result->error);
+    result->error = NULL;
+}
+
+// shell_run_finish without the stats table
+static int run_finish(ShellContext *ctx, ShellRun *run) {
+    record_stages(ctx, run);
+    ShellResult result;
+    shell_run_result(run, &result);
+    free(ctx->last_error);
+    ctx->last_error = result.error; // Ownership moves to the context
+    ctx->last_exit_code = result.exit_code;
+    return result.exit_code;
+}
+
+int shell_run_finish(ShellContext *ctx, ShellRun *run) {
+    int exit_code = run_finish(ctx, run);
+    record_stats(ctx, run, exit_code);
+    return exit_code;
+}
+
+void shell_run_complete(ShellRun *run) {
+    if (shell_run_watch(run) >= 0) {
+        while (run_live_stages(run) > 0) {
+            if (shell_run_poll(run, -1) < 0) break;
+        }
+    } else {
+        // No pidfds (kernels before 5.3): poll the pipes with short
+        // timeouts and WNOHANG reaps
+        struct pollfd fds[run->num_stages];
+        int stage_of[run->num_stages];
+        while (run_live_stages(run) > 0) {
+            int nfds = 0;
+            for (int i = 0; i < run->num_stages; i++) {
+                if (run->stages[i].err_fd < 0 || run->stages[i].err_eof) continue;
+                fds[nfds].fd = run->stages[i].err_fd;
+                fds[nfds].events = POLLIN;
+                stage_of[nfds++] = i;
+            }
+            int ready = poll(fds, nfds, 10);
+            if (ready < 0 && errno != EINTR) break;
+            for (int j = 0; ready > 0 && j < nfds; j++) {
+                if (fds[j].revents) shell_run_drain(run, stage_of[j]);
+            }
+            for (int i = 0; i < run->num_stages; i++) shell_run_reap(run, i, false);
+        }
+    }
+
+    // Every stage has exited. Collect what's left in the pipes, but don't wait
+    // for EOF: a background grandchild may hold a write end open indefinitely.
+    shell_run_close_stderr(run);
+
+    // Fallback if polling failed outright
+    for (int i = 0; i < run->num_stages; i++) {
+        shell_run_reap(run, i, true);
+    }
+}
+
+int shell_run_wait(ShellContext *ctx, ShellRun *run) {
+    shell_run_complete(run);
+    return shell_run_finish(ctx, run);
+}
+
+// Attach a memfd for captured stdout to the run. Returns the fd or -1.
+static int run_open_capture(ShellRun *run) {
+    run->out_fd = memfd_create("shell-capture", MFD_CLOEXEC);
+    return run->out_fd;
+}
+
+int shell_run_map_output(ShellRun *run, ShellOutput *out) {
+    out->data = NULL;
+    out->len = 0;
+    if (run->out_fd < 0) return 0; // Builtins and launch failures produce no output
+
+    struct stat st;
+    if (fstat(run->out_fd, &st) < 0) return -1;
+    if (st.st_size > 0) {
+        void *data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_SHARED, run->out_fd, 0);
+        if (data == MAP_FAILED) return -1;
+        out->data = data;
+        out->len = (size_t) st.st_size;
+    }
+    // The mapping keeps the pages alive on its own
+    close(run->out_fd);
+    run->out_fd = -1;
+    return 0;
+}
+
+void shell_output_unmap(ShellOutput *out) {
+    if (out->data) munmap(out->data, out->len);
+    out->data = NULL;
+    out->len = 0;
+}
+
+// "a b | c d": the words of a command or pipeline joined, for job listings and stats
+static char* command_text(char *const *const *pipeline_argv, int num_commands) {
+    size_t len = 1;
+    for (int i = 0; i < num_commands; i++) {
+        for (int j = 0; pipeline_argv[i] && pipeline_argv[i][j]; j++) len += strlen(pipeline_argv[i][j]) + 1;
+        len += 3;
+    }
+    char *text = malloc(len), *p = text;
+    if (!text) return NULL;
+    for (int i = 0; i < num_commands; i++) {
+        if (i > 0) { memcpy(p, "| ", 2); p += 2; }
+        for (int j = 0; pipeline_argv[i] && pipeline_argv[i][j]; j++) {
+            size_t n = strlen(pipeline_argv[i][j]);
+            memcpy(p, pipeline_argv[i][j], n);
+            p += n;
+            *p++ = ' ';
+        }
+    }
+    if (p > text) p--; // Trailing space
+    *p = '\0';
+    return text;
+}
+
+// Where a builtin's output to fd (1 or 2) goes once its redirections are
+// applied; -1 means into the run's error message, as stderr normally does
+static int builtin_fd(const ShellRun *run, const ShellRedirList *redirs, const int *redir_fds, int fd) {
+    if (redirs) fd = redir_resolve(redirs->redirs, redirs->num_redirs, redir_fds, fd);
+    if (fd == STDOUT_FILENO) return run->out_fd >= 0 ? run->out_fd : STDOUT_FILENO;
+    if (fd == STDERR_FILENO) return -1;
+    return fd;
+}
+
+// Launch a single command, taking pre-parsed arguments
+// Uses the context's spawn engine (see spawn_engine.c)
+ShellRun* shell_start(ShellContext *ctx, char *const argv[], const ShellRunOptions *opts) {
+    if (!argv || !argv[0]) return NULL;
+    int argc = 0;
+    while(argv[argc] != NULL) argc++;
+    if (argc == 0) return NULL;
+
+    // Builtins run in-process, except in the background where they'd have
+    // no effect on the shell anyway (bash runs them in a subshell there)
+    bool background = opts && opts->background;
+    const ShellRedirList *redirs = stage_redirs(opts, 0);
+    int redir_fds[SHELL_MAX_REDIRS], num_redirs = redirs ? redirs->num_redirs : 0;
+    char *redir_error;
+    const ShellBuiltin *builtin = background ? NULL : builtin_lookup(argv[0]);
+    if (builtin) {
+        ShellRun *run = run_alloc(0, 0);
+        if (!run) return NULL;
+        if (opts && opts->capture_stdout && run_open_capture(run) < 0) {
+            shell_run_free(run);
+            return NULL;
+        }
+        if (redirs && redir_open(shell_dirfd(ctx), redirs->redirs, num_redirs, redir_fds, &run->error) < 0) {
+            if (!run->error) { shell_run_free(run); return NULL; }
+            run->exit_code = 1;
+            return run;
+        }
+        run->exit_code = builtin_run(ctx, builtin, argc, argv, builtin_fd(run, redirs, redir_fds, STDOUT_FILENO),
+                                     builtin_fd(run, redirs, redir_fds, STDERR_FILENO), &run->error);
+        redir_close(redir_fds, num_redirs);
+        return run;
+    }
+
+    // Rebuilt only if the environment changed since the last launch
+    char *const *envp = env_envp(&ctx->env);
+    if (!envp) return NULL;
+
+    ShellRun *run = run_alloc(1, ctx->stderr_tail_size);
+    if (!run) return NULL;
+
+    // Files are opened here, so a bad one fails the command without launching it
+    if (redirs && redir_open(shell_dirfd(ctx), redirs->redirs, num_redirs, redir_fds, &redir_error) < 0) {
+        if (!redir_error) { shell_run_free(run); return NULL; }
+        run_fail_stage(run, 0, redir_error, background);
+        free(redir_error);
+        if (ctx->stats.cap > 0) run->command = command_text(&argv, 1);
+        return run;
+    }
+
+    // --- Launch via the configured spawn engine ---
+    int err_write = -1, devnull = -1;
+    if ((!background && (err_write = run_open_stderr(run, 0)) < 0) ||
+        (background && (devnull = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0)) {
+        redir_close(redir_fds, num_redirs);
+        shell_run_free(run);
+        return NULL;
+    }
+
+    // Child: stderr -> error pipe (a background job keeps the terminal's)
+    SpawnPlan plan = { .argv = argv, .path = cmd_cache_lookup(&ctx->cmds, argv[0]), .envp = envp,
+                       .err_fd = background ? STDERR_FILENO : err_write, .set_pgid = background,
+                       .limits = stage_limits(opts, 0) };
+    spawn_plan_dup(&plan, err_write, STDERR_FILENO);
+    spawn_plan_dup(&plan, devnull, STDIN_FILENO);
+    if (opts && opts->capture_stdout) {
+        if (run_open_capture(run) < 0) {
+            if (err_write >= 0) close(err_write);
+            if (devnull >= 0) close(devnull);
+            redir_close(redir_fds, num_redirs);
+            shell_run_free(run);
+            return NULL;
         }
-        return ctx->last_exit_code;
+        spawn_plan_dup(&plan, run->out_fd, STDOUT_FILENO);
     }
+    spawn_plan_redirect(&plan, redirs, redir_fds);
+
+    TRACE(stage_start, TRACE_STAGE_START, run->trace_run, 0, 0, ctx->spawn_engine);
+    int64_t started = stats_now_ns();
+    pid_t pid = shell_spawn(ctx, &plan, &run->stages[0]);
+    trace_spawned(run, 0, pid, started);
+    if (err_write >= 0) close(err_write);
+    if (devnull >= 0) close(devnull);
+    redir_close(redir_fds, num_redirs);
+    if (pid < 0) { shell_run_free(run); return NULL; }
+
+    // --- Parent Process ---
+    run_set_stage(run, 0, pid, started);
+    if (ctx->stats.cap > 0) run->command = command_text(&argv, 1);
+    if (background && pid > 0) run->pgid = pid;
+    return run;
+}
+
+// Execute a single command, taking pre-parsed arguments
+int shell_execute(ShellContext *ctx, char *const argv[]) {
+    if (ctx->last_error) { free(ctx->last_error); ctx->last_error = NULL; }
+
+    ShellRun *run = shell_start(ctx, argv, NULL);
+    if (!run) return -1;
+    int ret = shell_run_wait(ctx, run);
+    shell_run_free(run);
+    return ret;
+}
+
+// Pipe buffer ceiling for unprivileged processes (/proc/sys/fs/pipe-max-size)
+static size_t pipe_max_size(void) {
+    static size_t max_size;
+    if (max_size == 0) {
+        FILE *f = fopen("/proc/sys/fs/pipe-max-size", "re");
+        unsigned long size = 0;
+        if (f) {
+            if (fscanf(f, "%lu", &size) != 1) size = 0;
+            fclose(f);
+        }
+        max_size = size > 0 ? size : 1 << 20; // The kernel's default limit
+    }
+    return max_size;
+}
+
+// Create a pipe between two stages, holding up to size bytes (0 = as created).
+// A larger buffer lets the writer run further ahead before it has to sleep,
+// so a data-heavy pipeline switches between its stages far less often.
+// Sizes past the unprivileged limit are clamped to it; if even that is
+// refused (the user's pipe-user-pages-soft quota) the pipe is still usable.
+static int open_stage_pipe(int fds[2], size_t size) {
+    // Close-on-exec: concurrent launches from other threads mustn't inherit
+    // either end, or a reader here would never see EOF
+    if (pipe2(fds, O_CLOEXEC) == -1) return -1;
+    if (size > 0) {
+        if (size > (size_t) INT_MAX) size = INT_MAX;
+        if (fcntl(fds[1], F_SETPIPE_SZ, (int) size) < 0 && errno == EPERM && size > pipe_max_size()) {
+            fcntl(fds[1], F_SETPIPE_SZ, (int) pipe_max_size());
+        }
+    }
+    return 0;
 }
 
 // Helper function to clean up resources during pipeline setup failure
-static void cleanup_pipeline_resources(int num_commands, int pipes[][2], int pipes_to_close_idx, pid_t pids[], int pids_to_kill_idx) {
+static void cleanup_pipeline_resources(int pipes[][2], int pipes_to_close_idx, ShellRun *run, int pids_to_kill_idx) {
     // Close pipes created up to the error point
     for (int i = 0; i <= pipes_to_close_idx; i++) {
         close(pipes[i][0]);
         close(pipes[i][1]);
     }
 
-    // Terminate and wait for children forked before the error
+    // Terminate and wait for children started before the error
     for (int i = 0; i <= pids_to_kill_idx; i++) {
-        if (pids[i] > 0) {
-            kill(pids[i], SIGTERM); // Send termination signal
-            waitpid(pids[i], NULL, 0); // Wait for termination
+        if (run->stages[i].pid > 0) {
+            kill(run->stages[i].pid, SIGTERM); // Send termination signal
+            shell_run_reap(run, i, true); // Wait for termination
         }
     }
 }
 
-// Execute a pipeline of commands, taking pre-parsed arguments for each command
-int shell_execute_pipeline(ShellContext *ctx, char *const *const *pipeline_argv, int num_commands) {
-    if (num_commands <= 0) return 0;
+// Launch a pipeline of commands, taking pre-parsed arguments for each command
+ShellRun* shell_start_pipeline(ShellContext *ctx, char *const *const *pipeline_argv, int num_commands,
+                               const ShellRunOptions *opts) {
+    if (num_commands <= 0) return run_alloc(0, 0); // Empty pipeline is success (like shell)
 
-    // If only one command, execute it directly (more efficient)
+    // If only one command, launch it directly (more efficient, and captures stderr)
     if (num_commands == 1) {
         // Need to handle potential NULL argv[0] case if outer list allows empty lists
-        if (!pipeline_argv[0] || !pipeline_argv[0][0]) return -1; // Invalid command
-        return shell_execute(ctx, pipeline_argv[0]);
+        if (!pipeline_argv[0] || !pipeline_argv[0][0]) return NULL; // Invalid command
+        return shell_start(ctx, pipeline_argv[0], opts);
+    }
+
+    char *const *envp = env_envp(&ctx->env);
+    if (!envp) return NULL;
+
+    ShellRun *run = run_alloc(num_commands, ctx->stderr_tail_size);
+    if (!run) return NULL;
+    run->is_pipeline = true;
+    if (opts && opts->capture_stdout && run_open_capture(run) < 0) {
+        shell_run_free(run);
+        return NULL;
+    }
+    // Background jobs read /dev/null rather than compete for the terminal
+    bool background = opts && opts->background;
+    int devnull = -1;
+    if (background && (devnull = open("/dev/null", O_RDONLY | O_CLOEXEC)) < 0) {
+        shell_run_free(run);
+        return NULL;
     }
 
     int pipes[num_commands - 1][2];
@@ -147,79 +779,101 @@ int shell_execute_pipeline(ShellContext *ctx, char *const *const *pipeline_argv,
         pipes[i][1] = -1;
     }
 
-    pid_t pids[num_commands];
-    // Initialize pids to 0 or -1 (0 = not forked, -1 = error/invalid)
-    for (int i = 0; i < num_commands; i++) {
-        pids[i] = 0;
-    }
-
-    int status = 0; // Hold status of last command
-    int setup_error = 0; // Flag to indicate setup failed
-
     // Create pipes
     for (int i = 0; i < num_commands - 1; i++) {
-        if (pipe(pipes[i]) == -1) {
+        if (open_stage_pipe(pipes[i], ctx->pipe_size) == -1) {
             perror("pipe");
             // Cleanup pipes created so far (up to i-1)
-            cleanup_pipeline_resources(num_commands, pipes, i - 1, pids, -1); // No pids to kill yet
-            return -1; // Return error after cleanup
+            cleanup_pipeline_resources(pipes, i - 1, run, -1); // No pids to kill yet
+            if (devnull >= 0) close(devnull);
+            shell_run_free(run);
+            return NULL; // Return error after cleanup
         }
     }
 
+    // Every child closes every pipe fd once its own stdin/stdout are in place
+    int num_pipe_fds = 2 * (num_commands - 1);
+    int pipe_fds[num_pipe_fds];
+    for (int i = 0; i < num_commands - 1; i++) {
+        pipe_fds[2 * i] = pipes[i][0];
+        pipe_fds[2 * i + 1] = pipes[i][1];
+    }
+
     // Create processes
     for (int i = 0; i < num_commands; i++) {
-         // Check if the command itself is valid before forking
+         // Check if the command itself is valid before spawning
         if (!pipeline_argv[i] || !pipeline_argv[i][0]) {
              fprintf(stderr, "Error: Invalid empty command in pipeline stage %d\n", i);
-             pids[i] = -1; // Mark as invalid
-             setup_error = 1; // Mark that setup failed
+             // Already-started stages are still reaped, but the result is a setup error
+             run->setup_failed = true;
+             run->exit_code = -1;
+             run->error = strdup("Invalid command in pipeline");
              break; // Stop creating processes
         }
 
-        pids[i] = fork();
-        if (pids[i] < 0) {
-            perror("fork");
-            // Cleanup pipes and already forked processes (up to i-1)
-            cleanup_pipeline_resources(num_commands, pipes, num_commands - 2, pids, i - 1);
-            return -1; // Return error after cleanup
-        }
-
-        if (pids[i] == 0) {
-            // Child process
-
-            // Redirect input from previous command's pipe (if not the first command)
-            if (i > 0) {
-                if (dup2(pipes[i - 1][0], STDIN_FILENO) == -1) {
-                    perror("dup2 stdin");
-                    _exit(1);
-                }
-            }
-            // Redirect output to next command's pipe (if not the last command)
-            if (i < num_commands - 1) {
-                if (dup2(pipes[i][1], STDOUT_FILENO) == -1) {
-                    perror("dup2 stdout");
-                    _exit(1);
-                }
+        // A stage whose redirection fails isn't launched; the others still
+        // run, and its neighbours see EOF or EPIPE as if it had exited at once
+        const ShellRedirList *redirs = stage_redirs(opts, i);
+        int redir_fds[SHELL_MAX_REDIRS], num_redirs = redirs ? redirs->num_redirs : 0;
+        char *redir_error;
+        if (redirs && redir_open(shell_dirfd(ctx), redirs->redirs, num_redirs, redir_fds, &redir_error) < 0) {
+            if (!redir_error) {
+                cleanup_pipeline_resources(pipes, num_commands - 2, run, i - 1);
+                if (devnull >= 0) close(devnull);
+                shell_run_free(run);
+                return NULL;
             }
+            run_fail_stage(run, i, redir_error, background);
+            free(redir_error);
+            continue;
+        }
 
-            // Close *all* pipe file descriptors in the child
-            // Only close valid pipe fds
-            for (int j = 0; j < num_commands - 1; j++) {
-                if (pipes[j][0] != -1) close(pipes[j][0]);
-                if (pipes[j][1] != -1) close(pipes[j][1]);
-            }
+        // Each stage gets its own stderr pipe, so a failure can be pinned on its stage
+        // (background stages write to the terminal instead)
+        int err_write = background ? -1 : run_open_stderr(run, i);
+        if (!background && err_write < 0) {
+            perror("pipe");
+            redir_close(redir_fds, num_redirs);
+            cleanup_pipeline_resources(pipes, num_commands - 2, run, i - 1);
+            if (devnull >= 0) close(devnull);
+            shell_run_free(run);
+            return NULL;
+        }
 
-            // === Execute directly using execvp ===
-            execvp(pipeline_argv[i][0], pipeline_argv[i]);
+        // A background job's stages all join the first one's process group
+        SpawnPlan plan = { .argv = pipeline_argv[i], .path = cmd_cache_lookup(&ctx->cmds, pipeline_argv[i][0]),
+                           .envp = envp, .close_fds = pipe_fds, .num_close = num_pipe_fds,
+                           .err_fd = background ? STDERR_FILENO : err_write,
+                           .set_pgid = background, .pgid = run->pgid, .limits = stage_limits(opts, i) };
+        spawn_plan_dup(&plan, err_write, STDERR_FILENO);
+        // Redirect input from previous command's pipe (if not the first command)
+        if (i > 0) spawn_plan_dup(&plan, pipes[i - 1][0], STDIN_FILENO);
+        else spawn_plan_dup(&plan, devnull, STDIN_FILENO);
+        // Redirect output to next command's pipe (if not the last command),
+        // or into the capture memfd for the last one
+        if (i < num_commands - 1) spawn_plan_dup(&plan, pipes[i][1], STDOUT_FILENO);
+        else if (run->out_fd >= 0) spawn_plan_dup(&plan, run->out_fd, STDOUT_FILENO);
+        spawn_plan_redirect(&plan, redirs, redir_fds);
 
-            // If execvp returns, it failed.
-            // Use the same more detailed error format as in shell_execute
-            char error_buf[MAX_ERROR_LEN];
-            snprintf(error_buf, sizeof(error_buf), "%s: %s", pipeline_argv[i][0], strerror(errno));
-            write(STDERR_FILENO, error_buf, strlen(error_buf));
-            _exit(127);
+        TRACE(stage_start, TRACE_STAGE_START, run->trace_run, i, 0, ctx->spawn_engine);
+        int64_t started = stats_now_ns();
+        pid_t pid = shell_spawn(ctx, &plan, &run->stages[i]);
+        trace_spawned(run, i, pid, started);
+        if (err_write >= 0) close(err_write);
+        redir_close(redir_fds, num_redirs);
+        if (pid < 0) {
+            perror("spawn");
+            // Cleanup pipes and already started processes (up to i-1)
+            cleanup_pipeline_resources(pipes, num_commands - 2, run, i - 1);
+            if (devnull >= 0) close(devnull);
+            shell_run_free(run);
+            return NULL; // Return error after cleanup
         }
+        run_set_stage(run, i, pid, started);
+        if (background && pid > 0 && run->pgid == 0) run->pgid = pid;
     }
+    if (devnull >= 0) close(devnull);
+    if (ctx->stats.cap > 0) run->command = command_text(pipeline_argv, num_commands);
 
     // Parent: close all pipe file descriptors
     for (int i = 0; i < num_commands - 1; i++) {
@@ -227,66 +881,303 @@ int shell_execute_pipeline(ShellContext *ctx, char *const *const *pipeline_argv,
         if (pipes[i][1] != -1) close(pipes[i][1]);
     }
 
-    // If setup failed partway, clean up processes that were started
-    if (setup_error) {
-        // Wait for any processes that *were* successfully forked before the error
-        for(int i = 0; i < num_commands; ++i) {
-            if (pids[i] > 0) {
-                 waitpid(pids[i], NULL, 0); // Wait for them to finish (or be killed)
+    // No need to free pipeline_argv, Python wrapper owns it
+    return run;
+}
+
+// Execute a pipeline of commands, taking pre-parsed arguments for each command
+int shell_execute_pipeline(ShellContext *ctx, char *const *const *pipeline_argv, int num_commands) {
+    if (num_commands <= 0) return 0;
+
+    ShellRun *run = shell_start_pipeline(ctx, pipeline_argv, num_commands, NULL);
+    if (!run) return -1;
+    int ret = shell_run_wait(ctx, run);
+    shell_run_free(run);
+    return ret;
+}
+
+// --- Batches ---
+
+// Outcome of a finished single-command run (or one that never started: run NULL, err errno)
+static void batch_result(const ShellRun *run, int err, ShellResult *result) {
+    if (run) {
+        shell_run_result(run, result);
+        return;
+    }
+    memset(result, 0, sizeof(*result));
+    result->exit_code = -1;
+    result->error = strdup(strerror(err));
+}
+
+// A batch command is done: store its result, count it in ctx->stats, release it
+static void batch_finish(ShellContext *ctx, ShellRun *run, ShellResult *result) {
+    shell_run_complete(run);
+    batch_result(run, 0, result);
+    record_stats(ctx, run, result->exit_code);
+    shell_run_free(run);
+}
+
+int shell_execute_many(ShellContext *ctx, char *const *const *argvs, int num_commands, int max_parallel,
+                       const ShellLimits *const *limits, ShellResult *results) {
+    if (num_commands <= 0) return 0;
+    if (max_parallel <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        max_parallel = cpus > 0 ? (int) cpus : 1;
+    }
+    if (max_parallel > num_commands) max_parallel = num_commands;
+
+    // One slot per command in flight; each run's watch fd sits in a shared epoll set
+    ShellRun **slots = calloc(max_parallel, sizeof(ShellRun*));
+    int *slot_cmd = calloc(max_parallel, sizeof(int));
+    if (!slots || !slot_cmd) { free(slots); free(slot_cmd); return -1; }
+    int ep = epoll_create1(EPOLL_CLOEXEC); // -1: commands run one at a time
+
+    int next = 0, running = 0;
+    while (next < num_commands || running > 0) {
+        // Refill every free slot before waiting
+        while (next < num_commands && running < max_parallel) {
+            int i = next++;
+            ShellRunOptions opts = { .limits = limits ? &limits[i] : NULL };
+            ShellRun *run = shell_start(ctx, argvs[i], &opts);
+            if (!run) { batch_result(NULL, errno, &results[i]); continue; }
+
+            int s = 0;
+            while (slots[s]) s++;
+            struct epoll_event ev = { .events = EPOLLIN, .data.u32 = (uint32_t) s };
+            int fd = ep >= 0 && run_live_stages(run) > 0 ? shell_run_watch(run) : -1;
+            if (fd < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, fd, &ev) < 0) {
+                // Builtin, exec failure or no pidfds: finish it right here
+                batch_finish(ctx, run, &results[i]);
+                continue;
+            }
+            slots[s] = run;
+            slot_cmd[s] = i;
+            running++;
+        }
+        if (running == 0) continue;
+
+        struct epoll_event events[16];
+        int ready = epoll_wait(ep, events, 16, -1);
+        if (ready < 0 && errno != EINTR) {
+            // Can't wait on the set any more: finish what's running one by one
+            ready = 0;
+            for (int s = 0; s < max_parallel; s++) {
+                if (!slots[s]) continue;
+                batch_finish(ctx, slots[s], &results[slot_cmd[s]]);
+                slots[s] = NULL;
+                running--;
             }
         }
-        if (ctx->last_error) free(ctx->last_error);
-        ctx->last_error = strdup("Invalid command in pipeline");
-        ctx->last_exit_code = -1; // Indicate setup error
-        return ctx->last_exit_code;
+        for (int j = 0; j < ready; j++) {
+            int s = (int) events[j].data.u32;
+            ShellRun *run = slots[s];
+            if (!run || shell_run_poll(run, 0) > 0) continue;
+            // Every stage reaped (or polling failed, and shell_run_complete blocks instead)
+            epoll_ctl(ep, EPOLL_CTL_DEL, run->epoll_fd, NULL);
+            batch_finish(ctx, run, &results[slot_cmd[s]]);
+            slots[s] = NULL;
+            running--;
+        }
     }
+    if (ep >= 0) close(ep);
+    free(slots);
+    free(slot_cmd);
 
-    // Parent: Wait for all child processes
-    // Store the status of the *last* command in the pipeline
+    // The batch as a whole reports its first failure, in input order
+    if (ctx->last_error) { free(ctx->last_error); ctx->last_error = NULL; }
+    free_last_stages(ctx);
+    ctx->last_exit_code = 0;
     for (int i = 0; i < num_commands; i++) {
-        if (pids[i] > 0) { // Only wait for valid pids (should be all if no setup_error)
-            int child_status;
-            waitpid(pids[i], &child_status, 0);
-            if (i == num_commands - 1) { // Is this the last command?
-                status = child_status;
-            }
+        if (results[i].exit_code == 0 && results[i].signal == 0) continue;
+        ctx->last_exit_code = results[i].exit_code;
+        ctx->last_error = results[i].error ? strdup(results[i].error) : NULL;
+        break;
+    }
+    return 0;
+}
+
+// --- Command lines ---
+
+// Locale whose LC_COLLATE orders glob matches, as the child environment sees it
+static const char* collate_locale(ShellContext *ctx) {
+    static const char *const vars[] = { "LC_ALL", "LC_COLLATE", "LANG" };
+    for (size_t i = 0; i < sizeof(vars) / sizeof(vars[0]); i++) {
+        const char *value = env_get(&ctx->env, vars[i]);
+        if (value && *value) return value;
+    }
+    return NULL;
+}
+
+int shell_glob(ShellContext *ctx, ShellArena *arena, const char *pattern, char ***matches) {
+    return glob_expand(&ctx->globs, ctx->cwd, collate_locale(ctx), pattern, arena, matches);
+}
+
+int shell_expand_globs(ShellContext *ctx, ShellArena *arena, ShellPipeline *pipeline) {
+    for (int c = 0; c < pipeline->num_commands; c++) {
+        ShellCommand *cmd = &pipeline->commands[c];
+        if (!cmd->globs) continue;
+
+        // Count first so the new argv is allocated once
+        char ***found = arena_alloc(arena, sizeof(char**) * cmd->argc);
+        int *counts = arena_alloc(arena, sizeof(int) * cmd->argc);
+        if (!found || !counts) return -1;
+        size_t argc = 0;
+        for (int i = 0; i < cmd->argc; i++) {
+            counts[i] = 0;
+            if (cmd->globs[i] && (counts[i] = shell_glob(ctx, arena, cmd->globs[i], &found[i])) < 0) return -1;
+            argc += counts[i] > 0 ? (size_t) counts[i] : 1;
+        }
+
+        char **argv = arena_alloc(arena, sizeof(char*) * (argc + 1));
+        if (!argv) return -1;
+        size_t n = 0;
+        for (int i = 0; i < cmd->argc; i++) {
+            if (counts[i] == 0) { argv[n++] = cmd->argv[i]; continue; }
+            for (int m = 0; m < counts[i]; m++) argv[n++] = found[i][m];
         }
-        // Note: The case where the last command was invalid (pids[i] == -1)
-        // is now handled by the setup_error logic above.
+        argv[n] = NULL;
+        cmd->argv = argv;
+        cmd->argc = (int) n;
+        cmd->globs = NULL;
+        pipeline->argvs[c] = argv;
     }
+    return 0;
+}
 
-    // Set context's last exit code based on the status of the last command
-    // Note: Capturing specific stderr for each failed command in a pipeline
-    // would require additional plumbing (e.g., separate error pipes per command).
-    if (ctx->last_error) {
-        free(ctx->last_error);
-        ctx->last_error = NULL;
+ShellRun* shell_start_line(ShellContext *ctx, ShellArena *arena, const char *line,
+                           const ShellRunOptions *opts, const char **syntax_error) {
+    *syntax_error = NULL;
+    ShellPipeline pipeline;
+    if (shell_parse(arena, line, &pipeline) < 0) {
+        // Allocation failures are not the user's syntax
+        if (strcmp(pipeline.error, "out of memory") != 0) *syntax_error = pipeline.error;
+        return NULL;
     }
+    if (pipeline.num_commands == 0) return run_alloc(0, 0);
 
-    // Check status from the last command
-    if (WIFEXITED(status)) {
-        ctx->last_exit_code = WEXITSTATUS(status);
-        // If the last command exited with an error, store a generic message
-        if (ctx->last_exit_code != 0) {
-             ctx->last_error = strdup("Pipeline command failed");
+    // Each command's redirections, if any has some
+    ShellRedirList *redirs = NULL;
+    for (int i = 0; i < pipeline.num_commands; i++) {
+        if (pipeline.commands[i].num_redirs == 0) continue;
+        if (!redirs) {
+            redirs = arena_alloc(arena, sizeof(ShellRedirList) * pipeline.num_commands);
+            if (!redirs) return NULL;
+            memset(redirs, 0, sizeof(ShellRedirList) * pipeline.num_commands);
         }
-    } else if (status == -1) { // Our custom error marker from setup_error
-         // This case is already handled by the setup_error block earlier
-         // where last_error is set to "Invalid command in pipeline"
-         // and last_exit_code is set to -1.
-         // We just need to ensure we don't overwrite it here.
-    } else {
-        ctx->last_exit_code = -1; // Indicate non-exit termination (signal?)
-        // Store a message indicating abnormal termination
-        ctx->last_error = strdup("Pipeline command terminated abnormally");
+        redirs[i].redirs = pipeline.commands[i].redirs;
+        redirs[i].num_redirs = pipeline.commands[i].num_redirs;
     }
+    ShellRunOptions line_opts = opts ? *opts : (ShellRunOptions) { 0 };
+    line_opts.redirs = redirs;
 
-    // No need to free pipeline_argv, Python wrapper owns it
-    return ctx->last_exit_code;
+    if (shell_expand_globs(ctx, arena, &pipeline) < 0) return NULL;
+    if (pipeline.background) {
+        // Listed without the '&' (and the blanks before it), like bash's `jobs`
+        size_t len = strlen(line);
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+        if (len > 0 && line[len - 1] == '&') len--;
+        while (len > 0 && (line[len - 1] == ' ' || line[len - 1] == '\t')) len--;
+        const char *command = arena_strndup(arena, line, len);
+        ShellRun *run = command ? run_alloc(0, 0) : NULL;
+        if (!run) return NULL;
+        run->job_id = shell_start_job(ctx, (char *const *const *) pipeline.argvs, pipeline.num_commands,
+                                      command, redirs, line_opts.limits);
+        if (run->job_id < 0) { shell_run_free(run); return NULL; }
+        return run;
+    }
+    ShellRun *run = pipeline.num_commands == 1
+        ? shell_start(ctx, pipeline.argvs[0], &line_opts)
+        : shell_start_pipeline(ctx, (char *const *const *) pipeline.argvs, pipeline.num_commands, &line_opts);
+    if (run && run->command) {
+        // Stats show the line as typed, before glob expansion
+        free(run->command);
+        run->command = strdup(line);
+    }
+    return run;
+}
+
+// --- Jobs ---
+
+int shell_start_job(ShellContext *ctx, char *const *const *pipeline_argv, int num_commands,
+                    const char *command, const ShellRedirList *redirs, const ShellLimits *const *limits) {
+    char *text = NULL;
+    if (!command && !(command = text = command_text(pipeline_argv, num_commands))) return -1;
+
+    ShellRunOptions opts = { .background = true, .redirs = redirs, .limits = limits };
+    ShellRun *run = shell_start_pipeline(ctx, pipeline_argv, num_commands, &opts);
+    int id = run ? jobs_add(&ctx->jobs, run, run->pgid, command) : -1;
+    free(text);
+    if (!run) return -1;
+    if (id < 0) {
+        // Can't track it: don't leave an orphan running
+        if (run->pgid > 0) kill(-run->pgid, SIGTERM);
+        for (int i = 0; i < run->num_stages; i++) shell_run_reap(run, i, true);
+        shell_run_free(run);
+        return -1;
+    }
+    ctx->last_job = id;
+    return id;
+}
+
+int shell_jobs_reap(ShellContext *ctx) {
+    return jobs_reap(&ctx->jobs);
+}
+
+int shell_jobs_fd(ShellContext *ctx) {
+    return ctx->jobs.epoll_fd;
+}
+
+int shell_job_kill(ShellContext *ctx, int id, int sig) {
+    ShellJob *job = jobs_find(&ctx->jobs, id);
+    if (!job || job->done || job->pgid <= 0) { errno = ESRCH; return -1; }
+    return killpg(job->pgid, sig);
+}
+
+void shell_jobs_forget_done(ShellContext *ctx) {
+    jobs_forget_done(&ctx->jobs);
+}
+
+ShellRun* shell_job_take(ShellContext *ctx, int id) {
+    return jobs_take(&ctx->jobs, id);
+}
+
+// Path of a snapshot's new cwd fd. Without /proc, the path it was reached
+// by (not normalized) is the best there is.
+static char* snapshot_cwd_path(const ShellContext *ctx, int fd, const char *path) {
+    char link[64], target[PATH_MAX];
+    snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+    ssize_t len = readlink(link, target, sizeof(target) - 1);
+    if (len > 0) {
+        target[len] = '\0';
+        return strdup(target);
+    }
+    char *joined;
+    if (path[0] == '/' || !ctx->cwd) return strdup(path);
+    return asprintf(&joined, "%s/%s", ctx->cwd, path) < 0 ? NULL : joined;
 }
 
 // Change directory
 int shell_cd(ShellContext *ctx, const char *path) {
+    if (ctx->cwd_fd >= 0) {
+        // A snapshot: move its own directory fd, the process's cwd stays put
+        int fd = openat(ctx->cwd_fd, path, O_PATH | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) return -1;
+        char *cwd = NULL;
+        // chdir() would need search permission, which an O_PATH open doesn't check
+        if (faccessat(fd, ".", X_OK, AT_EACCESS) != 0 || !(cwd = snapshot_cwd_path(ctx, fd, path))) {
+            int err = errno;
+            close(fd);
+            errno = err;
+            return -1;
+        }
+        close(ctx->cwd_fd);
+        ctx->cwd_fd = fd;
+        free(ctx->cwd);
+        ctx->cwd = cwd;
+        ctx->cwd_generation++;
+        return 0;
+    }
+
     if (chdir(path) != 0) {
         return -1;
     }
@@ -294,61 +1185,37 @@ int shell_cd(ShellContext *ctx, const char *path) {
     // Update current working directory
     free(ctx->cwd);
     ctx->cwd = getcwd(NULL, 0);
+    ctx->cwd_generation++;
     return 0;
 }
 
 // Get environment variable
 const char* shell_getenv(ShellContext *ctx, const char *name) {
-    for (int i = 0; ctx->env[i]; i++) {
-        char *equals = strchr(ctx->env[i], '=');
-        if (equals && strncmp(ctx->env[i], name, equals - ctx->env[i]) == 0) {
-            return equals + 1;
-        }
-    }
-    return NULL;
+    return env_get(&ctx->env, name);
 }
 
 // Set environment variable
 int shell_setenv(ShellContext *ctx, const char *name, const char *value) {
-    char *new_var;
-    // Use snprintf to avoid potential buffer overflows if name/value are huge,
-    // though the immediate issue is the realloc below.
-    int required_size = snprintf(NULL, 0, "%s=%s", name, value);
-    if (required_size < 0) { return -1; } // Encoding error
-    new_var = malloc(required_size + 1);
-    if (!new_var) { return -1; } // Malloc failed
-    sprintf(new_var, "%s=%s", name, value); // sprintf is safe here due to size check
-
-    // Find existing variable
-    int i;
-    for (i = 0; ctx->env[i]; i++) {
-        char *equals = strchr(ctx->env[i], '=');
-        // Check for NULL equals just in case env var has no '='
-        if (equals && strncmp(ctx->env[i], name, equals - ctx->env[i]) == 0 && name[equals - ctx->env[i]] == '\0') {
-            free(ctx->env[i]); // Free the old string
-            ctx->env[i] = new_var; // Assign the newly allocated string
-            return 0;
-        }
-    }
-
-    // --- Add new variable --- 
-    int env_count = i; // 'i' is now the index of the NULL terminator
+    if (env_set(&ctx->env, name, value) < 0) return -1;
+    if (strcmp(name, "PATH") == 0) return cmd_cache_set_path(&ctx->cmds, value);
+    return 0;
+}
 
-    // Resize the environment array: needs space for env_count existing pointers,
-    // the new pointer, and the new NULL terminator (env_count + 2 total)
-    char **new_env = realloc(ctx->env, sizeof(char*) * (env_count + 2));
-    if (!new_env) {
-        free(new_var); // Free the variable string we allocated
-        // ctx->env is still the old, valid pointer
-        return -1; // Realloc failed
-    }
-    ctx->env = new_env; // Update context pointer to the new array
+// Remove environment variable
+int shell_unsetenv(ShellContext *ctx, const char *name) {
+    if (env_unset(&ctx->env, name) < 0) return -1;
+    if (strcmp(name, "PATH") == 0) return cmd_cache_set_path(&ctx->cmds, NULL);
+    return 0;
+}
 
-    // Add the new variable and the null terminator
-    ctx->env[env_count] = new_var;
-    ctx->env[env_count + 1] = NULL;
+// Resolve a command through the path cache
+const char* shell_which(ShellContext *ctx, const char *name) {
+    return cmd_cache_lookup(&ctx->cmds, name);
+}
 
-    return 0;
+// Forget every cached resolution (bash's `hash -r`)
+int shell_rehash(ShellContext *ctx) {
+    return cmd_cache_set_path(&ctx->cmds, shell_getenv(ctx, "PATH"));
 }
 
 // Get last error message
@@ -361,14 +1228,17 @@ void shell_cleanup(ShellContext *ctx) {
     if (!ctx) return;
     
     if (ctx->cwd) free(ctx->cwd);
+    if (ctx->cwd_fd >= 0) close(ctx->cwd_fd);
     if (ctx->last_error) free(ctx->last_error);
+    free_last_stages(ctx);
     
-    if (ctx->env) {
-        for (int i = 0; ctx->env[i]; i++) {
-            free(ctx->env[i]);
-        }
-        free(ctx->env);
-    }
+    env_free(&ctx->env);
+    cmd_cache_free(&ctx->cmds);
+    glob_cache_free(&ctx->globs);
+    jobs_free(&ctx->jobs);
+    stats_free(&ctx->stats);
+    spawn_server_free(&ctx->server);
+    pthread_rwlock_destroy(&ctx->lock);
     
     free(ctx);
 } 
\ No newline at end of file
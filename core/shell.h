@@ -2,25 +2,262 @@
 #define SHELL_H
 
 #include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <pthread.h>
+#include "ring.h"
+#include "env.h"
+#include "cmd_cache.h"
+#include "shell_glob.h"
+#include "parser.h"
+#include "redir.h"
+#include "jobs.h"
+#include "stats.h"
+#include "spawn_server.h"
+#include "spawn_limits.h"
 
-// Shell context structure
+#define MAX_ERROR_LEN 4096  // Default bytes of stderr kept for last_error
+
+// How child processes are launched
+typedef enum {
+    SHELL_SPAWN_FORK = 0,  // fork() + execvp() (default)
+    SHELL_SPAWN_POSIX,     // posix_spawnp(), vfork-style, no page table copy
+    SHELL_SPAWN_SERVER,    // Forked by a small helper process (spawn_server.c)
+} ShellSpawnEngine;
+
+// Outcome of one command or pipeline (shell_run_result), or of one stage of one
+typedef struct {
+    int exit_code;         // Exit status, -1 if it was killed by a signal
+    int signal;            // Signal that killed it, 0 if it exited
+    char *error;           // Tail of its stderr or why it failed, NULL if there is none
+    ShellUsage usage;      // Time and resources it used (zero for builtins)
+} ShellResult;
+
+// Shell context structure.
+// One context can drive several runs at once from different threads. Hold
+// lock shared to read its state (cwd, env, last_*) and exclusively for
+// anything that changes it, launches included (they update the caches).
+// A run needs no lock between its start and shell_run_finish: completing
+// it only touches the run itself.
 typedef struct {
     char *cwd;              // Current working directory
-    char **env;            // Environment variables
+    int cwd_fd;             // cwd held open by a snapshot (shell_snapshot), -1 = the process's cwd
+    uint64_t cwd_generation; // Bumped by every successful shell_cd
+    ShellEnv env;          // Environment variables (passed to every child)
+    ShellCmdCache cmds;    // Command name -> path resolutions (bash's `hash`)
+    ShellGlobCache globs;  // Recent directory listings for wildcard expansion
+    ShellJobTable jobs;    // Background jobs
+    int last_job;          // Id of the most recently started job, 0 if none
     int last_exit_code;    // Last command's exit code
     bool interactive;      // Whether shell is interactive
     char *last_error;     // Last error message
+    ShellResult *last_stages; // Per-stage outcome of the last run (bash's PIPESTATUS)
+    int num_last_stages;
+    ShellStats stats;      // Usage of recent runs, when enabled (stats_resize)
+    ShellSpawnEngine spawn_engine; // Engine used to launch commands
+    ShellSpawnServer server; // Helper for SHELL_SPAWN_SERVER, started by spawn_server_start
+    size_t stderr_tail_size; // Bytes of stderr kept per stage (ring buffer size)
+    size_t pipe_size;      // Capacity asked for between pipeline stages, 0 = kernel default
+    pthread_rwlock_t lock; // See above; taken by callers, never by the functions below
 } ShellContext;
 
+// Per-invocation options for shell_start/shell_start_pipeline (NULL = defaults)
+typedef struct {
+    bool capture_stdout;   // Send the last stage's stdout to a memfd (ShellRun.out_fd)
+    bool background;       // Own process group, stdin from /dev/null, stderr not captured
+    const ShellRedirList *redirs; // One per stage, applied after its pipes (NULL = none)
+    const ShellLimits *const *limits; // One per stage, NULL (or a NULL entry) = none; not
+                                      // applied to builtins that run in-process
+} ShellRunOptions;
+
+// One process of a running command or pipeline
+typedef struct {
+    pid_t pid;             // >0 child pid, 0 exec failed (exit 127), -1 never started
+    int pidfd;             // pidfd for event-loop notification, -1 if not opened
+    int status;            // waitpid() status once reaped
+    bool reaped;           // Whether status is final
+    int err_fd;            // Read end of this stage's stderr pipe, -1 if not captured
+    bool err_eof;          // err_fd has hit EOF (or failed)
+    ShellRing err;         // Last ctx->stderr_tail_size bytes of the stage's stderr
+    int64_t started_ns;    // Monotonic clock just before the spawn
+    ShellUsage usage;      // wait4() figures, filled in when reaped
+    ShellSpawnServer *server; // Helper whose child this is (reaped through it), NULL if ours
+} ShellStage;
+
+// A command or pipeline that has been launched but not yet reaped.
+// Created by shell_start/shell_start_pipeline and completed either with
+// shell_run_wait (blocking) or by handing shell_run_watch's fd to an event
+// loop, calling shell_run_poll whenever it is readable, and then calling
+// shell_run_finish.
+typedef struct ShellRun {
+    int num_stages;        // 0 for builtins that already ran in-process
+    ShellStage *stages;
+    bool is_pipeline;      // Reports the failing stage's stderr, not the last one's
+    int epoll_fd;          // Watches every pidfd and stderr pipe, -1 until shell_run_watch
+    int exit_code;         // Result for runs with no stages or a failed setup
+    char *error;           // Builtin/setup error message, owned by the run
+    bool setup_failed;     // Pipeline had an invalid stage; result is exit_code/error
+    int out_fd;            // memfd holding the captured stdout, -1 if not capturing
+    pid_t pgid;            // Process group of a background run, 0 otherwise
+    int job_id;            // Job a background line was started as (shell_start_line), 0 if none
+    char *command;         // Command line for ctx->stats, NULL while that is disabled
+    uint32_t trace_run;    // Tags the run's trace events (trace.h), 0 when not tracing
+} ShellRun;
+
+// Captured stdout of a finished run, mapped read-only into memory
+typedef struct {
+    void *data;            // NULL when the output is empty
+    size_t len;
+} ShellOutput;
+
 // Initialize shell context
 ShellContext* shell_init(void);
 
+// New context starting out with ctx's cwd, environment, spawn engine and
+// buffer sizes, but changing them independently: its cwd is a directory fd
+// its children fchdir to, so shell_cd on it never calls chdir(), and its
+// environment shares ctx's table until one of them is changed. Runs,
+// jobs, caches and stats start empty; a server spawn engine becomes
+// posix_spawn until one is started for it. Hold ctx's lock exclusively.
+// Returns NULL (errno set) on failure.
+ShellContext* shell_snapshot(ShellContext *ctx);
+
+// Directory fd that relative paths of ctx's resolve against: its cwd_fd,
+// or AT_FDCWD (for openat() and friends)
+int shell_dirfd(const ShellContext *ctx);
+
 // Execute a command with pre-parsed arguments
 int shell_execute(ShellContext *ctx, char *const argv[]);
 
 // Execute a pipeline of commands with pre-parsed arguments for each stage
 int shell_execute_pipeline(ShellContext *ctx, char *const *const *pipeline_argv, int num_commands);
 
+// Run independent commands with up to max_parallel (<= 0: one per CPU) in
+// flight at a time, like xargs -P. Each exit is picked up via its pidfd and
+// the freed slot refilled at once. limits (NULL = none) has one entry per
+// command, as in ShellRunOptions. results[i] (caller-allocated, one per
+// command, errors to be freed) holds command i's outcome; last_exit_code and
+// last_error describe the first command that failed. Returns 0, or -1 with
+// errno set if the batch couldn't be set up.
+int shell_execute_many(ShellContext *ctx, char *const *const *argvs, int num_commands, int max_parallel,
+                       const ShellLimits *const *limits, ShellResult *results);
+
+// Launch a command without waiting for it, or run it in-process if it is a
+// builtin (builtins.c; not for background runs). A redirection that can't
+// be opened fails the command with status 1 and the message as its stderr,
+// like bash, without launching it.
+// Returns NULL if no process could be created.
+ShellRun* shell_start(ShellContext *ctx, char *const argv[], const ShellRunOptions *opts);
+
+// Launch a pipeline without waiting for it. Returns NULL on setup failure.
+ShellRun* shell_start_pipeline(ShellContext *ctx, char *const *const *pipeline_argv, int num_commands,
+                               const ShellRunOptions *opts);
+
+// Parse a command line, expand its wildcards and launch it as a command or
+// pipeline, with its redirections applied. Words, matches and argv arrays
+// come from arena. On a syntax error returns NULL with *syntax_error set
+// (static string); a blank line gives a run with no stages, and so does a
+// line ending in '&', which is started as a background job (ShellRun.job_id).
+ShellRun* shell_start_line(ShellContext *ctx, ShellArena *arena, const char *line,
+                           const ShellRunOptions *opts, const char **syntax_error);
+
+// Start a pipeline as a background job (see ShellRunOptions.background).
+// command is the text shown in job listings (NULL: the words joined with
+// spaces and " | "); redirs and limits have one entry per stage, or are
+// NULL. Returns the job id, or -1.
+int shell_start_job(ShellContext *ctx, char *const *const *pipeline_argv, int num_commands,
+                    const char *command, const ShellRedirList *redirs, const ShellLimits *const *limits);
+
+// Reap every job process that has exited, without blocking. Returns the
+// number of jobs that finished.
+int shell_jobs_reap(ShellContext *ctx);
+
+// fd that becomes readable when a job process exits (add it to an event
+// loop and call shell_jobs_reap), or -1 if the kernel lacks pidfds
+int shell_jobs_fd(ShellContext *ctx);
+
+// Send sig to every process of a job. Returns 0, or -1 with errno set.
+int shell_job_kill(ShellContext *ctx, int id, int sig);
+
+// Drop finished jobs from the table (after they have been reported)
+void shell_jobs_forget_done(ShellContext *ctx);
+
+// Move a job to the foreground: it leaves the table and its run can be
+// completed like any other (shell_run_wait, or an event loop). NULL if
+// there is no such job.
+ShellRun* shell_job_take(ShellContext *ctx, int id);
+
+// Expand one wildcard pattern against ctx->cwd, sorted for ctx's LC_COLLATE.
+// Returns the number of matches (0 leaves *matches untouched) or -1.
+int shell_glob(ShellContext *ctx, ShellArena *arena, const char *pattern, char ***matches);
+
+// Replace every wildcard word of a parsed line with its matches, in place.
+// Words that match nothing stay as written, like bash without nullglob.
+int shell_expand_globs(ShellContext *ctx, ShellArena *arena, ShellPipeline *pipeline);
+
+// Open a pidfd for every live stage. Returns -1 (errno set) if unsupported.
+int shell_run_open_pidfds(ShellRun *run);
+
+// Perform one read() on a stage's stderr pipe. Returns 1 if data was read,
+// 0 at EOF, -1 if the (non-blocking) pipe is empty for now.
+int shell_run_drain(ShellRun *run, int stage);
+
+// Read whatever is left in every stderr pipe without waiting for EOF (a
+// background grandchild may hold a write end open), then close them.
+void shell_run_close_stderr(ShellRun *run);
+
+// Reap one stage, blocking or not. Returns true once the stage has exited.
+bool shell_run_reap(ShellRun *run, int stage, bool block);
+
+// Record a stage's wait4() result (status and rusage) for whoever reaped it
+void shell_stage_exited(ShellStage *stage, int status, const struct rusage *ru);
+
+// A stage whose exit status can't be had: exit 127 with the reason as its stderr
+void shell_stage_lost(ShellStage *stage, const char *why);
+
+// Put every live stage's pidfd and every open stderr pipe into one epoll
+// set. Returns its fd (readable whenever shell_run_poll has work), or -1
+// with errno set if pidfds aren't supported.
+int shell_run_watch(ShellRun *run);
+
+// Wait up to timeout_ms (-1 = forever, 0 = don't) for events on the watch
+// fd, draining stderr pipes and reaping stages that are ready. Returns the
+// number of stages still running, or -1 with errno set.
+int shell_run_poll(ShellRun *run, int timeout_ms);
+
+// Record the run's outcome in ctx (last_exit_code, last_error, last_stages)
+// and return the exit code
+int shell_run_finish(ShellContext *ctx, ShellRun *run);
+
+// The outcome of a finished run, taken from the run alone: the exit code
+// and signal of its last stage, the error message last_error would get and
+// its usage summed over the stages. result->error is malloc'd (free it
+// with shell_result_free). Returns the exit code.
+int shell_run_result(const ShellRun *run, ShellResult *result);
+
+void shell_result_free(ShellResult *result);
+
+// Wait until every stage of a run has exited and its stderr is collected.
+// Touches nothing but the run, so it doesn't need ctx->lock.
+void shell_run_complete(ShellRun *run);
+
+// Drive a run to completion synchronously: wait on every stderr pipe and
+// every stage's pidfd together until all stages have exited, so a child that
+// writes more than a pipe buffer of stderr can't block forever.
+int shell_run_wait(ShellContext *ctx, ShellRun *run);
+
+// Map a finished run's captured stdout. The child wrote straight into the
+// memfd, so this is the only view of the data and nothing is copied.
+// Returns 0, or -1 with errno set.
+int shell_run_map_output(ShellRun *run, ShellOutput *out);
+
+// Unmap output returned by shell_run_map_output
+void shell_output_unmap(ShellOutput *out);
+
+// Release a run, closing any fds it still holds
+void shell_run_free(ShellRun *run);
+
 // Change directory
 int shell_cd(ShellContext *ctx, const char *path);
 
@@ -30,6 +267,15 @@ const char* shell_getenv(ShellContext *ctx, const char *name);
 // Set environment variable
 int shell_setenv(ShellContext *ctx, const char *name, const char *value);
 
+// Remove environment variable
+int shell_unsetenv(ShellContext *ctx, const char *name);
+
+// Absolute path a command runs from, or NULL if it isn't found in PATH
+const char* shell_which(ShellContext *ctx, const char *name);
+
+// Forget every cached command resolution and directory listing
+int shell_rehash(ShellContext *ctx);
+
 // Get last error message
 const char* shell_get_error(ShellContext *ctx);
 
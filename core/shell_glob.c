@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <fnmatch.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "shell_glob.h"
+
+#define GLOB_CACHE_TTL_SEC 10     // Listings unused for this long are dropped
+#define GLOB_RACY_NS 100000000L   // A change this close to the scan may not move the mtime
+#define GLOB_MAX_DEPTH 128        // Deeper patterns match nothing rather than exhaust the stack
+
+// State of one glob_expand() call
+typedef struct {
+    ShellGlobCache *cache;
+    ShellArena *arena;
+    const char *cwd;
+    char **results;
+    size_t count;
+    size_t cap;
+} Glob;
+
+static long long ts_diff_ns(struct timespec a, struct timespec b) {
+    return (long long) (a.tv_sec - b.tv_sec) * 1000000000LL + (a.tv_nsec - b.tv_nsec);
+}
+
+static void free_dir(GlobDir *d) {
+    free(d->dir);
+    free(d->blob);
+    free(d->offsets);
+    free(d->types);
+    memset(d, 0, sizeof(*d));
+}
+
+void glob_cache_init(ShellGlobCache *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void glob_cache_free(ShellGlobCache *cache) {
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) free_dir(&cache->dirs[i]);
+    free(cache->collate_name);
+    if (cache->collate) freelocale(cache->collate);
+    memset(cache, 0, sizeof(*cache));
+}
+
+// Read every name in path except "." and ".." into d
+static int read_dir(GlobDir *d, const char *path) {
+    DIR *dp = opendir(path);
+    if (!dp) return -1;
+
+    size_t blob_cap = 4096, blob_len = 0, cap = 256, n = 0;
+    char *blob = malloc(blob_cap);
+    uint32_t *offsets = malloc(sizeof(uint32_t) * cap);
+    unsigned char *types = malloc(cap);
+    if (!blob || !offsets || !types) goto fail;
+
+    struct dirent *de;
+    while ((de = readdir(dp)) != NULL) {
+        const char *name = de->d_name;
+        if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) continue;
+        size_t len = strlen(name) + 1;
+        if (blob_len + len > UINT32_MAX) goto fail; // 4 GB of names; give up on caching it
+        if (blob_len + len > blob_cap) {
+            while (blob_len + len > blob_cap) blob_cap *= 2;
+            char *grown = realloc(blob, blob_cap);
+            if (!grown) goto fail;
+            blob = grown;
+        }
+        if (n == cap) {
+            cap *= 2;
+            uint32_t *grown_offsets = realloc(offsets, sizeof(uint32_t) * cap);
+            if (!grown_offsets) goto fail;
+            offsets = grown_offsets;
+            unsigned char *grown_types = realloc(types, cap);
+            if (!grown_types) goto fail;
+            types = grown_types;
+        }
+        memcpy(blob + blob_len, name, len);
+        offsets[n] = (uint32_t) blob_len;
+        types[n] = de->d_type;
+        blob_len += len;
+        n++;
+    }
+    closedir(dp);
+    d->blob = blob;
+    d->offsets = offsets;
+    d->types = types;
+    d->count = n;
+    return 0;
+
+fail:
+    closedir(dp);
+    free(blob);
+    free(offsets);
+    free(types);
+    return -1;
+}
+
+// Listing of the directory at absolute path, from the cache when its mtime
+// hasn't moved. scratch is used instead of a cache slot when every slot is
+// busy (pinned by an outer directory being matched). Returns NULL if path
+// isn't a readable directory.
+static GlobDir* get_listing(ShellGlobCache *cache, const char *path, GlobDir *scratch, int *pinned) {
+    struct stat st;
+    if (stat(path, &st) != 0 || !S_ISDIR(st.st_mode)) return NULL;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    GlobDir *slot = NULL;
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        GlobDir *d = &cache->dirs[i];
+        if (d->dir && strcmp(d->dir, path) == 0) {
+            if (!d->racy && d->dev == st.st_dev && d->ino == st.st_ino &&
+                d->mtime.tv_sec == st.st_mtim.tv_sec && d->mtime.tv_nsec == st.st_mtim.tv_nsec) {
+                cache->hits++;
+                d->used = now;
+                return d;
+            }
+            slot = pinned[i] ? scratch : d;
+            break;
+        }
+    }
+    if (!slot) {
+        // A free slot, else the least recently used one not in use higher up
+        for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+            GlobDir *d = &cache->dirs[i];
+            if (pinned[i]) continue;
+            if (!d->dir) { slot = d; break; }
+            if (!slot || ts_diff_ns(d->used, slot->used) < 0) slot = d;
+        }
+    }
+    if (!slot) slot = scratch;
+    free_dir(slot);
+
+    struct timespec scan_start;
+    clock_gettime(CLOCK_REALTIME, &scan_start);
+    if (read_dir(slot, path) < 0 || !(slot->dir = strdup(path))) {
+        free_dir(slot);
+        return NULL;
+    }
+    slot->dev = st.st_dev;
+    slot->ino = st.st_ino;
+    slot->mtime = st.st_mtim;
+    // Timestamps are coarse: a file created right after the scan may leave the mtime as is
+    slot->racy = ts_diff_ns(scan_start, st.st_mtim) < GLOB_RACY_NS;
+    slot->used = now;
+    cache->misses++;
+    return slot;
+}
+
+static int add_result(Glob *g, const char *path, size_t len) {
+    if (g->count == g->cap) {
+        size_t cap = g->cap ? g->cap * 2 : 16;
+        char **grown = arena_alloc(g->arena, sizeof(char*) * cap);
+        if (!grown) return -1;
+        if (g->count) memcpy(grown, g->results, sizeof(char*) * g->count);
+        g->results = grown;
+        g->cap = cap;
+    }
+    if (!(g->results[g->count] = arena_strndup(g->arena, path, len))) return -1;
+    g->count++;
+    return 0;
+}
+
+// Absolute form of the directory prefix (path[0..len)) into out
+static bool absolute_dir(const Glob *g, const char *path, size_t len, char *out) {
+    int n;
+    if (len > 0 && path[0] == '/') n = snprintf(out, PATH_MAX, "%.*s", (int) len, path);
+    else if (len > 0) n = snprintf(out, PATH_MAX, "%s/%.*s", g->cwd, (int) len, path);
+    else n = snprintf(out, PATH_MAX, "%s", g->cwd);
+    return n > 0 && n < PATH_MAX;
+}
+
+// Is path[0..len) a directory? d_type answers without a stat() for most entries
+static bool is_dir_entry(const Glob *g, const char *path, size_t len, unsigned char type) {
+    if (type == DT_DIR) return true;
+    if (type != DT_LNK && type != DT_UNKNOWN) return false;
+    char full[PATH_MAX];
+    struct stat st;
+    return absolute_dir(g, path, len, full) && stat(full, &st) == 0 && S_ISDIR(st.st_mode);
+}
+
+// Listing for the directory prefix path[0..len); kept out of match_from so
+// the PATH_MAX buffer isn't on the stack for every level of recursion
+static GlobDir* listing_for(Glob *g, const char *path, size_t len, GlobDir *scratch, int *pinned) {
+    char dir[PATH_MAX];
+    if (!absolute_dir(g, path, len, dir)) return NULL;
+    return get_listing(g->cache, dir, scratch, pinned);
+}
+
+// Does the component (len bytes) contain an unescaped wildcard?
+static bool has_magic(const char *comp, size_t len) {
+    for (size_t i = 0; i < len; i++) {
+        if (comp[i] == '\\') i++;
+        else if (comp[i] == '*' || comp[i] == '?' || comp[i] == '[') return true;
+    }
+    return false;
+}
+
+// Match the pattern components in rest against the directory path[0..len)
+// (the output form: as written, '/'-terminated unless empty).
+static int match_from(Glob *g, char *path, size_t len, const char *rest, int *pinned, int depth) {
+    if (depth > GLOB_MAX_DEPTH) return 0;
+    while (*rest == '/') rest++;
+    const char *end = strchr(rest, '/');
+    size_t comp_len = end ? (size_t) (end - rest) : strlen(rest);
+    const char *after = end;
+    while (after && *after == '/') after++;
+    bool last = !after || *after == '\0';
+    bool want_dir = end != NULL; // Trailing '/' (or more components) : directories only
+
+    if (!has_magic(rest, comp_len)) {
+        // Literal component: unescape it onto the path
+        size_t n = len;
+        for (size_t i = 0; i < comp_len; i++) {
+            if (rest[i] == '\\' && i + 1 < comp_len) i++;
+            if (n + 2 >= PATH_MAX) return 0;
+            path[n++] = rest[i];
+        }
+        if (!last) {
+            path[n++] = '/';
+            return match_from(g, path, n, after, pinned, depth + 1);
+        }
+        path[n] = '\0';
+        char abs[PATH_MAX];
+        struct stat st;
+        if (!absolute_dir(g, path, n, abs)) return 0;
+        if (want_dir ? (stat(abs, &st) != 0 || !S_ISDIR(st.st_mode)) : lstat(abs, &st) != 0) return 0;
+        if (want_dir) path[n++] = '/';
+        return add_result(g, path, n);
+    }
+
+    char comp[NAME_MAX * 2 + 2];
+    if (comp_len >= sizeof(comp)) return 0;
+    memcpy(comp, rest, comp_len);
+    comp[comp_len] = '\0';
+
+    GlobDir scratch = { 0 };
+    GlobDir *listing = listing_for(g, path, len, &scratch, pinned);
+    if (!listing) return 0;
+    int index = listing == &scratch ? -1 : (int) (listing - g->cache->dirs);
+    if (index >= 0) pinned[index]++; // Keep it while deeper levels use the cache
+
+    int result = 0;
+    for (size_t i = 0; i < listing->count && result == 0; i++) {
+        const char *name = listing->blob + listing->offsets[i];
+        // FNM_PERIOD: a leading '.' only matches a literal '.'
+        if (fnmatch(comp, name, FNM_PERIOD) != 0) continue;
+        size_t name_len = strlen(name);
+        if (len + name_len + 2 >= PATH_MAX) continue;
+        memcpy(path + len, name, name_len);
+        size_t n = len + name_len;
+        if (want_dir && !is_dir_entry(g, path, n, listing->types[i])) continue;
+        if (!last) {
+            path[n++] = '/';
+            result = match_from(g, path, n, after, pinned, depth + 1);
+        } else {
+            if (want_dir) path[n++] = '/';
+            result = add_result(g, path, n);
+        }
+    }
+
+    if (index >= 0) pinned[index]--;
+    if (listing == &scratch) free_dir(&scratch);
+    return result;
+}
+
+// Make cache->collate match the requested LC_COLLATE locale name
+static void set_collation(ShellGlobCache *cache, const char *name) {
+    if (!name || !*name || strcmp(name, "C") == 0 || strcmp(name, "POSIX") == 0) name = "C";
+    if (cache->collate_name && strcmp(cache->collate_name, name) == 0) return;
+
+    if (cache->collate) freelocale(cache->collate);
+    free(cache->collate_name);
+    // An unknown locale sorts in byte order, like the C locale
+    cache->collate = strcmp(name, "C") == 0 ? (locale_t) 0 : newlocale(LC_COLLATE_MASK, name, (locale_t) 0);
+    cache->collate_name = strdup(name);
+}
+
+static int compare_matches(const void *a, const void *b, void *locale) {
+    const char *x = *(const char *const *) a;
+    const char *y = *(const char *const *) b;
+    return locale ? strcoll_l(x, y, (locale_t) locale) : strcmp(x, y);
+}
+
+int glob_expand(ShellGlobCache *cache, const char *cwd, const char *collate,
+                const char *pattern, ShellArena *arena, char ***matches) {
+    // Drop listings nobody has used for a while
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        GlobDir *d = &cache->dirs[i];
+        if (d->dir && now.tv_sec - d->used.tv_sec > GLOB_CACHE_TTL_SEC) free_dir(d);
+    }
+
+    Glob g = { .cache = cache, .arena = arena, .cwd = cwd ? cwd : "." };
+    int pinned[GLOB_CACHE_DIRS] = { 0 };
+    char path[PATH_MAX];
+    size_t len = 0;
+    if (pattern[0] == '/') path[len++] = '/';
+
+    if (match_from(&g, path, len, pattern, pinned, 0) < 0) return -1;
+    if (g.count == 0) return 0;
+
+    set_collation(cache, collate);
+    qsort_r(g.results, g.count, sizeof(char*), compare_matches, cache->collate);
+    *matches = g.results;
+    return (int) g.count;
+}
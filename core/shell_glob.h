@@ -0,0 +1,51 @@
+#ifndef SHELL_GLOB_H
+#define SHELL_GLOB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+#include <locale.h>
+#include <sys/types.h>
+#include "arena.h"
+
+#define GLOB_CACHE_DIRS 8  // Directory listings kept at once
+
+// One cached directory listing, valid while the directory's mtime is unchanged
+typedef struct {
+    char *dir;             // Absolute path (key), NULL if the slot is free
+    dev_t dev;
+    ino_t ino;
+    struct timespec mtime;
+    bool racy;             // Modified too close to the scan to trust the mtime
+    char *blob;            // All names, NUL-separated
+    uint32_t *offsets;     // Start of each name in blob
+    unsigned char *types;  // d_type of each name
+    size_t count;
+    struct timespec used;  // Last use (CLOCK_MONOTONIC), for LRU and expiry
+} GlobDir;
+
+// Short-lived cache of directory listings used by glob expansion, so several
+// patterns on one line, or consecutive commands in one directory, read a
+// large directory once.
+typedef struct {
+    GlobDir dirs[GLOB_CACHE_DIRS];
+    unsigned long hits;    // Listings served from the cache
+    unsigned long misses;  // Listings read from disk
+    char *collate_name;    // Locale the sort order below was built for
+    locale_t collate;      // LC_COLLATE used to sort matches, (locale_t) 0 = byte order
+} ShellGlobCache;
+
+void glob_cache_init(ShellGlobCache *cache);
+void glob_cache_free(ShellGlobCache *cache);
+
+// Expand pattern (fnmatch syntax, '\' escapes) relative to cwd. Matches are
+// sorted like bash sorts them (strcoll in the given LC_COLLATE locale name,
+// NULL or "C" for byte order) and allocated from arena. Hidden files only
+// match a pattern that starts with '.', and "." / ".." never match.
+// Returns the number of matches (0: none, *matches untouched), or -1 on
+// allocation failure.
+int glob_expand(ShellGlobCache *cache, const char *cwd, const char *collate,
+                const char *pattern, ShellArena *arena, char ***matches);
+
+#endif // SHELL_GLOB_H
@@ -0,0 +1,382 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include "shell_history.h"
+
+#define HISTORY_MIN_CAP 256
+#define HISTORY_MAP_SLACK (1 << 20) // Extra bytes mapped beyond the end of the file
+
+const char* history_text(const ShellHistory *hist, size_t i, size_t *len) {
+    const HistEntry *e = &hist->entries[i];
+    *len = e->len;
+    return (e->copied ? hist->copies : hist->map) + e->offset;
+}
+
+static int grow(void **array, size_t *cap, size_t need, size_t size) {
+    if (need <= *cap) return 0;
+    size_t n = *cap ? *cap : HISTORY_MIN_CAP;
+    while (n < need) n *= 2;
+    void *p = realloc(*array, n * size);
+    if (!p) return -1;
+    *array = p;
+    *cap = n;
+    return 0;
+}
+
+// Compare two texts bytewise, shorter first on a tie
+static int compare_text(const char *a, size_t alen, const char *b, size_t blen) {
+    int c = memcmp(a, b, alen < blen ? alen : blen);
+    if (c) return c;
+    return alen < blen ? -1 : alen > blen;
+}
+
+// An entry and its first 8 bytes as a big-endian number, so most of the
+// sort never touches the text
+typedef struct {
+    uint64_t head;
+    uint32_t id;
+} SortKey;
+
+static uint64_t text_head(const char *text, size_t len) {
+    uint64_t head = 0;
+    for (size_t i = 0; i < 8; i++) head = head << 8 | (i < len ? (unsigned char) text[i] : 0);
+    return head;
+}
+
+static int compare_keys(const void *a, const void *b, void *arg) {
+    const ShellHistory *hist = arg;
+    size_t alen, blen;
+    const char *at = history_text(hist, ((const SortKey *) a)->id, &alen);
+    const char *bt = history_text(hist, ((const SortKey *) b)->id, &blen);
+    return compare_text(at, alen, bt, blen);
+}
+
+static uint32_t text_hash(const char *text, size_t len) {
+    // FNV-1a, same as the environment table
+    uint32_t h = 2166136261u;
+    for (size_t i = 0; i < len; i++) {
+        h ^= (unsigned char) text[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// First sorted position whose text is >= the given text
+static size_t lower_bound(const ShellHistory *hist, const char *text, size_t len) {
+    size_t lo = 0, hi = hist->num_sorted;
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        size_t mlen;
+        const char *mt = history_text(hist, hist->sorted[mid], &mlen);
+        if (compare_text(mt, mlen, text, len) < 0) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+// Sorted positions [*first, return) of the texts starting with prefix
+static size_t prefix_range(const ShellHistory *hist, const char *prefix, size_t len, size_t *first) {
+    size_t lo = lower_bound(hist, prefix, len), hi = hist->num_sorted;
+    *first = lo;
+    // Texts starting with prefix compare >= it, and end before the first
+    // one that doesn't start with it
+    size_t a = lo;
+    while (a < hi) {
+        size_t mid = a + (hi - a) / 2;
+        size_t mlen;
+        const char *mt = history_text(hist, hist->sorted[mid], &mlen);
+        if (mlen >= len && memcmp(mt, prefix, len) == 0) a = mid + 1;
+        else hi = mid;
+    }
+    return a;
+}
+
+// Make entry i the newest of its text in the sorted index
+static int sorted_add(ShellHistory *hist, uint32_t i) {
+    size_t len;
+    const char *text = history_text(hist, i, &len);
+    size_t at = lower_bound(hist, text, len);
+    if (at < hist->num_sorted) {
+        size_t olen;
+        const char *other = history_text(hist, hist->sorted[at], &olen);
+        if (compare_text(other, olen, text, len) == 0) {
+            hist->sorted[at] = i;
+            return 0;
+        }
+    }
+    if (grow((void **) &hist->sorted, &hist->sorted_cap, hist->num_sorted + 1, sizeof(uint32_t)) < 0) return -1;
+    memmove(hist->sorted + at + 1, hist->sorted + at, (hist->num_sorted - at) * sizeof(uint32_t));
+    hist->sorted[at] = i;
+    hist->num_sorted++;
+    return 0;
+}
+
+// Build the sorted index of everything at once (after the initial load).
+// Histories repeat themselves a lot, so the newest copy of each text is
+// picked out with a hash table first; the distinct ones are then radix
+// sorted by their first 8 bytes, and only texts sharing those are compared.
+static int sorted_build(ShellHistory *hist) {
+    size_t cap = 16;
+    while (cap < hist->count * 2) cap *= 2;
+    uint32_t *seen = malloc(sizeof(uint32_t) * cap);
+    SortKey *keys = malloc(sizeof(SortKey) * (hist->count + 1));
+    SortKey *tmp = malloc(sizeof(SortKey) * (hist->count + 1));
+    if (!seen || !keys || !tmp ||
+        grow((void **) &hist->sorted, &hist->sorted_cap, hist->count, sizeof(uint32_t)) < 0) {
+        free(seen);
+        free(keys);
+        free(tmp);
+        return -1;
+    }
+    memset(seen, 0xff, sizeof(uint32_t) * cap);  // UINT32_MAX = empty
+    size_t n = 0;
+    for (size_t i = hist->count; i-- > 0;) {
+        size_t len;
+        const char *text = history_text(hist, i, &len);
+        size_t slot = text_hash(text, len) & (cap - 1);
+        bool dup = false;
+        for (; seen[slot] != UINT32_MAX; slot = (slot + 1) & (cap - 1)) {
+            size_t olen;
+            const char *other = history_text(hist, seen[slot], &olen);
+            if (olen == len && memcmp(other, text, len) == 0) {
+                dup = true;
+                break;
+            }
+        }
+        if (dup) continue;
+        seen[slot] = (uint32_t) i;
+        keys[n++] = (SortKey) {text_head(text, len), (uint32_t) i};
+    }
+    free(seen);
+
+    // LSD radix sort on head, skipping bytes every key shares
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t counts[256] = {0};
+        for (size_t i = 0; i < n; i++) counts[(keys[i].head >> shift) & 0xff]++;
+        if (n == 0 || counts[(keys[0].head >> shift) & 0xff] == n) continue;
+        size_t sum = 0;
+        for (int b = 0; b < 256; b++) {
+            size_t c = counts[b];
+            counts[b] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; i++) tmp[counts[(keys[i].head >> shift) & 0xff]++] = keys[i];
+        SortKey *swap = keys;
+        keys = tmp;
+        tmp = swap;
+    }
+    // Texts sharing their first 8 bytes are ordered by the rest
+    for (size_t i = 0; i < n;) {
+        size_t j = i + 1;
+        while (j < n && keys[j].head == keys[i].head) j++;
+        if (j - i > 1) qsort_r(keys + i, j - i, sizeof(SortKey), compare_keys, hist);
+        i = j;
+    }
+    for (size_t i = 0; i < n; i++) hist->sorted[i] = keys[i].id;
+    hist->num_sorted = n;
+    free(keys);
+    free(tmp);
+    return 0;
+}
+
+// Update hist->size, mapping more of the file if it grew past the mapping.
+// The mapping runs past the end of the file, so appends rarely remap; only
+// the first size bytes are ever read.
+static int map_file(ShellHistory *hist) {
+    struct stat st;
+    if (fstat(hist->fd, &st) < 0) return -1;
+    size_t size = (size_t) st.st_size;
+    if (size <= hist->mapped) {
+        hist->size = size;
+        return 0;
+    }
+    size_t want = size + size / 4 + HISTORY_MAP_SLACK;
+    void *map = mmap(NULL, want, PROT_READ, MAP_SHARED, hist->fd, 0);
+    if (map == MAP_FAILED) return -1;
+    if (hist->map) munmap((void *) hist->map, hist->mapped);
+    hist->map = map;
+    hist->mapped = want;
+    hist->size = size;
+    return 0;
+}
+
+// Add the "+" lines [start, end) of the map as one entry, the way
+// FileHistory reads them: lines joined, without the last newline
+static int add_entry(ShellHistory *hist, const char *start, const char *end, int lines, bool index) {
+    if (grow((void **) &hist->entries, &hist->cap, hist->count + 1, sizeof(HistEntry)) < 0) return -1;
+    HistEntry *e = &hist->entries[hist->count];
+    if (lines == 1) {
+        e->offset = (uint64_t) (start + 1 - hist->map);
+        e->len = (uint32_t) (end - start - 2);
+        e->copied = 0;
+    } else {
+        size_t need = (size_t) (end - start);
+        if (grow((void **) &hist->copies, &hist->copies_cap, hist->copies_len + need, 1) < 0) return -1;
+        e->offset = hist->copies_len;
+        e->copied = 1;
+        char *out = hist->copies + hist->copies_len;
+        for (const char *p = start; p < end;) {
+            const char *nl = memchr(p, '\n', (size_t) (end - p));
+            size_t n = (size_t) (nl - p);  // "+" and the text, without the newline
+            memcpy(out, p + 1, n - 1);
+            out += n - 1;
+            *out++ = '\n';
+            p = nl + 1;
+        }
+        e->len = (uint32_t) (out - 1 - (hist->copies + hist->copies_len));
+        hist->copies_len = (size_t) (out - hist->copies);
+        if (grow((void **) &hist->multi, &hist->multi_cap, hist->num_multi + 1, sizeof(uint32_t)) < 0) return -1;
+        hist->multi[hist->num_multi++] = (uint32_t) hist->count;
+    }
+    hist->count++;
+    return index ? sorted_add(hist, (uint32_t) (hist->count - 1)) : 0;
+}
+
+// Turn the complete lines past hist->parsed into entries. A last line
+// without its newline (a write in progress) is left for next time.
+static int parse(ShellHistory *hist, bool index) {
+    if (map_file(hist) < 0) return -1;
+    if (hist->parsed > hist->size) return 0;  // Truncated under us: keep what we have
+    const char *p = hist->map + hist->parsed, *end = hist->map + hist->size;
+    const char *block = NULL;  // First "+" line of the entry being read
+    int lines = 0;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', (size_t) (end - p));
+        if (!nl) break;
+        if (*p == '+') {
+            if (!block) block = p;
+            lines++;
+        } else {
+            if (block && add_entry(hist, block, p, lines, index) < 0) return -1;
+            block = NULL;
+            lines = 0;
+            hist->parsed = (uint64_t) (nl + 1 - hist->map);
+        }
+        p = nl + 1;
+    }
+    // An entry is only complete once another line follows it, or the file
+    // ends right after it (FileHistory starts every entry with a newline)
+    if (block && p == end) {
+        if (add_entry(hist, block, p, lines, index) < 0) return -1;
+        hist->parsed = (uint64_t) (p - hist->map);
+    }
+    return 0;
+}
+
+int history_open(ShellHistory *hist, const char *path) {
+    memset(hist, 0, sizeof(*hist));
+    hist->fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (hist->fd < 0) return -1;
+    if (parse(hist, false) < 0 || sorted_build(hist) < 0) {
+        int saved = errno;
+        history_close(hist);
+        errno = saved;
+        return -1;
+    }
+    return 0;
+}
+
+void history_close(ShellHistory *hist) {
+    if (hist->map) munmap((void *) hist->map, hist->mapped);
+    if (hist->fd >= 0) close(hist->fd);
+    free(hist->entries);
+    free(hist->copies);
+    free(hist->sorted);
+    free(hist->multi);
+    memset(hist, 0, sizeof(*hist));
+    hist->fd = -1;
+}
+
+int history_append(ShellHistory *hist, const char *text, size_t len) {
+    // "\n# 2024-01-31 12:00:00.000000\n" like FileHistory, then a "+" per line
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    struct tm tm;
+    localtime_r(&tv.tv_sec, &tm);
+    char stamp[64];
+    size_t stamp_len = strftime(stamp, sizeof(stamp), "\n# %Y-%m-%d %H:%M:%S", &tm);
+    stamp_len += (size_t) snprintf(stamp + stamp_len, sizeof(stamp) - stamp_len, ".%06ld\n", (long) tv.tv_usec);
+
+    size_t lines = 1;
+    for (size_t i = 0; i < len; i++) lines += text[i] == '\n';
+    char *buf = malloc(stamp_len + len + lines * 2);
+    if (!buf) return -1;
+    memcpy(buf, stamp, stamp_len);
+    char *out = buf + stamp_len;
+    *out++ = '+';
+    for (size_t i = 0; i < len; i++) {
+        *out++ = text[i];
+        if (text[i] == '\n') *out++ = '+';
+    }
+    *out++ = '\n';
+
+    // One O_APPEND write, so entries from several shells never interleave
+    size_t n = (size_t) (out - buf);
+    ssize_t written;
+    do {
+        written = write(hist->fd, buf, n);
+    } while (written < 0 && errno == EINTR);
+    free(buf);
+    if (written < 0) return -1;
+    return parse(hist, true);
+}
+
+// Last line of entry i starting with prefix. Returns false if none does.
+static bool entry_line(const ShellHistory *hist, size_t i, const char *prefix, size_t len, const char **line,
+                       size_t *line_len) {
+    size_t text_len;
+    const char *text = history_text(hist, i, &text_len);
+    const char *end = text + text_len;
+    for (;;) {
+        const char *start = end;
+        while (start > text && start[-1] != '\n') start--;
+        if ((size_t) (end - start) >= len && memcmp(start, prefix, len) == 0) {
+            *line = start;
+            *line_len = (size_t) (end - start);
+            return true;
+        }
+        if (start == text) return false;
+        end = start - 1; // The newline before this line
+    }
+}
+
+long history_suggest(const ShellHistory *hist, const char *prefix, size_t len, const char **line,
+                     size_t *line_len) {
+    size_t first, last = prefix_range(hist, prefix, len, &first);
+    long newest = -1;
+    for (size_t i = first; i < last; i++) {
+        if ((long) hist->sorted[i] > newest) newest = hist->sorted[i];
+    }
+    // A later line of a newer multi-line entry can match too; the index only
+    // knows where entries start
+    for (size_t m = hist->num_multi; m-- > 0 && (long) hist->multi[m] > newest;) {
+        if (entry_line(hist, hist->multi[m], prefix, len, line, line_len)) return hist->multi[m];
+    }
+    if (newest >= 0) entry_line(hist, (size_t) newest, prefix, len, line, line_len);
+    return newest;
+}
+
+static int newest_first(const void *a, const void *b) {
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+int history_search(const ShellHistory *hist, const char *prefix, size_t len, size_t max,
+                   uint32_t **out, size_t *count) {
+    size_t first, last = prefix_range(hist, prefix, len, &first);
+    size_t n = last - first;
+    *out = malloc(sizeof(uint32_t) * (n ? n : 1));
+    if (!*out) return -1;
+    memcpy(*out, hist->sorted + first, n * sizeof(uint32_t));
+    qsort(*out, n, sizeof(uint32_t), newest_first);
+    *count = n < max ? n : max;
+    return 0;
+}
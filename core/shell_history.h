@@ -0,0 +1,71 @@
+#ifndef SHELL_HISTORY_H
+#define SHELL_HISTORY_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// One history entry. Single-line entries are read straight from the mapped
+// file; multi-line ones are joined into the copies buffer.
+typedef struct {
+    uint64_t offset;       // Start of the text in the map, or in copies
+    uint32_t len;
+    uint32_t copied;       // Text lives in copies
+} HistEntry;
+
+// Command history in prompt_toolkit's FileHistory format:
+//   "\n# <timestamp>\n" then "+<line>\n" for each line of the entry.
+// The file is mapped and only ever appended to. Entries are indexed in
+// file order (oldest first), and a second index holds the newest entry
+// of each distinct text sorted by text, so every entry with a given
+// prefix is one contiguous run found by binary search.
+typedef struct {
+    int fd;
+    const char *map;       // Read-only view of the file, remapped as it grows
+    size_t mapped;         // Bytes mapped, past the end of the file
+    size_t size;           // File size at the last look
+    uint64_t parsed;       // File bytes turned into entries so far
+    HistEntry *entries;
+    size_t count;
+    size_t cap;
+    char *copies;
+    size_t copies_len;
+    size_t copies_cap;
+    uint32_t *sorted;      // Entry numbers: newest of each distinct text, by text
+    size_t num_sorted;
+    size_t sorted_cap;
+    uint32_t *multi;       // Entry numbers of the multi-line entries, oldest first
+    size_t num_multi;
+    size_t multi_cap;
+} ShellHistory;
+
+// Open (creating if needed) and index the history file.
+// Returns 0, or -1 with errno set.
+int history_open(ShellHistory *hist, const char *path);
+
+void history_close(ShellHistory *hist);
+
+// Text of entry i (0 = oldest), not NUL-terminated. Valid until the next
+// history call.
+const char* history_text(const ShellHistory *hist, size_t i, size_t *len);
+
+// Append an entry, plus anything other shells appended since we last
+// looked. Returns 0, or -1 with errno set.
+int history_append(ShellHistory *hist, const char *text, size_t len);
+
+// Newest line starting with prefix, the way prompt_toolkit's
+// AutoSuggestFromHistory picks it: entries newest first, and within a
+// multi-line entry its last line first. Returns the entry number with
+// *line/*line_len set to that line, or -1 if there is none.
+// O(log n) to find the run of entries starting with prefix, then one pass
+// over its entry numbers; only multi-line entries newer than the best of
+// those are scanned line by line.
+long history_suggest(const ShellHistory *hist, const char *prefix, size_t len, const char **line,
+                     size_t *line_len);
+
+// Entry numbers of up to max distinct entries starting with prefix, newest
+// first. *out is malloc'd (free() it). Returns 0, or -1 on allocation failure.
+int history_search(const ShellHistory *hist, const char *prefix, size_t len, size_t max,
+                   uint32_t **out, size_t *count);
+
+#endif // SHELL_HISTORY_H
@@ -1,6 +1,16 @@
 #define PY_SSIZE_T_CLEAN  // Must be defined before including Python.h for clean Py_ssize_t definition
 #include <Python.h>
+#include <structmember.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <dlfcn.h>
 #include "shell.h"
+#include "parser.h"
+#include "resp_cache.h"
+#include "cmd_index.h"
+#include "trace.h"
+#include "shell_history.h"
 
 /* 
  * Define the Python object structure
@@ -8,288 +18,3154 @@
  * PyObject_HEAD is a macro that contains the basic Python object header
  * ctx is our custom C shell context that we want to access from Python
  */
+#define ARGV_ARENA_BLOCK 4096 // Fits the argv of thousands of typical commands between resets
+
 typedef struct {
     PyObject_HEAD
     ShellContext *ctx;  // Pointer to our C shell implementation context
+    ShellArena argv_arena;    // argv arrays for the next launch; belongs to the exclusive lock holder
+    PyObject *cwd;            // Interned ctx->cwd as of cwd_generation, NULL until get_cwd()
+    uint64_t cwd_generation;
 } ShellObject;
 
 /*
- * Destructor for our Shell object
- * Called by Python's garbage collector when object is no longer referenced
- * Responsible for cleaning up both Python object and our C resources
+ * Take the context's lock (ShellContext.lock) from a thread that holds the
+ * GIL: exclusively with shell_lock, to launch or change anything, shared
+ * with shell_read_lock, to look at it. If another thread has it (e.g. one
+ * launching a command), wait with the GIL released so that thread, and
+ * everything else, can keep running. Without the GIL, use the
+ * pthread_rwlock calls directly.
+ */
+static void
+shell_lock(ShellObject *self)
+{
+    if (pthread_rwlock_trywrlock(&self->ctx->lock) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_rwlock_wrlock(&self->ctx->lock);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void
+shell_read_lock(ShellObject *self)
+{
+    if (pthread_rwlock_tryrdlock(&self->ctx->lock) != 0) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_rwlock_rdlock(&self->ctx->lock);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static void
+shell_unlock(ShellObject *self)
+{
+    pthread_rwlock_unlock(&self->ctx->lock);
+}
+
+/*
+ * Destructor for our Shell object
+ * Called by Python's garbage collector when object is no longer referenced
+ * Responsible for cleaning up both Python object and our C resources
+ */
+static void
+Shell_dealloc(ShellObject *self)
+{
+    if (self->ctx) {
+        shell_cleanup(self->ctx);  // Clean up our C shell context
+    }
+    arena_free(&self->argv_arena);
+    Py_XDECREF(self->cwd);
+    Py_TYPE(self)->tp_free((PyObject *) self);  // Free the Python object itself
+}
+
+/*
+ * Constructor for our Shell object
+ * Called when Python code creates a new Shell() instance
+ * Allocates and initializes both Python object and C shell context
+ */
+static int Shell_set_spawn_engine(ShellObject *self, PyObject *value, void *closure);
+
+static PyObject *
+Shell_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"spawn_engine", NULL};
+    PyObject *spawn_engine = NULL;
+    // Optional keyword: Shell(spawn_engine="posix_spawn")
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|$O", kwlist, &spawn_engine))
+        return NULL;
+
+    ShellObject *self;
+    // Allocate the Python object first
+    self = (ShellObject *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+        // Initialize our C shell context
+        self->ctx = shell_init();
+        if (self->ctx == NULL) {
+            Py_DECREF(self);  // Clean up Python object if C init fails
+            return NULL;
+        }
+        arena_init(&self->argv_arena, ARGV_ARENA_BLOCK);
+        if (spawn_engine && Shell_set_spawn_engine(self, spawn_engine, NULL) < 0) {
+            Py_DECREF(self);
+            return NULL;
+        }
+    }
+    return (PyObject *) self;
+}
+
+// Fill argv from a list/tuple of str, allocating the pointer array from the
+// arena. With borrow, argv points at the strings' own UTF-8 buffers (the
+// caller guarantees they outlive the launch); otherwise the bytes are copied
+// into the arena. Returns NULL with an exception set on bad input.
+static char **
+seq_to_argv(ShellArena *arena, PyObject *fast, bool borrow)
+{
+    Py_ssize_t argc = PySequence_Fast_GET_SIZE(fast);
+    PyObject **items = PySequence_Fast_ITEMS(fast);
+    char **argv = arena_alloc(arena, sizeof(char*) * (argc + 1));
+    if (!argv) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    for (Py_ssize_t i = 0; i < argc; i++) {
+        if (!PyUnicode_Check(items[i])) {
+            PyErr_SetString(PyExc_TypeError, "Arguments must be strings");
+            return NULL;
+        }
+        Py_ssize_t len;
+        const char *utf8 = PyUnicode_AsUTF8AndSize(items[i], &len);
+        if (!utf8)
+            return NULL;
+        if (memchr(utf8, '\0', (size_t) len)) {
+            PyErr_SetString(PyExc_ValueError, "embedded null character in argument");
+            return NULL;
+        }
+        argv[i] = borrow ? (char *) utf8 : arena_strndup(arena, utf8, (size_t) len);
+        if (!argv[i]) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    argv[argc] = NULL;
+    return argv;
+}
+
+/*
+ * Marshal execute()'s argv (pipeline=false) or execute_pipeline()'s sequence
+ * of argvs into the per-Shell argv arena.
+ * Lists and tuples are used in place. Anything else goes through
+ * PySequence_Fast first, before the lock is taken, since iterating it can
+ * run Python code. String bytes are borrowed when nothing can drop them
+ * while the GIL is released: the sequence holding them is a tuple, or a
+ * list only we reference. Strings in other lists are copied into the arena.
+ * On success the Shell lock is held, *argvs points into the arena, and *keep
+ * holds the references the borrowed buffers need. Release the lock, then
+ * Py_DECREF(*keep). Returns the number of commands, or -1 with an exception
+ * set and the lock not held.
+ */
+static Py_ssize_t
+marshal_commands(ShellObject *self, PyObject *seq, bool pipeline, char ****argvs, PyObject **keep)
+{
+    const char *type_error = pipeline ? "Pipeline must be a sequence of argument sequences"
+                                      : "argv must be a sequence of strings";
+    PyObject *outer = PySequence_Fast(seq, type_error);
+    if (!outer)
+        return -1;
+    // Borrowing from a container nobody else can change
+    bool outer_safe = PyTuple_Check(outer) || outer != seq;
+
+    if (pipeline) {
+        Py_ssize_t n = PySequence_Fast_GET_SIZE(outer);
+        bool plain = true;
+        for (Py_ssize_t i = 0; i < n && plain; i++) {
+            PyObject *stage = PySequence_Fast_GET_ITEM(outer, i);
+            plain = PyList_Check(stage) || PyTuple_Check(stage);
+        }
+        if (!plain) {
+            // Rare: stages that are other iterables. Convert them into a list of our own.
+            PyObject *stages = PyList_New(n);
+            for (Py_ssize_t i = 0; stages && i < n; i++) {
+                PyObject *fast = PySequence_Fast(PySequence_Fast_GET_ITEM(outer, i), type_error);
+                if (!fast)
+                    Py_CLEAR(stages);
+                else
+                    PyList_SET_ITEM(stages, i, fast);
+            }
+            Py_DECREF(outer);
+            if (!stages)
+                return -1;
+            outer = stages;
+            outer_safe = true;
+        }
+    }
+
+    // shell_lock may wait with the GIL released, and meanwhile another thread
+    // can change a list of the caller's: sizes and types are only read from
+    // here on, while the GIL is held throughout
+    shell_lock(self);
+    Py_ssize_t n = pipeline ? PySequence_Fast_GET_SIZE(outer) : 1;
+    arena_reset(&self->argv_arena);
+    char ***out = arena_alloc(&self->argv_arena, sizeof(char**) * (n ? n : 1));
+    if (!out) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        PyObject *stage = pipeline ? PySequence_Fast_GET_ITEM(outer, i) : outer;
+        if (!PyList_Check(stage) && !PyTuple_Check(stage)) { // Replaced while we waited
+            PyErr_SetString(PyExc_TypeError, type_error);
+            goto error;
+        }
+        bool borrow = pipeline ? outer_safe && PyTuple_Check(stage) : outer_safe;
+        if (!(out[i] = seq_to_argv(&self->argv_arena, stage, borrow)))
+            goto error;
+    }
+    *argvs = out;
+    *keep = outer;
+    return n;
+
+error:
+    shell_unlock(self);
+    Py_DECREF(outer);
+    return -1;
+}
+
+/*
+ * Convert one command's redirections, a list or tuple of (fd, op, target)
+ * as core.parse() returns them, into the argv arena. op is "<", ">", ">>"
+ * or ">&" (also "<&"), target a file name, or the fd to copy for ">&".
+ * Only lists, tuples, str and int are accepted: this runs with the Shell
+ * lock held, so nothing may call back into Python code. Returns 0, or -1
+ * with an exception set.
+ */
+static int
+seq_to_redirs(ShellArena *arena, PyObject *seq, ShellRedirList *out)
+{
+    static const char *type_error = "redirects must be a list of (fd, op, target) tuples";
+    if (!PyList_Check(seq) && !PyTuple_Check(seq)) {
+        PyErr_SetString(PyExc_TypeError, type_error);
+        return -1;
+    }
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    if (n > SHELL_MAX_REDIRS) {
+        PyErr_Format(PyExc_ValueError, "at most %d redirections per command", SHELL_MAX_REDIRS);
+        return -1;
+    }
+    ShellRedir *redirs = arena_alloc(arena, sizeof(ShellRedir) * (n ? n : 1));
+    if (!redirs) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t j = 0; j < n; j++) {
+        PyObject *item = PySequence_Fast_GET_ITEM(seq, j);
+        if (!PyTuple_Check(item) || PyTuple_GET_SIZE(item) != 3 || !PyLong_Check(PyTuple_GET_ITEM(item, 0)) ||
+            !PyUnicode_Check(PyTuple_GET_ITEM(item, 1))) {
+            PyErr_SetString(PyExc_TypeError, type_error);
+            return -1;
+        }
+        int overflow;
+        long fd = PyLong_AsLongAndOverflow(PyTuple_GET_ITEM(item, 0), &overflow);
+        if (overflow || fd < 0 || fd > INT_MAX) {
+            PyErr_SetString(PyExc_ValueError, "redirected fd out of range");
+            return -1;
+        }
+        const char *op = PyUnicode_AsUTF8(PyTuple_GET_ITEM(item, 1));
+        if (!op)
+            return -1;
+        PyObject *target = PyTuple_GET_ITEM(item, 2);
+        ShellRedir *r = &redirs[j];
+        *r = (ShellRedir) { .fd = (int) fd };
+
+        if (strcmp(op, ">&") == 0 || strcmp(op, "<&") == 0) {
+            long dup_fd = PyLong_Check(target) ? PyLong_AsLongAndOverflow(target, &overflow) : -1;
+            if (overflow || dup_fd < 0 || dup_fd > INT_MAX) {
+                PyErr_Format(PyExc_ValueError, "'%s' needs a file descriptor", op);
+                return -1;
+            }
+            r->kind = SHELL_REDIR_DUP;
+            r->dup_fd = (int) dup_fd;
+            continue;
+        }
+        if (strcmp(op, "<") == 0) r->kind = SHELL_REDIR_READ;
+        else if (strcmp(op, ">") == 0) r->kind = SHELL_REDIR_WRITE;
+        else if (strcmp(op, ">>") == 0) r->kind = SHELL_REDIR_APPEND;
+        else {
+            PyErr_Format(PyExc_ValueError, "unknown redirection operator '%s'", op);
+            return -1;
+        }
+        Py_ssize_t len;
+        const char *name = PyUnicode_Check(target) ? PyUnicode_AsUTF8AndSize(target, &len) : NULL;
+        if (!name) {
+            if (!PyErr_Occurred())
+                PyErr_Format(PyExc_TypeError, "'%s' needs a file name", op);
+            return -1;
+        }
+        if (memchr(name, '\0', (size_t) len)) {
+            PyErr_SetString(PyExc_ValueError, "embedded null character in file name");
+            return -1;
+        }
+        // Copied: the caller's list may change once the GIL is released
+        if (!(r->target = arena_strndup(arena, name, (size_t) len))) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+    out->redirs = redirs;
+    out->num_redirs = (int) n;
+    return 0;
+}
+
+/*
+ * Marshal the redirects argument (NULL: none) for num_commands stages into
+ * the argv arena, after marshal_commands and with the lock still held. For
+ * a pipeline it holds one list per stage (None for a stage without any),
+ * otherwise the single command's list. *out is NULL when there are none.
+ * Returns 0, or -1 with an exception set; the lock stays held either way.
+ */
+static int
+marshal_redirects(ShellObject *self, PyObject *redirects, bool pipeline, Py_ssize_t num_commands,
+                  ShellRedirList **out)
+{
+    *out = NULL;
+    if (!redirects || num_commands == 0)
+        return 0;
+    if (pipeline && ((!PyList_Check(redirects) && !PyTuple_Check(redirects)) ||
+                     PySequence_Fast_GET_SIZE(redirects) != num_commands)) {
+        PyErr_SetString(PyExc_TypeError, "redirects must hold one list per pipeline stage");
+        return -1;
+    }
+    ShellRedirList *lists = arena_alloc(&self->argv_arena, sizeof(ShellRedirList) * num_commands);
+    if (!lists) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    for (Py_ssize_t i = 0; i < num_commands; i++) {
+        PyObject *stage = pipeline ? PySequence_Fast_GET_ITEM(redirects, i) : redirects;
+        lists[i] = (ShellRedirList) { NULL, 0 };
+        if (stage != Py_None && seq_to_redirs(&self->argv_arena, stage, &lists[i]) < 0)
+            return -1;
+    }
+    *out = lists;
+    return 0;
+}
+
+// An int limit value in [min, max]
+static int
+limit_int(PyObject *value, const char *key, long long min, long long max, long long *out)
+{
+    int overflow = 0;
+    long long v = PyLong_Check(value) ? PyLong_AsLongLongAndOverflow(value, &overflow) : min - 1;
+    if (overflow || v < min || v > max) {
+        if (!PyErr_Occurred())
+            PyErr_Format(PyExc_ValueError, "limit '%s' needs ints from %lld to %lld", key, min, max);
+        return -1;
+    }
+    *out = v;
+    return 0;
+}
+
+// rlimit_*: n, or (soft, hard); None is unlimited
+static int
+limit_rlimit(PyObject *value, const char *key, ShellRlimit *out)
+{
+    PyObject *items[2] = { value, value };
+    if (PyTuple_Check(value)) {
+        if (PyTuple_GET_SIZE(value) != 2) {
+            PyErr_Format(PyExc_ValueError, "limit '%s' must be an int or a (soft, hard) tuple", key);
+            return -1;
+        }
+        items[0] = PyTuple_GET_ITEM(value, 0);
+        items[1] = PyTuple_GET_ITEM(value, 1);
+    }
+    rlim_t v[2];
+    for (int k = 0; k < 2; k++) {
+        long long n;
+        if (items[k] == Py_None) {
+            v[k] = RLIM_INFINITY;
+            continue;
+        }
+        if (limit_int(items[k], key, 0, LLONG_MAX, &n) < 0)
+            return -1;
+        v[k] = (rlim_t) n;
+    }
+    out->set = true;
+    out->limit.rlim_cur = v[0];
+    out->limit.rlim_max = v[1];
+    return 0;
+}
+
+// cpus, and numa's nodes: an iterable of numbers, each one setting a bit of mask
+static int
+limit_bits(PyObject *value, const char *key, int max, unsigned long *mask)
+{
+    PyObject *fast = PySequence_Fast(value, "");
+    if (!fast || PySequence_Fast_GET_SIZE(fast) == 0) {
+        Py_XDECREF(fast);
+        PyErr_Clear();
+        PyErr_Format(PyExc_ValueError, "limit '%s' needs a non-empty list of numbers", key);
+        return -1;
+    }
+    const int bits = 8 * sizeof(unsigned long);
+    for (Py_ssize_t i = 0; i < PySequence_Fast_GET_SIZE(fast); i++) {
+        long long n;
+        if (limit_int(PySequence_Fast_GET_ITEM(fast, i), key, 0, max - 1, &n) < 0) {
+            Py_DECREF(fast);
+            return -1;
+        }
+        mask[n / bits] |= 1UL << (n % bits);
+    }
+    Py_DECREF(fast);
+    return 0;
+}
+
+static const char *const numa_policies[] = {
+    [SHELL_NUMA_DEFAULT] = "default", [SHELL_NUMA_PREFERRED] = "preferred", [SHELL_NUMA_BIND] = "bind",
+    [SHELL_NUMA_INTERLEAVE] = "interleave", [SHELL_NUMA_LOCAL] = "local",
+};
+
+static const char *const ioprio_classes[] = {
+    [SHELL_IOPRIO_RT] = "realtime", [SHELL_IOPRIO_BE] = "best-effort", [SHELL_IOPRIO_IDLE] = "idle",
+};
+
+// Index of name in names[1..n-1], or 0 (with ValueError set) if it isn't there
+static int
+limit_choice(PyObject *name, const char *key, const char *const *names, int n)
+{
+    const char *s = PyUnicode_Check(name) ? PyUnicode_AsUTF8(name) : NULL;
+    for (int i = 1; s && i < n; i++) {
+        if (strcmp(s, names[i]) == 0)
+            return i;
+    }
+    if (!PyErr_Occurred())
+        PyErr_Format(PyExc_ValueError, "unknown %s %R", key, name);
+    return 0;
+}
+
+// "policy" or (policy, nodes)
+static int
+limit_numa(PyObject *value, ShellLimits *limits)
+{
+    PyObject *policy = value, *nodes = NULL;
+    if (PyTuple_Check(value) && PyTuple_GET_SIZE(value) == 2) {
+        policy = PyTuple_GET_ITEM(value, 0);
+        nodes = PyTuple_GET_ITEM(value, 1);
+    }
+    int mode = limit_choice(policy, "numa policy", numa_policies, SHELL_NUMA_LOCAL + 1);
+    if (!mode)
+        return -1;
+    limits->numa = (ShellNumaPolicy) mode;
+    if (mode == SHELL_NUMA_DEFAULT || mode == SHELL_NUMA_LOCAL) {
+        if (nodes) {
+            PyErr_Format(PyExc_ValueError, "numa policy '%s' takes no nodes", numa_policies[mode]);
+            return -1;
+        }
+        return 0;
+    }
+    if (!nodes) {
+        PyErr_Format(PyExc_ValueError, "numa policy '%s' needs (policy, nodes)", numa_policies[mode]);
+        return -1;
+    }
+    return limit_bits(nodes, "numa", SHELL_MAX_NUMA_NODES, limits->numa_nodes);
+}
+
+// "class" or (class, level)
+static int
+limit_ioprio(PyObject *value, ShellLimits *limits)
+{
+    PyObject *cls = value;
+    long long level = 4; // The kernel's default best-effort level (nice 0)
+    if (PyTuple_Check(value) && PyTuple_GET_SIZE(value) == 2) {
+        cls = PyTuple_GET_ITEM(value, 0);
+        if (limit_int(PyTuple_GET_ITEM(value, 1), "ioprio", 0, 7, &level) < 0)
+            return -1;
+    }
+    int c = limit_choice(cls, "ioprio class", ioprio_classes, SHELL_IOPRIO_IDLE + 1);
+    if (!c)
+        return -1;
+    limits->set_ioprio = true;
+    limits->ioprio_class = (ShellIoprioClass) c;
+    limits->ioprio_level = (int) level;
+    return 0;
+}
+
+/*
+ * One limits dict into a ShellLimits in the arena. Keys: cpus (CPU
+ * numbers), numa ("local", or ("bind", nodes) and the like), rlimit_as,
+ * rlimit_cpu, rlimit_nofile (n or (soft, hard)), nice, ioprio ("idle" or
+ * (class, level)) and cgroup (a cgroup v2 directory).
+ */
+static int
+dict_to_limits(ShellArena *arena, PyObject *dict, ShellLimits **out)
+{
+    if (!PyDict_Check(dict)) {
+        PyErr_SetString(PyExc_TypeError, "limits must be dicts");
+        return -1;
+    }
+    ShellLimits *limits = arena_alloc(arena, sizeof(ShellLimits));
+    if (!limits) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    memset(limits, 0, sizeof(*limits));
+
+    PyObject *key, *value;
+    Py_ssize_t pos = 0;
+    while (PyDict_Next(dict, &pos, &key, &value)) {
+        const char *name = PyUnicode_Check(key) ? PyUnicode_AsUTF8(key) : NULL;
+        long long n = 0;
+        int result;
+        if (!name) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_TypeError, "limits keys must be str");
+            return -1;
+        }
+        if (strcmp(name, "cpus") == 0) {
+            // cpu_set_t is this same bitmask of longs, as the kernel reads it
+            unsigned long mask[sizeof(cpu_set_t) / sizeof(unsigned long)] = { 0 };
+            result = limit_bits(value, name, CPU_SETSIZE, mask);
+            memcpy(&limits->cpus, mask, sizeof(limits->cpus));
+            limits->set_cpus = true;
+        } else if (strcmp(name, "numa") == 0) {
+            result = limit_numa(value, limits);
+        } else if (strcmp(name, "rlimit_as") == 0) {
+            result = limit_rlimit(value, name, &limits->as);
+        } else if (strcmp(name, "rlimit_cpu") == 0) {
+            result = limit_rlimit(value, name, &limits->cpu);
+        } else if (strcmp(name, "rlimit_nofile") == 0) {
+            result = limit_rlimit(value, name, &limits->nofile);
+        } else if (strcmp(name, "nice") == 0) {
+            result = limit_int(value, name, -20, 19, &n);
+            limits->set_nice = true;
+            limits->nice = (int) n;
+        } else if (strcmp(name, "ioprio") == 0) {
+            result = limit_ioprio(value, limits);
+        } else if (strcmp(name, "cgroup") == 0) {
+            Py_ssize_t len;
+            const char *dir = PyUnicode_Check(value) ? PyUnicode_AsUTF8AndSize(value, &len) : NULL;
+            if (!dir || memchr(dir, '\0', (size_t) len)) {
+                if (!PyErr_Occurred())
+                    PyErr_SetString(PyExc_ValueError, "limit 'cgroup' needs a directory name");
+                return -1;
+            }
+            // Copied: the caller's dict may change once the GIL is released
+            if (!(limits->cgroup = arena_strndup(arena, dir, (size_t) len))) {
+                PyErr_NoMemory();
+                return -1;
+            }
+            result = 0;
+        } else {
+            PyErr_Format(PyExc_ValueError, "unknown limit '%s'", name);
+            return -1;
+        }
+        if (result < 0)
+            return -1;
+    }
+    *out = limits;
+    return 0;
+}
+
+/*
+ * Marshal the limits argument (NULL: none) for num_commands stages (or
+ * commands, for execute_many) into the argv arena, like marshal_redirects.
+ * One dict applies to every stage; with several stages it may instead be
+ * a list of one dict (or None) per stage. Returns 0, or -1 with an
+ * exception set; the lock stays held either way.
+ */
+static int
+marshal_limits(ShellObject *self, PyObject *limits, bool per_stage, Py_ssize_t num_commands,
+               const ShellLimits *const **out)
+{
+    *out = NULL;
+    if (!limits || num_commands == 0)
+        return 0;
+    const ShellLimits **stages = arena_alloc(&self->argv_arena, sizeof(ShellLimits*) * num_commands);
+    if (!stages) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    if (PyDict_Check(limits)) {
+        ShellLimits *all;
+        if (dict_to_limits(&self->argv_arena, limits, &all) < 0)
+            return -1;
+        for (Py_ssize_t i = 0; i < num_commands; i++)
+            stages[i] = all;
+    } else {
+        if (!per_stage || (!PyList_Check(limits) && !PyTuple_Check(limits)) ||
+            PySequence_Fast_GET_SIZE(limits) != num_commands) {
+            PyErr_SetString(PyExc_TypeError, per_stage ? "limits must be a dict, or hold one dict (or None) per stage"
+                                                       : "limits must be a dict");
+            return -1;
+        }
+        for (Py_ssize_t i = 0; i < num_commands; i++) {
+            PyObject *item = PySequence_Fast_GET_ITEM(limits, i);
+            ShellLimits *stage = NULL;
+            if (item != Py_None && dict_to_limits(&self->argv_arena, item, &stage) < 0)
+                return -1;
+            stages[i] = stage;
+        }
+    }
+    *out = stages;
+    return 0;
+}
+
+// Optional items of an execute result, after (exit_code, error)
+#define RESULT_CAPTURE 1  // capture=True: the captured stdout, a core.Output
+#define RESULT_USAGE   2  // usage=True: a tuple of per-stage usage dicts, last
+
+/*
+ * Parse the (argv_or_pipeline, *, capture=False, usage=False, redirects=None,
+ * limits=None) arguments shared by the execute methods, vectorcall-style,
+ * into RESULT_* flags. redirects and limits are NULL for methods that don't
+ * take them. Returns 0, or -1 with TypeError set.
+ */
+static int
+parse_run_args(const char *fname, const char *argname, PyObject *const *args, Py_ssize_t nargs,
+               PyObject *kwnames, PyObject **seq, int *flags, PyObject **redirects, PyObject **limits,
+               PyObject **on_stderr)
+{
+    *seq = nargs > 0 ? args[0] : NULL;
+    *flags = 0;
+    if (redirects)
+        *redirects = NULL;
+    if (limits)
+        *limits = NULL;
+    if (on_stderr)
+        *on_stderr = NULL;
+    if (nargs > 1) {
+        PyErr_Format(PyExc_TypeError, "%s() takes exactly 1 positional argument (%zd given)", fname, nargs);
+        return -1;
+    }
+    Py_ssize_t nkw = kwnames ? PyTuple_GET_SIZE(kwnames) : 0;
+    for (Py_ssize_t i = 0; i < nkw; i++) {
+        PyObject *key = PyTuple_GET_ITEM(kwnames, i);
+        PyObject *value = args[nargs + i];
+        int flag = PyUnicode_CompareWithASCIIString(key, "capture") == 0 ? RESULT_CAPTURE
+                 : PyUnicode_CompareWithASCIIString(key, "usage") == 0 ? RESULT_USAGE : 0;
+        if (flag) {
+            int on = PyObject_IsTrue(value);
+            if (on < 0)
+                return -1;
+            if (on)
+                *flags |= flag;
+        } else if (PyUnicode_CompareWithASCIIString(key, argname) == 0 && !*seq) {
+            *seq = value;
+        } else if (redirects && PyUnicode_CompareWithASCIIString(key, "redirects") == 0) {
+            *redirects = value == Py_None ? NULL : value;
+        } else if (limits && PyUnicode_CompareWithASCIIString(key, "limits") == 0) {
+            *limits = value == Py_None ? NULL : value;
+        } else if (on_stderr && PyUnicode_CompareWithASCIIString(key, "on_stderr") == 0) {
+            if (value != Py_None && !PyCallable_Check(value)) {
+                PyErr_Format(PyExc_TypeError, "%s(): on_stderr must be callable or None", fname);
+                return -1;
+            }
+            *on_stderr = value == Py_None ? NULL : value;
+        } else {
+            PyErr_Format(PyExc_TypeError, "%s() got an unexpected keyword argument '%U'", fname, key);
+            return -1;
+        }
+    }
+    if (!*seq) {
+        PyErr_Format(PyExc_TypeError, "%s() missing required argument '%s'", fname, argname);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * CommandResult: what every execute variant returns. It reads as the tuple
+ * (exit_code, error), followed by the Output for capture=True and the usage
+ * for usage=True, so unpacking, indexing and comparing with tuples work.
+ * Every field also has a name, including the ones the tuple leaves out
+ * (signal, pipestatus). It is built from the run's own ShellResult, not
+ * the Shell's last_* state, so concurrent calls each get their own.
+ */
+typedef struct {
+    PyObject_HEAD
+    int exit_code;
+    int signal;
+    PyObject *error;      // str, or None
+    PyObject *output;     // core.Output with capture=True, else None
+    PyObject *usage;      // Usage with usage=True, else None
+    PyObject *pipestatus; // Exit code of each stage
+    int flags;            // RESULT_* items in the tuple view
+} CommandResultObject;
+
+static PyTypeObject CommandResultType;
+
+static void
+CommandResult_dealloc(CommandResultObject *self)
+{
+    Py_XDECREF(self->error);
+    Py_XDECREF(self->output);
+    Py_XDECREF(self->usage);
+    Py_XDECREF(self->pipestatus);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static Py_ssize_t
+CommandResult_length(CommandResultObject *self)
+{
+    return 2 + ((self->flags & RESULT_CAPTURE) != 0) + ((self->flags & RESULT_USAGE) != 0);
+}
+
+static PyObject *
+CommandResult_item(CommandResultObject *self, Py_ssize_t i)
+{
+    PyObject *item;
+    if (i < 0 || i >= CommandResult_length(self)) {
+        PyErr_SetString(PyExc_IndexError, "CommandResult index out of range");
+        return NULL;
+    }
+    if (i == 0)
+        return PyLong_FromLong(self->exit_code);
+    if (i == 1)
+        item = self->error;
+    else if (i == 2 && (self->flags & RESULT_CAPTURE))
+        item = self->output;
+    else
+        item = self->usage;
+    Py_INCREF(item);
+    return item;
+}
+
+// The tuple the result stands for
+static PyObject *
+CommandResult_tuple(CommandResultObject *self)
+{
+    Py_ssize_t n = CommandResult_length(self);
+    PyObject *tuple = PyTuple_New(n);
+    for (Py_ssize_t i = 0; tuple && i < n; i++) {
+        PyObject *item = CommandResult_item(self, i);
+        if (!item)
+            Py_CLEAR(tuple);
+        else
+            PyTuple_SET_ITEM(tuple, i, item);
+    }
+    return tuple;
+}
+
+// result[i], with negative indexes and slices, as for the tuple
+static PyObject *
+CommandResult_subscript(CommandResultObject *self, PyObject *key)
+{
+    if (PyIndex_Check(key)) {
+        Py_ssize_t i = PyNumber_AsSsize_t(key, PyExc_IndexError);
+        if (i == -1 && PyErr_Occurred())
+            return NULL;
+        return CommandResult_item(self, i < 0 ? i + CommandResult_length(self) : i);
+    }
+    PyObject *tuple = CommandResult_tuple(self);
+    if (!tuple)
+        return NULL;
+    PyObject *item = PyObject_GetItem(tuple, key);
+    Py_DECREF(tuple);
+    return item;
+}
+
+static PyObject *
+CommandResult_richcompare(PyObject *a, PyObject *b, int op)
+{
+    // Compare as tuples, against tuples or other results
+    PyObject *ta = NULL, *tb = NULL, *r = NULL;
+    if (!PyTuple_Check(a) && !PyObject_TypeCheck(a, &CommandResultType))
+        Py_RETURN_NOTIMPLEMENTED;
+    if (!PyTuple_Check(b) && !PyObject_TypeCheck(b, &CommandResultType))
+        Py_RETURN_NOTIMPLEMENTED;
+    ta = PyTuple_Check(a) ? (Py_INCREF(a), a) : CommandResult_tuple((CommandResultObject *) a);
+    tb = PyTuple_Check(b) ? (Py_INCREF(b), b) : CommandResult_tuple((CommandResultObject *) b);
+    if (ta && tb)
+        r = PyObject_RichCompare(ta, tb, op);
+    Py_XDECREF(ta);
+    Py_XDECREF(tb);
+    return r;
+}
+
+static Py_hash_t
+CommandResult_hash(CommandResultObject *self)
+{
+    PyObject *tuple = CommandResult_tuple(self);
+    if (!tuple)
+        return -1;
+    Py_hash_t hash = PyObject_Hash(tuple);
+    Py_DECREF(tuple);
+    return hash;
+}
+
+static PyObject *
+CommandResult_repr(CommandResultObject *self)
+{
+    return PyUnicode_FromFormat("core.CommandResult(exit_code=%d, error=%R, signal=%d, pipestatus=%R)",
+                                self->exit_code, self->error, self->signal, self->pipestatus);
+}
+
+static PyMemberDef CommandResult_members[] = {
+    {"exit_code", T_INT, offsetof(CommandResultObject, exit_code), READONLY,
+     "Exit status of the (last) command, -1 if a signal killed it"},
+    {"signal", T_INT, offsetof(CommandResultObject, signal), READONLY,
+     "Signal that killed the last command, 0 if it exited"},
+    {"error", T_OBJECT, offsetof(CommandResultObject, error), READONLY,
+     "Tail of the failing command's stderr, or why it failed; None if there is none"},
+    {"output", T_OBJECT, offsetof(CommandResultObject, output), READONLY,
+     "Captured stdout (a core.Output) with capture=True, else None"},
+    {"usage", T_OBJECT, offsetof(CommandResultObject, usage), READONLY,
+     "Resource usage with usage=True, else None"},
+    {"pipestatus", T_OBJECT, offsetof(CommandResultObject, pipestatus), READONLY,
+     "Exit code of each stage (like bash's PIPESTATUS)"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods CommandResult_as_sequence = {
+    .sq_length = (lenfunc) CommandResult_length,
+    .sq_item = (ssizeargfunc) CommandResult_item,
+};
+
+static PyMappingMethods CommandResult_as_mapping = {
+    .mp_length = (lenfunc) CommandResult_length,
+    .mp_subscript = (binaryfunc) CommandResult_subscript,
+};
+
+static PyTypeObject CommandResultType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "core.CommandResult",
+    .tp_doc = "Outcome of one execute call; behaves as the tuple (exit_code, error[, output][, usage])",
+    .tp_basicsize = sizeof(CommandResultObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) CommandResult_dealloc,
+    .tp_repr = (reprfunc) CommandResult_repr,
+    .tp_hash = (hashfunc) CommandResult_hash,
+    .tp_richcompare = CommandResult_richcompare,
+    .tp_as_sequence = &CommandResult_as_sequence,
+    .tp_as_mapping = &CommandResult_as_mapping,
+    .tp_members = CommandResult_members,
+};
+
+/*
+ * A CommandResult holding result's exit code, signal and error, with
+ * output, usage and pipestatus still None for the caller to fill in
+ */
+static CommandResultObject *
+new_result(const ShellResult *result, int flags)
+{
+    CommandResultObject *self = PyObject_New(CommandResultObject, &CommandResultType);
+    if (!self)
+        return NULL;
+    self->exit_code = result->exit_code;
+    self->signal = result->signal;
+    self->flags = flags;
+    self->error = result->error ? PyUnicode_FromString(result->error) : (Py_INCREF(Py_None), Py_None);
+    self->output = self->usage = self->pipestatus = NULL;
+    if (!self->error) {
+        Py_DECREF(self);
+        return NULL;
+    }
+    Py_INCREF(Py_None);
+    self->output = Py_None;
+    Py_INCREF(Py_None);
+    self->usage = Py_None;
+    Py_INCREF(Py_None);
+    self->pipestatus = Py_None;
+    return self;
+}
+
+/*
+ * Output object: stdout captured with capture=True.
+ * Wraps the read-only mapping of the memfd the command wrote to and exports
+ * it through the buffer protocol, so memoryview(out) sees the child's bytes
+ * directly and bytes(out)/out.decode() make the only copy.
+ */
+typedef struct {
+    PyObject_HEAD
+    ShellOutput out;
+} OutputObject;
+
+static PyTypeObject OutputType;
+
+static void
+Output_dealloc(OutputObject *self)
+{
+    shell_output_unmap(&self->out);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static int
+Output_getbuffer(OutputObject *self, Py_buffer *view, int flags)
+{
+    static char empty[1];
+    return PyBuffer_FillInfo(view, (PyObject *) self, self->out.data ? self->out.data : empty,
+                             (Py_ssize_t) self->out.len, 1 /* readonly */, flags);
+}
+
+static Py_ssize_t
+Output_length(OutputObject *self)
+{
+    return (Py_ssize_t) self->out.len;
+}
+
+/*
+ * Python method: out.decode(encoding="utf-8", errors="strict")
+ */
+static PyObject *
+Output_decode(OutputObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"encoding", "errors", NULL};
+    const char *encoding = "utf-8";
+    const char *errors = "strict";
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|ss", kwlist, &encoding, &errors))
+        return NULL;
+    return PyUnicode_Decode(self->out.data ? self->out.data : "", (Py_ssize_t) self->out.len,
+                            encoding, errors);
+}
+
+static PyObject *
+Output_repr(OutputObject *self)
+{
+    return PyUnicode_FromFormat("<core.Output %zd bytes>", (Py_ssize_t) self->out.len);
+}
+
+static PyMethodDef Output_methods[] = {
+    {"decode", (PyCFunction)(void(*)(void)) Output_decode, METH_VARARGS | METH_KEYWORDS,
+     "Decode the captured bytes to a string"},
+    {NULL}  /* Sentinel */
+};
+
+static PyBufferProcs Output_as_buffer = {
+    .bf_getbuffer = (getbufferproc) Output_getbuffer,
+};
+
+static PySequenceMethods Output_as_sequence = {
+    .sq_length = (lenfunc) Output_length,
+};
+
+static PyTypeObject OutputType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "core.Output",
+    .tp_doc = "Captured stdout of a command (supports the buffer protocol)",
+    .tp_basicsize = sizeof(OutputObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) Output_dealloc,
+    .tp_repr = (reprfunc) Output_repr,
+    .tp_as_buffer = &Output_as_buffer,
+    .tp_as_sequence = &Output_as_sequence,
+    .tp_methods = Output_methods,
+};
+
+/*
+ * ResponseCache object: a persistent key -> bytes store (resp_cache.c).
+ * Keys are SHA-256 digests, given as 32 bytes or 64 hex digits. Operations
+ * are short and run with the GIL held.
+ */
+typedef struct {
+    PyObject_HEAD
+    RespCache cache;
+    bool open;
+} ResponseCacheObject;
+
+static void
+ResponseCache_dealloc(ResponseCacheObject *self)
+{
+    if (self->open)
+        resp_cache_close(&self->cache);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+ResponseCache_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", "max_bytes", NULL};
+    PyObject *path = NULL;
+    unsigned long long max_bytes = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&|$K", kwlist, PyUnicode_FSConverter, &path,
+                                     &max_bytes))
+        return NULL;
+    ResponseCacheObject *self = (ResponseCacheObject *) type->tp_alloc(type, 0);
+    if (self && resp_cache_open(&self->cache, PyBytes_AS_STRING(path), max_bytes) < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        Py_CLEAR(self);
+    } else if (self) {
+        self->open = true;
+    }
+    Py_DECREF(path);
+    return (PyObject *) self;
+}
+
+static int
+response_cache_ready(ResponseCacheObject *self)
+{
+    if (!self->open) {
+        PyErr_SetString(PyExc_ValueError, "ResponseCache is closed");
+        return -1;
+    }
+    return 0;
+}
+
+// Decode a key argument into a 32-byte digest
+static int
+response_cache_key(PyObject *key, uint8_t *out)
+{
+    if (PyBytes_Check(key) && PyBytes_GET_SIZE(key) == RESP_CACHE_KEY_LEN) {
+        memcpy(out, PyBytes_AS_STRING(key), RESP_CACHE_KEY_LEN);
+        return 0;
+    }
+    Py_ssize_t len;
+    const char *hex = PyUnicode_Check(key) ? PyUnicode_AsUTF8AndSize(key, &len) : NULL;
+    if (hex && len == RESP_CACHE_KEY_LEN * 2) {
+        for (int i = 0; i < RESP_CACHE_KEY_LEN * 2; i++) {
+            char c = hex[i];
+            int v = c >= '0' && c <= '9' ? c - '0'
+                  : c >= 'a' && c <= 'f' ? c - 'a' + 10
+                  : c >= 'A' && c <= 'F' ? c - 'A' + 10 : -1;
+            if (v < 0)
+                break;
+            if (i % 2 == 0)
+                out[i / 2] = (uint8_t) (v << 4);
+            else
+                out[i / 2] |= (uint8_t) v;
+            if (i == RESP_CACHE_KEY_LEN * 2 - 1)
+                return 0;
+        }
+    }
+    PyErr_Clear();
+    PyErr_SetString(PyExc_ValueError, "Key must be a SHA-256 digest (32 bytes or 64 hex digits)");
+    return -1;
+}
+
+/*
+ * Python method: cache.get(key) -> bytes or None
+ */
+static PyObject *
+ResponseCache_get(ResponseCacheObject *self, PyObject *key)
+{
+    uint8_t digest[RESP_CACHE_KEY_LEN];
+    if (response_cache_ready(self) < 0 || response_cache_key(key, digest) < 0)
+        return NULL;
+    const void *value;
+    size_t len;
+    int found = resp_cache_get(&self->cache, digest, &value, &len);
+    if (found < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    if (!found)
+        Py_RETURN_NONE;
+    return PyBytes_FromStringAndSize(value, (Py_ssize_t) len);
+}
+
+/*
+ * Python method: cache.put(key, value)
+ * value is bytes (or anything with the buffer protocol); it replaces any
+ * earlier value for key. If the log then can't be compacted back under
+ * max_bytes, the value is still stored and a RuntimeWarning is issued.
+ */
+static PyObject *
+ResponseCache_put(ResponseCacheObject *self, PyObject *args)
+{
+    PyObject *key;
+    Py_buffer value;
+    uint8_t digest[RESP_CACHE_KEY_LEN];
+    if (!PyArg_ParseTuple(args, "Oy*", &key, &value))
+        return NULL;
+    int rc = -1;
+    if (response_cache_ready(self) == 0 && response_cache_key(key, digest) == 0) {
+        rc = resp_cache_put(&self->cache, digest, value.buf, (size_t) value.len);
+        if (rc < 0)
+            PyErr_SetFromErrno(PyExc_OSError);
+        else if (rc > 0) // Stored; only the log is still over max_bytes
+            rc = PyErr_WarnFormat(PyExc_RuntimeWarning, 1, "response cache not compacted: %s",
+                                  strerror(errno));
+    }
+    PyBuffer_Release(&value);
+    if (rc < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+/*
+ * Python method: cache.compact(target_bytes=None)
+ * Keep only the most recently used entries that fit in target_bytes
+ * (default: everything live, which just drops replaced values).
+ */
+static PyObject *
+ResponseCache_compact(ResponseCacheObject *self, PyObject *args)
+{
+    PyObject *target = Py_None;
+    if (!PyArg_ParseTuple(args, "|O", &target) || response_cache_ready(self) < 0)
+        return NULL;
+    uint64_t target_bytes = UINT64_MAX;
+    if (target != Py_None) {
+        target_bytes = PyLong_AsUnsignedLongLong(target);
+        if (PyErr_Occurred())
+            return NULL;
+    }
+    if (resp_cache_compact(&self->cache, target_bytes) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    Py_RETURN_NONE;
+}
+
+/*
+ * Python method: cache.info() -> dict of entries, log_bytes, live_bytes,
+ * max_bytes, and this object's hits, misses and compactions
+ */
+static PyObject *
+ResponseCache_info(ResponseCacheObject *self, PyObject *Py_UNUSED(ignored))
+{
+    uint64_t entries, log_bytes, live_bytes;
+    if (response_cache_ready(self) < 0)
+        return NULL;
+    if (resp_cache_stat(&self->cache, &entries, &log_bytes, &live_bytes) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return Py_BuildValue("{s:K,s:K,s:K,s:K,s:K,s:K,s:K}",
+                         "entries", (unsigned long long) entries,
+                         "log_bytes", (unsigned long long) log_bytes,
+                         "live_bytes", (unsigned long long) live_bytes,
+                         "max_bytes", (unsigned long long) self->cache.max_bytes,
+                         "hits", (unsigned long long) self->cache.hits,
+                         "misses", (unsigned long long) self->cache.misses,
+                         "compactions", (unsigned long long) self->cache.compactions);
+}
+
+/*
+ * Python method: cache.close()
+ */
+static PyObject *
+ResponseCache_close(ResponseCacheObject *self, PyObject *Py_UNUSED(ignored))
+{
+    if (self->open)
+        resp_cache_close(&self->cache);
+    self->open = false;
+    Py_RETURN_NONE;
+}
+
+static Py_ssize_t
+ResponseCache_length(ResponseCacheObject *self)
+{
+    uint64_t entries, log_bytes, live_bytes;
+    if (response_cache_ready(self) < 0)
+        return -1;
+    if (resp_cache_stat(&self->cache, &entries, &log_bytes, &live_bytes) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return (Py_ssize_t) entries;
+}
+
+static PyMethodDef ResponseCache_methods[] = {
+    {"get", (PyCFunction) ResponseCache_get, METH_O,
+     "Cached bytes for a key, or None"},
+    {"put", (PyCFunction) ResponseCache_put, METH_VARARGS,
+     "Store bytes for a key"},
+    {"compact", (PyCFunction) ResponseCache_compact, METH_VARARGS,
+     "Rewrite the log keeping the most recently used entries"},
+    {"info", (PyCFunction) ResponseCache_info, METH_NOARGS,
+     "Size and hit counters"},
+    {"close", (PyCFunction) ResponseCache_close, METH_NOARGS,
+     "Unmap and close the cache files"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods ResponseCache_as_sequence = {
+    .sq_length = (lenfunc) ResponseCache_length,
+};
+
+static PyTypeObject ResponseCacheType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "core.ResponseCache",
+    .tp_doc = "ResponseCache(path, *, max_bytes=0): memory-mapped, append-only response cache",
+    .tp_basicsize = sizeof(ResponseCacheObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = ResponseCache_new,
+    .tp_dealloc = (destructor) ResponseCache_dealloc,
+    .tp_as_sequence = &ResponseCache_as_sequence,
+    .tp_methods = ResponseCache_methods,
+};
+
+/*
+ * CommandIndex object: an immutable sorted snapshot of command names
+ * (cmd_index.c) answering prefix queries with binary search. To update
+ * one, build a new index and swap the reference; readers keep using the
+ * snapshot they hold.
+ */
+typedef struct {
+    PyObject_HEAD
+    CmdIndex *index;
+} CommandIndexObject;
+
+static PyTypeObject CommandIndexType;
+
+static void
+CommandIndex_dealloc(CommandIndexObject *self)
+{
+    cmd_index_free(self->index);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// Encode every str in iterable with the filesystem encoding into a new list
+// of bytes, returned in *keep, with *names pointing at their buffers
+// (PyMem_Free() it). Returns the number of names, or -1 with an exception set.
+static Py_ssize_t
+fs_names(PyObject *iterable, PyObject **keep, const char ***names)
+{
+    *names = NULL;
+    *keep = PyList_New(0);
+    PyObject *iter = *keep ? PyObject_GetIter(iterable) : NULL;
+    if (!iter)
+        goto error;
+    PyObject *item;
+    while ((item = PyIter_Next(iter))) {
+        PyObject *encoded = NULL;
+        int ok = PyUnicode_FSConverter(item, &encoded);
+        Py_DECREF(item);
+        if (!ok || PyList_Append(*keep, encoded) < 0) {
+            Py_XDECREF(encoded);
+            Py_DECREF(iter);
+            goto error;
+        }
+        Py_DECREF(encoded);
+    }
+    Py_DECREF(iter);
+    if (PyErr_Occurred())
+        goto error;
+    Py_ssize_t n = PyList_GET_SIZE(*keep);
+    *names = PyMem_Malloc(sizeof(char*) * (n + 1));
+    if (!*names) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    for (Py_ssize_t i = 0; i < n; i++)
+        (*names)[i] = PyBytes_AS_STRING(PyList_GET_ITEM(*keep, i));
+    return n;
+error:
+    Py_CLEAR(*keep);
+    return -1;
+}
+
+static PyObject *
+command_index_wrap(CmdIndex *index)
+{
+    if (!index)
+        return PyErr_NoMemory();
+    CommandIndexObject *self = PyObject_New(CommandIndexObject, &CommandIndexType);
+    if (!self) {
+        cmd_index_free(index);
+        return NULL;
+    }
+    self->index = index;
+    return (PyObject *) self;
+}
+
+static PyObject *
+CommandIndex_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"names", NULL};
+    PyObject *iterable, *keep;
+    const char **names;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O", kwlist, &iterable))
+        return NULL;
+    Py_ssize_t n = fs_names(iterable, &keep, &names);
+    if (n < 0)
+        return NULL;
+    CmdIndex *index = cmd_index_build(names, (size_t) n);
+    PyMem_Free(names);
+    Py_DECREF(keep);
+    return command_index_wrap(index);
+}
+
+/*
+ * Python method: index.complete(prefix="", limit=-1)
+ * Sorted list of the names starting with prefix, at most limit of them
+ * (all if negative)
+ */
+static PyObject *
+CommandIndex_complete(CommandIndexObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"prefix", "limit", NULL};
+    PyObject *prefix = NULL;
+    Py_ssize_t limit = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O&n", kwlist, PyUnicode_FSConverter, &prefix,
+                                     &limit))
+        return NULL;
+    size_t first = 0;
+    size_t n = prefix ? cmd_index_range(self->index, PyBytes_AS_STRING(prefix),
+                                        (size_t) PyBytes_GET_SIZE(prefix), &first)
+                      : self->index->count;
+    Py_XDECREF(prefix);
+    if (limit >= 0 && (size_t) limit < n)
+        n = (size_t) limit;
+    PyObject *list = PyList_New((Py_ssize_t) n);
+    for (size_t i = 0; list && i < n; i++) {
+        PyObject *name = PyUnicode_DecodeFSDefault(cmd_index_name(self->index, first + i));
+        if (!name) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, name);
+    }
+    return list;
+}
+
+static Py_ssize_t
+CommandIndex_length(CommandIndexObject *self)
+{
+    return (Py_ssize_t) self->index->count;
+}
+
+static int
+CommandIndex_contains(CommandIndexObject *self, PyObject *name)
+{
+    PyObject *encoded = NULL;
+    if (!PyUnicode_Check(name))
+        return 0;
+    if (!PyUnicode_FSConverter(name, &encoded))
+        return -1;
+    size_t first, len = (size_t) PyBytes_GET_SIZE(encoded);
+    size_t n = cmd_index_range(self->index, PyBytes_AS_STRING(encoded), len, &first);
+    // The exact name, if present, sorts first among those it prefixes
+    int found = n > 0 && strlen(cmd_index_name(self->index, first)) == len;
+    Py_DECREF(encoded);
+    return found;
+}
+
+static PyMethodDef CommandIndex_methods[] = {
+    {"complete", (PyCFunction)(void(*)(void)) CommandIndex_complete, METH_VARARGS | METH_KEYWORDS,
+     "Sorted names starting with a prefix"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods CommandIndex_as_sequence = {
+    .sq_length = (lenfunc) CommandIndex_length,
+    .sq_contains = (objobjproc) CommandIndex_contains,
+};
+
+static PyTypeObject CommandIndexType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "core.CommandIndex",
+    .tp_doc = "CommandIndex(names): immutable sorted set of command names for prefix completion",
+    .tp_basicsize = sizeof(CommandIndexObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = CommandIndex_new,
+    .tp_dealloc = (destructor) CommandIndex_dealloc,
+    .tp_as_sequence = &CommandIndex_as_sequence,
+    .tp_methods = CommandIndex_methods,
+};
+
+/*
+ * History object: command history in FileHistory's file format, indexed
+ * for prefix lookups (shell_history.c). Operations run with the GIL held.
+ */
+typedef struct {
+    PyObject_HEAD
+    ShellHistory hist;
+    bool open;
+} HistoryObject;
+
+static void
+History_dealloc(HistoryObject *self)
+{
+    if (self->open)
+        history_close(&self->hist);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+static PyObject *
+History_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"path", NULL};
+    PyObject *path = NULL;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O&", kwlist, PyUnicode_FSConverter, &path))
+        return NULL;
+    HistoryObject *self = (HistoryObject *) type->tp_alloc(type, 0);
+    if (self && history_open(&self->hist, PyBytes_AS_STRING(path)) < 0) {
+        PyErr_SetFromErrnoWithFilenameObject(PyExc_OSError, path);
+        Py_CLEAR(self);
+    } else if (self) {
+        self->open = true;
+    }
+    Py_DECREF(path);
+    return (PyObject *) self;
+}
+
+// Entry i as str (invalid UTF-8 replaced, as FileHistory reads it)
+static PyObject *
+history_entry(HistoryObject *self, size_t i)
+{
+    size_t len;
+    const char *text = history_text(&self->hist, i, &len);
+    return PyUnicode_DecodeUTF8(text, (Py_ssize_t) len, "replace");
+}
+
+/*
+ * Python method: history.append(text)
+ */
+static PyObject *
+History_append(HistoryObject *self, PyObject *arg)
+{
+    Py_ssize_t len;
+    const char *text = PyUnicode_AsUTF8AndSize(arg, &len);
+    if (!text)
+        return NULL;
+    if (history_append(&self->hist, text, (size_t) len) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    Py_RETURN_NONE;
+}
+
+/*
+ * Python method: history.strings() -> every entry, newest first
+ */
+static PyObject *
+History_strings(HistoryObject *self, PyObject *Py_UNUSED(ignored))
+{
+    size_t count = self->hist.count;
+    PyObject *list = PyList_New((Py_ssize_t) count);
+    for (size_t i = 0; list && i < count; i++) {
+        PyObject *entry = history_entry(self, count - 1 - i);
+        if (!entry) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, entry);
+    }
+    return list;
+}
+
+/*
+ * Python method: history.suggest(prefix) -> newest line starting with
+ * prefix (a whole entry, or one line of a multi-line one), or None
+ */
+static PyObject *
+History_suggest(HistoryObject *self, PyObject *arg)
+{
+    Py_ssize_t len;
+    const char *prefix = PyUnicode_AsUTF8AndSize(arg, &len);
+    if (!prefix)
+        return NULL;
+    const char *line;
+    size_t line_len;
+    if (history_suggest(&self->hist, prefix, (size_t) len, &line, &line_len) < 0)
+        Py_RETURN_NONE;
+    return PyUnicode_DecodeUTF8(line, (Py_ssize_t) line_len, "replace");
+}
+
+/*
+ * Python method: history.search(prefix, limit=-1)
+ * Distinct entries starting with prefix, newest first
+ */
+static PyObject *
+History_search(HistoryObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"prefix", "limit", NULL};
+    const char *prefix;
+    Py_ssize_t len, limit = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#|n", kwlist, &prefix, &len, &limit))
+        return NULL;
+    uint32_t *found;
+    size_t count;
+    if (history_search(&self->hist, prefix, (size_t) len, limit < 0 ? SIZE_MAX : (size_t) limit,
+                       &found, &count) < 0)
+        return PyErr_NoMemory();
+    PyObject *list = PyList_New((Py_ssize_t) count);
+    for (size_t i = 0; list && i < count; i++) {
+        PyObject *entry = history_entry(self, found[i]);
+        if (!entry) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, entry);
+    }
+    free(found);
+    return list;
+}
+
+static Py_ssize_t
+History_length(HistoryObject *self)
+{
+    return (Py_ssize_t) self->hist.count;
+}
+
+// history[i]: entry i, 0 = oldest (negative indexes count from the newest)
+static PyObject *
+History_item(HistoryObject *self, Py_ssize_t i)
+{
+    if (i < 0 || (size_t) i >= self->hist.count) {
+        PyErr_SetString(PyExc_IndexError, "history index out of range");
+        return NULL;
+    }
+    return history_entry(self, (size_t) i);
+}
+
+static PyMethodDef History_methods[] = {
+    {"append", (PyCFunction) History_append, METH_O,
+     "Add an entry to the end of the history file"},
+    {"strings", (PyCFunction) History_strings, METH_NOARGS,
+     "Every entry, newest first"},
+    {"suggest", (PyCFunction) History_suggest, METH_O,
+     "Newest line of any entry starting with a prefix, or None"},
+    {"search", (PyCFunction)(void(*)(void)) History_search, METH_VARARGS | METH_KEYWORDS,
+     "Distinct entries starting with a prefix, newest first"},
+    {NULL}  /* Sentinel */
+};
+
+static PySequenceMethods History_as_sequence = {
+    .sq_length = (lenfunc) History_length,
+    .sq_item = (ssizeargfunc) History_item,
+};
+
+static PyTypeObject HistoryType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "core.History",
+    .tp_doc = "History(path): indexed command history in prompt_toolkit's FileHistory format",
+    .tp_basicsize = sizeof(HistoryObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = History_new,
+    .tp_dealloc = (destructor) History_dealloc,
+    .tp_as_sequence = &History_as_sequence,
+    .tp_methods = History_methods,
+};
+
+// Resource usage as a dict: times in seconds, max_rss in kilobytes
+static PyObject *
+usage_to_dict(const ShellUsage *usage)
+{
+    return Py_BuildValue("{s:d,s:d,s:d,s:l,s:l,s:l}",
+                         "wall_time", usage->wall_ns / 1e9,
+                         "user_time", usage->user_us / 1e6,
+                         "sys_time", usage->sys_us / 1e6,
+                         "max_rss", usage->max_rss_kb,
+                         "voluntary_switches", usage->voluntary_cs,
+                         "involuntary_switches", usage->involuntary_cs);
+}
+
+// Tuple with a usage dict for each stage of a finished run (empty for builtins)
+static PyObject *
+run_usage(ShellRun *run)
+{
+    int n = run ? run->num_stages : 0;
+    PyObject *stages = PyTuple_New(n);
+    for (int i = 0; stages && i < n; i++) {
+        PyObject *usage = usage_to_dict(&run->stages[i].usage);
+        if (!usage)
+            Py_CLEAR(stages);
+        else
+            PyTuple_SET_ITEM(stages, i, usage);
+    }
+    return stages;
+}
+
+// Exit code of each stage of a finished run, like the pipestatus attribute
+static PyObject *
+run_pipestatus(ShellRun *run, const ShellResult *result)
+{
+    if (!run || run->num_stages == 0 || run->setup_failed)
+        return Py_BuildValue("(i)", result->exit_code);
+    PyObject *codes = PyTuple_New(run->num_stages);
+    for (int i = 0; codes && i < run->num_stages; i++) {
+        int status = run->stages[i].status;
+        PyObject *code = PyLong_FromLong(WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        if (!code)
+            Py_CLEAR(codes);
+        else
+            PyTuple_SET_ITEM(codes, i, code);
+    }
+    return codes;
+}
+
+/*
+ * Build the CommandResult for a finished run from its own result, with
+ * the captured Output for RESULT_CAPTURE and the per-stage usage for
+ * RESULT_USAGE. run may be NULL if it never started.
+ */
+static PyObject *
+build_run_result(ShellRun *run, const ShellResult *result, int flags)
+{
+    CommandResultObject *self = new_result(result, flags);
+    if (!self)
+        return NULL;
+    Py_SETREF(self->pipestatus, run_pipestatus(run, result));
+    if (!self->pipestatus)
+        goto error;
+    if (flags & RESULT_CAPTURE) {
+        OutputObject *output = PyObject_New(OutputObject, &OutputType);
+        if (!output) goto error;
+        output->out.data = NULL;
+        output->out.len = 0;
+        Py_SETREF(self->output, (PyObject *) output);
+        if (run && shell_run_map_output(run, &output->out) < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto error;
+        }
+    }
+    if (flags & RESULT_USAGE) {
+        Py_SETREF(self->usage, run_usage(run));
+        if (!self->usage) goto error;
+    }
+    return (PyObject *) self;
+
+error:
+    Py_DECREF(self);
+    return NULL;
+}
+
+/*
+ * Wait for a started run, record it in the context and take its own
+ * result. Called without the GIL or the lock; the lock is only taken for
+ * the recording, so other threads can use the Shell while the run goes on.
+ */
+static void
+finish_blocking(ShellObject *self, ShellRun *run, ShellResult *result)
+{
+    shell_run_complete(run);
+    pthread_rwlock_wrlock(&self->ctx->lock);
+    shell_run_finish(self->ctx, run);
+    pthread_rwlock_unlock(&self->ctx->lock);
+    shell_run_result(run, result);
+}
+
+/*
+ * Run a pipeline (a single command is a pipeline of one) to completion with
+ * the GIL released and build its result. Called with the Shell lock held
+ * (see marshal_commands) and releases it as soon as the pipeline is
+ * launched; nothing touches Python objects while the GIL is released, so
+ * other threads can run, on this Shell too.
+ */
+static PyObject *
+run_blocking(ShellObject *self, char *const *const *pipeline_argv, int num_commands, int flags,
+             const ShellRedirList *redirs, const ShellLimits *const *limits)
+{
+    ShellRunOptions opts = { .capture_stdout = (flags & RESULT_CAPTURE) != 0, .redirs = redirs,
+                             .limits = limits };
+    ShellRun *run;
+    ShellResult result = { .exit_code = -1 };
+
+    Py_BEGIN_ALLOW_THREADS
+    run = shell_start_pipeline(self->ctx, pipeline_argv, num_commands, &opts);
+    pthread_rwlock_unlock(&self->ctx->lock);
+    if (run)
+        finish_blocking(self, run, &result);
+    Py_END_ALLOW_THREADS
+
+    PyObject *ret = build_run_result(run, &result, flags);
+    shell_run_free(run);
+    shell_result_free(&result);
+    return ret;
+}
+
+/*
+ * Python method: shell.execute(argv, *, capture=False, usage=False, redirects=None, limits=None)
+ * Executes a single shell command given a list or tuple of arguments.
+ * The GIL is released while the child runs. With capture=True the
+ * command's stdout is returned as a third tuple item (a core.Output).
+ * usage=True appends a tuple with each stage's usage dict (wall, user and
+ * sys time in seconds, max_rss in KB, context switches), from wait4().
+ * redirects is a list of (fd, op, target) tuples as core.parse() gives
+ * them, applied in order: [(1, ">", "out.txt"), (2, ">&", 1)].
+ * limits is a dict of placement and limits applied in the child before
+ * exec (see dict_to_limits), e.g. {"cpus": [2, 3], "rlimit_as": 1 << 30,
+ * "nice": 10}; such commands are always forked.
+ */
+static PyObject *
+Shell_execute(ShellObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *seq, *keep, *redirects, *limits;
+    char ***argvs;
+    ShellRedirList *redirs;
+    const ShellLimits *const *stage_limits;
+    int flags;
+    if (parse_run_args("execute", "argv", args, nargs, kwnames, &seq, &flags, &redirects, &limits, NULL) < 0)
+        return NULL;
+    if (marshal_commands(self, seq, false, &argvs, &keep) < 0)
+        return NULL;
+    if (marshal_redirects(self, redirects, false, 1, &redirs) < 0 ||
+        marshal_limits(self, limits, false, 1, &stage_limits) < 0) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return NULL;
+    }
+
+    // Call our C implementation with the parsed argv
+    PyObject *ret = run_blocking(self, (char *const *const *) argvs, 1, flags, redirs, stage_limits);
+    Py_DECREF(keep);
+    return ret;
+}
+
+/*
+ * Python method: shell.execute_pipeline([ [cmd1_arg0, cmd1_arg1], [cmd2_arg0], ... ], *, capture=False,
+ *                                       usage=False, redirects=None, limits=None)
+ * Executes a pipeline of shell commands, taking a sequence of arguments for
+ * each. The GIL is released while the children run. capture=True captures
+ * the last stage's stdout. redirects holds one list per stage (or None),
+ * each applied after that stage's pipes, as in bash. limits is one dict
+ * for every stage, or one dict (or None) per stage, to pin each stage to
+ * its own CPUs: [{"cpus": [0]}, {"cpus": [1]}].
+ */
+static PyObject *
+Shell_execute_pipeline(ShellObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *seq, *keep, *redirects, *limits;
+    char ***argvs;
+    ShellRedirList *redirs;
+    const ShellLimits *const *stage_limits;
+    int flags;
+    if (parse_run_args("execute_pipeline", "pipeline", args, nargs, kwnames, &seq, &flags, &redirects, &limits, NULL) < 0)
+        return NULL;
+    Py_ssize_t num_commands = marshal_commands(self, seq, true, &argvs, &keep);
+    if (num_commands < 0)
+        return NULL;
+    if (num_commands == 0) {
+        // Empty pipeline is success (like shell)
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return build_run_result(NULL, &(ShellResult) { 0 }, flags);
+    }
+    if (marshal_redirects(self, redirects, true, num_commands, &redirs) < 0 ||
+        marshal_limits(self, limits, true, num_commands, &stage_limits) < 0) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return NULL;
+    }
+
+    PyObject *ret = run_blocking(self, (char *const *const *) argvs, (int) num_commands, flags, redirs,
+                                 stage_limits);
+    Py_DECREF(keep);
+    return ret;
+}
+
+/*
+ * Python method: shell.execute_many(argvs, *, max_parallel=0, usage=False, limits=None)
+ * Runs every argument list in argvs as its own command, keeping up to
+ * max_parallel of them running (0: one per CPU), and returns their
+ * (exit_code, error) tuples in input order, with each command's usage
+ * dict appended when usage=True. The GIL is released meanwhile. limits is
+ * one dict for every command, or one (or None) per command.
+ */
+static PyObject *
+Shell_execute_many(ShellObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"argvs", "max_parallel", "usage", "limits", NULL};
+    PyObject *seq, *keep, *limits = NULL;
+    int max_parallel = 0, usage = 0;
+    char ***argvs;
+    const ShellLimits *const *command_limits;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|$ipO", kwlist, &seq, &max_parallel, &usage, &limits))
+        return NULL;
+    Py_ssize_t n = marshal_commands(self, seq, true, &argvs, &keep);
+    if (n < 0)
+        return NULL;
+    if (marshal_limits(self, limits == Py_None ? NULL : limits, true, n, &command_limits) < 0) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return NULL;
+    }
+    ShellResult *results = n ? calloc((size_t) n, sizeof(ShellResult)) : NULL;
+    if (n && !results) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return PyErr_NoMemory();
+    }
+
+    int ret;
+    Py_BEGIN_ALLOW_THREADS
+    ret = shell_execute_many(self->ctx, (char *const *const *) argvs, (int) n, max_parallel, command_limits,
+                             results);
+    pthread_rwlock_unlock(&self->ctx->lock);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(keep);
+
+    PyObject *list = ret < 0 ? PyErr_SetFromErrno(PyExc_OSError) : PyList_New(n);
+    for (Py_ssize_t i = 0; list && i < n; i++) {
+        // Each command is a run of one stage; usage is its dict alone
+        CommandResultObject *item = new_result(&results[i], usage ? RESULT_USAGE : 0);
+        if (item) {
+            Py_SETREF(item->pipestatus, Py_BuildValue("(i)", results[i].exit_code));
+            if (usage && item->pipestatus)
+                Py_SETREF(item->usage, usage_to_dict(&results[i].usage));
+            if (!item->pipestatus || !item->usage)
+                Py_CLEAR(item);
+        }
+        if (!item)
+            Py_CLEAR(list);
+        else
+            PyList_SET_ITEM(list, i, (PyObject *) item);
+    }
+    for (Py_ssize_t i = 0; i < n; i++)
+        shell_result_free(&results[i]);
+    free(results);
+    return list;
+}
+
+/*
+ * Run object: a command started by execute_async/execute_pipeline_async.
+ * Owns the C ShellRun and the asyncio future handed back to the caller.
+ * The run's epoll fd (every stage's pidfd and stderr pipe) is registered
+ * with loop.add_reader(), so child exit wakes the loop instead of a
+ * blocking waitpid() and stderr is drained as it arrives, with one
+ * callback however many stages there are. With on_stderr, each stage
+ * whose tail grew while the run is still live is reported as it happens.
+ */
+typedef struct {
+    PyObject_HEAD
+    ShellObject *shell;   // Keeps the context alive until the run finishes
+    ShellRun *run;
+    PyObject *loop;
+    PyObject *future;
+    bool watching;        // The run's epoll fd is registered with the loop
+    int flags;            // RESULT_* items the result carries
+    PyObject *on_stderr;  // on_stderr(stage, tail) as stderr arrives, or NULL
+    size_t *err_seen;     // Each stage's err.total when on_stderr last heard of it
+} RunObject;
+
+static PyTypeObject RunType;
+
+static void
+Run_dealloc(RunObject *self)
+{
+    shell_run_free(self->run);
+    Py_XDECREF(self->shell);
+    Py_XDECREF(self->loop);
+    Py_XDECREF(self->future);
+    Py_XDECREF(self->on_stderr);
+    free(self->err_seen);
+    Py_TYPE(self)->tp_free((PyObject *) self);
+}
+
+// loop.remove_reader(fd), ignoring errors (the loop may already be closing)
+static void
+run_remove_reader(RunObject *self, int fd)
+{
+    PyObject *r = PyObject_CallMethod(self->loop, "remove_reader", "i", fd);
+    if (r == NULL) PyErr_Clear();
+    Py_XDECREF(r);
+}
+
+// loop.add_reader(fd, getattr(self, method), *arg)
+static int
+run_add_reader(RunObject *self, int fd, const char *method, PyObject *arg)
+{
+    PyObject *callback = PyObject_GetAttrString((PyObject *) self, method);
+    if (!callback) return -1;
+    PyObject *r = arg
+        ? PyObject_CallMethod(self->loop, "add_reader", "iOO", fd, callback, arg)
+        : PyObject_CallMethod(self->loop, "add_reader", "iO", fd, callback);
+    Py_DECREF(callback);
+    if (!r) return -1;
+    Py_DECREF(r);
+    return 0;
+}
+
+// All stages exited: collect the rest of stderr and resolve the future
+static PyObject *
+run_complete(RunObject *self)
+{
+    if (self->watching) {
+        run_remove_reader(self, self->run->epoll_fd);
+        self->watching = false;
+    }
+    // The children are gone, so only data already in the pipes is left
+    // (unless a grandchild kept one open; they are non-blocking either way)
+    shell_run_close_stderr(self->run);
+
+    ShellResult result;
+    shell_lock(self->shell);
+    shell_run_finish(self->shell->ctx, self->run);
+    shell_unlock(self->shell);
+    shell_run_result(self->run, &result);
+
+    PyObject *value = build_run_result(self->run, &result, self->flags);
+    shell_result_free(&result);
+    if (!value) return NULL;
+
+    // The awaiting task may have been cancelled in the meantime
+    PyObject *done = PyObject_CallMethod(self->future, "done", NULL);
+    if (!done) { Py_DECREF(value); return NULL; }
+    int is_done = PyObject_IsTrue(done);
+    Py_DECREF(done);
+    if (!is_done) {
+        PyObject *name = PyUnicode_FromString("set_result");
+        PyObject *r = name ? PyObject_CallMethodObjArgs(self->future, name, value, NULL) : NULL;
+        Py_XDECREF(name);
+        Py_XDECREF(r);
+        if (!r) { Py_DECREF(value); return NULL; }
+    }
+    Py_DECREF(value);
+    Py_RETURN_NONE;
+}
+
+// Hand every stage whose stderr tail grew since the last call to on_stderr.
+// Its errors are reported as unraisable: they must not lose the run.
+static void
+run_report_stderr(RunObject *self)
+{
+    for (int i = 0; i < self->run->num_stages; i++) {
+        const ShellRing *err = &self->run->stages[i].err;
+        if (err->total == self->err_seen[i])
+            continue;
+        self->err_seen[i] = err->total;
+        char *tail = ring_dup(err);
+        if (!tail)
+            continue;
+        PyObject *r = PyObject_CallFunction(self->on_stderr, "is", i, tail);
+        free(tail);
+        if (!r)
+            PyErr_WriteUnraisable(self->on_stderr);
+        Py_XDECREF(r);
+    }
+}
+
+/*
+ * Loop callback: the run's epoll fd is readable (a stage exited or wrote
+ * to stderr)
+ */
+static PyObject *
+Run_on_events(RunObject *self, PyObject *Py_UNUSED(ignored))
+{
+    int live = shell_run_poll(self->run, 0);
+    if (live > 0) {
+        if (self->on_stderr)
+            run_report_stderr(self);
+        Py_RETURN_NONE;
+    }
+    if (live < 0) {
+        // epoll itself failed: finish synchronously rather than never resolve
+        Py_BEGIN_ALLOW_THREADS
+        for (int i = 0; i < self->run->num_stages; i++) shell_run_reap(self->run, i, true);
+        Py_END_ALLOW_THREADS
+    }
+    return run_complete(self);
+}
+
+/*
+ * Blocking completion, used from an executor thread when pidfds aren't
+ * available (kernels before 5.3). Runs without the GIL.
+ */
+static PyObject *
+Run_wait(RunObject *self, PyObject *Py_UNUSED(ignored))
+{
+    ShellResult result;
+    Py_BEGIN_ALLOW_THREADS
+    finish_blocking(self->shell, self->run, &result);
+    Py_END_ALLOW_THREADS
+
+    PyObject *ret = build_run_result(self->run, &result, self->flags);
+    shell_result_free(&result);
+    return ret;
+}
+
+static PyMethodDef Run_methods[] = {
+    {"_on_events", (PyCFunction) Run_on_events, METH_NOARGS,
+     "Event loop callback for the run's epoll fd"},
+    {"_wait", (PyCFunction) Run_wait, METH_NOARGS,
+     "Block until the run finishes (executor fallback)"},
+    {NULL}  /* Sentinel */
+};
+
+static PyTypeObject RunType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "core.Run",
+    .tp_doc = "In-flight command started by Shell.execute_async",
+    .tp_basicsize = sizeof(RunObject),
+    .tp_itemsize = 0,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_dealloc = (destructor) Run_dealloc,
+    .tp_methods = Run_methods,
+};
+
+/*
+ * Wrap a started ShellRun in an awaitable resolving to (exit_code, error).
+ * Steals run. on_stderr may be NULL.
+ */
+static PyObject *
+make_awaitable(ShellObject *shell, ShellRun *run, int flags, PyObject *on_stderr)
+{
+    static PyObject *asyncio = NULL;
+    if (!asyncio && !(asyncio = PyImport_ImportModule("asyncio"))) {
+        shell_run_free(run);
+        return NULL;
+    }
+
+    RunObject *self = PyObject_New(RunObject, &RunType);
+    if (!self) { shell_run_free(run); return NULL; }
+    Py_INCREF(shell);
+    self->shell = shell;
+    self->run = run;
+    self->future = NULL;
+    self->watching = false;
+    self->flags = flags;
+    self->on_stderr = NULL;
+    self->err_seen = NULL;
+    self->loop = PyObject_CallMethod(asyncio, "get_running_loop", NULL);
+    if (!self->loop) goto error;
+    if (on_stderr) {
+        self->err_seen = calloc(run->num_stages, sizeof(size_t));
+        if (!self->err_seen) { PyErr_NoMemory(); goto error; }
+        Py_INCREF(on_stderr);
+        self->on_stderr = on_stderr;
+    }
+
+    bool live = false;
+    for (int i = 0; i < run->num_stages; i++) {
+        if (!run->stages[i].reaped) live = true;
+    }
+
+    // No pidfd support: finish on a worker thread instead
+    if (live && shell_run_watch(run) < 0) {
+        PyObject *wait = PyObject_GetAttrString((PyObject *) self, "_wait");
+        if (!wait) goto error;
+        PyObject *fut = PyObject_CallMethod(self->loop, "run_in_executor", "OO", Py_None, wait);
+        Py_DECREF(wait);
+        Py_DECREF(self);
+        return fut;
+    }
+
+    self->future = PyObject_CallMethod(self->loop, "create_future", NULL);
+    if (!self->future) goto error;
+
+    if (!live) {
+        // Builtin or exec failure: nothing left to wait for
+        PyObject *r = run_complete(self);
+        if (!r) goto error;
+        Py_DECREF(r);
+    } else {
+        if (run_add_reader(self, run->epoll_fd, "_on_events", NULL) < 0) goto error;
+        self->watching = true;
+    }
+
+    // The loop's reader callbacks keep the Run alive until completion
+    PyObject *future = self->future;
+    Py_INCREF(future);
+    Py_DECREF(self);
+    return future;
+
+error:
+    // Unregister the run, then reap synchronously so no zombies are left
+    if (self->watching) {
+        PyObject *exc_type, *exc_value, *exc_tb;
+        PyErr_Fetch(&exc_type, &exc_value, &exc_tb);
+        run_remove_reader(self, run->epoll_fd);
+        PyErr_Restore(exc_type, exc_value, exc_tb);
+    }
+    Py_BEGIN_ALLOW_THREADS
+    for (int i = 0; i < run->num_stages; i++) shell_run_reap(run, i, true);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(self);
+    return NULL;
+}
+
+/*
+ * Launch a marshalled pipeline for the async methods. Called with the
+ * Shell lock held and releases it.
+ */
+static PyObject *
+start_async(ShellObject *self, char ***argvs, Py_ssize_t num_commands, PyObject *keep, int flags,
+            const ShellRedirList *redirs, const ShellLimits *const *limits, PyObject *on_stderr)
+{
+    ShellRunOptions opts = { .capture_stdout = (flags & RESULT_CAPTURE) != 0, .redirs = redirs,
+                             .limits = limits };
+    ShellRun *run;
+    Py_BEGIN_ALLOW_THREADS
+    run = shell_start_pipeline(self->ctx, (char *const *const *) argvs, (int) num_commands, &opts);
+    pthread_rwlock_unlock(&self->ctx->lock);
+    Py_END_ALLOW_THREADS
+
+    // The children have their own copies now (or failed to exec)
+    Py_DECREF(keep);
+
+    if (!run) {
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return make_awaitable(self, run, flags, on_stderr);
+}
+
+/*
+ * Python method: await shell.execute_async(argv, *, capture=False, usage=False, redirects=None,
+ *                                          limits=None, on_stderr=None)
+ * Starts the command and returns an awaitable resolving to the same
+ * tuple as execute(). Must be called from a running asyncio event loop;
+ * the loop stays responsive while the child runs. on_stderr(stage, tail)
+ * is called from the loop whenever a stage writes to stderr before the
+ * run is over, with that stage's stderr tail so far (kernels without
+ * pidfds finish on a thread and never call it).
+ */
+static PyObject *
+Shell_execute_async(ShellObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *seq, *keep, *redirects, *limits, *on_stderr;
+    char ***argvs;
+    ShellRedirList *redirs;
+    const ShellLimits *const *stage_limits;
+    int flags;
+    if (parse_run_args("execute_async", "argv", args, nargs, kwnames, &seq, &flags, &redirects, &limits, &on_stderr) < 0)
+        return NULL;
+    if (marshal_commands(self, seq, false, &argvs, &keep) < 0)
+        return NULL;
+    if (marshal_redirects(self, redirects, false, 1, &redirs) < 0 ||
+        marshal_limits(self, limits, false, 1, &stage_limits) < 0) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return NULL;
+    }
+    return start_async(self, argvs, 1, keep, flags, redirs, stage_limits, on_stderr);
+}
+
+/*
+ * Python method: await shell.execute_pipeline_async([[...], [...]], *, capture=False, usage=False,
+ *                                                   redirects=None, limits=None, on_stderr=None)
+ * Pipeline counterpart of execute_async().
+ */
+static PyObject *
+Shell_execute_pipeline_async(ShellObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *seq, *keep, *redirects, *limits, *on_stderr;
+    char ***argvs;
+    ShellRedirList *redirs;
+    const ShellLimits *const *stage_limits;
+    int flags;
+    if (parse_run_args("execute_pipeline_async", "pipeline", args, nargs, kwnames, &seq, &flags, &redirects, &limits, &on_stderr) < 0)
+        return NULL;
+    Py_ssize_t num_commands = marshal_commands(self, seq, true, &argvs, &keep);
+    if (num_commands < 0)
+        return NULL;
+    if (marshal_redirects(self, redirects, true, num_commands, &redirs) < 0 ||
+        marshal_limits(self, limits, true, num_commands, &stage_limits) < 0) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return NULL;
+    }
+    return start_async(self, argvs, num_commands, keep, flags, redirs, stage_limits, on_stderr);
+}
+
+/*
+ * The line argument of execute_line() and execute_line_async() as UTF-8
+ */
+static const char *
+line_arg(PyObject *line)
+{
+    if (!PyUnicode_Check(line)) {
+        PyErr_SetString(PyExc_TypeError, "line must be a string");
+        return NULL;
+    }
+    return PyUnicode_AsUTF8(line);
+}
+
+/* Raise the exception for a shell_start_line() that returned NULL */
+static PyObject *
+line_error(const char *syntax_error)
+{
+    if (syntax_error)
+        return PyErr_Format(PyExc_ValueError, "%s", syntax_error);
+    if (errno == ENOMEM)
+        return PyErr_NoMemory();
+    return PyErr_SetFromErrno(PyExc_OSError);
+}
+
+/*
+ * Python method: shell.execute_line(line, *, capture=False, usage=False)
+ * Parses, glob-expands and runs a whole command line natively: the words,
+ * matches and argv arrays go straight into the Shell's arena without
+ * becoming Python objects. Returns the same tuple as execute(); raises
+ * ValueError on a syntax error.
+ */
+static PyObject *
+Shell_execute_line(ShellObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *arg;
+    int flags;
+    if (parse_run_args("execute_line", "line", args, nargs, kwnames, &arg, &flags, NULL, NULL, NULL) < 0)
+        return NULL;
+    const char *line = line_arg(arg);
+    if (!line)
+        return NULL;
+
+    ShellRunOptions opts = { .capture_stdout = (flags & RESULT_CAPTURE) != 0 };
+    const char *syntax_error;
+    ShellRun *run;
+    ShellResult result;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->ctx->lock);
+    arena_reset(&self->argv_arena);
+    run = shell_start_line(self->ctx, &self->argv_arena, line, &opts, &syntax_error);
+    pthread_rwlock_unlock(&self->ctx->lock);
+    if (run)
+        finish_blocking(self, run, &result);
+    Py_END_ALLOW_THREADS
+
+    if (!run)
+        return line_error(syntax_error);
+    PyObject *ret = build_run_result(run, &result, flags);
+    shell_run_free(run);
+    shell_result_free(&result);
+    return ret;
+}
+
+/*
+ * Python method: await shell.execute_line_async(line, *, capture=False, usage=False, on_stderr=None)
+ * Async counterpart of execute_line(); see execute_async().
+ */
+static PyObject *
+Shell_execute_line_async(ShellObject *self, PyObject *const *args, Py_ssize_t nargs, PyObject *kwnames)
+{
+    PyObject *arg, *on_stderr;
+    int flags;
+    if (parse_run_args("execute_line_async", "line", args, nargs, kwnames, &arg, &flags, NULL, NULL, &on_stderr) < 0)
+        return NULL;
+    const char *line = line_arg(arg);
+    if (!line)
+        return NULL;
+
+    ShellRunOptions opts = { .capture_stdout = (flags & RESULT_CAPTURE) != 0 };
+    const char *syntax_error;
+    ShellRun *run;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->ctx->lock);
+    arena_reset(&self->argv_arena);
+    run = shell_start_line(self->ctx, &self->argv_arena, line, &opts, &syntax_error);
+    pthread_rwlock_unlock(&self->ctx->lock);
+    Py_END_ALLOW_THREADS
+
+    if (!run)
+        return line_error(syntax_error);
+    return make_awaitable(self, run, flags, on_stderr);
+}
+
+/*
+ * Python method: shell.start_job(pipeline, *, command=None, redirects=None, limits=None)
+ * Starts a pipeline (a list of argument lists) in the background, in its
+ * own process group with stdin from /dev/null, and returns its job id.
+ * command is the text shown by jobs(); defaults to the joined arguments.
+ * redirects and limits are as for execute_pipeline().
+ */
+static PyObject *
+Shell_start_job(ShellObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"pipeline", "command", "redirects", "limits", NULL};
+    PyObject *seq, *keep, *redirects = NULL, *limits = NULL;
+    const char *command = NULL;
+    char ***argvs;
+    ShellRedirList *redirs;
+    const ShellLimits *const *stage_limits;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|$zOO", kwlist, &seq, &command, &redirects, &limits))
+        return NULL;
+    if (redirects == Py_None)
+        redirects = NULL;
+    if (limits == Py_None)
+        limits = NULL;
+    Py_ssize_t num_commands = marshal_commands(self, seq, true, &argvs, &keep);
+    if (num_commands < 0)
+        return NULL;
+    if (num_commands == 0) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        PyErr_SetString(PyExc_ValueError, "Pipeline must have at least one command");
+        return NULL;
+    }
+    if (marshal_redirects(self, redirects, true, num_commands, &redirs) < 0 ||
+        marshal_limits(self, limits, true, num_commands, &stage_limits) < 0) {
+        shell_unlock(self);
+        Py_DECREF(keep);
+        return NULL;
+    }
+
+    int id;
+    Py_BEGIN_ALLOW_THREADS
+    id = shell_start_job(self->ctx, (char *const *const *) argvs, (int) num_commands, command, redirs,
+                         stage_limits);
+    pthread_rwlock_unlock(&self->ctx->lock);
+    Py_END_ALLOW_THREADS
+    Py_DECREF(keep);
+
+    if (id < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return PyLong_FromLong(id);
+}
+
+// {"id", "pgid", "command", "done", "exit_code", "pids"} for a job; caller holds the lock
+static PyObject *
+job_to_dict(const ShellJob *job)
+{
+    PyObject *pids = PyList_New(job->run->num_stages);
+    for (int i = 0; pids && i < job->run->num_stages; i++) {
+        PyObject *pid = PyLong_FromLong((long) job->run->stages[i].pid);
+        if (!pid) {
+            Py_CLEAR(pids);
+            break;
+        }
+        PyList_SET_ITEM(pids, i, pid);
+    }
+    if (!pids)
+        return NULL;
+    return Py_BuildValue("{s:i,s:l,s:O&,s:O,s:N,s:N}", "id", job->id, "pgid", (long) job->pgid,
+                         "command", PyUnicode_DecodeFSDefault, job->command,
+                         "done", job->done ? Py_True : Py_False,
+                         "exit_code", job->done ? PyLong_FromLong(job->exit_code) : (Py_INCREF(Py_None), Py_None),
+                         "pids", pids);
+}
+
+/*
+ * List the jobs after reaping whatever has exited. With forget_done the
+ * finished ones are returned alone and removed from the table.
+ */
+static PyObject *
+list_jobs(ShellObject *self, bool forget_done)
+{
+    shell_lock(self);
+    ShellJobTable *table = &self->ctx->jobs;
+    shell_jobs_reap(self->ctx);
+    PyObject *list = PyList_New(0);
+    for (size_t i = 0; list && i < table->count; i++) {
+        if (forget_done && !table->jobs[i].done)
+            continue;
+        PyObject *job = job_to_dict(&table->jobs[i]);
+        if (!job || PyList_Append(list, job) < 0)
+            Py_CLEAR(list);
+        Py_XDECREF(job);
+    }
+    if (list && forget_done)
+        shell_jobs_forget_done(self->ctx);
+    shell_unlock(self);
+    return list;
+}
+
+/*
+ * Python method: shell.jobs()
+ * Every job in the table, oldest first, as dicts with "id", "pgid",
+ * "command", "done", "exit_code" (None while running) and "pids"
+ */
+static PyObject *
+Shell_jobs(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return list_jobs(self, false);
+}
+
+/*
+ * Python method: shell.reap_jobs()
+ * Reaps without blocking and returns the jobs that have finished, removing
+ * them from the table (bash's "[1]+ Done" notices). Call it whenever
+ * jobs_fd() is readable, or before each prompt.
+ */
+static PyObject *
+Shell_reap_jobs(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return list_jobs(self, true);
+}
+
+/*
+ * Python method: shell.jobs_fd()
+ * fd that becomes readable when a job process exits, for
+ * loop.add_reader(fd, ...) + reap_jobs(); -1 if unsupported (poll instead)
+ */
+static PyObject *
+Shell_jobs_fd(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    shell_lock(self);
+    int fd = shell_jobs_fd(self->ctx);
+    shell_unlock(self);
+    return PyLong_FromLong(fd);
+}
+
+/* Take a job out of the table to finish it in the foreground; NULL + ValueError if unknown */
+static ShellRun *
+take_job(ShellObject *self, PyObject *args)
+{
+    int id;
+    if (!PyArg_ParseTuple(args, "i", &id))
+        return NULL;
+    shell_lock(self);
+    ShellRun *run = shell_job_take(self->ctx, id);
+    shell_unlock(self);
+    if (!run)
+        PyErr_Format(PyExc_ValueError, "no such job: %d", id);
+    return run;
+}
+
+/*
+ * Python method: shell.wait_job(id)
+ * Brings a job to the foreground and waits for it (GIL released), like
+ * `fg`. Returns the same tuple as execute_pipeline(); the job leaves the table.
+ */
+static PyObject *
+Shell_wait_job(ShellObject *self, PyObject *args)
+{
+    ShellRun *run = take_job(self, args);
+    if (!run)
+        return NULL;
+
+    ShellResult result;
+    Py_BEGIN_ALLOW_THREADS
+    finish_blocking(self, run, &result);
+    Py_END_ALLOW_THREADS
+
+    PyObject *ret = build_run_result(run, &result, 0);
+    shell_run_free(run);
+    shell_result_free(&result);
+    return ret;
+}
+
+/*
+ * Python method: await shell.wait_job_async(id)
+ * Async counterpart of wait_job(): resolves when the job's last process exits
+ */
+static PyObject *
+Shell_wait_job_async(ShellObject *self, PyObject *args)
+{
+    ShellRun *run = take_job(self, args);
+    if (!run)
+        return NULL;
+    return make_awaitable(self, run, false, NULL);
+}
+
+/*
+ * Python method: shell.kill_job(id, sig=signal.SIGTERM)
+ * Sends a signal to every process of a running job
+ */
+static PyObject *
+Shell_kill_job(ShellObject *self, PyObject *args)
+{
+    int id, sig = SIGTERM;
+    if (!PyArg_ParseTuple(args, "i|i", &id, &sig))
+        return NULL;
+    shell_lock(self);
+    int result = shell_job_kill(self->ctx, id, sig);
+    shell_unlock(self);
+    if (result < 0) {
+        if (errno == ESRCH)
+            return PyErr_Format(PyExc_ValueError, "no such running job: %d", id);
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    Py_RETURN_NONE;
+}
+
+/*
+ * Python method: shell.cd(path)
+ * Changes current directory
+ * Converts Python string path → C string, updates shell context
+ */
+static PyObject *
+Shell_cd(ShellObject *self, PyObject *args)
+{
+    const char *path;
+    if (!PyArg_ParseTuple(args, "s", &path))
+        return NULL;
+
+    shell_lock(self);
+    int result = shell_cd(self->ctx, path);
+    shell_unlock(self);
+    return PyLong_FromLong(result);
+}
+
+/*
+ * Python method: shell.getenv(name)
+ * Gets environment variable value
+ * Returns None if variable doesn't exist
+ */
+static PyObject *
+Shell_getenv(ShellObject *self, PyObject *args)
+{
+    const char *name;
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    shell_read_lock(self);
+    const char *value = shell_getenv(self->ctx, name);
+    if (value == NULL) {
+        shell_unlock(self);
+        Py_RETURN_NONE;  // Python's None if variable not found
+    }
+    PyObject *py_value = PyUnicode_FromString(value);  // Convert C string to Python string
+    shell_unlock(self);
+    return py_value;
+}
+
+/*
+ * Python method: shell.setenv(name, value)
+ * Sets environment variable
+ * Takes two Python strings, converts to C strings
+ */
+static PyObject *
+Shell_setenv(ShellObject *self, PyObject *args)
+{
+    const char *name;
+    const char *value;
+    // "ss" format means parse two strings
+    if (!PyArg_ParseTuple(args, "ss", &name, &value))
+        return NULL;
+
+    shell_lock(self);
+    int result = shell_setenv(self->ctx, name, value);
+    shell_unlock(self);
+    return PyLong_FromLong(result);
+}
+
+/*
+ * Python method: shell.unsetenv(name)
+ * Removes environment variable (no error if it was not set)
+ */
+static PyObject *
+Shell_unsetenv(ShellObject *self, PyObject *args)
+{
+    const char *name;
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    shell_lock(self);
+    int result = shell_unsetenv(self->ctx, name);
+    shell_unlock(self);
+    return PyLong_FromLong(result);
+}
+
+/*
+ * Python method: shell.which(name)
+ * Absolute path the command would run from (via the path cache), or None
+ */
+static PyObject *
+Shell_which(ShellObject *self, PyObject *args)
+{
+    const char *name;
+    if (!PyArg_ParseTuple(args, "s", &name))
+        return NULL;
+
+    shell_lock(self);
+    const char *path = shell_which(self->ctx, name);
+    PyObject *ret = path ? PyUnicode_DecodeFSDefault(path) : NULL;
+    shell_unlock(self);
+    if (!path)
+        Py_RETURN_NONE;
+    return ret;
+}
+
+/*
+ * Python method: shell.path_commands()
+ * Sorted list of every executable name in the shell's PATH.
+ * Uses the same per-directory cache as command lookup, so directories that
+ * haven't changed since the last call aren't read again.
+ */
+static PyObject *
+Shell_path_commands(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    const char **names = NULL;
+    size_t count = 0;
+    int result;
+
+    // Listing PATH can take a while on a cold cache; don't hold the GIL for it
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->ctx->lock);
+    result = cmd_cache_list(&self->ctx->cmds, &names, &count);
+    Py_END_ALLOW_THREADS
+
+    if (result < 0) {
+        shell_unlock(self);
+        return PyErr_NoMemory();
+    }
+
+    // The names belong to the cache, so copy them before letting go of the lock
+    PyObject *list = PyList_New((Py_ssize_t) count);
+    for (size_t i = 0; list && i < count; i++) {
+        PyObject *name = PyUnicode_DecodeFSDefault(names[i]);
+        if (!name) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, name);
+    }
+    shell_unlock(self);
+    free(names);
+    return list;
+}
+
+/*
+ * Python method: shell.command_index(extra=())
+ * CommandIndex of every executable in the shell's PATH plus the names in
+ * extra, built from the same per-directory cache as path_commands()
+ */
+static PyObject *
+Shell_command_index(ShellObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"extra", NULL};
+    PyObject *extra = NULL, *keep = NULL;
+    const char **extra_names = NULL;
+    Py_ssize_t num_extra = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &extra))
+        return NULL;
+    if (extra && (num_extra = fs_names(extra, &keep, &extra_names)) < 0)
+        return NULL;
+
+    const char **names = NULL, **all = NULL;
+    size_t count = 0;
+    CmdIndex *index = NULL;
+    int result;
+    // Listing PATH and sorting can take a while; don't hold the GIL for it
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->ctx->lock);
+    result = cmd_cache_list(&self->ctx->cmds, &names, &count);
+    if (result == 0 && (all = malloc(sizeof(char*) * (count + (size_t) num_extra + 1)))) {
+        memcpy(all, names, sizeof(char*) * count);
+        if (num_extra)
+            memcpy(all + count, extra_names, sizeof(char*) * (size_t) num_extra);
+        // The index copies the names, so the cache can change once it's built
+        index = cmd_index_build(all, count + (size_t) num_extra);
+    }
+    pthread_rwlock_unlock(&self->ctx->lock);
+    Py_END_ALLOW_THREADS
+
+    free(all);
+    free(names);
+    PyMem_Free(extra_names);
+    Py_XDECREF(keep);
+    return command_index_wrap(index);
+}
+
+/*
+ * Python method: shell.rehash()
+ * Drops every cached command resolution, like `hash -r`
  */
-static void
-Shell_dealloc(ShellObject *self)
+static PyObject *
+Shell_rehash(ShellObject *self, PyObject *Py_UNUSED(ignored))
 {
-    if (self->ctx) {
-        shell_cleanup(self->ctx);  // Clean up our C shell context
-    }
-    Py_TYPE(self)->tp_free((PyObject *) self);  // Free the Python object itself
+    shell_lock(self);
+    int result = shell_rehash(self->ctx);
+    shell_unlock(self);
+    if (result < 0)
+        return PyErr_NoMemory();
+    Py_RETURN_NONE;
 }
 
 /*
- * Constructor for our Shell object
- * Called when Python code creates a new Shell() instance
- * Allocates and initializes both Python object and C shell context
+ * Python method: shell.snapshot()
+ * New Shell with this one's cwd, environment and settings that are then
+ * its own to change: cd and setenv on either don't affect the other, and
+ * the process's cwd is never touched by the snapshot. Cheap: it holds a
+ * directory fd rather than calling chdir(), and shares the environment
+ * table until one side modifies it. Use one per concurrent job, or for a
+ * `( cd dir && ... )` subshell.
  */
 static PyObject *
-Shell_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
+Shell_snapshot(ShellObject *self, PyObject *Py_UNUSED(ignored))
 {
-    ShellObject *self;
-    // Allocate the Python object first
-    self = (ShellObject *) type->tp_alloc(type, 0);
-    if (self != NULL) {
-        // Initialize our C shell context
-        self->ctx = shell_init();
-        if (self->ctx == NULL) {
-            Py_DECREF(self);  // Clean up Python object if C init fails
-            return NULL;
-        }
+    ShellObject *snap = (ShellObject *) Py_TYPE(self)->tp_alloc(Py_TYPE(self), 0);
+    if (snap == NULL)
+        return NULL;
+    shell_lock(self);
+    snap->ctx = shell_snapshot(self->ctx);
+    shell_unlock(self);
+    if (snap->ctx == NULL) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        Py_DECREF(snap);
+        return NULL;
     }
-    return (PyObject *) self;
+    arena_init(&snap->argv_arena, ARGV_ARENA_BLOCK);
+    return (PyObject *) snap;
 }
 
-// Helper function to convert a Python list of strings to char** argv
-// Returns allocated argv (caller must free it and its contents) or NULL on failure
-static char** py_list_to_argv(PyObject* py_list) {
-    if (!PyList_Check(py_list)) {
-        PyErr_SetString(PyExc_TypeError, "Argument must be a list of strings");
+/*
+ * Python method: shell.glob(pattern)
+ * Sorted list of the paths matching a wildcard pattern (fnmatch syntax,
+ * '\' escapes), relative to the shell's cwd. [] if nothing matches.
+ * Directory listings are cached while their mtime is unchanged.
+ */
+static PyObject *
+Shell_glob(ShellObject *self, PyObject *args)
+{
+    const char *pattern;
+    if (!PyArg_ParseTuple(args, "s", &pattern))
         return NULL;
+
+    char **matches = NULL;
+    int count;
+    // A cold listing of a big directory takes a while; don't hold the GIL for it
+    Py_BEGIN_ALLOW_THREADS
+    pthread_rwlock_wrlock(&self->ctx->lock);
+    arena_reset(&self->argv_arena);
+    count = shell_glob(self->ctx, &self->argv_arena, pattern, &matches);
+    Py_END_ALLOW_THREADS
+
+    if (count < 0) {
+        shell_unlock(self);
+        return PyErr_NoMemory();
+    }
+    // The matches live in the arena, so copy them before letting go of the lock
+    PyObject *list = PyList_New(count);
+    for (int i = 0; list && i < count; i++) {
+        PyObject *path = PyUnicode_DecodeFSDefault(matches[i]);
+        if (!path) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, i, path);
     }
+    shell_unlock(self);
+    return list;
+}
 
-    Py_ssize_t argc = PyList_Size(py_list);
-    // Allocate space for char* pointers plus the terminating NULL
-    char **argv = malloc(sizeof(char*) * (argc + 1));
-    if (!argv) {
-        PyErr_NoMemory();
-        return NULL;
+/*
+ * Python method: shell.glob_cache_info()
+ * {"hits", "misses", "dirs"}: listings served from the cache, listings
+ * read from disk, and directories cached right now
+ */
+static PyObject *
+Shell_glob_cache_info(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    shell_read_lock(self);
+    const ShellGlobCache *cache = &self->ctx->globs;
+    int dirs = 0;
+    for (int i = 0; i < GLOB_CACHE_DIRS; i++) {
+        if (cache->dirs[i].dir) dirs++;
     }
+    PyObject *info = Py_BuildValue("{s:k,s:k,s:i}", "hits", cache->hits, "misses", cache->misses, "dirs", dirs);
+    shell_unlock(self);
+    return info;
+}
 
-    for (Py_ssize_t i = 0; i < argc; i++) {
-        PyObject *item = PyList_GetItem(py_list, i);
-        if (!PyUnicode_Check(item)) {
-            PyErr_SetString(PyExc_TypeError, "List items must be strings");
-            // Free already allocated strings and the argv array
-            for (Py_ssize_t j = 0; j < i; j++) {
-                free(argv[j]);
-            }
-            free(argv);
-            return NULL;
-        }
-        // PyUnicode_AsUTF8 returns a pointer to the internal buffer, which is
-        // generally okay for short-lived usage like passing to execvp.
-        // If the C function stored these pointers long-term, we'd need strdup.
-        // However, let's use strdup for safety, as C layer might evolve.
-        const char *utf8_str = PyUnicode_AsUTF8(item);
-        if (!utf8_str) { // Error during conversion
-             for (Py_ssize_t j = 0; j < i; j++) {
-                free(argv[j]);
-            }
-            free(argv);
-            return NULL; // Error already set by PyUnicode_AsUTF8
-        }
-        argv[i] = strdup(utf8_str);
-        if (!argv[i]) { // strdup failed
-            PyErr_NoMemory();
-            for (Py_ssize_t j = 0; j < i; j++) {
-                free(argv[j]);
-            }
-            free(argv);
-            return NULL;
+/*
+ * Python method: shell.last_stages()
+ * One dict per stage of the last command or pipeline:
+ * {"exit_code", "signal", "error"}, where error is the tail of the stage's
+ * stderr (None if it wrote nothing)
+ */
+static PyObject *
+Shell_last_stages(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    shell_read_lock(self);
+    PyObject *list = PyList_New(self->ctx->num_last_stages);
+    for (int i = 0; list && i < self->ctx->num_last_stages; i++) {
+        const ShellResult *r = &self->ctx->last_stages[i];
+        PyObject *item = Py_BuildValue("{s:i,s:i,s:z}", "exit_code", r->exit_code,
+                                       "signal", r->signal, "error", r->error);
+        if (!item) {
+            Py_CLEAR(list);
+            break;
         }
+        PyList_SET_ITEM(list, i, item);
     }
-    argv[argc] = NULL; // Null-terminate the array
-    return argv;
+    shell_unlock(self);
+    return list;
 }
 
-// Helper function to free argv created by py_list_to_argv
-static void free_argv(char **argv) {
-    if (!argv) return;
-    for (int i = 0; argv[i] != NULL; i++) {
-        free(argv[i]);
+/*
+ * Python method: shell.stats()
+ * Usage of the most recent runs, oldest first, once stats_size is set:
+ * dicts with "command", "exit_code" and "stages" plus the usage keys, for
+ * the run as a whole (wall time from first spawn to last reap, CPU time
+ * and context switches summed over the stages, the largest max_rss).
+ */
+static PyObject *
+Shell_stats(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    shell_read_lock(self);
+    const ShellStats *stats = &self->ctx->stats;
+    PyObject *list = PyList_New((Py_ssize_t) stats->count);
+    for (size_t i = 0; list && i < stats->count; i++) {
+        const ShellStatsEntry *entry = stats_get(stats, i);
+        PyObject *item = usage_to_dict(&entry->usage);
+        PyObject *command = item ? PyUnicode_DecodeUTF8(entry->command, strlen(entry->command), "replace") : NULL;
+        PyObject *exit_code = command ? PyLong_FromLong(entry->exit_code) : NULL;
+        PyObject *stages = exit_code ? PyLong_FromLong(entry->num_stages) : NULL;
+        bool ok = stages && PyDict_SetItemString(item, "command", command) == 0
+                  && PyDict_SetItemString(item, "exit_code", exit_code) == 0
+                  && PyDict_SetItemString(item, "stages", stages) == 0;
+        Py_XDECREF(command);
+        Py_XDECREF(exit_code);
+        Py_XDECREF(stages);
+        if (!ok) {
+            Py_XDECREF(item);
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, item);
     }
-    free(argv);
+    shell_unlock(self);
+    return list;
 }
 
 /*
- * Python method: shell.execute(argv_list)
- * Executes a single shell command given a list of arguments.
+ * Python method: shell.clear_stats()
+ * Empties the stats table, keeping its size
  */
 static PyObject *
-Shell_execute(ShellObject *self, PyObject *args)
+Shell_clear_stats(ShellObject *self, PyObject *Py_UNUSED(ignored))
 {
-    PyObject *py_argv_list;
-    // Parse argument as a Python list object
-    if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &py_argv_list))
-        return NULL; // Error message already set by PyArg_ParseTuple
+    shell_lock(self);
+    stats_clear(&self->ctx->stats);
+    shell_unlock(self);
+    Py_RETURN_NONE;
+}
 
-    // Convert Python list to C argv
-    char **argv = py_list_to_argv(py_argv_list);
-    if (!argv) {
-        return NULL; // Error message set by py_list_to_argv
-    }
+/*
+ * Python method: shell.trace_events(clear=False)
+ * Events recorded while tracing is on, oldest first: dicts with "ns"
+ * (monotonic), "event" ("stage_start", "spawn", "exec_failed",
+ * "stderr_read", "stage_exit" or "reap"), "run", "stage", "pid" and
+ * "value" (see core/trace.h). The ring is process-wide, so runs of every
+ * Shell are in it; clear=True empties it afterwards.
+ */
+static PyObject *
+Shell_trace_events(ShellObject *self, PyObject *args, PyObject *kwds)
+{
+    static char *kwlist[] = {"clear", NULL};
+    int clear = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|p", kwlist, &clear))
+        return NULL;
 
-    // Call our C implementation with the parsed argv
-    int result = shell_execute(self->ctx, argv);
+    TraceEvent *events = malloc(TRACE_CAPACITY * sizeof(TraceEvent));
+    if (!events)
+        return PyErr_NoMemory();
+    size_t n = trace_snapshot(events, TRACE_CAPACITY, NULL);
+    if (clear)
+        trace_clear();
 
-    // Free the argv array and its contents
-    free_argv(argv);
+    PyObject *list = PyList_New((Py_ssize_t) n);
+    for (size_t i = 0; list && i < n; i++) {
+        const TraceEvent *e = &events[i];
+        const char *name = trace_type_name(e->type);
+        PyObject *item = Py_BuildValue("{s:L,s:s,s:k,s:i,s:i,s:L}", "ns", (long long) e->ns,
+                                       "event", name ? name : "unknown", "run", (unsigned long) e->run,
+                                       "stage", (int) e->stage, "pid", (int) e->pid,
+                                       "value", (long long) e->value);
+        if (!item) {
+            Py_CLEAR(list);
+            break;
+        }
+        PyList_SET_ITEM(list, (Py_ssize_t) i, item);
+    }
+    free(events);
+    return list;
+}
 
-    // Get error message if command failed
-    const char *error = shell_get_error(self->ctx);
-    if (result != 0 && error != NULL) {
-        // Return tuple (exit_code, error_message)
-        return Py_BuildValue("(is)", result, error);
+/*
+ * Python method: shell.get_cwd()
+ * Gets current working directory
+ * No arguments, returns Python string (interned, and the same object
+ * until the directory changes)
+ */
+static PyObject *
+Shell_get_cwd(ShellObject *self, PyObject *Py_UNUSED(ignored))
+{
+    shell_read_lock(self);
+    // The same object until the next cd: prompts call this on every redraw
+    if (!self->cwd || self->cwd_generation != self->ctx->cwd_generation) {
+        PyObject *cwd = PyUnicode_FromString(self->ctx->cwd);
+        if (!cwd) {
+            shell_unlock(self);
+            return NULL;
+        }
+        PyUnicode_InternInPlace(&cwd);
+        Py_XSETREF(self->cwd, cwd);
+        self->cwd_generation = self->ctx->cwd_generation;
     }
+    shell_unlock(self);
+    Py_INCREF(self->cwd);
+    return self->cwd;
+}
 
-    // Return just exit code if no error
-    return Py_BuildValue("(iO)", result, Py_None);
+/*
+ * Python attribute: shell.cwd_generation
+ * Changes whenever the working directory does (cd), so callers can cache
+ * whatever they derive from get_cwd()
+ */
+static PyObject *
+Shell_get_cwd_generation(ShellObject *self, void *closure)
+{
+    shell_read_lock(self);
+    uint64_t generation = self->ctx->cwd_generation;
+    shell_unlock(self);
+    return PyLong_FromUnsignedLongLong(generation);
 }
 
 /*
- * Python method: shell.execute_pipeline([ [cmd1_arg0, cmd1_arg1], [cmd2_arg0], ... ])
- * Executes a pipeline of shell commands, taking lists of arguments for each.
+ * Python attribute: shell.last_exit_code
+ * Exit code of the last command run in the foreground ($?)
  */
 static PyObject *
-Shell_execute_pipeline(ShellObject *self, PyObject *args)
+Shell_get_last_exit_code(ShellObject *self, void *closure)
 {
-    PyObject *py_pipeline_list;
-    // Parse argument as a Python list object
-    if (!PyArg_ParseTuple(args, "O!", &PyList_Type, &py_pipeline_list))
-        return NULL;
+    shell_read_lock(self);
+    int code = self->ctx->last_exit_code;
+    shell_unlock(self);
+    return PyLong_FromLong(code);
+}
 
-    Py_ssize_t num_commands = PyList_Size(py_pipeline_list);
-    if (num_commands == 0) {
-        return Py_BuildValue("(iO)", 0, Py_None); // Empty pipeline is success (like shell)
-    }
+/*
+ * Python attribute: shell.spawn_engine
+ * "fork" (fork + execvp), "posix_spawn" (posix_spawnp, vfork-style) or
+ * "server" (a helper process forks; started the first time it is chosen).
+ * Switchable at any time so the launch paths can be A/B tested.
+ */
+static const char *spawn_engine_names[] = {
+    [SHELL_SPAWN_FORK] = "fork",
+    [SHELL_SPAWN_POSIX] = "posix_spawn",
+    [SHELL_SPAWN_SERVER] = "server",
+};
 
-    // Allocate the array of argv arrays (char***)
-    // Need space for num_commands pointers to (char**)
-    char ***pipeline_argv = malloc(sizeof(char**) * num_commands);
-    if (!pipeline_argv) {
-        PyErr_NoMemory();
-        return NULL;
+/*
+ * Start the spawn server helper, installed next to this extension module.
+ * Returns 0, or -1 with OSError set.
+ */
+static int
+start_spawn_server(ShellObject *self)
+{
+    Dl_info info;
+    char helper[PATH_MAX];
+    if (!dladdr((void *) &start_spawn_server, &info) || !info.dli_fname) {
+        PyErr_SetString(PyExc_OSError, "cannot locate the core module to find " SPAWN_SERVER_NAME);
+        return -1;
     }
-    // Initialize all pointers to NULL in case of early exit during allocation
-    for(Py_ssize_t k=0; k < num_commands; ++k) {
-        pipeline_argv[k] = NULL;
-    }
-
-    // Convert each inner list
-    Py_ssize_t i;
-    for (i = 0; i < num_commands; i++) {
-        PyObject *py_inner_list = PyList_GetItem(py_pipeline_list, i);
-        // Check if the inner item is actually a list before converting
-        if (!PyList_Check(py_inner_list)) {
-             PyErr_SetString(PyExc_TypeError, "Pipeline argument must be a list of lists of strings");
-             // Cleanup already allocated inner lists
-             for (Py_ssize_t j = 0; j < i; j++) {
-                 free_argv(pipeline_argv[j]);
-             }
-             free(pipeline_argv);
-             return NULL;
-        }
-        pipeline_argv[i] = py_list_to_argv(py_inner_list); // Reuse helper
-        if (!pipeline_argv[i]) {
-            // Error occurred in conversion, cleanup previously converted lists
-            // Note: pipeline_argv[i] is already NULL from py_list_to_argv failure
-            for (Py_ssize_t j = 0; j < num_commands; j++) { // Free all up to num_commands
-                 if(pipeline_argv[j]) free_argv(pipeline_argv[j]);
-            }
-            free(pipeline_argv);
-            return NULL; // Error already set by py_list_to_argv
-        }
+    const char *slash = strrchr(info.dli_fname, '/');
+    int dir_len = slash ? (int) (slash - info.dli_fname + 1) : 0;
+    snprintf(helper, sizeof(helper), "%.*s%s", dir_len, info.dli_fname, SPAWN_SERVER_NAME);
+
+    shell_lock(self);
+    int result = spawn_server_start(&self->ctx->server, helper);
+    shell_unlock(self);
+    if (result < 0) {
+        PyErr_SetFromErrnoWithFilename(PyExc_OSError, helper);
+        return -1;
     }
+    return 0;
+}
 
-    // Call C implementation with the array of argv arrays
-    // Note: We cast away constness here, which is generally safe if the C
-    // function doesn't modify the strings, but technically invokes UB if it did.
-    // The C function signature uses `char *const *const *` for clarity.
-    int result = shell_execute_pipeline(self->ctx, (char *const *const *)pipeline_argv, num_commands);
+static PyObject *
+Shell_get_spawn_engine(ShellObject *self, void *closure)
+{
+    shell_read_lock(self);
+    ShellSpawnEngine engine = self->ctx->spawn_engine;
+    shell_unlock(self);
+    return PyUnicode_FromString(spawn_engine_names[engine]);
+}
 
-    // Free the allocated pipeline structure
-    for (i = 0; i < num_commands; i++) {
-        // Check pointer before freeing, in case of earlier error
-        if(pipeline_argv[i]) {
-           free_argv(pipeline_argv[i]);
+static int
+Shell_set_spawn_engine(ShellObject *self, PyObject *value, void *closure)
+{
+    if (value == NULL || !PyUnicode_Check(value)) {
+        PyErr_SetString(PyExc_TypeError, "spawn_engine must be a string");
+        return -1;
+    }
+    const char *name = PyUnicode_AsUTF8(value);
+    if (!name) return -1;
+    for (size_t i = 0; i < sizeof(spawn_engine_names) / sizeof(spawn_engine_names[0]); i++) {
+        if (strcmp(name, spawn_engine_names[i]) == 0) {
+            if (i == SHELL_SPAWN_SERVER && start_spawn_server(self) < 0) return -1;
+            // shell_spawn() reads it under the lock, mid-launch on another thread
+            shell_lock(self);
+            self->ctx->spawn_engine = (ShellSpawnEngine) i;
+            shell_unlock(self);
+            return 0;
         }
     }
-    free(pipeline_argv);
+    PyErr_Format(PyExc_ValueError, "unknown spawn engine '%s' (expected 'fork', 'posix_spawn' or 'server')",
+                 name);
+    return -1;
+}
 
-    // Get error message if pipeline failed
-    const char *error = shell_get_error(self->ctx);
-    if (result != 0 && error != NULL) {
-        // Return tuple (exit_code, error_message)
-        return Py_BuildValue("(is)", result, error);
+/*
+ * Python attribute: shell.spawn_server_pid
+ * Pid of the spawn server helper, None while it isn't running
+ */
+static PyObject *
+Shell_get_spawn_server_pid(ShellObject *self, void *closure)
+{
+    shell_read_lock(self);
+    ShellSpawnServer *server = &self->ctx->server;
+    pthread_mutex_lock(&server->lock);
+    pid_t pid = server->lost ? 0 : server->pid;
+    pthread_mutex_unlock(&server->lock);
+    shell_unlock(self);
+    if (pid == 0)
+        Py_RETURN_NONE;
+    return PyLong_FromLong((long) pid);
+}
+
+/*
+ * Python attribute: shell.stderr_tail_size
+ * How many bytes of a command's stderr are kept for the error message.
+ * stderr is always read to EOF; only the most recent bytes are retained.
+ */
+static PyObject *
+Shell_get_stderr_tail_size(ShellObject *self, void *closure)
+{
+    return PyLong_FromSize_t(self->ctx->stderr_tail_size);
+}
+
+static int
+Shell_set_stderr_tail_size(ShellObject *self, PyObject *value, void *closure)
+{
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete stderr_tail_size");
+        return -1;
     }
-    // Return just exit code if no error
-    return Py_BuildValue("(iO)", result, Py_None);
+    size_t size = PyLong_AsSize_t(value);
+    if (size == (size_t) -1 && PyErr_Occurred()) return -1;
+    if (size == 0) {
+        PyErr_SetString(PyExc_ValueError, "stderr_tail_size must be positive");
+        return -1;
+    }
+    shell_lock(self);
+    self->ctx->stderr_tail_size = size;
+    shell_unlock(self);
+    return 0;
 }
 
 /*
- * Python method: shell.cd(path)
- * Changes current directory
- * Converts Python string path → C string, updates shell context
+ * Python attribute: shell.pipe_size
+ * Buffer size asked for on the pipes between pipeline stages (0, the
+ * default, keeps the kernel's 64 KB). Throughput mode for data-heavy
+ * pipelines: fewer stalls and context switches per MB moved.
  */
 static PyObject *
-Shell_cd(ShellObject *self, PyObject *args)
+Shell_get_pipe_size(ShellObject *self, void *closure)
 {
-    const char *path;
-    if (!PyArg_ParseTuple(args, "s", &path))
-        return NULL;
+    return PyLong_FromSize_t(self->ctx->pipe_size);
+}
 
-    int result = shell_cd(self->ctx, path);
-    return PyLong_FromLong(result);
+static int
+Shell_set_pipe_size(ShellObject *self, PyObject *value, void *closure)
+{
+    if (value == NULL) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete pipe_size");
+        return -1;
+    }
+    size_t size = PyLong_AsSize_t(value);
+    if (size == (size_t) -1 && PyErr_Occurred()) return -1;
+    shell_lock(self);
+    self->ctx->pipe_size = size;
+    shell_unlock(self);
+    return 0;
 }
 
 /*
- * Python method: shell.getenv(name)
- * Gets environment variable value
- * Returns None if variable doesn't exist
+ * Python attribute: shell.stats_size
+ * How many recent runs stats() keeps (0, the default, records nothing).
+ * Setting it empties the table.
  */
 static PyObject *
-Shell_getenv(ShellObject *self, PyObject *args)
+Shell_get_stats_size(ShellObject *self, void *closure)
 {
-    const char *name;
-    if (!PyArg_ParseTuple(args, "s", &name))
-        return NULL;
+    return PyLong_FromSize_t(self->ctx->stats.cap);
+}
 
-    const char *value = shell_getenv(self->ctx, name);
+static int
+Shell_set_stats_size(ShellObject *self, PyObject *value, void *closure)
+{
     if (value == NULL) {
-        Py_RETURN_NONE;  // Python's None if variable not found
+        PyErr_SetString(PyExc_TypeError, "cannot delete stats_size");
+        return -1;
+    }
+    size_t size = PyLong_AsSize_t(value);
+    if (size == (size_t) -1 && PyErr_Occurred()) return -1;
+    shell_lock(self);
+    int ret = stats_resize(&self->ctx->stats, size);
+    shell_unlock(self);
+    if (ret < 0) {
+        PyErr_NoMemory();
+        return -1;
     }
-    return PyUnicode_FromString(value);  // Convert C string to Python string
+    return 0;
 }
 
 /*
- * Python method: shell.setenv(name, value)
- * Sets environment variable
- * Takes two Python strings, converts to C strings
+ * Attribute table for configuration knobs on the Shell object
+ */
+/*
+ * Python attribute: shell.argv_arena_mallocs (read-only)
+ * Blocks the argv arena has taken from malloc so far. It levels off once
+ * the arena is warm, which is what benchmarks check.
  */
 static PyObject *
-Shell_setenv(ShellObject *self, PyObject *args)
+Shell_get_argv_arena_mallocs(ShellObject *self, void *closure)
 {
-    const char *name;
-    const char *value;
-    // "ss" format means parse two strings
-    if (!PyArg_ParseTuple(args, "ss", &name, &value))
-        return NULL;
+    shell_read_lock(self);
+    size_t mallocs = self->argv_arena.mallocs;
+    shell_unlock(self);
+    return PyLong_FromSize_t(mallocs);
+}
 
-    int result = shell_setenv(self->ctx, name, value);
-    return PyLong_FromLong(result);
+/*
+ * Python attribute: shell.tracing
+ * Whether trace points record into the event ring (process-wide, off by
+ * default; see trace_events())
+ */
+static PyObject *
+Shell_get_tracing(ShellObject *self, void *closure)
+{
+    return PyBool_FromLong(atomic_load(&trace_on));
+}
+
+static int
+Shell_set_tracing(ShellObject *self, PyObject *value, void *closure)
+{
+    if (!value) {
+        PyErr_SetString(PyExc_TypeError, "cannot delete tracing");
+        return -1;
+    }
+    int on = PyObject_IsTrue(value);
+    if (on < 0)
+        return -1;
+    trace_enable(on);
+    return 0;
 }
 
 /*
- * Python method: shell.get_cwd()
- * Gets current working directory
- * No arguments, returns Python string
+ * Python attribute: shell.pipestatus
+ * Exit code of every stage of the last command or pipeline, like bash's
+ * PIPESTATUS (-1 for a stage killed by a signal)
  */
 static PyObject *
-Shell_get_cwd(ShellObject *self, PyObject *Py_UNUSED(ignored))
+Shell_get_pipestatus(ShellObject *self, void *closure)
+{
+    shell_read_lock(self);
+    PyObject *codes = PyTuple_New(self->ctx->num_last_stages);
+    for (int i = 0; codes && i < self->ctx->num_last_stages; i++) {
+        PyObject *code = PyLong_FromLong(self->ctx->last_stages[i].exit_code);
+        if (!code) {
+            Py_CLEAR(codes);
+            break;
+        }
+        PyTuple_SET_ITEM(codes, i, code);
+    }
+    shell_unlock(self);
+    return codes;
+}
+
+/*
+ * Python attribute: shell.last_job
+ * Id of the most recently started background job, None if there was none
+ */
+static PyObject *
+Shell_get_last_job(ShellObject *self, void *closure)
 {
-    return PyUnicode_FromString(self->ctx->cwd);
+    shell_read_lock(self);
+    int id = self->ctx->last_job;
+    shell_unlock(self);
+    if (id == 0)
+        Py_RETURN_NONE;
+    return PyLong_FromLong(id);
 }
 
+static PyGetSetDef Shell_getset[] = {
+    {"spawn_engine", (getter) Shell_get_spawn_engine, (setter) Shell_set_spawn_engine,
+     "Process launch engine: 'fork', 'posix_spawn' or 'server'", NULL},
+    {"spawn_server_pid", (getter) Shell_get_spawn_server_pid, NULL,
+     "Pid of the spawn server helper (None unless the 'server' engine started it)", NULL},
+    {"stderr_tail_size", (getter) Shell_get_stderr_tail_size, (setter) Shell_set_stderr_tail_size,
+     "Bytes of stderr kept per stage (the most recent ones)", NULL},
+    {"pipe_size", (getter) Shell_get_pipe_size, (setter) Shell_set_pipe_size,
+     "Buffer size of the pipes between pipeline stages (0 = kernel default)", NULL},
+    {"argv_arena_mallocs", (getter) Shell_get_argv_arena_mallocs, NULL,
+     "Blocks the argv arena has malloc'd (levels off once warm)", NULL},
+    {"pipestatus", (getter) Shell_get_pipestatus, NULL,
+     "Exit code of each stage of the last run (like bash's PIPESTATUS)", NULL},
+    {"last_job", (getter) Shell_get_last_job, NULL,
+     "Id of the most recently started background job", NULL},
+    {"cwd_generation", (getter) Shell_get_cwd_generation, NULL,
+     "Counter bumped by every change of directory", NULL},
+    {"last_exit_code", (getter) Shell_get_last_exit_code, NULL,
+     "Exit code of the last foreground command", NULL},
+    {"tracing", (getter) Shell_get_tracing, (setter) Shell_set_tracing,
+     "Record spawn/exit/reap events for trace_events() (process-wide)", NULL},
+    {"stats_size", (getter) Shell_get_stats_size, (setter) Shell_set_stats_size,
+     "Number of recent runs stats() keeps (0 disables recording)", NULL},
+    {NULL}  /* Sentinel */
+};
+
 /*
  * Method table mapping Python method names to C functions
  * Each entry specifies:
@@ -299,16 +3175,64 @@ Shell_get_cwd(ShellObject *self, PyObject *Py_UNUSED(ignored))
  * - Method documentation
  */
 static PyMethodDef Shell_methods[] = {
-    {"execute", (PyCFunction) Shell_execute, METH_VARARGS,
+    {"execute", (PyCFunction)(void(*)(void)) Shell_execute, METH_FASTCALL | METH_KEYWORDS,
      "Execute a shell command given a list of arguments"},
-    {"execute_pipeline", (PyCFunction) Shell_execute_pipeline, METH_VARARGS,
+    {"execute_pipeline", (PyCFunction)(void(*)(void)) Shell_execute_pipeline, METH_FASTCALL | METH_KEYWORDS,
      "Execute a pipeline of commands given list of lists of arguments"},
+    {"execute_async", (PyCFunction)(void(*)(void)) Shell_execute_async, METH_FASTCALL | METH_KEYWORDS,
+     "Start a command and return an awaitable for its (exit_code, error)"},
+    {"execute_pipeline_async", (PyCFunction)(void(*)(void)) Shell_execute_pipeline_async, METH_FASTCALL | METH_KEYWORDS,
+     "Start a pipeline and return an awaitable for its (exit_code, error)"},
+    {"execute_line", (PyCFunction)(void(*)(void)) Shell_execute_line, METH_FASTCALL | METH_KEYWORDS,
+     "Parse, glob-expand and run a command line"},
+    {"execute_line_async", (PyCFunction)(void(*)(void)) Shell_execute_line_async, METH_FASTCALL | METH_KEYWORDS,
+     "Start a command line and return an awaitable for its (exit_code, error)"},
+    {"execute_many", (PyCFunction)(void(*)(void)) Shell_execute_many, METH_VARARGS | METH_KEYWORDS,
+     "Run many commands, up to max_parallel at a time; results in input order"},
+    {"start_job", (PyCFunction)(void(*)(void)) Shell_start_job, METH_VARARGS | METH_KEYWORDS,
+     "Start a pipeline as a background job and return its id"},
+    {"jobs", (PyCFunction) Shell_jobs, METH_NOARGS,
+     "List background jobs"},
+    {"reap_jobs", (PyCFunction) Shell_reap_jobs, METH_NOARGS,
+     "Return (and forget) the jobs that have finished"},
+    {"jobs_fd", (PyCFunction) Shell_jobs_fd, METH_NOARGS,
+     "fd that becomes readable when a job process exits"},
+    {"wait_job", (PyCFunction) Shell_wait_job, METH_VARARGS,
+     "Wait for a job in the foreground"},
+    {"wait_job_async", (PyCFunction) Shell_wait_job_async, METH_VARARGS,
+     "Return an awaitable for a job's (exit_code, error)"},
+    {"kill_job", (PyCFunction) Shell_kill_job, METH_VARARGS,
+     "Send a signal to a job's processes"},
     {"cd", (PyCFunction) Shell_cd, METH_VARARGS,
      "Change current directory"},
     {"getenv", (PyCFunction) Shell_getenv, METH_VARARGS,
      "Get environment variable"},
     {"setenv", (PyCFunction) Shell_setenv, METH_VARARGS,
      "Set environment variable"},
+    {"unsetenv", (PyCFunction) Shell_unsetenv, METH_VARARGS,
+     "Remove environment variable"},
+    {"which", (PyCFunction) Shell_which, METH_VARARGS,
+     "Resolve a command name to the absolute path it runs from"},
+    {"path_commands", (PyCFunction) Shell_path_commands, METH_NOARGS,
+     "List every executable in PATH (sorted)"},
+    {"command_index", (PyCFunction)(void(*)(void)) Shell_command_index, METH_VARARGS | METH_KEYWORDS,
+     "Prefix index of every executable in PATH, plus extra names"},
+    {"rehash", (PyCFunction) Shell_rehash, METH_NOARGS,
+     "Forget cached command locations"},
+    {"snapshot", (PyCFunction) Shell_snapshot, METH_NOARGS,
+     "Independent copy of the shell's cwd and environment"},
+    {"glob", (PyCFunction) Shell_glob, METH_VARARGS,
+     "Expand a wildcard pattern to a sorted list of paths"},
+    {"glob_cache_info", (PyCFunction) Shell_glob_cache_info, METH_NOARGS,
+     "Hit/miss counters of the directory listing cache"},
+    {"last_stages", (PyCFunction) Shell_last_stages, METH_NOARGS,
+     "Exit code, signal and stderr tail of each stage of the last run"},
+    {"stats", (PyCFunction) Shell_stats, METH_NOARGS,
+     "Resource usage of recent runs, oldest first (see stats_size)"},
+    {"trace_events", (PyCFunction)(void(*)(void)) Shell_trace_events, METH_VARARGS | METH_KEYWORDS,
+     "Events recorded while tracing is on, oldest first"},
+    {"clear_stats", (PyCFunction) Shell_clear_stats, METH_NOARGS,
+     "Forget the runs recorded for stats()"},
     {"get_cwd", (PyCFunction) Shell_get_cwd, METH_NOARGS,
      "Get current working directory"},
     {NULL}  /* Sentinel marking end of method list */
@@ -328,6 +3252,166 @@ static PyTypeObject ShellType = {
     .tp_new = Shell_new,           // Constructor
     .tp_dealloc = (destructor) Shell_dealloc,  // Destructor
     .tp_methods = Shell_methods,    // Method table
+    .tp_getset = Shell_getset,      // Attribute table
+};
+
+#define PARSE_ARENA_BLOCK 8192 // Holds any ordinary command line in one block
+
+/*
+ * Convert one parsed command to (argv, globs, redirects).
+ * globs is None unless some word has wildcards; then it is a list parallel
+ * to argv holding the pattern (or None for literal words).
+ * redirects is a list of (fd, op, target) with op one of "<", ">", ">>", ">&";
+ * target is a file name, or the fd being copied for ">&".
+ */
+static PyObject *
+command_to_tuple(const ShellCommand *cmd)
+{
+    static const char *redir_ops[] = {
+        [SHELL_REDIR_READ] = "<",
+        [SHELL_REDIR_WRITE] = ">",
+        [SHELL_REDIR_APPEND] = ">>",
+        [SHELL_REDIR_DUP] = ">&",
+    };
+    PyObject *argv = PyList_New(cmd->argc);
+    PyObject *globs = cmd->globs ? PyList_New(cmd->argc) : (Py_INCREF(Py_None), Py_None);
+    PyObject *redirs = PyList_New(cmd->num_redirs);
+    if (!argv || !globs || !redirs)
+        goto error;
+
+    for (int i = 0; i < cmd->argc; i++) {
+        PyObject *arg = PyUnicode_DecodeFSDefault(cmd->argv[i]);
+        if (!arg)
+            goto error;
+        PyList_SET_ITEM(argv, i, arg);
+        if (cmd->globs) {
+            PyObject *pattern = cmd->globs[i] ? PyUnicode_DecodeFSDefault(cmd->globs[i])
+                                              : (Py_INCREF(Py_None), Py_None);
+            if (!pattern)
+                goto error;
+            PyList_SET_ITEM(globs, i, pattern);
+        }
+    }
+    for (int i = 0; i < cmd->num_redirs; i++) {
+        const ShellRedir *r = &cmd->redirs[i];
+        PyObject *item = r->kind == SHELL_REDIR_DUP
+            ? Py_BuildValue("(isi)", r->fd, redir_ops[r->kind], r->dup_fd)
+            : Py_BuildValue("(isO&)", r->fd, redir_ops[r->kind], PyUnicode_DecodeFSDefault, r->target);
+        if (!item)
+            goto error;
+        PyList_SET_ITEM(redirs, i, item);
+    }
+    return Py_BuildValue("(NNN)", argv, globs, redirs);
+
+error:
+    Py_XDECREF(argv);
+    Py_XDECREF(globs);
+    Py_XDECREF(redirs);
+    return NULL;
+}
+
+/* Raise the exception matching a failed shell_parse() */
+static PyObject *
+parse_error(const ShellPipeline *pipeline)
+{
+    if (strcmp(pipeline->error, "out of memory") == 0)
+        return PyErr_NoMemory();
+    return PyErr_Format(PyExc_ValueError, "%s (at position %zu)", pipeline->error, pipeline->error_pos);
+}
+
+/*
+ * Python function: core.parse(line)
+ * Parses a command line with the native parser.
+ * Returns (stages, background): stages is a list of (argv, globs, redirects)
+ * tuples, one per pipeline stage, and background is True for a trailing '&'.
+ * Raises ValueError on a syntax error (unterminated quote, missing command...).
+ */
+static PyObject *
+core_parse(PyObject *Py_UNUSED(module), PyObject *arg)
+{
+    const char *line = PyUnicode_AsUTF8(arg);
+    if (!line)
+        return NULL;
+
+    ShellArena arena;
+    ShellPipeline pipeline;
+    arena_init(&arena, PARSE_ARENA_BLOCK);
+    if (shell_parse(&arena, line, &pipeline) < 0) {
+        parse_error(&pipeline);
+        arena_free(&arena);
+        return NULL;
+    }
+
+    PyObject *stages = PyList_New(pipeline.num_commands);
+    for (int i = 0; stages && i < pipeline.num_commands; i++) {
+        PyObject *stage = command_to_tuple(&pipeline.commands[i]);
+        if (!stage) {
+            Py_CLEAR(stages);
+            break;
+        }
+        PyList_SET_ITEM(stages, i, stage);
+    }
+    arena_free(&arena);
+    if (!stages)
+        return NULL;
+    return Py_BuildValue("(NO)", stages, pipeline.background ? Py_True : Py_False);
+}
+
+/*
+ * Python function: core.bench_parse(line, iterations=100000)
+ * Parses line repeatedly with one reused arena, GIL released, and reports
+ * {"ns_per_line", "mallocs_per_line", "bytes_per_line"}. This measures the
+ * native parser alone, without building any Python objects.
+ */
+static PyObject *
+core_bench_parse(PyObject *Py_UNUSED(module), PyObject *args)
+{
+    const char *line;
+    Py_ssize_t iterations = 100000;
+    if (!PyArg_ParseTuple(args, "s|n", &line, &iterations))
+        return NULL;
+    if (iterations <= 0) {
+        PyErr_SetString(PyExc_ValueError, "iterations must be positive");
+        return NULL;
+    }
+
+    ShellArena arena;
+    ShellPipeline pipeline;
+    struct timespec start, end;
+    size_t bytes = 0;
+    int result = 0;
+    arena_init(&arena, PARSE_ARENA_BLOCK);
+
+    Py_BEGIN_ALLOW_THREADS
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (Py_ssize_t i = 0; i < iterations && result == 0; i++) {
+        arena_reset(&arena);
+        result = shell_parse(&arena, line, &pipeline);
+        bytes += arena.bytes;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    Py_END_ALLOW_THREADS
+
+    if (result < 0) {
+        parse_error(&pipeline);
+        arena_free(&arena);
+        return NULL;
+    }
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    PyObject *stats = Py_BuildValue("{s:d,s:d,s:d}",
+                                    "ns_per_line", ns / iterations,
+                                    "mallocs_per_line", (double) arena.mallocs / iterations,
+                                    "bytes_per_line", (double) bytes / iterations);
+    arena_free(&arena);
+    return stats;
+}
+
+static PyMethodDef core_methods[] = {
+    {"parse", (PyCFunction) core_parse, METH_O,
+     "Parse a command line into (stages, background)"},
+    {"bench_parse", (PyCFunction) core_bench_parse, METH_VARARGS,
+     "Time the native parser on a line"},
+    {NULL}  /* Sentinel */
 };
 
 /*
@@ -339,7 +3423,7 @@ static struct PyModuleDef moduledef = {
     "core",                   // Module name
     "Shell core module.",     // Module documentation
     -1,                      // Module keeps state in global variables
-    NULL                     // No module-level methods
+    core_methods             // Module-level functions
 };
 
 /*
@@ -352,9 +3436,21 @@ PyInit_core(void)
 {
     PyObject *m;
 
-    // Finalize the type object including inherited slots
+    // Finalize the type objects including inherited slots
     if (PyType_Ready(&ShellType) < 0)
         return NULL;
+    if (PyType_Ready(&RunType) < 0)
+        return NULL;
+    if (PyType_Ready(&OutputType) < 0)
+        return NULL;
+    if (PyType_Ready(&CommandResultType) < 0)
+        return NULL;
+    if (PyType_Ready(&ResponseCacheType) < 0)
+        return NULL;
+    if (PyType_Ready(&CommandIndexType) < 0)
+        return NULL;
+    if (PyType_Ready(&HistoryType) < 0)
+        return NULL;
 
     // Create the module
     m = PyModule_Create(&moduledef);
@@ -368,6 +3464,36 @@ PyInit_core(void)
         Py_DECREF(m);
         return NULL;
     }
+    Py_INCREF(&OutputType);
+    if (PyModule_AddObject(m, "Output", (PyObject *) &OutputType) < 0) {
+        Py_DECREF(&OutputType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&CommandResultType);
+    if (PyModule_AddObject(m, "CommandResult", (PyObject *) &CommandResultType) < 0) {
+        Py_DECREF(&CommandResultType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&ResponseCacheType);
+    if (PyModule_AddObject(m, "ResponseCache", (PyObject *) &ResponseCacheType) < 0) {
+        Py_DECREF(&ResponseCacheType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&CommandIndexType);
+    if (PyModule_AddObject(m, "CommandIndex", (PyObject *) &CommandIndexType) < 0) {
+        Py_DECREF(&CommandIndexType);
+        Py_DECREF(m);
+        return NULL;
+    }
+    Py_INCREF(&HistoryType);
+    if (PyModule_AddObject(m, "History", (PyObject *) &HistoryType) < 0) {
+        Py_DECREF(&HistoryType);
+        Py_DECREF(m);
+        return NULL;
+    }
 
     return m;
 } 
\ No newline at end of file
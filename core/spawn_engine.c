@@ -0,0 +1,229 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <spawn.h>
+#include "spawn_engine.h"
+
+extern char **environ;
+
+// posix_spawn can start the child in a directory fd of ours (a snapshot's
+// cwd) from glibc 2.29 on; before that such children are forked
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 29))
+#define HAVE_SPAWN_FCHDIR 1
+#endif
+
+void spawn_plan_dup(SpawnPlan *plan, int src_fd, int target_fd) {
+    if (src_fd < 0 || src_fd == target_fd || plan->num_dups >= SPAWN_MAX_DUPS) return;
+    plan->dups[plan->num_dups].src_fd = src_fd;
+    plan->dups[plan->num_dups].target_fd = target_fd;
+    plan->num_dups++;
+}
+
+void spawn_plan_redirect(SpawnPlan *plan, const ShellRedirList *redirs, const int *fds) {
+    for (int j = 0; redirs && j < redirs->num_redirs; j++) {
+        const ShellRedir *r = &redirs->redirs[j];
+        spawn_plan_dup(plan, r->kind == SHELL_REDIR_DUP ? r->dup_fd : fds[j], r->fd);
+    }
+}
+
+// Python ignores these, and ignored dispositions survive exec. Children
+// should start with the defaults, like they would under a regular shell.
+static void default_child_signals(sigset_t *set) {
+    sigemptyset(set);
+    sigaddset(set, SIGPIPE);
+    sigaddset(set, SIGXFSZ);
+}
+
+// Report an exec failure the same way the fork engine's child does
+static void write_exec_error(int fd, const char *cmd, int err) {
+    char error_buf[MAX_ERROR_LEN];
+    int len = snprintf(error_buf, sizeof(error_buf), "%s: %s", cmd, strerror(err));
+    if (len > 0) {
+        ssize_t ignored = write(fd, error_buf, (size_t)len < sizeof(error_buf) ? (size_t)len : sizeof(error_buf) - 1);
+        (void)ignored;
+    }
+}
+
+// --- fork() + execvpe() engine ---
+// Copies the parent's page tables, so cost grows with the host process size.
+static pid_t spawn_fork(const SpawnPlan *plan, int cwd_fd) {
+    pid_t pid = fork();
+    if (pid != 0) return pid; // Parent (or fork failure, -1)
+
+    // --- Child Process ---
+    // Also done by the parent (shell_spawn), whichever runs first
+    if (plan->set_pgid) setpgid(0, plan->pgid);
+
+    sigset_t defaults, empty;
+    default_child_signals(&defaults);
+    for (int sig = 1; sig < NSIG; sig++) {
+        if (sigismember(&defaults, sig) == 1) signal(sig, SIG_DFL);
+    }
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    // Before the dups, which may reuse cwd_fd's number
+    if (cwd_fd >= 0 && fchdir(cwd_fd) == -1) {
+        perror("fchdir");
+        _exit(1);
+    }
+    for (int i = 0; i < plan->num_dups; i++) {
+        if (dup2(plan->dups[i].src_fd, plan->dups[i].target_fd) == -1) {
+            perror("dup2");
+            _exit(1);
+        }
+    }
+    for (int i = 0; i < plan->num_close; i++) {
+        if (plan->close_fds[i] > STDERR_FILENO) close(plan->close_fds[i]);
+    }
+    // After the dups, so failures are reported on the command's stderr
+    const char *what;
+    if (plan->limits && limits_apply(plan->limits, &what) < 0) {
+        perror(what);
+        _exit(1);
+    }
+
+    char *const *envp = plan->envp ? plan->envp : environ;
+    if (plan->path) {
+        execve(plan->path, plan->argv, envp);
+        // Failed (a script without #!, or the file is gone since it was cached): search PATH
+    }
+    // Point environ at the child's env too, so the PATH search sees the same PATH
+    environ = (char **) envp;
+    execvpe(plan->argv[0], plan->argv, envp);
+
+    // If execvpe returns, it failed. stderr is already the right fd here.
+    write_exec_error(STDERR_FILENO, plan->argv[0], errno);
+    _exit(127);
+}
+
+// --- posix_spawnp() engine ---
+// glibc implements this with clone(CLONE_VM|CLONE_VFORK), so the parent's
+// address space is shared rather than copied and launch latency stays flat
+// as the Python process grows.
+static pid_t spawn_posix(const SpawnPlan *plan, int cwd_fd) {
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t defaults, empty;
+    pid_t pid = -1;
+    int err;
+
+    if ((err = posix_spawn_file_actions_init(&actions)) != 0) { errno = err; return -1; }
+    if ((err = posix_spawnattr_init(&attr)) != 0) {
+        posix_spawn_file_actions_destroy(&actions);
+        errno = err;
+        return -1;
+    }
+
+    // Same fchdir-dup-close order as the fork engine's child
+#ifdef HAVE_SPAWN_FCHDIR
+    if (cwd_fd >= 0) err = posix_spawn_file_actions_addfchdir_np(&actions, cwd_fd);
+#endif
+    for (int i = 0; i < plan->num_dups && err == 0; i++) {
+        err = posix_spawn_file_actions_adddup2(&actions, plan->dups[i].src_fd, plan->dups[i].target_fd);
+    }
+    for (int i = 0; i < plan->num_close && err == 0; i++) {
+        if (plan->close_fds[i] > STDERR_FILENO) {
+            err = posix_spawn_file_actions_addclose(&actions, plan->close_fds[i]);
+        }
+    }
+
+    if (err == 0) {
+        default_child_signals(&defaults);
+        sigemptyset(&empty);
+        posix_spawnattr_setsigdefault(&attr, &defaults);
+        posix_spawnattr_setsigmask(&attr, &empty);
+        short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+        if (plan->set_pgid) {
+            posix_spawnattr_setpgroup(&attr, plan->pgid);
+            flags |= POSIX_SPAWN_SETPGROUP;
+        }
+        posix_spawnattr_setflags(&attr, flags);
+
+        char *const *envp = plan->envp ? plan->envp : environ;
+        if (plan->path) {
+            // Already resolved, skip the PATH walk
+            err = posix_spawn(&pid, plan->path, &actions, &attr, plan->argv, envp);
+        }
+        if (!plan->path || err == ENOEXEC || err == ENOENT) { // Same fallback as the fork engine
+            err = posix_spawnp(&pid, plan->argv[0], &actions, &attr, plan->argv, envp);
+        }
+    }
+
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+
+    if (err == 0) return pid;
+    if (err == EAGAIN || err == ENOMEM) { errno = err; return -1; } // Couldn't create the process
+
+    // posix_spawnp hands exec errors back to us instead of to the child's
+    // stderr, so write the message the fork engine's child would have written.
+    write_exec_error(plan->err_fd >= 0 ? plan->err_fd : STDERR_FILENO, plan->argv[0], err);
+    errno = err; // For the exec_failed trace point
+    return 0;
+}
+
+// --- Spawn server engine ---
+// The helper forks instead of us, so cost is that of a tiny process
+// whatever the size of ours. fds are passed over the socket, so the plan's
+// close list isn't needed: the child only gets 0-2 and the dup sources.
+static pid_t spawn_server(ShellContext *ctx, const SpawnPlan *plan, ShellStage *stage) {
+    int dups[2 * SPAWN_MAX_DUPS];
+    for (int i = 0; i < plan->num_dups; i++) {
+        dups[2 * i] = plan->dups[i].src_fd;
+        dups[2 * i + 1] = plan->dups[i].target_fd;
+    }
+    ServerLaunch launch = { .argv = plan->argv, .path = plan->path, .cwd = ctx->cwd, .dups = dups,
+                            .num_dups = plan->num_dups, .set_pgid = plan->set_pgid, .pgid = plan->pgid };
+    int pidfd;
+    pid_t pid = spawn_server_spawn(&ctx->server, &launch, plan->envp ? plan->envp : environ,
+                                   ctx->env.generation, &pidfd);
+    if (pid < 0) return -1;
+    if (stage) {
+        stage->pidfd = pidfd;
+        stage->server = &ctx->server;
+    } else if (pidfd >= 0) {
+        close(pidfd);
+    }
+    return pid;
+}
+
+pid_t shell_spawn(ShellContext *ctx, const SpawnPlan *plan, ShellStage *stage) {
+    if (!plan->argv || !plan->argv[0]) { errno = EINVAL; return -1; }
+
+    pid_t pid;
+    int cwd_fd = ctx->cwd_fd;
+    switch (plan->limits ? SHELL_SPAWN_FORK : ctx->spawn_engine) {
+    case SHELL_SPAWN_SERVER:
+        // Background jobs are reaped by process group (jobs.c), which only
+        // works for our own children; so are commands started before the
+        // helper is. A snapshot's cwd is an open fd, which the helper only
+        // knows by path, and the directory may since have been renamed.
+        if (stage && !plan->set_pgid && cwd_fd < 0 && ctx->server.sock >= 0 && !ctx->server.lost) {
+            pid = spawn_server(ctx, plan, stage);
+            if (pid >= 0 || !ctx->server.lost) break;
+            // The helper died under us: launch this one (and later ones) directly
+        }
+        // fall through
+    case SHELL_SPAWN_POSIX:
+#ifdef HAVE_SPAWN_FCHDIR
+        pid = spawn_posix(plan, cwd_fd);
+        break;
+#else
+        if (cwd_fd < 0) { pid = spawn_posix(plan, -1); break; }
+        // fall through: only a forked child can fchdir
+#endif
+    case SHELL_SPAWN_FORK:
+    default:
+        pid = spawn_fork(plan, cwd_fd);
+        // The child may not have run yet; set the group from here too so it
+        // is in place before anyone signals or waits for it
+        if (pid > 0 && plan->set_pgid) setpgid(pid, plan->pgid ? plan->pgid : pid);
+        break;
+    }
+    return pid;
+}
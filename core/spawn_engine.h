@@ -0,0 +1,52 @@
+#ifndef SPAWN_ENGINE_H
+#define SPAWN_ENGINE_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "shell.h"
+#include "redir.h"
+
+#define SPAWN_MAX_DUPS (3 + SHELL_MAX_REDIRS)  // stdin, stdout, stderr, then redirections
+
+// One dup2(src_fd, target_fd) to apply in the child before exec
+typedef struct {
+    int src_fd;
+    int target_fd;
+} SpawnDup;
+
+// Everything the child needs set up between process creation and exec.
+// Every spawn engine consumes the same plan so callers don't care which one runs.
+typedef struct {
+    char *const *argv;          // NULL-terminated argument vector
+    const char *path;           // Resolved program path, NULL means search PATH for argv[0]
+    char *const *envp;          // Environment for the child, NULL means environ
+    SpawnDup dups[SPAWN_MAX_DUPS];
+    int num_dups;
+    const int *close_fds;       // fds to close in the child after the dups
+    int num_close;
+    int err_fd;                 // Where exec failures are reported (the child's stderr)
+    bool set_pgid;              // Move the child into process group pgid before exec
+    pid_t pgid;                 // 0 = a new group led by the child
+    const ShellLimits *limits;  // Placement and limits to apply before exec, NULL = none
+} SpawnPlan;
+
+// Start a child process described by plan using ctx->spawn_engine, in
+// ctx's cwd (ctx->cwd_fd, for a snapshot; the process's own otherwise).
+// Plans with limits are always forked: only a child running our code can
+// apply them.
+// Returns the child's pid, 0 if the command could not be executed (the
+// "argv[0]: strerror" message has already been written to plan->err_fd and
+// the caller should treat the child as having exited with status 127),
+// or -1 if no process could be created at all (errno is set).
+// stage, if given, gets the pidfd and server of a child the spawn server
+// launched; those can only be reaped through the server.
+pid_t shell_spawn(ShellContext *ctx, const SpawnPlan *plan, ShellStage *stage);
+
+// Add a dup2 to a plan, skipping it when the fd is already in place
+void spawn_plan_dup(SpawnPlan *plan, int src_fd, int target_fd);
+
+// Add a command's redirections (fds from redir_open) after the pipe dups,
+// so they override them in the order they were written, as in bash
+void spawn_plan_redirect(SpawnPlan *plan, const ShellRedirList *redirs, const int *fds);
+
+#endif // SPAWN_ENGINE_H
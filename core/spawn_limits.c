@@ -0,0 +1,74 @@
+#define _GNU_SOURCE
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "spawn_limits.h"
+
+// Not every libc wraps these: call the kernel directly
+#define MPOL_MODE(policy) ((int) (policy) - 1)   // SHELL_NUMA_DEFAULT.. -> MPOL_DEFAULT..
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+// Move ourselves into the cgroup v2 group at dir: "0" in cgroup.procs means the writer
+static int join_cgroup(const char *dir, const char **what) {
+    static char procs[PATH_MAX]; // The child's own copy; keeps the message's path alive
+    size_t len = strlen(dir);
+    *what = procs;
+    if (len + sizeof("/cgroup.procs") > sizeof(procs)) {
+        *what = dir;
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    memcpy(procs, dir, len);
+    memcpy(procs + len, "/cgroup.procs", sizeof("/cgroup.procs"));
+    int fd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    ssize_t written = write(fd, "0", 1);
+    int err = errno;
+    close(fd);
+    errno = err;
+    return written == 1 ? 0 : -1;
+}
+
+static int set_rlimit(int resource, const ShellRlimit *r) {
+    return r->set ? setrlimit(resource, &r->limit) : 0;
+}
+
+int limits_apply(const ShellLimits *limits, const char **what) {
+    // The cgroup first, so whatever it limits covers the rest of startup too
+    if (limits->cgroup && join_cgroup(limits->cgroup, what) < 0) return -1;
+
+    if (limits->numa != SHELL_NUMA_NONE) {
+        bool nodes = limits->numa != SHELL_NUMA_DEFAULT && limits->numa != SHELL_NUMA_LOCAL;
+        // maxnode counts one past the last bit the kernel reads
+        if (syscall(SYS_set_mempolicy, MPOL_MODE(limits->numa), nodes ? limits->numa_nodes : NULL,
+                    nodes ? SHELL_MAX_NUMA_NODES + 1 : 0) < 0) {
+            *what = "set_mempolicy";
+            return -1;
+        }
+    }
+    if (limits->set_cpus && sched_setaffinity(0, sizeof(limits->cpus), &limits->cpus) < 0) {
+        *what = "sched_setaffinity";
+        return -1;
+    }
+    if (limits->set_nice && setpriority(PRIO_PROCESS, 0, limits->nice) < 0) {
+        *what = "setpriority";
+        return -1;
+    }
+    if (limits->set_ioprio) {
+        int level = limits->ioprio_class == SHELL_IOPRIO_IDLE ? 0 : limits->ioprio_level;
+        int value = ((int) limits->ioprio_class << IOPRIO_CLASS_SHIFT) | level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, value) < 0) {
+            *what = "ioprio_set";
+            return -1;
+        }
+    }
+    // Address space last: the limit may be too tight for anything but the exec
+    if (set_rlimit(RLIMIT_NOFILE, &limits->nofile) < 0) { *what = "setrlimit(RLIMIT_NOFILE)"; return -1; }
+    if (set_rlimit(RLIMIT_CPU, &limits->cpu) < 0) { *what = "setrlimit(RLIMIT_CPU)"; return -1; }
+    if (set_rlimit(RLIMIT_AS, &limits->as) < 0) { *what = "setrlimit(RLIMIT_AS)"; return -1; }
+    return 0;
+}
@@ -0,0 +1,56 @@
+#ifndef SPAWN_LIMITS_H
+#define SPAWN_LIMITS_H
+
+#include <stdbool.h>
+#include <sched.h>
+#include <sys/resource.h>
+
+#define SHELL_MAX_NUMA_NODES 1024  // Nodes a NUMA policy can name (like cpu_set_t's 1024 CPUs)
+
+// set_mempolicy() mode for a child; NONE leaves it with ours
+typedef enum {
+    SHELL_NUMA_NONE = 0,
+    SHELL_NUMA_DEFAULT,    // MPOL_DEFAULT: allocate on the node the thread runs on
+    SHELL_NUMA_PREFERRED,  // MPOL_PREFERRED: the first of nodes, falling back to others
+    SHELL_NUMA_BIND,       // MPOL_BIND: only nodes
+    SHELL_NUMA_INTERLEAVE, // MPOL_INTERLEAVE: round-robin over nodes
+    SHELL_NUMA_LOCAL,      // MPOL_LOCAL: the node of the CPU allocating
+} ShellNumaPolicy;
+
+// I/O scheduling classes (ioprio_set)
+typedef enum {
+    SHELL_IOPRIO_RT = 1,
+    SHELL_IOPRIO_BE = 2,
+    SHELL_IOPRIO_IDLE = 3,
+} ShellIoprioClass;
+
+typedef struct {
+    bool set;
+    struct rlimit limit;   // setrlimit() soft and hard values
+} ShellRlimit;
+
+// Placement and limits for one launched command, applied in the child
+// right before exec. Zeroed means "inherit the shell's" for every field.
+typedef struct ShellLimits {
+    bool set_cpus;
+    cpu_set_t cpus;        // sched_setaffinity() mask
+    ShellNumaPolicy numa;
+    unsigned long numa_nodes[SHELL_MAX_NUMA_NODES / (8 * sizeof(unsigned long))]; // Node bitmask
+    ShellRlimit as;        // RLIMIT_AS, bytes of address space
+    ShellRlimit cpu;       // RLIMIT_CPU, seconds of CPU time
+    ShellRlimit nofile;    // RLIMIT_NOFILE, open fds
+    bool set_nice;
+    int nice;              // Niceness (setpriority), not an increment
+    bool set_ioprio;
+    ShellIoprioClass ioprio_class;
+    int ioprio_level;      // 0 (highest) - 7 for the RT and BE classes
+    const char *cgroup;    // cgroup v2 directory to move the child into, NULL = ours
+} ShellLimits;
+
+// Apply limits to the calling process: the child, between fork and exec,
+// once its fds are in place (so a relative cgroup is found from its cwd).
+// Only async-signal-safe calls. Returns 0, or -1 with errno set and *what
+// naming the call that failed ("sched_setaffinity", a cgroup.procs path, ...).
+int limits_apply(const ShellLimits *limits, const char **what);
+
+#endif // SPAWN_LIMITS_H
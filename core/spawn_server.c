@@ -0,0 +1,378 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "spawn_server.h"
+
+extern char **environ;
+
+void spawn_server_init(ShellSpawnServer *server) {
+    memset(server, 0, sizeof(*server));
+    server->sock = -1;
+    server->spawned_pidfd = -1;
+    pthread_mutex_init(&server->lock, NULL);
+}
+
+// Forget a helper that is gone (or never started) so it can be replaced
+static void server_release(ShellSpawnServer *server) {
+    if (server->sock >= 0) close(server->sock);
+    server->sock = -1;
+    if (server->pid > 0) {
+        while (waitpid(server->pid, NULL, 0) < 0 && errno == EINTR) {}
+    }
+    server->pid = 0;
+    server->lost = false;
+    server->num_running = 0; // Their exits went with the helper
+    server->env_sent = false;
+    if (server->spawned_pidfd >= 0) close(server->spawned_pidfd);
+    server->spawned_pidfd = -1;
+}
+
+int spawn_server_start(ShellSpawnServer *server, const char *helper) {
+    pthread_mutex_lock(&server->lock);
+    if (server->sock >= 0 && !server->lost) {
+        pthread_mutex_unlock(&server->lock);
+        return 0;
+    }
+    server_release(server);
+
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+        pthread_mutex_unlock(&server->lock);
+        return -1;
+    }
+    // dup2 onto itself wouldn't clear close-on-exec, so never start out there
+    if (fds[1] == SPAWN_SERVER_FD) {
+        int moved = fcntl(fds[1], F_DUPFD_CLOEXEC, SPAWN_SERVER_FD + 1);
+        close(fds[1]);
+        fds[1] = moved;
+    }
+
+    // The helper only gets its end of the socket and /dev/null: it never
+    // holds our terminal, pipes or files open itself
+    posix_spawn_file_actions_t actions;
+    pid_t pid = 0;
+    int err = fds[1] < 0 ? errno : posix_spawn_file_actions_init(&actions);
+    if (err == 0) {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDWR, 0);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDOUT_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, STDIN_FILENO, STDERR_FILENO);
+        posix_spawn_file_actions_adddup2(&actions, fds[1], SPAWN_SERVER_FD);
+        char *argv[] = { SPAWN_SERVER_NAME, NULL };
+        err = posix_spawn(&pid, helper, &actions, NULL, argv, environ);
+        posix_spawn_file_actions_destroy(&actions);
+    }
+    if (fds[1] >= 0) close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        pthread_mutex_unlock(&server->lock);
+        errno = err;
+        return -1;
+    }
+
+    server->pid = pid;
+    server->sock = fds[0];
+    pthread_mutex_unlock(&server->lock);
+    return 0;
+}
+
+void spawn_server_free(ShellSpawnServer *server) {
+    server_release(server);
+    free(server->exits);
+    server->exits = NULL;
+    server->num_exits = server->exits_cap = 0;
+    pthread_mutex_destroy(&server->lock);
+}
+
+// --- Receiving ---
+
+static int server_lost(ShellSpawnServer *server) {
+    server->lost = true;
+    return -1;
+}
+
+static int recv_full(int sock, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(sock, (char *) buf + got, len - got, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += (size_t) n;
+    }
+    return 0;
+}
+
+// Make room for one more exit than there can be now, before a launch
+static int reserve_exit(ShellSpawnServer *server) {
+    if (server->num_exits + server->num_running < server->exits_cap) return 0;
+    size_t cap = server->exits_cap ? server->exits_cap * 2 : 16;
+    ServerExit *exits = realloc(server->exits, cap * sizeof(*exits));
+    if (!exits) return -1;
+    server->exits = exits;
+    server->exits_cap = cap;
+    return 0;
+}
+
+static void record_exit(ShellSpawnServer *server, const ServerExited *exited) {
+    // reserve_exit() made room for every child still running; an exit for
+    // a pid we never launched has none and is dropped
+    if (server->num_running == 0 || server->num_exits == server->exits_cap) return;
+    server->num_running--;
+    ServerExit *e = &server->exits[server->num_exits++];
+    memset(e, 0, sizeof(*e));
+    e->pid = exited->pid;
+    e->status = exited->status;
+    e->ru.ru_utime.tv_sec = exited->user_us / 1000000;
+    e->ru.ru_utime.tv_usec = exited->user_us % 1000000;
+    e->ru.ru_stime.tv_sec = exited->sys_us / 1000000;
+    e->ru.ru_stime.tv_usec = exited->sys_us % 1000000;
+    e->ru.ru_maxrss = exited->max_rss_kb;
+    e->ru.ru_nvcsw = exited->voluntary_cs;
+    e->ru.ru_nivcsw = exited->involuntary_cs;
+}
+
+static bool take_exit(ShellSpawnServer *server, pid_t pid, int *status, struct rusage *ru) {
+    for (size_t i = 0; i < server->num_exits; i++) {
+        if (server->exits[i].pid != pid) continue;
+        if (status) *status = server->exits[i].status;
+        if (ru) *ru = server->exits[i].ru;
+        server->exits[i] = server->exits[--server->num_exits];
+        return true;
+    }
+    return false;
+}
+
+// Handle one message from the helper. Returns 1, 0 if nothing is waiting
+// (only when !block), or -1 once the helper is gone.
+static int server_read(ShellSpawnServer *server, bool block) {
+    if (server->lost) return -1;
+
+    ServerHeader header;
+    char control[CMSG_SPACE(sizeof(int))];
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n;
+    do {
+        n = recvmsg(server->sock, &msg, MSG_CMSG_CLOEXEC | (block ? MSG_WAITALL : MSG_DONTWAIT));
+    } while (n < 0 && errno == EINTR);
+    if (n < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (n <= 0) return server_lost(server);
+
+    int fd = -1;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) memcpy(&fd, CMSG_DATA(c), sizeof(fd));
+    }
+
+    // The helper writes each message in one go, so the rest is already here
+    // or about to be
+    union { ServerSpawned spawned; ServerExited exited; } payload;
+    if ((size_t) n < sizeof(header) && recv_full(server->sock, (char *) &header + n, sizeof(header) - n) < 0) {
+        if (fd >= 0) close(fd);
+        return server_lost(server);
+    }
+    if (header.len > sizeof(payload) || recv_full(server->sock, &payload, header.len) < 0) {
+        if (fd >= 0) close(fd);
+        return server_lost(server);
+    }
+
+    if (header.type == SERVER_SPAWNED && header.len == sizeof(ServerSpawned)) {
+        // A new child with this pid means any exit still filed under it is stale
+        if (payload.spawned.pid > 0) {
+            take_exit(server, payload.spawned.pid, NULL, NULL);
+            server->num_running++;
+        }
+        if (server->spawned_pidfd >= 0) close(server->spawned_pidfd);
+        server->replied = true;
+        server->spawned = payload.spawned.pid;
+        server->spawned_pidfd = fd;
+        fd = -1;
+    } else if (header.type == SERVER_EXITED && header.len == sizeof(ServerExited)) {
+        record_exit(server, &payload.exited);
+    }
+    if (fd >= 0) close(fd);
+    return 1;
+}
+
+// --- Sending ---
+
+// Send one message. The socket is never allowed to block us outright:
+// while the helper is busy writing exits back to us, read them, or both
+// sides could end up waiting on full buffers.
+static int server_send(ShellSpawnServer *server, uint32_t type, const struct iovec *parts, int num_parts,
+                       const int *fds, int num_fds) {
+    ServerHeader header = { type, 0 };
+    struct iovec iov[4];
+    int num_iov = 0;
+    size_t total = sizeof(header);
+    iov[num_iov++] = (struct iovec) { &header, sizeof(header) };
+    for (int i = 0; i < num_parts && num_iov < 4; i++) {
+        iov[num_iov++] = parts[i];
+        header.len += (uint32_t) parts[i].iov_len;
+        total += parts[i].iov_len;
+    }
+
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+    bool attach = num_fds > 0;
+    struct iovec *next = iov;
+    size_t sent = 0;
+    while (sent < total) {
+        struct msghdr msg = { .msg_iov = next, .msg_iovlen = (size_t) (iov + num_iov - next) };
+        if (attach) { // Only with the first byte
+            memset(control, 0, sizeof(control));
+            msg.msg_control = control;
+            msg.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+            struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+            c->cmsg_level = SOL_SOCKET;
+            c->cmsg_type = SCM_RIGHTS;
+            c->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+            memcpy(CMSG_DATA(c), fds, sizeof(int) * num_fds);
+        }
+
+        ssize_t n = sendmsg(server->sock, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd p = { server->sock, POLLIN | POLLOUT, 0 };
+            if (poll(&p, 1, -1) < 0 && errno != EINTR) return server_lost(server);
+            if ((p.revents & POLLIN) && server_read(server, false) < 0) return -1;
+            continue;
+        }
+        if (n < 0) return server_lost(server);
+
+        attach = false;
+        sent += (size_t) n;
+        // Skip what went out
+        while (n > 0 && next < iov + num_iov) {
+            size_t step = (size_t) n < next->iov_len ? (size_t) n : next->iov_len;
+            next->iov_base = (char *) next->iov_base + step;
+            next->iov_len -= step;
+            n -= (ssize_t) step;
+            if (next->iov_len == 0) next++;
+        }
+    }
+    return 0;
+}
+
+static int send_env(ShellSpawnServer *server, char *const *envp) {
+    size_t len = 0;
+    for (char *const *e = envp; e && *e; e++) len += strlen(*e) + 1;
+    char *block = malloc(len ? len : 1);
+    if (!block) return -1;
+    size_t at = 0;
+    for (char *const *e = envp; e && *e; e++) {
+        size_t n = strlen(*e) + 1;
+        memcpy(block + at, *e, n);
+        at += n;
+    }
+    struct iovec part = { block, len };
+    int result = server_send(server, SERVER_ENV, &part, 1, NULL, 0);
+    free(block);
+    return result;
+}
+
+// Add fd to the set handed to the helper, once, if it is open
+static void add_fd(ServerSpawn *req, int *fds, int fd) {
+    if (fd < 0 || req->num_fds >= SPAWN_SERVER_MAX_FDS || fcntl(fd, F_GETFD) < 0) return;
+    for (int i = 0; i < req->num_fds; i++) {
+        if (req->fd_nums[i] == fd) return;
+    }
+    fds[req->num_fds] = fd;
+    req->fd_nums[req->num_fds++] = fd;
+}
+
+pid_t spawn_server_spawn(ShellSpawnServer *server, const ServerLaunch *launch, char *const *envp,
+                         uint64_t env_generation, int *pidfd) {
+    *pidfd = -1;
+    if (!launch->argv || !launch->argv[0]) { errno = EINVAL; return -1; }
+
+    // The trailer: dup pairs, then path, cwd and argv as NUL-terminated strings
+    const char *path = launch->path ? launch->path : "";
+    const char *cwd = launch->cwd ? launch->cwd : "";
+    int argc = 0;
+    size_t len = sizeof(int32_t) * 2 * (size_t) launch->num_dups + strlen(path) + 1 + strlen(cwd) + 1;
+    for (; launch->argv[argc]; argc++) len += strlen(launch->argv[argc]) + 1;
+    char *trailer = malloc(len);
+    if (!trailer) return -1;
+    char *at = trailer;
+    for (int i = 0; i < 2 * launch->num_dups; i++) {
+        int32_t v = launch->dups[i];
+        memcpy(at, &v, sizeof(v));
+        at += sizeof(v);
+    }
+    at = stpcpy(at, path) + 1;
+    at = stpcpy(at, cwd) + 1;
+    for (int i = 0; i < argc; i++) at = stpcpy(at, launch->argv[i]) + 1;
+
+    ServerSpawn req;
+    int fds[SPAWN_SERVER_MAX_FDS];
+    memset(&req, 0, sizeof(req));
+    for (int fd = 0; fd <= STDERR_FILENO; fd++) add_fd(&req, fds, fd);
+    for (int i = 0; i < launch->num_dups; i++) add_fd(&req, fds, launch->dups[2 * i]);
+    req.num_dups = launch->num_dups;
+    req.set_pgid = launch->set_pgid;
+    req.pgid = launch->pgid;
+    req.argc = argc;
+
+    pthread_mutex_lock(&server->lock);
+    pid_t pid = -1;
+    int err = EPIPE;
+    if (reserve_exit(server) < 0) {
+        err = ENOMEM;
+    } else if (server->sock >= 0 && !server->lost) {
+        bool ok = true;
+        if (!server->env_sent || server->env_generation != env_generation) {
+            ok = send_env(server, envp) == 0;
+            server->env_sent = ok;
+            server->env_generation = env_generation;
+        }
+        struct iovec parts[2] = { { &req, sizeof(req) }, { trailer, len } };
+        server->replied = false;
+        ok = ok && server_send(server, SERVER_SPAWN, parts, 2, fds, req.num_fds) == 0;
+        while (ok && !server->replied) ok = server_read(server, true) >= 0;
+        if (ok && server->spawned > 0) {
+            pid = server->spawned;
+            *pidfd = server->spawned_pidfd;
+            server->spawned_pidfd = -1;
+        } else if (ok) {
+            err = -server->spawned;
+        }
+    }
+    pthread_mutex_unlock(&server->lock);
+    free(trailer);
+    if (pid < 0) errno = err;
+    return pid;
+}
+
+int spawn_server_reap(ShellSpawnServer *server, pid_t pid, int pidfd, bool block, int *status,
+                      struct rusage *ru) {
+    pthread_mutex_lock(&server->lock);
+    bool found = take_exit(server, pid, status, ru);
+    while (!found && server_read(server, false) > 0) found = take_exit(server, pid, status, ru);
+
+    // Exited but not reported yet: the report is already on its way
+    if (!found && !block && !server->lost && pidfd >= 0) {
+        struct pollfd p = { pidfd, POLLIN, 0 };
+        block = poll(&p, 1, 0) > 0;
+    }
+    // Wait without holding the lock, so other runs can spawn and reap meanwhile
+    while (!found && block && !server->lost) {
+        pthread_mutex_unlock(&server->lock);
+        struct pollfd p = { server->sock, POLLIN, 0 };
+        poll(&p, 1, -1);
+        pthread_mutex_lock(&server->lock);
+        found = take_exit(server, pid, status, ru);
+        while (!found && server_read(server, false) > 0) found = take_exit(server, pid, status, ru);
+    }
+
+    // Nobody is left to report it
+    int result = found ? 1 : server->lost ? -1 : 0;
+    pthread_mutex_unlock(&server->lock);
+    return result;
+}
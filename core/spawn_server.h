@@ -0,0 +1,120 @@
+#ifndef SPAWN_SERVER_H
+#define SPAWN_SERVER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
+// --- Wire protocol, shared with the helper program (spawn_server_main.c) ---
+// Messages go over a SOCK_STREAM socketpair as a ServerHeader followed by
+// len payload bytes. Passed fds ride on the message as SCM_RIGHTS.
+
+#define SPAWN_SERVER_FD 3        // The helper's end of the socket
+#define SPAWN_SERVER_MAX_FDS 32  // fds handed over with one spawn request
+#define SPAWN_SERVER_NAME "core-spawn-server" // Helper executable, next to the extension
+
+enum {
+    SERVER_ENV = 1,        // -> helper: "NAME=VALUE\0" entries, envp for later spawns
+    SERVER_SPAWN,          // -> helper: ServerSpawn and its trailer, with the fds
+    SERVER_SPAWNED,        // <- helper: ServerSpawned, with the child's pidfd if it has one
+    SERVER_EXITED,         // <- helper: ServerExited, whenever a child is reaped
+};
+
+typedef struct {
+    uint32_t type;
+    uint32_t len;          // Payload bytes after the header
+} ServerHeader;
+
+// Followed by int32 dups[num_dups][2] ((src, target) in the parent's fd
+// numbering, applied in order), then NUL-terminated path ("" = search PATH),
+// cwd and argv[0..argc-1]
+typedef struct {
+    int32_t num_fds;
+    int32_t fd_nums[SPAWN_SERVER_MAX_FDS]; // The parent's number for each passed fd
+    int32_t num_dups;
+    int32_t set_pgid;
+    int32_t pgid;
+    int32_t argc;
+} ServerSpawn;
+
+typedef struct {
+    int32_t pid;           // Child's pid, or -errno if it couldn't be forked
+} ServerSpawned;
+
+typedef struct {
+    int32_t pid;
+    int32_t status;        // wait4() status
+    int64_t user_us;
+    int64_t sys_us;
+    int64_t max_rss_kb;
+    int64_t voluntary_cs;
+    int64_t involuntary_cs;
+} ServerExited;
+
+// --- Client side (spawn_server.c) ---
+
+// An exit the helper reported that no stage has claimed yet
+typedef struct {
+    pid_t pid;
+    int status;
+    struct rusage ru;
+} ServerExit;
+
+// The helper process. Processes it launches are its children, not ours, so
+// their exits come back over the socket instead of from wait4().
+typedef struct {
+    pid_t pid;             // Helper's pid, 0 when it isn't running
+    int sock;              // Our end of the socket, -1 before the helper is started
+    bool lost;             // The helper went away (EOF or a socket error)
+    bool env_sent;         // The helper holds the environment of env_generation
+    uint64_t env_generation;
+    ServerExit *exits;
+    size_t num_exits;
+    size_t exits_cap;      // Kept >= num_exits + num_running, so no exit is ever dropped
+    size_t num_running;    // Children launched whose exit hasn't come back yet
+    bool replied;          // The request in flight has its SERVER_SPAWNED
+    pid_t spawned;         // Its pid (or -errno)
+    int spawned_pidfd;
+    pthread_mutex_t lock;  // Runs are reaped outside the context's lock
+} ShellSpawnServer;
+
+// One launch request, in the parent's terms
+typedef struct {
+    char *const *argv;
+    const char *path;      // Resolved program, NULL to search PATH
+    const char *cwd;
+    const int *dups;       // num_dups (src, target) pairs, applied in order
+    int num_dups;
+    bool set_pgid;
+    pid_t pgid;
+} ServerLaunch;
+
+void spawn_server_init(ShellSpawnServer *server);
+
+// Start the helper program (a small process that never loads Python)
+// unless it is already running; a helper that went away is replaced.
+// Returns 0, or -1 with errno set.
+int spawn_server_start(ShellSpawnServer *server, const char *helper);
+
+// Close the socket (the helper exits at EOF, leaving its children running)
+// and reap the helper
+void spawn_server_free(ShellSpawnServer *server);
+
+// Have the helper fork and exec a command. The child starts with our
+// current fds 0-2 and every dup source, then applies the dups exactly like
+// the fork engine's child. envp is resent only if env_generation changed.
+// Returns the child's pid with *pidfd set (-1 if the helper's kernel has no
+// pidfds), or -1 with errno set.
+pid_t spawn_server_spawn(ShellSpawnServer *server, const ServerLaunch *launch, char *const *envp,
+                         uint64_t env_generation, int *pidfd);
+
+// Collect the exit of a child the helper launched: 1 with *status and *ru
+// set once it has exited, 0 if it is still running and block is false, or
+// -1 if the helper has gone away without reporting it (the status is lost).
+int spawn_server_reap(ShellSpawnServer *server, pid_t pid, int pidfd, bool block, int *status,
+                      struct rusage *ru);
+
+#endif // SPAWN_SERVER_H
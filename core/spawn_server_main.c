@@ -0,0 +1,304 @@
+// core-spawn-server: launches commands for the "server" spawn engine.
+//
+// Started once by the extension (spawn_server.c) with its end of a socket
+// on fd 3. It stays tiny, so fork() here copies a handful of pages instead
+// of the Python interpreter's whole address space. The protocol is in
+// spawn_server.h; the helper exits when the socket reaches EOF.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include "spawn_server.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+
+#define MAX_MESSAGE (64 << 20) // Sanity limit for one request
+
+extern char **environ;
+
+static char *env_block;                 // Last SERVER_ENV payload
+static char **env_vars;                 // Pointers into env_block, NULL-terminated
+
+static int recv_full(int fd, void *buf, size_t len) {
+    size_t got = 0;
+    while (got < len) {
+        ssize_t n = recv(fd, (char *) buf + got, len - got, MSG_WAITALL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        got += (size_t) n;
+    }
+    return 0;
+}
+
+// Send one message, with fd attached if it is >= 0. The socket blocks, and
+// the extension keeps reading while it waits on us, so this always drains.
+static int send_message(uint32_t type, const void *payload, uint32_t len, int fd) {
+    ServerHeader header = { type, len };
+    struct iovec iov[2] = { { &header, sizeof(header) }, { (void *) payload, len } };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = 2 };
+    if (fd >= 0) {
+        memset(control, 0, sizeof(control));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(c), &fd, sizeof(int));
+    }
+
+    size_t total = sizeof(header) + len, sent = 0;
+    while (sent < total) {
+        ssize_t n = sendmsg(SPAWN_SERVER_FD, &msg, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        sent += (size_t) n;
+        msg.msg_control = NULL; // The fd went with the first byte
+        msg.msg_controllen = 0;
+        while (n > 0 && msg.msg_iovlen > 0) {
+            size_t step = (size_t) n < msg.msg_iov->iov_len ? (size_t) n : msg.msg_iov->iov_len;
+            msg.msg_iov->iov_base = (char *) msg.msg_iov->iov_base + step;
+            msg.msg_iov->iov_len -= step;
+            n -= (ssize_t) step;
+            if (msg.msg_iov->iov_len == 0) { msg.msg_iov++; msg.msg_iovlen--; }
+        }
+    }
+    return 0;
+}
+
+static void set_env(char *block, size_t len) {
+    size_t count = 0;
+    for (size_t i = 0; i < len; i++) count += block[i] == '\0';
+    char **vars = malloc((count + 1) * sizeof(*vars));
+    if (!vars) { free(block); return; }
+    size_t n = 0;
+    for (size_t i = 0; i < len && n < count; i += strlen(block + i) + 1) vars[n++] = block + i;
+    vars[n] = NULL;
+    free(env_vars);
+    free(env_block);
+    env_vars = vars;
+    env_block = block;
+}
+
+static bool is_dup_target(const int32_t *dups, int num_dups, int fd) {
+    for (int i = 0; i < num_dups; i++) {
+        if (dups[2 * i + 1] == fd) return true;
+    }
+    return false;
+}
+
+// In the forked child: rebuild the parent's fd layout, then exec.
+// fds[k] is what the parent calls req->fd_nums[k].
+static void child_exec(const ServerSpawn *req, const int *fds, const int32_t *dups, const char *path,
+                       const char *cwd, char **argv) {
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    signal(SIGXFSZ, SIG_DFL);
+    sigset_t empty;
+    sigemptyset(&empty);
+    sigprocmask(SIG_SETMASK, &empty, NULL);
+
+    if (req->set_pgid) setpgid(0, req->pgid);
+    if (cwd[0] && chdir(cwd) < 0) {
+        dprintf(STDERR_FILENO, "%s: %s", cwd, strerror(errno));
+        _exit(1);
+    }
+
+    // Received fds land on arbitrary numbers that may collide with the
+    // targets, so move them all above every target first
+    int base = SPAWN_SERVER_FD + 1;
+    for (int k = 0; k < req->num_fds; k++) {
+        if (req->fd_nums[k] >= base) base = req->fd_nums[k] + 1;
+    }
+    for (int i = 0; i < req->num_dups; i++) {
+        if (dups[2 * i + 1] >= base) base = dups[2 * i + 1] + 1;
+    }
+    int high[SPAWN_SERVER_MAX_FDS];
+    for (int k = 0; k < req->num_fds; k++) {
+        high[k] = fcntl(fds[k], F_DUPFD, base);
+        if (high[k] < 0) _exit(1);
+    }
+    for (int k = 0; k < req->num_fds; k++) {
+        if (dup2(high[k], req->fd_nums[k]) < 0) _exit(1);
+        close(high[k]);
+    }
+
+    // Same dup-then-close order as the fork engine's child
+    for (int i = 0; i < req->num_dups; i++) {
+        if (dup2(dups[2 * i], dups[2 * i + 1]) == -1) {
+            perror("dup2");
+            _exit(1);
+        }
+    }
+    for (int k = 0; k < req->num_fds; k++) {
+        int fd = req->fd_nums[k];
+        if (fd > STDERR_FILENO && !is_dup_target(dups, req->num_dups, fd)) close(fd);
+    }
+
+    char **envp = env_vars ? env_vars : environ;
+    if (path[0]) execve(path, argv, envp);
+    environ = envp;
+    execvpe(argv[0], argv, envp);
+
+    dprintf(STDERR_FILENO, "%s: %s", argv[0], strerror(errno));
+    _exit(127);
+}
+
+// Validate a SERVER_SPAWN request and launch it. Always replies.
+static int handle_spawn(const char *payload, size_t len, const int *fds, int num_received) {
+    int32_t result = -EPROTO;
+    int pidfd = -1;
+    ServerSpawn req;
+    char **argv = NULL;
+
+    if (len < sizeof(req)) goto reply;
+    memcpy(&req, payload, sizeof(req));
+    size_t dup_bytes = sizeof(int32_t) * 2 * (size_t) req.num_dups;
+    if (req.num_fds != num_received || req.num_dups < 0 || req.argc < 1 ||
+        len < sizeof(req) + dup_bytes || payload[len - 1] != '\0') {
+        goto reply;
+    }
+    int32_t *dups = malloc(dup_bytes ? dup_bytes : 1);
+    argv = malloc(((size_t) req.argc + 1) * sizeof(*argv));
+    if (!dups || !argv) {
+        free(dups);
+        result = -ENOMEM;
+        goto reply;
+    }
+    memcpy(dups, payload + sizeof(req), dup_bytes);
+
+    // path, cwd, then argv, each NUL-terminated (the last byte is a NUL)
+    const char *end = payload + len;
+    const char *path = payload + sizeof(req) + dup_bytes;
+    const char *cwd = path + strlen(path) + 1;
+    const char *at = cwd < end ? cwd + strlen(cwd) + 1 : end;
+    int argc = 0;
+    for (; argc < req.argc && at < end; argc++) {
+        argv[argc] = (char *) at;
+        at += strlen(at) + 1;
+    }
+    argv[argc] = NULL;
+    if (argc != req.argc) {
+        free(dups);
+        goto reply;
+    }
+
+    pid_t pid = fork();
+    if (pid == 0) child_exec(&req, fds, dups, path, cwd, argv);
+    result = pid > 0 ? pid : -errno;
+    if (pid > 0) pidfd = (int) syscall(SYS_pidfd_open, pid, 0);
+    free(dups);
+
+reply:;
+    ServerSpawned spawned = { result };
+    int sent = send_message(SERVER_SPAWNED, &spawned, sizeof(spawned), pidfd);
+    if (pidfd >= 0) close(pidfd);
+    free(argv);
+    return sent;
+}
+
+static int64_t timeval_us(const struct timeval *tv) {
+    return (int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static int reap_children(void) {
+    int status;
+    struct rusage ru;
+    pid_t pid;
+    while ((pid = wait4(-1, &status, WNOHANG, &ru)) > 0) {
+        ServerExited exited = {
+            pid, status, timeval_us(&ru.ru_utime), timeval_us(&ru.ru_stime),
+            ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw,
+        };
+        if (send_message(SERVER_EXITED, &exited, sizeof(exited), -1) < 0) return -1;
+    }
+    return 0;
+}
+
+// Read and act on one message. Returns -1 at EOF or on a broken request.
+static int handle_message(void) {
+    ServerHeader header;
+    char control[CMSG_SPACE(sizeof(int) * SPAWN_SERVER_MAX_FDS)];
+    struct iovec iov = { &header, sizeof(header) };
+    struct msghdr msg = { .msg_iov = &iov, .msg_iovlen = 1,
+                          .msg_control = control, .msg_controllen = sizeof(control) };
+    ssize_t n;
+    do n = recvmsg(SPAWN_SERVER_FD, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+    while (n < 0 && errno == EINTR);
+    if (n <= 0) return -1;
+
+    int fds[SPAWN_SERVER_MAX_FDS];
+    int num_fds = 0;
+    for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+        if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+        int count = (int) ((c->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+        for (int i = 0; i < count; i++) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(c) + i * sizeof(int), sizeof(int));
+            if (num_fds < SPAWN_SERVER_MAX_FDS) fds[num_fds++] = fd;
+            else close(fd);
+        }
+    }
+
+    int result = -1;
+    char *payload = NULL;
+    if ((size_t) n == sizeof(header) && header.len <= MAX_MESSAGE && (payload = malloc(header.len + 1)) &&
+        recv_full(SPAWN_SERVER_FD, payload, header.len) == 0) {
+        if (header.type == SERVER_ENV) {
+            set_env(payload, header.len);
+            payload = NULL;
+            result = 0;
+        } else if (header.type == SERVER_SPAWN) {
+            result = handle_spawn(payload, header.len, fds, num_fds);
+        }
+    }
+    for (int i = 0; i < num_fds; i++) close(fds[i]);
+    free(payload);
+    return result;
+}
+
+int main(void) {
+    // Ctrl-C at the terminal reaches the whole foreground process group,
+    // which includes us; only the children should get it
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+    if (fcntl(SPAWN_SERVER_FD, F_SETFD, FD_CLOEXEC) < 0) return 1;
+
+    sigset_t chld;
+    sigemptyset(&chld);
+    sigaddset(&chld, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &chld, NULL);
+    int sfd = signalfd(-1, &chld, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sfd < 0) return 1;
+
+    for (;;) {
+        struct pollfd p[2] = { { SPAWN_SERVER_FD, POLLIN, 0 }, { sfd, POLLIN, 0 } };
+        if (poll(p, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            return 1;
+        }
+        if (p[1].revents & POLLIN) {
+            struct signalfd_siginfo info;
+            while (read(sfd, &info, sizeof(info)) > 0) {}
+            if (reap_children() < 0) break;
+        }
+        if ((p[0].revents & (POLLIN | POLLHUP | POLLERR)) && handle_message() < 0) break;
+    }
+    // Whatever is still running is reparented and keeps going
+    return 0;
+}
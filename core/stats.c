@@ -0,0 +1,83 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+#include "stats.h"
+
+int64_t stats_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t timeval_us(const struct timeval *tv) {
+    return (int64_t) tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+void stats_usage_set(ShellUsage *usage, const struct rusage *ru, int64_t started_ns, int64_t ended_ns) {
+    usage->wall_ns = started_ns > 0 && ended_ns > started_ns ? ended_ns - started_ns : 0;
+    usage->user_us = timeval_us(&ru->ru_utime);
+    usage->sys_us = timeval_us(&ru->ru_stime);
+    usage->max_rss_kb = ru->ru_maxrss; // Linux reports kilobytes
+    usage->voluntary_cs = ru->ru_nvcsw;
+    usage->involuntary_cs = ru->ru_nivcsw;
+}
+
+void stats_usage_add(ShellUsage *total, const ShellUsage *stage) {
+    total->user_us += stage->user_us;
+    total->sys_us += stage->sys_us;
+    if (stage->max_rss_kb > total->max_rss_kb) total->max_rss_kb = stage->max_rss_kb;
+    total->voluntary_cs += stage->voluntary_cs;
+    total->involuntary_cs += stage->involuntary_cs;
+}
+
+void stats_init(ShellStats *stats) {
+    memset(stats, 0, sizeof(*stats));
+}
+
+void stats_free(ShellStats *stats) {
+    free(stats->entries);
+    memset(stats, 0, sizeof(*stats));
+}
+
+int stats_resize(ShellStats *stats, size_t cap) {
+    ShellStatsEntry *entries = NULL;
+    if (cap > 0 && !(entries = malloc(sizeof(ShellStatsEntry) * cap))) {
+        stats_free(stats);
+        return -1;
+    }
+    free(stats->entries);
+    stats->entries = entries;
+    stats->cap = cap;
+    stats_clear(stats);
+    return 0;
+}
+
+void stats_clear(ShellStats *stats) {
+    stats->head = 0;
+    stats->count = 0;
+}
+
+void stats_add(ShellStats *stats, const char *command, int exit_code, int num_stages, const ShellUsage *usage) {
+    if (stats->cap == 0) return;
+    ShellStatsEntry *entry;
+    if (stats->count < stats->cap) {
+        entry = &stats->entries[(stats->head + stats->count++) % stats->cap];
+    } else {
+        // Full: the oldest entry makes room
+        entry = &stats->entries[stats->head];
+        stats->head = (stats->head + 1) % stats->cap;
+    }
+    size_t len = command ? strnlen(command, STATS_COMMAND_LEN - 1) : 0;
+    memcpy(entry->command, command ? command : "", len);
+    entry->command[len] = '\0';
+    entry->exit_code = exit_code;
+    entry->num_stages = num_stages;
+    entry->usage = *usage;
+    stats->total++;
+}
+
+const ShellStatsEntry* stats_get(const ShellStats *stats, size_t i) {
+    return &stats->entries[(stats->head + i) % stats->cap];
+}
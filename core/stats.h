@@ -0,0 +1,67 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+struct rusage;
+
+// Resources one process used: wait4()'s rusage plus monotonic wall time
+typedef struct {
+    int64_t wall_ns;       // Spawn to reap
+    int64_t user_us;       // CPU time in user mode
+    int64_t sys_us;        // CPU time in the kernel
+    long max_rss_kb;       // Peak resident set size
+    long voluntary_cs;     // Context switches while blocked (I/O, pipes, sleep)
+    long involuntary_cs;   // Context switches from preemption
+} ShellUsage;
+
+#define STATS_COMMAND_LEN 96  // Bytes of the command line kept per entry (with the NUL)
+
+// One finished command or pipeline
+typedef struct {
+    char command[STATS_COMMAND_LEN]; // Command line, truncated
+    int exit_code;
+    int num_stages;
+    ShellUsage usage;      // Whole run: first spawn to last reap, CPU and switches summed, largest peak RSS
+} ShellStatsEntry;
+
+// Rolling table of the most recent runs. Disabled (nothing recorded) until
+// given a capacity; when full the oldest entry is overwritten.
+typedef struct {
+    ShellStatsEntry *entries;
+    size_t cap;
+    size_t head;           // Index of the oldest entry
+    size_t count;
+    uint64_t total;        // Entries ever added
+} ShellStats;
+
+// Monotonic clock in nanoseconds
+int64_t stats_now_ns(void);
+
+// Fill usage from a wait4() rusage and the spawn/reap timestamps
+void stats_usage_set(ShellUsage *usage, const struct rusage *ru, int64_t started_ns, int64_t ended_ns);
+
+// Add one stage's figures to a whole-run total (wall time is handled by the caller)
+void stats_usage_add(ShellUsage *total, const ShellUsage *stage);
+
+void stats_init(ShellStats *stats);
+
+void stats_free(ShellStats *stats);
+
+// Change the capacity (0 disables recording), dropping every entry.
+// Returns 0, or -1 if allocation failed (the table is then disabled).
+int stats_resize(ShellStats *stats, size_t cap);
+
+// Forget the entries but keep the capacity
+void stats_clear(ShellStats *stats);
+
+// Record a run. Does nothing while disabled.
+void stats_add(ShellStats *stats, const char *command, int exit_code, int num_stages, const ShellUsage *usage);
+
+// i-th entry, oldest first (i < count)
+const ShellStatsEntry* stats_get(const ShellStats *stats, size_t i);
+
+#endif // STATS_H
@@ -0,0 +1,84 @@
+#include <string.h>
+#include "trace.h"
+#include "stats.h"
+
+// One ring slot. seq is 0 while (re)written and index + 1 once published.
+typedef struct {
+    atomic_uint_fast64_t seq;
+    TraceEvent event;
+} TraceSlot;
+
+atomic_bool trace_on;
+static TraceSlot ring[TRACE_CAPACITY];
+static atomic_uint_fast64_t head;       // Slots ever claimed
+static atomic_uint_fast64_t cleared;    // head at the last trace_clear
+static atomic_uint_fast32_t next_run;
+
+void trace_record(TraceType type, uint32_t run, int stage, pid_t pid, int64_t value) {
+    uint64_t index = atomic_fetch_add_explicit(&head, 1, memory_order_relaxed);
+    TraceSlot *slot = &ring[index & (TRACE_CAPACITY - 1)];
+
+    // Unpublish, fill in, publish: a reader that sees the same seq before
+    // and after its copy got a whole event
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->event.ns = stats_now_ns();
+    slot->event.run = run;
+    slot->event.type = (uint16_t) type;
+    slot->event.stage = (int16_t) stage;
+    slot->event.pid = (int32_t) pid;
+    slot->event.value = value;
+    atomic_store_explicit(&slot->seq, index + 1, memory_order_release);
+}
+
+void trace_enable(bool on) {
+    atomic_store(&trace_on, on);
+}
+
+uint32_t trace_new_run(void) {
+    if (!atomic_load_explicit(&trace_on, memory_order_relaxed)) return 0;
+    uint32_t id = (uint32_t) atomic_fetch_add_explicit(&next_run, 1, memory_order_relaxed) + 1;
+    return id ? id : 1; // 0 means "no run", even after wrapping
+}
+
+size_t trace_snapshot(TraceEvent *out, size_t max, uint64_t *dropped) {
+    uint64_t end = atomic_load_explicit(&head, memory_order_acquire);
+    uint64_t start = atomic_load_explicit(&cleared, memory_order_relaxed);
+    uint64_t lost = 0;
+    if (end - start > TRACE_CAPACITY) {
+        lost = end - start - TRACE_CAPACITY;
+        start = end - TRACE_CAPACITY;
+    }
+
+    size_t n = 0;
+    for (uint64_t index = start; index < end && n < max; index++) {
+        TraceSlot *slot = &ring[index & (TRACE_CAPACITY - 1)];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq != index + 1) { lost++; continue; } // Being written, or already reused
+        TraceEvent event;
+        memcpy(&event, &slot->event, sizeof(event));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq) { lost++; continue; }
+        out[n++] = event;
+    }
+    if (dropped) *dropped = lost;
+    return n;
+}
+
+void trace_clear(void) {
+    atomic_store(&cleared, atomic_load(&head));
+}
+
+static const char *type_names[] = {
+    [TRACE_STAGE_START] = "stage_start",
+    [TRACE_SPAWN] = "spawn",
+    [TRACE_EXEC_FAILED] = "exec_failed",
+    [TRACE_STDERR_READ] = "stderr_read",
+    [TRACE_STAGE_EXIT] = "stage_exit",
+    [TRACE_REAP] = "reap",
+};
+
+const char* trace_type_name(int type) {
+    if (type <= 0 || type >= (int) (sizeof(type_names) / sizeof(type_names[0]))) return NULL;
+    return type_names[type];
+}
@@ -0,0 +1,82 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Hot-path tracing: where the time goes between a launch and its reap.
+//
+// Every trace point is both a USDT probe (provider "llm_shell"), compiled
+// in with -DSHELL_USDT (needs <sys/sdt.h>, e.g. systemtap-sdt-dev) for
+// bpftrace/perf to attach to, and an event in a fixed-size, process-wide
+// ring. Recording is off until trace_enable(true); while off a trace point
+// costs one relaxed load and a branch (a USDT probe is a nop until a
+// tracer attaches).
+//
+// The ring is lock-free: writers claim a slot with one atomic increment
+// and publish it with its sequence number, so runs on several threads (or
+// an event loop and a worker) can all record. Readers skip slots being
+// written, and the oldest events are overwritten once the ring is full.
+
+#define TRACE_CAPACITY 4096  // Events kept (a power of two)
+
+typedef enum {
+    TRACE_STAGE_START = 1, // About to spawn a stage. value: spawn engine
+    TRACE_SPAWN,           // Spawn returned. pid; value: ns the spawn call took
+    TRACE_EXEC_FAILED,     // posix_spawn couldn't execute the command. value: errno
+                           // (other engines' children report it as a reap with status 127)
+    TRACE_STDERR_READ,     // One read() on a stage's stderr pipe. value: bytes
+    TRACE_STAGE_EXIT,      // A stage's pidfd reported its exit. pid
+    TRACE_REAP,            // Exit status collected. pid; value: wait status
+} TraceType;
+
+typedef struct {
+    int64_t ns;            // Monotonic clock (stats_now_ns)
+    uint32_t run;          // Run the event belongs to (trace_new_run), 0 if none
+    uint16_t type;         // TraceType
+    int16_t stage;         // Stage index, -1 if none
+    int32_t pid;           // Process, 0 if none
+    int64_t value;         // Depends on the type (see TraceType)
+} TraceEvent;
+
+extern atomic_bool trace_on;
+
+#ifdef SHELL_USDT
+#include <sys/sdt.h>
+#define TRACE_PROBE(name, run, stage, pid, value) \
+    DTRACE_PROBE4(llm_shell, name, run, stage, pid, value)
+#else
+#define TRACE_PROBE(name, run, stage, pid, value) ((void) 0)
+#endif
+
+// Record an event. name is the probe's name (spawn, reap, ...)
+#define TRACE(name, type, run, stage, pid, value) do { \
+        TRACE_PROBE(name, run, stage, pid, value); \
+        if (__builtin_expect(atomic_load_explicit(&trace_on, memory_order_relaxed), 0)) \
+            trace_record(type, run, stage, pid, value); \
+    } while (0)
+
+// Append to the ring (use TRACE, which checks trace_on first)
+void trace_record(TraceType type, uint32_t run, int stage, pid_t pid, int64_t value);
+
+// Start or stop recording. Events already in the ring are kept.
+void trace_enable(bool on);
+
+// Id to tag a new run's events with, 0 while recording is off
+uint32_t trace_new_run(void);
+
+// Copy up to max events, oldest first, into out. Returns how many were
+// copied. *dropped (if given) gets how many since the last trace_clear
+// were missed: overwritten, or being written at the time.
+size_t trace_snapshot(TraceEvent *out, size_t max, uint64_t *dropped);
+
+// Forget everything recorded so far
+void trace_clear(void);
+
+// "spawn", "reap", ... (the probe name), or NULL for an unknown type
+const char* trace_type_name(int type);
+
+#endif // TRACE_H
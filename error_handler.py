@@ -1,23 +1,155 @@
 from rich.console import Console
-from rich.markdown import Markdown
+from typing import Optional
 import json
 
+
+def _clean_step(item) -> str:
+    return str(item).strip().lstrip('- ').lstrip('• ')
+
+
+class SolutionStream:
+    """Incremental scanner for the explain_error JSON.
+
+    feed() it chunks as they arrive; problem and solution hold whatever has
+    been completed so far. Only strings are tracked, with a stack of the
+    containers they sit in, so "problem" and "solution" are found at any
+    depth (the model sometimes nests them) and text before the first "{"
+    (a Markdown code fence) is skipped.
+    """
+
+    def __init__(self):
+        self.problem = None
+        self.solution = []
+        self._stack = []      # [kind, owner key, current key, expecting a key]
+        self._string = None   # Raw characters of the string being read
+        self._escape = False
+
+    def feed(self, text: str) -> bool:
+        """Consume a chunk. Returns True if problem or solution changed."""
+        changed = False
+        for ch in text:
+            if self._string is not None:
+                if self._escape:
+                    self._escape = False
+                elif ch == '\\':
+                    self._escape = True
+                elif ch == '"':
+                    changed |= self._on_string(''.join(self._string))
+                    self._string = None
+                    continue
+                self._string.append(ch)
+                continue
+            if not self._stack:
+                if ch == '{' and self.problem is None and not self.solution:
+                    self._stack.append(['object', None, None, True])
+                continue
+            top = self._stack[-1]
+            if ch == '"':
+                self._string = []
+            elif ch in '{[':
+                owner = top[2] if top[0] == 'object' else top[1]
+                self._stack.append(['object' if ch == '{' else 'array', owner, None, ch == '{'])
+            elif ch in '}]':
+                self._stack.pop()
+            elif ch == ':':
+                top[3] = False
+            elif ch == ',' and top[0] == 'object':
+                top[2], top[3] = None, True
+        return changed
+
+    def _on_string(self, raw: str) -> bool:
+        try:
+            value = json.loads('"' + raw + '"')
+        except json.JSONDecodeError:
+            value = raw
+        top = self._stack[-1]
+        if top[0] == 'object':
+            if top[3]:
+                top[2] = value  # A key
+                return False
+            if top[2] == 'problem':
+                self.problem = value.strip()
+                return True
+            if top[2] == 'solution':
+                self.solution.extend(_clean_step(line) for line in value.split('\n') if line.strip())
+                return True
+        elif top[1] == 'solution' and value.strip():
+            self.solution.append(_clean_step(value))
+            return True
+        return False
+
+
 class ErrorHandler:
-    def __init__(self, console: Console, llm_client):
+    def __init__(self, console: Console, get_llm_client):
         self.console = console
-        self.llm_client = llm_client
+        # Called at the first error, so the client isn't built at startup
+        self.get_llm_client = get_llm_client
+
+    async def handle_error(self, error_msg: str, explain: Optional[str] = None) -> None:
+        """Handle and display errors with explanations.
 
-    async def handle_error(self, error_msg: str) -> None:
-        """Handle and display errors with explanations."""
+        explain is the text to ask about when it isn't error_msg itself: the
+        start of it, already being explained by a speculative request."""
         # Always show error message first
         self.console.print(f"[bold red]Error:[/bold red] {error_msg}")
         
-        # Then get and show the solution
-        explanation = await self.llm_client.explain_error(error_msg)
-        self._print_error_solution(explanation)
+        try:
+            llm_client = self.get_llm_client()
+        except Exception as e:
+            self.console.print(f"[yellow]No explanation available:[/yellow] {e}")
+            return
+        
+        # Then get and show the solution, as it arrives if the client can stream
+        explain = explain or error_msg
+        stream = getattr(llm_client, "explain_error_stream", None)
+        if stream is None:
+            explanation = await llm_client.explain_error(explain)
+            self._print_error_solution(explanation)
+            return
+        await self._stream_error_solution(stream(explain))
+
+    async def _stream_error_solution(self, chunks) -> None:
+        """Render the problem and each solution step as soon as they are complete."""
+        # Imported on first use: rich.markdown pulls in markdown-it and pygments
+        from rich.live import Live
+        from rich.markdown import Markdown
+        parser = SolutionStream()
+        explanation = ""
+        self.console.print("\n")
+        with Live(console=self.console, refresh_per_second=12, vertical_overflow="visible") as live:
+            async for chunk in chunks:
+                explanation += chunk
+                if parser.feed(chunk):
+                    live.update(Markdown(self._solution_markdown(parser.problem or "...", parser.solution)))
+            # The whole reply decides the final rendering, exactly as without streaming
+            final = self._explanation_markdown(explanation.strip())
+            live.update(Markdown(final or "No explanation available."))
+
+    @staticmethod
+    def _solution_markdown(problem: str, steps) -> str:
+        markdown_output = f"**Problem:**\n{problem}\n\n"
+        if steps:
+            markdown_output += "**Solution:**\n"
+            for item in steps:
+                markdown_output += f"- {item}\n"
+        return markdown_output
 
     def _print_error_solution(self, explanation: str) -> None:
         """Format and print error solutions using Rich Markdown."""
+        markdown_output = self._explanation_markdown(explanation)
+
+        # Render the final markdown
+        if markdown_output:
+            from rich.markdown import Markdown
+            md = Markdown(markdown_output)
+            self.console.print("\n") # Add a newline before the markdown block
+            self.console.print(md)
+        else:
+            # Should not happen if logic above is correct, but just in case
+             self.console.print("\n[yellow]Explanation:[/yellow] No explanation available.") 
+
+    def _explanation_markdown(self, explanation: str) -> str:
+        """Markdown for a complete explain_error reply."""
         markdown_output = ""
         problem_str = "Unknown issue"
         solution_list = []
@@ -35,9 +167,9 @@ class ErrorHandler:
                         problem_str = data.get('problem', problem_str)
                         solution_data = data.get('solution', [])
                         if isinstance(solution_data, list):
-                            solution_list = [str(item).strip().lstrip('- ').lstrip('• ') for item in solution_data if item]
+                            solution_list = [_clean_step(item) for item in solution_data if item]
                         elif isinstance(solution_data, str): # Handle single string solution
-                            solution_list = [item.strip().lstrip('- ').lstrip('• ') for item in solution_data.split('\n') if item.strip()]
+                            solution_list = [_clean_step(item) for item in solution_data.split('\n') if item.strip()]
                         else:
                             solution_list = ['No specific solution steps provided.']
 
@@ -59,24 +191,12 @@ class ErrorHandler:
                      solution_list = [explanation]
 
             # --- Construct Markdown Output --- 
-            markdown_output += f"**Problem:**\n{problem_str}\n\n"
-            if solution_list:
-                 markdown_output += "**Solution:**\n"
-                 for item in solution_list:
-                     markdown_output += f"- {item}\n"
-            else:
-                 markdown_output += "**Solution:**\n- No specific solution steps provided.\n"
+            markdown_output = self._solution_markdown(problem_str, solution_list or
+                                                      ["No specific solution steps provided."])
 
         except Exception as e:
             # Ultimate fallback: Show raw explanation in markdown format
             self.console.print(f"\n[yellow]Could not process explanation fully ({e}). Raw content:[/yellow]")
             markdown_output = explanation # Render the raw string as markdown
 
-        # Render the final markdown
-        if markdown_output:
-            md = Markdown(markdown_output)
-            self.console.print("\n") # Add a newline before the markdown block
-            self.console.print(md)
-        else:
-            # Should not happen if logic above is correct, but just in case
-             self.console.print("\n[yellow]Explanation:[/yellow] No explanation available.") 
\ No newline at end of file
+        return markdown_output
@@ -1,5 +1,4 @@
 from rich.console import Console
-from rich.markdown import Markdown
 import textwrap
 
 class ResponseFormatter:
@@ -21,7 +20,8 @@ class ResponseFormatter:
         if not markdown_text.strip().startswith("# "):
             markdown_text = f"# Detailed Explanation\n\n{markdown_text}"
             
-        # Render the markdown
+        # Render the markdown (rich.markdown is only imported once it is needed)
+        from rich.markdown import Markdown
         md = Markdown(markdown_text)
         self.console.print(md)
 
@@ -58,5 +58,6 @@ class ResponseFormatter:
         """Format and print brief explanations using markdown."""
         # Add a heading and render as markdown
         markdown_text = f"# Explanation\n\n{explanation}"
+        from rich.markdown import Markdown
         md = Markdown(markdown_text)
         self.console.print(md) 
\ No newline at end of file
@@ -0,0 +1,69 @@
+"""
+prompt_toolkit history and auto-suggest backed by the core's indexed history.
+"""
+
+import asyncio
+
+from prompt_toolkit.auto_suggest import AutoSuggest, Suggestion
+from prompt_toolkit.history import History
+
+import core
+
+# Entries handed to prompt_toolkit between yields to the event loop while loading
+LOAD_BATCH = 1000
+
+
+class CoreHistory(History):
+    """FileHistory-compatible history whose lookups go through core.History's prefix index."""
+
+    def __init__(self, filename):
+        # Same file format as FileHistory, so an existing history file just works
+        self.store = core.History(filename)
+        super().__init__()
+
+    async def load(self):
+        """Entries newest first, read from the mapped file as they are consumed.
+
+        History.load would copy every entry into a list first; this lets the
+        first prompt draw while older entries are still being handed over.
+        """
+        for n, string in enumerate(self.load_history_strings(), 1):
+            yield string
+            if n % LOAD_BATCH == 0:
+                await asyncio.sleep(0)
+
+    def load_history_strings(self):
+        """Every entry, newest first (as History.load expects), one at a time."""
+        store = self.store
+        for i in range(len(store) - 1, -1, -1):
+            yield store[i]
+
+    def get_strings(self):
+        # Oldest first, uncopied: Buffer calls this on every accepted line and
+        # only needs len() and indexing, which core.History has
+        return self.store
+
+    def append_string(self, string):
+        # The store is the only copy; there is no loaded list to keep in step
+        self.store_string(string)
+
+    def store_string(self, string):
+        self.store.append(string)
+
+
+class CoreAutoSuggest(AutoSuggest):
+    """Like AutoSuggestFromHistory, but a binary search instead of a scan of every entry."""
+
+    def get_suggestion(self, buffer, document):
+        history = buffer.history
+        if not isinstance(history, CoreHistory):
+            return None
+        # Only the last line of a multi-line input is completed, from any
+        # line of a history entry
+        text = document.text.rsplit("\n", 1)[-1]
+        if not text.strip():
+            return None
+        line = history.store.suggest(text)
+        if line is None:
+            return None
+        return Suggestion(line[len(text):])
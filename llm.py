@@ -5,7 +5,8 @@ LLM integration module for handling interactions with Google's Gemini model.
 import os
 import json
 import hashlib
-import time
+import asyncio
+from collections import OrderedDict
 from typing import Optional, Dict
 from pathlib import Path
 from google import genai
@@ -14,6 +15,7 @@ from dotenv import load_dotenv
 from pydantic import BaseModel
 # Import the models from models.py
 from models import COMMAND_SCHEMA, CommandResponse
+import core
 
 # Load environment variables
 load_dotenv()
@@ -37,61 +39,155 @@ class LLMClient:
             response_mime_type="application/json",
         )
         
-        # Initialize cache with debounced save
-        self.cache_file = Path.home() / '.llm_shell_cache.json'
-        self._dirty = False
-        self._last_save = 0
-        self._save_interval = 60  # Save at most once per minute
-        self._load_cache()
+        # Persistent response cache: an append-only log in the core extension,
+        # so a hit is one index probe and a new entry is one append
+        self.cache_file = Path.home() / '.llm_shell_cache'
+        self.cache_max_bytes = int(os.getenv("LLM_CACHE_MAX_BYTES", str(64 << 20)))
+        self._open_cache()
+        
+        # Recently used responses in memory, bounded by count and bytes:
+        # key -> (response, size of its JSON)
+        self._memory = OrderedDict()
+        self._memory_bytes = 0
+        self.memory_max_entries = int(os.getenv("LLM_MEMORY_CACHE_ENTRIES", "256"))
+        self.memory_max_bytes = int(os.getenv("LLM_MEMORY_CACHE_BYTES", str(4 << 20)))
+        
+        # Requests in flight: key -> task every caller asking for it awaits
+        self._inflight = {}
     
-    def _load_cache(self):
-        """Load the persistent cache from disk."""
+    def _open_cache(self):
+        """Open the persistent cache, importing the old JSON cache once."""
         try:
-            if self.cache_file.exists():
-                with open(self.cache_file, 'r') as f:
-                    self.persistent_cache = json.load(f)
-            else:
-                self.persistent_cache = {}
+            self.cache = core.ResponseCache(str(self.cache_file), max_bytes=self.cache_max_bytes)
         except Exception:
-            self.persistent_cache = {}
-    
-    def _save_cache(self):
-        """Save the persistent cache to disk with debouncing."""
-        current_time = time.time()
-        if not self._dirty or (current_time - self._last_save) < self._save_interval:
+            self.cache = None  # Run without a cache if it can't be opened
+            return
+        legacy = Path.home() / '.llm_shell_cache.json'
+        if not legacy.exists():
             return
-            
         try:
-            with open(self.cache_file, 'w') as f:
-                json.dump(self.persistent_cache, f)
-            self._last_save = current_time
-            self._dirty = False
+            if len(self.cache) == 0:
+                with open(legacy, 'r') as f:
+                    for key, response in json.load(f).items():
+                        self.cache.put(key, json.dumps(response).encode())
         except Exception:
-            pass  # Fail silently if we can't save cache
+            pass  # A damaged old cache is just not imported
+        # Set it aside so it isn't imported again, e.g. after clear_cache()
+        try:
+            legacy.rename(legacy.with_name(legacy.name + '.migrated'))
+        except OSError:
+            pass
     
     def _cache_key(self, query_type: str, text: str) -> str:
         version = "v2"  # Increment when changing prompts
         return hashlib.sha256(f"{version}|{query_type}|{text}".encode()).hexdigest()
     
+    def _remember(self, cache_key: str, response, size: int):
+        """Put a response in the memory tier, evicting least recently used ones."""
+        old = self._memory.pop(cache_key, None)
+        if old is not None:
+            self._memory_bytes -= old[1]
+        if size > self.memory_max_bytes:
+            return
+        self._memory[cache_key] = (response, size)
+        self._memory_bytes += size
+        while len(self._memory) > self.memory_max_entries or self._memory_bytes > self.memory_max_bytes:
+            _, (_, evicted) = self._memory.popitem(last=False)
+            self._memory_bytes -= evicted
+    
     def _get_from_cache(self, cache_key: str) -> Optional[Dict | str]:
-        """Get a response from the in-memory cache."""
-        return self.persistent_cache.get(cache_key)
+        """Get a response from memory, or else from the persistent cache."""
+        entry = self._memory.get(cache_key)
+        if entry is not None:
+            self._memory.move_to_end(cache_key)
+            return entry[0]
+        try:
+            raw = self.cache.get(cache_key) if self.cache is not None else None
+            if raw is None:
+                return None
+            response = json.loads(raw)
+        except Exception:
+            return None
+        self._remember(cache_key, response, len(raw))
+        return response
     
     def _add_to_cache(self, cache_key: str, response):
-        """Add a response to both memory and persistent cache."""
-        self.persistent_cache[cache_key] = response
-        self._dirty = True
-        
-        # Try to save cache if enough time has passed
-        self._save_cache()
+        """Add a response to memory and append it to the persistent cache."""
+        raw = json.dumps(response).encode()
+        self._remember(cache_key, response, len(raw))
+        try:
+            if self.cache is not None:
+                self.cache.put(cache_key, raw)
+        except Exception:
+            pass  # Fail silently if we can't save cache
+    
+    async def _cached(self, cache_key: str, produce, valid=bool):
+        """Cached response for cache_key, or the result of produce() (a coroutine
+        function), which is then cached. Concurrent callers with the same key share
+        one call to produce()."""
+        cached = self._get_from_cache(cache_key)
+        if valid(cached):
+            return cached
+        # A caller giving up doesn't cancel the request the others are waiting on
+        return await asyncio.shield(self._start(cache_key, produce))
+    
+    def _start(self, cache_key: str, produce):
+        """The in-flight task for cache_key, starting produce() if there is none."""
+        task = self._inflight.get(cache_key)
+        if task is None:
+            task = asyncio.ensure_future(self._produce_and_cache(cache_key, produce))
+            self._inflight[cache_key] = task
+            task.add_done_callback(lambda _: self._inflight.pop(cache_key, None))
+        return task
+    
+    async def _produce_and_cache(self, cache_key: str, produce):
+        result = await produce()
+        self._add_to_cache(cache_key, result)
+        return result
+    
+    async def _stream_cached(self, cache_key: str, contents):
+        """Yield a response's text as it arrives, caching the whole of it at the end.
+        A cached or already in-flight response is yielded in one piece."""
+        cached = self._get_from_cache(cache_key)
+        if cached:
+            yield str(cached)
+            return
+        inflight = self._inflight.get(cache_key)
+        if inflight is not None:
+            yield str(await asyncio.shield(inflight))
+            return
+        # Let non-streaming callers with the same key wait for this stream
+        future = asyncio.get_running_loop().create_future()
+        self._inflight[cache_key] = future
+        response = ""
+        try:
+            async for chunk in self._generate_stream(contents):
+                response += chunk
+                yield chunk
+        except Exception as e:
+            future.set_exception(e)
+            future.exception()  # Nobody may be waiting; don't warn about it
+            raise
+        except BaseException:
+            future.cancel()  # Cancelled, or the consumer stopped reading
+            raise
+        else:
+            result = response.strip()
+            self._add_to_cache(cache_key, result)
+            future.set_result(result)
+        finally:
+            self._inflight.pop(cache_key, None)
+    
+    async def _stream_text(self, contents) -> str:
+        """Whole text of a streamed response, stripped."""
+        response = ""
+        async for chunk in self._generate_stream(contents):
+            response += chunk
+        return response.strip()
     
     async def complete_command(self, partial_command: str, context: Optional[dict] = None) -> str:
         """Complete a partial shell command."""
         cache_key = self._cache_key("complete", f"{partial_command}:{context}")
-        cached = self._get_from_cache(cache_key)
-        if cached:
-            return str(cached)
-        
         contents = [
             types.Content(
                 role="user",
@@ -99,23 +195,32 @@ class LLMClient:
                        f"Complete this shell command: {partial_command}\nContext: {context if context else 'None'}"}]
             )
         ]
-        
-        response = ""
-        async for chunk in self._generate_stream(contents):
-            response += chunk
-        
-        result = response.strip()
-        self._add_to_cache(cache_key, result)
-        return result
+        return str(await self._cached(cache_key, lambda: self._stream_text(contents)))
     
     async def explain_error(self, error_message: str) -> str:
         """Explain a shell error message in plain English."""
         cache_key = self._cache_key("error", error_message)
-        cached = self._get_from_cache(cache_key)
-        if cached:
-            return str(cached)
-        
-        contents = [
+        contents = self._error_contents(error_message)
+        return str(await self._cached(cache_key, lambda: self._stream_text(contents)))
+    
+    def prefetch_error(self, error_message: str) -> Optional[asyncio.Task]:
+        """Start explain_error's request ahead of the caller, who then joins it.
+        Returns the task (cancel it if the explanation isn't wanted after all), or
+        None if the answer is cached or someone else is already fetching it."""
+        cache_key = self._cache_key("error", error_message)
+        if cache_key in self._inflight or self._get_from_cache(cache_key):
+            return None
+        contents = self._error_contents(error_message)
+        return self._start(cache_key, lambda: self._stream_text(contents))
+    
+    async def explain_error_stream(self, error_message: str):
+        """Like explain_error, but yields the JSON text as it arrives."""
+        cache_key = self._cache_key("error", error_message)
+        async for chunk in self._stream_cached(cache_key, self._error_contents(error_message)):
+            yield chunk
+    
+    def _error_contents(self, error_message: str):
+        return [
             types.Content(
                 role="user",
                 parts=[{"text": "You are a shell error explainer. Given a shell error, explain it in a structured format using Markdown.\n" +
@@ -133,22 +238,10 @@ class LLMClient:
                        f"Error: {error_message}"}]
             )
         ]
-        
-        response = ""
-        async for chunk in self._generate_stream(contents):
-            response += chunk
-        
-        result = response.strip()
-        self._add_to_cache(cache_key, result)
-        return result
     
     async def explain_command(self, command: str) -> str:
         """Explain what a shell command does in plain English."""
         cache_key = self._cache_key("explain", command)
-        cached = self._get_from_cache(cache_key)
-        if cached:
-            return str(cached)
-        
         contents = [
             types.Content(
                 role="user",
@@ -173,22 +266,15 @@ class LLMClient:
                     "- note 2"}]
             )
         ]
-        
-        response = ""
-        async for chunk in self._generate_stream(contents):
-            response += chunk
-        
-        result = response.strip()
-        self._add_to_cache(cache_key, result)
-        return result
+        return str(await self._cached(cache_key, lambda: self._stream_text(contents)))
     
     async def generate_command(self, natural_language: str, context: Optional[dict] = None) -> Dict:
         """Generate a shell command from natural language, using structured output."""
         cache_key = self._cache_key("generate", f"{natural_language}:{context}")
-        cached = self._get_from_cache(cache_key)
-        if cached and isinstance(cached, dict):
-            return cached
-        
+        return await self._cached(cache_key, lambda: self._generate_command(natural_language),
+                                  valid=lambda cached: isinstance(cached, dict))
+    
+    async def _generate_command(self, natural_language: str) -> Dict:
         try:
             # Use structured output with schema
             contents = [
@@ -300,20 +386,25 @@ Query: {natural_language}"""
                 'detailed_explanation': "No detailed explanation available"
             }
         
-        # Cache the result and return
-        self._add_to_cache(cache_key, result)
         return result
     
     async def _generate_stream(self, contents):
         """Helper method to handle streaming responses."""
-        for chunk in self.client.models.generate_content_stream(
+        # The async client, so the loop keeps running commands meanwhile
+        stream = await self.client.aio.models.generate_content_stream(
             model=self.model,
             contents=contents,
             config=self.default_config,
-        ):
+        )
+        async for chunk in stream:
             yield chunk.text 
 
     def clear_cache(self):
-        """Call this after making prompt changes"""
-        self.persistent_cache = {}
-        self._save_cache() 
\ No newline at end of file
+        """Drop every cached response (bumping the version in _cache_key does the same)."""
+        self._memory.clear()
+        self._memory_bytes = 0
+        try:
+            if self.cache is not None:
+                self.cache.compact(0)
+        except OSError:
+            pass  # The cache is left as it was 
\ No newline at end of file
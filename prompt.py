@@ -0,0 +1,108 @@
+"""
+Prompt rendering for LLMShell. The formatted text is cached and rebuilt only
+when the core's cwd generation, the last exit status or a segment changes.
+Optional segments (git branch and state) are computed in the background and
+swapped in with a redraw, so the keystroke path never waits on them.
+"""
+
+import asyncio
+
+from prompt_toolkit.formatted_text import FormattedText
+
+
+class GitSegment:
+    """Branch of the repository around cwd, with '*' when it has changes. One `git status`."""
+
+    timeout = 2.0  # Seconds; a huge repository just goes without a segment
+
+    async def __call__(self, cwd: str):
+        try:
+            proc = await asyncio.create_subprocess_exec(
+                "git", "--no-optional-locks", "status", "--porcelain", "--branch",
+                cwd=cwd, stdin=asyncio.subprocess.DEVNULL,
+                stdout=asyncio.subprocess.PIPE, stderr=asyncio.subprocess.DEVNULL)
+        except OSError:
+            return []  # No git
+        try:
+            out, _ = await asyncio.wait_for(proc.communicate(), self.timeout)
+        except (asyncio.TimeoutError, asyncio.CancelledError):
+            proc.kill()
+            await proc.wait()
+            raise
+        if proc.returncode != 0:
+            return []  # Not a repository
+        lines = out.decode(errors="replace").splitlines()
+        head = lines[0][3:] if lines and lines[0].startswith("## ") else ""
+        if head.startswith("No commits yet on "):
+            branch = head[len("No commits yet on "):]
+        elif head.startswith("HEAD (no branch)"):
+            branch = "detached"
+        else:
+            branch = head.split("...")[0]
+        dirty = "*" if len(lines) > 1 else ""
+        return [("", " "), ("ansiyellow", f"({branch}{dirty})")]
+
+
+class PromptCache:
+    """Callable prompt for PromptSession: the formatted text for the current state."""
+
+    def __init__(self, core_shell, username: str, hostname: str, segments=()):
+        self.core_shell = core_shell
+        self.head = [("ansigreen", f"{username}@{hostname}"), ("", ":")]
+        self.segments = list(segments)
+        self.values = [[] for _ in self.segments]  # Each segment's last fragments
+        self.values_generation = None  # cwd_generation they were computed for
+        self.version = 0        # Bumped when a segment's value changes
+        self.exit_code = 0      # Status of the last command line, set by the shell after each one
+        self.on_change = None   # Called when a segment changed (e.g. app.invalidate)
+        self._task = None       # The refresh in progress
+        self._key = None
+        self._text = None
+
+    def __call__(self):
+        shell = self.core_shell
+        key = (shell.cwd_generation, self.exit_code, self.version)
+        if key != self._key:
+            # Another directory's git branch would be wrong, not just late
+            values = self.values if self.values_generation == key[0] else []
+            self._text = self._render(shell.get_cwd(), key[1], values)
+            self._key = key
+        return self._text
+
+    def _render(self, cwd: str, exit_code: int, values) -> FormattedText:
+        fragments = self.head + [("ansiblue", cwd)]
+        for value in values:
+            fragments += value
+        if exit_code:
+            fragments.append(("ansired", f" [{exit_code}]"))
+        fragments.append(("", "$ "))
+        return FormattedText(fragments)
+
+    def refresh(self):
+        """Recompute the segments in the background; call after each command."""
+        if not self.segments:
+            return
+        if self._task is not None:
+            self._task.cancel()  # Superseded: it may be for another directory
+        shell = self.core_shell
+        self._task = asyncio.ensure_future(self._update(shell.cwd_generation, shell.get_cwd()))
+        self._task.add_done_callback(self._updated)
+
+    def _updated(self, task):
+        if task is self._task:
+            self._task = None
+        if not task.cancelled() and task.exception() is not None:
+            # Nobody awaits it: report the error through the loop
+            task.get_loop().call_exception_handler({
+                "message": "prompt segment refresh failed", "exception": task.exception(), "future": task})
+
+    async def _update(self, generation: int, cwd: str):
+        values = await asyncio.gather(*(segment(cwd) for segment in self.segments),
+                                      return_exceptions=True)
+        values = [value if isinstance(value, list) else [] for value in values]
+        if values != self.values or generation != self.values_generation:
+            self.values = values
+            self.values_generation = generation
+            self.version += 1
+            if self.on_change is not None:
+                self.on_change()
@@ -1,13 +1,67 @@
-from setuptools import setup, Extension, find_packages
+from setuptools import setup, Extension, find_packages, Command
+from setuptools.command.build_ext import build_ext
 import os
+import subprocess
+import sys
 
 # Read long description from README.md
 with open('README.md', encoding='utf-8') as f:
     long_description = f.read()
 
 core_module = Extension('core',
-                       sources=['core/shell.c', 'core/shell_python.c'],
-                       include_dirs=['core'])
+                       sources=['core/shell.c', 'core/spawn_engine.c', 'core/ring.c', 'core/env.c', 'core/cmd_cache.c', 'core/cmd_index.c', 'core/arena.c', 'core/parser.c', 'core/shell_glob.c', 'core/shell_history.c', 'core/jobs.c', 'core/stats.c', 'core/trace.c', 'core/builtins.c', 'core/redir.c', 'core/spawn_server.c', 'core/spawn_limits.c', 'core/resp_cache.c', 'core/shell_python.c'],
+                       include_dirs=['core'],
+                       libraries=['dl'],
+                       # CORE_USDT=1: compile the trace points in as USDT probes too (needs sys/sdt.h)
+                       define_macros=[('SHELL_USDT', '1')] if os.environ.get('CORE_USDT') == '1' else [])
+
+# The "server" spawn engine's helper: a plain executable, installed next to
+# the extension module (core/spawn_server_main.c)
+SPAWN_SERVER = 'core-spawn-server'
+
+class BuildExt(build_ext):
+    """build_ext that also links the spawn server helper"""
+    def run(self):
+        super().run()
+        out_dir = os.path.dirname(self.get_ext_fullpath('core'))
+        objects = self.compiler.compile(['core/spawn_server_main.c'], output_dir=self.build_temp,
+                                        include_dirs=['core'], debug=self.debug)
+        self.compiler.link_executable(objects, SPAWN_SERVER, output_dir=out_dir)
+
+class BenchCommand(Command):
+    """python setup.py bench: build core in place and run bench/*.py"""
+    description = 'build the core extension in place and run the benchmarks'
+    user_options = [
+        ('output=', 'o', 'file the JSON results are written to [default: bench_output.txt]'),
+        ('baseline=', 'b', 'earlier results; regressions make the command fail'),
+    ]
+
+    def initialize_options(self):
+        self.output = 'bench_output.txt'
+        self.baseline = None
+
+    def finalize_options(self):
+        pass
+
+    def run(self):
+        build_ext = self.reinitialize_command('build_ext', inplace=1)
+        build_ext.ensure_finalized()
+        self.run_command('build_ext')
+
+        env = dict(os.environ, PYTHONPATH=os.path.abspath('.'))
+        benches = [['bench/bench_core.py'] + (['--baseline', self.baseline] if self.baseline else []),
+                   ['bench/bench_parse.py']]
+        failed = False
+        with open(self.output, 'w') as out:
+            for bench in benches:
+                proc = subprocess.run([sys.executable] + bench, env=env, stdout=subprocess.PIPE, text=True)
+                sys.stdout.write(proc.stdout)
+                out.write(''.join(line + '\n' for line in proc.stdout.splitlines()
+                                  if not line.startswith('{"regression"')))
+                failed = failed or proc.returncode != 0
+        if failed:
+            raise SystemExit('benchmarks failed or regressed (see above)')
+
 
 setup(
     name='shell-llm',
@@ -18,8 +72,9 @@ setup(
     author_email='jrdfm@gmail.com',  
     url='https://github.com/jrdfm/shell-llm',  
     py_modules=['llm', 'formatters', 'shell', 'error_handler', 'ui', 'models', 
-                'completions', 'utils', '__main__', '__init__'],
+                'completions', 'history', 'prompt', 'utils', '__main__', '__init__'],
     ext_modules=[core_module],
+    cmdclass={'build_ext': BuildExt, 'bench': BenchCommand},
     python_requires='>=3.8',
     entry_points={
         'console_scripts': [
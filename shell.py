@@ -5,57 +5,86 @@ Uses C core for improved performance.
 Natural language queries start with '#'.
 """
 
+import time
+_START = time.perf_counter()  # Before the imports, for --profile-startup
+
 import os
 import sys
 import asyncio
-import shlex
-import glob
 from prompt_toolkit import PromptSession
-from prompt_toolkit.history import FileHistory
-from prompt_toolkit.auto_suggest import AutoSuggestFromHistory
-from prompt_toolkit.formatted_text import HTML
+from prompt_toolkit.application import run_in_terminal
 from rich.console import Console
-from rich.traceback import install
 import json
-import subprocess
+import re
 
-from core import Shell
-from llm import LLMClient
+from core import Shell, parse
 from completions import ShellCompleter
+from history import CoreHistory, CoreAutoSuggest
+from prompt import PromptCache, GitSegment
 from formatters import ResponseFormatter
 from error_handler import ErrorHandler
-from models import COMMAND_SCHEMA, CommandResponse
 from ui import ShellUI
+from utils import StartupProfile
+
+# llm (google.genai, pydantic) is imported by the first '#' query or error,
+# and rich's traceback handler is installed once the first prompt is up
 
-# Install rich traceback handler
-install()
+# stderr lines that mean a command has failed, whatever it does next
+DEFAULT_FAILURE_SIGNATURES = [
+    r"command not found",
+    r"Permission denied",
+    r"No such file or directory",
+    r"^\S+:\d+(:\d+)?: (fatal )?error:",   # compiler error line
+]
 
 class LLMShell:
-    def __init__(self):
+    def __init__(self, profile: StartupProfile = None):
+        # profile.mark() ends each startup phase when --profile-startup is on
+        self.profile = profile
+        self._started = False  # The first prompt has been drawn
+        mark = profile.mark if profile is not None else lambda phase: None
+        
+        # The core first: everything else, the prompt included, uses it
+        self.core_shell = Shell()
+        mark("core shell")
+        
         self.console = Console(markup=True, highlight=True)
         self.history_file = os.path.expanduser("~/.llm_shell_history")
         
-        # Pre-compute static parts of the prompt
+        # Pre-compute static parts of the prompt; the rest is cached until the
+        # cwd or exit code changes. LLM_PROMPT_GIT=1 adds the git branch.
         self.username = os.getenv("USER", "user")
         self.hostname = os.uname().nodename
+        segments = [GitSegment()] if os.getenv("LLM_PROMPT_GIT", "0") == "1" else []
+        self.get_prompt = PromptCache(self.core_shell, self.username, self.hostname, segments)
         
         # Initialize components
-        self.core_shell = Shell()
         self._llm_client = None
         self.formatter = ResponseFormatter(self.console)
-        self.error_handler = ErrorHandler(self.console, self.llm_client)
+        self.error_handler = ErrorHandler(self.console, lambda: self.llm_client)
         self.ui = ShellUI(self.console)
+        mark("console")
+
+        # Speculative error explanations (LLM_SPECULATE=1): once a running
+        # command's stderr matches a failure signature, its explanation is
+        # requested right away. LLM_FAILURE_SIGNATURES replaces the defaults
+        # with regexes of its own, one per line.
+        self.failure_signatures = None
+        if os.getenv("LLM_SPECULATE", "0") == "1":
+            patterns = os.getenv("LLM_FAILURE_SIGNATURES")
+            patterns = patterns.splitlines() if patterns else DEFAULT_FAILURE_SIGNATURES
+            self.failure_signatures = re.compile("|".join(f"(?:{p})" for p in patterns if p), re.MULTILINE)
+        self._prefetch = None  # (stage, error text, task) of the running command
 
         self.session = PromptSession(
-            history=FileHistory(self.history_file),
-            auto_suggest=AutoSuggestFromHistory(),
+            history=CoreHistory(self.history_file),
+            auto_suggest=CoreAutoSuggest(),
             completer=ShellCompleter(core_shell=self.core_shell),
             enable_history_search=True,
         )
-        
-        # Clear the cache on startup
-        if self.llm_client:
-            self.llm_client.clear_cache()
+        # A segment computed in the background redraws the prompt it belongs to
+        self.get_prompt.on_change = self.session.app.invalidate
+        mark("prompt session")
     
     @property
     def llm_client(self):
@@ -64,16 +93,12 @@ class LLMShell:
             api_key = os.getenv("GOOGLE_API_KEY")
             if not api_key:
                 raise ValueError("GOOGLE_API_KEY environment variable not set")
+            from llm import LLMClient
             self._llm_client = LLMClient(api_key=api_key)
         return self._llm_client
     
-    def get_prompt(self):
-        """Generate the shell prompt."""
-        cwd = self.core_shell.get_cwd()
-        return HTML(f'<ansigreen>{self.username}@{self.hostname}</ansigreen>:<ansiblue>{cwd}</ansiblue>$ ')
-    
-    async def handle_natural_language_query(self, query: str, verbose: bool, very_verbose: bool):
-        """Handle natural language query processing."""
+    async def handle_natural_language_query(self, query: str, verbose: bool, very_verbose: bool) -> int:
+        """Handle natural language query processing. Returns its exit status."""
         try:
             response = await self.llm_client.generate_command(query)
             
@@ -97,9 +122,11 @@ class LLMShell:
                 self.formatter.format_detailed_explanation(response.get('detailed_explanation', ''))
             elif verbose and 'explanation' in response:
                 self.formatter.format_brief_explanation(response.get('explanation', ''))
+            return 0
             
         except Exception as e:
             await self.error_handler.handle_error(e)
+            return 1
     
     def _parse_string_response(self, response: str, query: str) -> dict:
         """Parse string response into structured format."""
@@ -114,26 +141,103 @@ class LLMShell:
             'detailed_explanation': 'No detailed explanation available'
         }
     
-    def _expand_globs(self, args):
-        """Helper function to expand glob patterns in arguments."""
-        if not args:
-            return []
+    def _expand_globs(self, args, globs):
+        """Helper function to expand the wildcard words the parser marked."""
+        if not globs:
+            return args
 
         expanded_args = [args[0]] # Keep the command itself
-        for arg in args[1:]:
-            # Simple check for glob characters
-            if '*' in arg or '?' in arg or ('[' in arg and ']' in arg):
-                matches = glob.glob(arg, recursive=False) # Consider recursive=True?
-                if matches:
-                    expanded_args.extend(matches)
-                else:
-                    # No match, pass the pattern literally
-                    expanded_args.append(arg)
+        for arg, pattern in zip(args[1:], globs[1:]):
+            if pattern is None:
+                # Literal word (no wildcards, or they were quoted)
+                expanded_args.append(arg)
+                continue
+            # Native glob: cached directory listings, sorted like bash
+            matches = self.core_shell.glob(pattern)
+            if matches:
+                expanded_args.extend(matches)
             else:
-                # Not a glob pattern, pass as is
+                # No match, pass the word literally
                 expanded_args.append(arg)
         return expanded_args
 
+    async def _job_builtin(self, args):
+        """jobs, fg [%N] and wait [%N]. Returns (exit_code, error_msg)."""
+        if args[0] == 'jobs':
+            for job in self.core_shell.jobs():
+                state = f"Exit {job['exit_code']}" if job['done'] and job['exit_code'] else ("Done" if job['done'] else "Running")
+                self.console.print(f"[{job['id']}]  {state:<10} {job['command']}", markup=False)
+            return 0, None
+
+        jobs = self.core_shell.jobs()
+        if len(args) > 1:
+            try:
+                ids = [int(args[1].lstrip('%'))]
+            except ValueError:
+                return 1, f"{args[0]}: {args[1]}: no such job"
+        elif args[0] == 'fg':
+            if not jobs:
+                return 1, "fg: no current job"
+            ids = [jobs[-1]['id']] # Like bash's %+: the most recent job
+        else:
+            ids = [job['id'] for job in jobs] # wait with no argument waits for every job
+
+        exit_code, error_msg = 0, None
+        for job_id in ids:
+            if args[0] == 'fg':
+                job = next((j for j in jobs if j['id'] == job_id), None)
+                if job:
+                    self.console.print(job['command'], markup=False)
+            try:
+                exit_code, error_msg = await self.core_shell.wait_job_async(job_id)
+            except ValueError:
+                return 127, f"{args[0]}: %{job_id}: no such job"
+        return exit_code, error_msg
+
+    def _report_finished_jobs(self):
+        """Print a line for each background job that ended since the last prompt."""
+        for job in self.core_shell.reap_jobs():
+            state = f"Exit {job['exit_code']}" if job['exit_code'] else "Done"
+            self.console.print(f"[{job['id']}]  {state:<10} {job['command']}", markup=False)
+
+    def _speculate(self):
+        """on_stderr callback for a foreground run: prefetch the explanation of
+        the stderr the run will report once it shows a failure signature.
+        None when disabled."""
+        if self.failure_signatures is None:
+            return None
+        def on_stderr(stage, tail):
+            # The result reports the first failing stage that wrote stderr, so
+            # a match in an earlier stage replaces the guess for a later one
+            if self._prefetch is not None and self._prefetch[0] <= stage:
+                return
+            if not self.failure_signatures.search(tail):
+                return
+            self._settle_prefetch()
+            text = tail.strip()
+            try:
+                self._prefetch = (stage, text, self.llm_client.prefetch_error(text))
+            except Exception:
+                self._prefetch = (stage, text, None)  # No LLM client; the error path reports it
+        return on_stderr
+
+    def _settle_prefetch(self, error_text=None):
+        """Settle the speculative request once the run's error is known.
+
+        Returns the text handle_error should explain: the prefetched one if
+        error_text starts with it (stderr written after the match doesn't
+        cost a second request), otherwise error_text, and the guess is cancelled.
+        """
+        if self._prefetch is None:
+            return error_text
+        _, text, task = self._prefetch
+        self._prefetch = None
+        if error_text is not None and error_text.startswith(text):
+            return text
+        if task is not None:
+            task.cancel()
+        return error_text
+
     async def handle_command(self, query: str):
         """Process and execute a shell command."""
         if not query.strip():
@@ -152,114 +256,111 @@ class LLMShell:
                 verbose = '-v' in parts
                 very_verbose = '-vv' in parts
                 clean_query = ' '.join([p for p in parts if p not in ['-v', '-vv']])
-                await self.handle_natural_language_query(clean_query, verbose, very_verbose)
+                exit_code = await self.handle_natural_language_query(clean_query, verbose, very_verbose)
                 return
             
+            # --- Parse once: quotes, escapes, pipes and redirections (native parser) ---
+            stages, background = parse(query)
+            if not stages:
+                return
+            # Applied by the core in the spawn path (or in-process, for builtins)
+            redirects = [stage_redirects for _, _, stage_redirects in stages]
+
             # --- Built-in Handling (before core execution) ---
-            if query.startswith('cd ') or query == 'cd':
-                 try:
-                     args = shlex.split(query) # Use shlex even for cd for consistency
-                     path = args[1] if len(args) > 1 else os.getenv("HOME", ".")
-                     # Use core_shell.cd which updates internal CWD
-                     exit_code = self.core_shell.cd(path)
-                     if exit_code != 0:
-                         # cd itself doesn't return error message, use strerror
-                         # (Note: core_shell.cd should ideally set last_error in context)
-                         error_msg = os.strerror(abs(exit_code)) # Assuming cd returns -errno
-                 except Exception as e:
-                     error_msg = f"cd error: {e}"
-                     exit_code = 1 # Indicate error
-                 # Skip core execution for cd
-                 pass # Continue to error handling section
+            if len(stages) == 1 and not background and stages[0][0][0] in ('jobs', 'fg', 'wait'):
+                exit_code, error_msg = await self._job_builtin(stages[0][0])
 
-            # --- Alias Simulation (before parsing) ---
+            # --- Alias Simulation ---
             # Add default color flags for common commands
             # NOTE: This is a basic simulation, real alias handling is complex.
             else:
-                parts = query.split(None, 1) # Split command from args
-                command_word = parts[0] if parts else ''
-                original_args_str = parts[1] if len(parts) > 1 else ''
-                
                 commands_with_color = {'ls', 'grep', 'dir', 'vdir', 'diff'}
-                
-                if command_word in commands_with_color:
-                    # Check if --color is already present
-                    if '--color' not in query.split(): # Basic check
-                        query = f"{command_word} --color=auto {original_args_str}".strip()
-                        # print(f"Alias applied: {query}") # Debug
 
-                # --- Core Execution (Now using potentially modified query) ---
-                if '|' in query:
-                    command_description = "Pipeline"
-                    commands_str = [cmd.strip() for cmd in query.split('|')]
-                    
-                    # Apply alias simulation to each part of the pipeline
-                    processed_cmds_str = []
-                    for cmd_str in commands_str:
-                        cmd_parts = cmd_str.split(None, 1)
-                        cmd_word = cmd_parts[0] if cmd_parts else ''
-                        cmd_args_str = cmd_parts[1] if len(cmd_parts) > 1 else ''
-                        if cmd_word in commands_with_color and '--color' not in cmd_str.split():
-                            processed_cmds_str.append(f"{cmd_word} --color=auto {cmd_args_str}".strip())
-                        else:
-                            processed_cmds_str.append(cmd_str)
-
-                    # Parse each processed stage using shlex and expand globs
-                    pipeline_args_parsed = [shlex.split(cmd) for cmd in processed_cmds_str]
-                    # Expand globs for each command in the pipeline
-                    pipeline_args_expanded = [self._expand_globs(parsed_cmd) for parsed_cmd in pipeline_args_parsed]
+                pipeline_args = []
+                for args, globs, _ in stages:
+                    if args[0] in commands_with_color and not any(a.startswith('--color') for a in args):
+                        args.insert(1, '--color=auto')
+                        if globs:
+                            globs.insert(1, None)
+                    # Expand globs for the words the parser marked as patterns
+                    pipeline_args.append(self._expand_globs(args, globs))
 
-                    valid_pipeline_args = [args for args in pipeline_args_expanded if args]
-                    if not valid_pipeline_args:
-                         error_msg = "Invalid empty pipeline"
-                         exit_code = 1
-                    else:
-                         result = self.core_shell.execute_pipeline(valid_pipeline_args)
+                # --- Core Execution ---
+                if background:
+                    job_id = self.core_shell.start_job(pipeline_args, command=query.rstrip('&').rstrip(),
+                                                       redirects=redirects)
+                    job = next(j for j in self.core_shell.jobs() if j['id'] == job_id)
+                    self.console.print(f"[{job_id}] {job['pgid']}", markup=False)
+                elif len(pipeline_args) > 1:
+                    command_description = "Pipeline"
+                    # Awaitable: the loop keeps serving the prompt and LLM calls meanwhile
+                    result = await self.core_shell.execute_pipeline_async(pipeline_args, redirects=redirects,
+                                                                          on_stderr=self._speculate())
                 else:
-                    # Handle Single Command
+                    # Handle Single Command (cd, echo, export, test... run in-process in the core)
                     command_description = "Command"
-                    # Parse the (potentially modified) query
-                    args_parsed = shlex.split(query)
-                    if not args_parsed:
-                         return # Empty command
-                    # Expand globs
-                    args_expanded = self._expand_globs(args_parsed)
-
-                    result = self.core_shell.execute(args_expanded)
+                    result = await self.core_shell.execute_async(pipeline_args[0], redirects=redirects[0],
+                                                                 on_stderr=self._speculate())
             
             # Process result from core shell execution (if not handled by built-in)
             if result is not None:
-                if isinstance(result, tuple):
-                    exit_code, core_error_msg = result
-                    # Prefer error message from core if available
-                    error_msg = core_error_msg if core_error_msg else error_msg
-                else:
-                    exit_code = result
+                exit_code = result.exit_code
+                # Prefer error message from core if available
+                error_msg = result.error if result.error else error_msg
 
             # --- Error Handling --- 
             # Handle any error message or non-zero exit code from built-ins or core
             if (error_msg and error_msg.strip()) or exit_code != 0:
                 error_text = error_msg.strip() if error_msg else f"{command_description} failed with exit code {exit_code}"
+                # A speculative request for this text (or its start) is joined, not repeated
+                explain = self._settle_prefetch(error_text)
                 # Call the async error handler
-                await self.error_handler.handle_error(error_text)
+                await self.error_handler.handle_error(error_text, explain=explain)
 
         except ValueError as e:
-            # Catch shlex parsing errors
+            # Catch syntax errors from the parser
+            exit_code = 2  # Like a shell's syntax error
             await self.error_handler.handle_error(f"Parsing error: {e}")
         except Exception as e:
             # Catch other unexpected errors during handling/execution
+            exit_code = 1
             await self.error_handler.handle_error(f"Execution error: {e}")
+        finally:
+            # The command succeeded (or failed differently): drop the guess
+            self._settle_prefetch()
+            # Every path's status, not just core runs' (the core's last_exit_code)
+            self.get_prompt.exit_code = exit_code
+
+    def _prompt_drawn(self):
+        """pre_run of the prompt: the rest of startup waits until the first one is drawn."""
+        if not self._started:
+            self._started = True
+            asyncio.get_running_loop().call_soon(self._finish_startup)
+
+    def _finish_startup(self):
+        if self.profile is not None:
+            self.profile.mark("first prompt")
+            report = self.profile.report()
+            run_in_terminal(lambda: print(report, file=sys.stderr))
+        self.get_prompt.refresh()
+        # Rich tracebacks import pygments, which the prompt needn't wait for
+        from rich.traceback import install
+        install()
 
     async def run(self):
         """Run the interactive shell."""
         self.ui.show_welcome_banner()
+        if self.profile is not None:
+            self.profile.mark("banner")
         
         while True:
             try:
-                command = await self.session.prompt_async(self.get_prompt)
+                self._report_finished_jobs()
+                command = await self.session.prompt_async(self.get_prompt, pre_run=self._prompt_drawn)
                 if command.strip() == "exit":
                     break
                 await self.handle_command(command)
+                self.get_prompt.refresh()
             except EOFError:
                 break
             except KeyboardInterrupt:
@@ -271,7 +372,17 @@ class LLMShell:
 
 def main():
     """Entry point for the shell."""
-    shell = LLMShell()
+    import argparse
+    parser = argparse.ArgumentParser(prog="shell-llm", description="Interactive shell with LLM-powered features")
+    parser.add_argument("--profile-startup", action="store_true",
+                        help="print how long each startup phase took once the prompt is up")
+    args = parser.parse_args()
+    
+    profile = None
+    if args.profile_startup:
+        profile = StartupProfile(_START)
+        profile.mark("imports")
+    shell = LLMShell(profile)
     asyncio.run(shell.run())
 
 if __name__ == "__main__":
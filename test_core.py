@@ -1,6 +1,11 @@
 import core
 import shlex
 import os
+import errno
+import asyncio
+import threading
+import signal
+import time
 import pytest # Assuming pytest is used or can be added to requirements
 
 # Fixture to create a shell instance for each test
@@ -58,6 +63,26 @@ def test_execute_invalid_command(shell):
     assert error is not None
     assert "No such file or directory" in error # execvp error message
 
+def test_execute_large_stderr(shell):
+    """Test a child writing far more than a pipe buffer of stderr doesn't deadlock"""
+    shell.stderr_tail_size = 1024
+    script = "head -c 1000000 /dev/zero | tr '\\0' x >&2; echo >&2; echo LAST LINE >&2; exit 3"
+    exit_code, error = shell.execute(["sh", "-c", script])
+    assert exit_code == 3
+    # Only the tail is kept, starting at a line boundary
+    assert error == "LAST LINE\n"
+
+def test_execute_stderr_tail_size(shell):
+    """Test the stderr tail size is configurable and validated"""
+    assert shell.stderr_tail_size == 4096
+    shell.stderr_tail_size = 16
+    exit_code, error = shell.execute(["sh", "-c", "echo 0123456789abcdefXYZ >&2; exit 1"])
+    assert exit_code == 1
+    assert len(error) <= 16
+    assert error.endswith("XYZ\n")
+    with pytest.raises(ValueError):
+        shell.stderr_tail_size = 0
+
 def test_pipeline_simple(shell):
     """Test a simple pipeline"""
     cmds = [
@@ -90,10 +115,93 @@ def test_pipeline_fail_stage(shell):
     ]
     pipeline_args = [shlex.split(c) for c in cmds]
     exit_code, error = shell.execute_pipeline(pipeline_args)
-    # The exit code reflects the *last* command. wc -c might succeed if it gets empty input.
-    # A more robust test would capture stderr from the failing stage if possible.
-    # For now, just check the exit code of the last stage (might be 0 or non-zero depending on wc behavior)
-    assert error is None # Current implementation doesn't capture errors from pipeline stages
+    # The exit code reflects the *last* command (wc -c succeeds on empty input),
+    # but the failing stage's own stderr is reported
+    assert exit_code == 0
+    assert error == "cat: non_existent_file_should_fail: No such file or directory\n"
+    assert shell.pipestatus[1:] == (1, 0)
+    stages = shell.last_stages()
+    assert stages[1]["error"] == error and stages[2] == {"exit_code": 0, "signal": 0, "error": None}
+
+def test_pipeline_stage_signals_and_large_stderr(shell):
+    """Test per-stage signals, and stages flooding stderr at the same time"""
+    shell.stderr_tail_size = 64
+    flood = "head -c 200000 /dev/zero | tr '\\0' x >&2; echo >&2; echo {} done >&2; exit {}"
+    exit_code, error = shell.execute_pipeline([
+        ["sh", "-c", flood.format("first", 2)],
+        ["sh", "-c", flood.format("second", 0)],
+        ["sh", "-c", "kill -TERM $$"],
+    ])
+    assert exit_code == -1
+    assert error == "first done\n"
+    assert shell.pipestatus == (2, 0, -1)
+    assert [s["signal"] for s in shell.last_stages()] == [0, 0, 15]
+    assert shell.last_stages()[1]["error"] == "second done\n"
+
+def test_pipeline_pipe_size(shell):
+    """Test throughput mode enlarges the pipes between stages without losing data"""
+    # F_GETPIPE_SZ on the stage's stdin
+    probe = ["python3", "-c", "import fcntl; print(fcntl.fcntl(0, 1032))"]
+    assert shell.pipe_size == 0
+    assert bytes(shell.execute_pipeline([["true"], probe], capture=True)[2]) == b"65536\n"
+    shell.pipe_size = 1 << 20
+    assert bytes(shell.execute_pipeline([["true"], probe], capture=True)[2]) == b"1048576\n"
+    # Past the unprivileged limit: clamped, not refused
+    shell.pipe_size = 1 << 30
+    size = int(bytes(shell.execute_pipeline([["true"], probe], capture=True)[2]))
+    assert 65536 <= size <= 1 << 30
+    exit_code, error, out = shell.execute_pipeline(
+        [["head", "-c", "5000000", "/dev/zero"], ["cat"], ["wc", "-c"]], capture=True)
+    assert (exit_code, bytes(out).strip()) == (0, b"5000000")
+    with pytest.raises(OverflowError):
+        shell.pipe_size = -1
+
+def test_execute_capture(shell):
+    """Test capturing stdout as a buffer-protocol object"""
+    exit_code, error, out = shell.execute(["echo", "captured text"], capture=True)
+    assert exit_code == 0
+    assert error is None
+    assert isinstance(out, core.Output)
+    assert len(out) == len("captured text\n")
+    assert bytes(out) == b"captured text\n"
+    assert out.decode() == "captured text\n"
+    view = memoryview(out)
+    assert view.readonly
+    assert view[:8] == b"captured"
+
+    # Without capture the result shape is unchanged
+    assert shell.execute(["true"]) == (0, None)
+
+def test_execute_capture_large_and_empty(shell):
+    """Test capture handles large outputs and commands that print nothing"""
+    exit_code, error, out = shell.execute(["head", "-c", "20000000", "/dev/zero"], capture=True)
+    assert exit_code == 0
+    assert len(out) == 20000000
+    assert memoryview(out)[-1] == 0
+
+    exit_code, error, out = shell.execute(["true"], capture=True)
+    assert exit_code == 0
+    assert len(out) == 0 and bytes(out) == b""
+
+def test_pipeline_capture(shell):
+    """Test capturing the last stage of a pipeline, sync and async"""
+    exit_code, error, out = shell.execute_pipeline([["printf", "b\\na\\n"], ["sort"]], capture=True)
+    assert exit_code == 0
+    assert bytes(out) == b"a\nb\n"
+
+    async def run():
+        return await asyncio.gather(
+            shell.execute_pipeline_async([["echo", "one two three"], ["wc", "-w"]], capture=True),
+            shell.execute_async(["cat", "non_existent_file_should_fail"], capture=True),
+        )
+    (exit_code, error, out), failed = asyncio.run(run())
+    assert exit_code == 0
+    assert out.decode().strip() == "3"
+
+    exit_code, error, out = failed
+    assert exit_code != 0
+    assert "No such file or directory" in error
+    assert len(out) == 0
 
 def test_cd(shell, change_dir):
     """Test changing directory"""
@@ -141,11 +249,749 @@ def test_env_vars(shell):
     assert exit_code == 0
     assert shell.getenv(var_name) == new_value
 
+def test_env_exact_name_match(shell):
+    """Test lookups match the whole name, not a prefix of it"""
+    shell.setenv("CORE_PATH_TEST", "short")
+    shell.setenv("CORE_PATH_TESTX", "long")
+    assert shell.getenv("CORE_PATH_TEST") == "short"
+    assert shell.getenv("CORE_PATH_TESTX") == "long"
+    assert shell.getenv("CORE_PATH_TES") is None
+    assert shell.unsetenv("CORE_PATH_TEST") == 0
+    assert shell.getenv("CORE_PATH_TEST") is None
+    assert shell.getenv("CORE_PATH_TESTX") == "long"
+
+@pytest.mark.parametrize("engine", ["fork", "posix_spawn", "server"])
+def test_env_passed_to_children(shell, engine):
+    """Test children see the shell's environment, not the process environment"""
+    shell.spawn_engine = engine
+    shell.setenv("CORE_CHILD_VAR", "from the shell")
+    exit_code, _, out = shell.execute(["sh", "-c", "echo $CORE_CHILD_VAR"], capture=True)
+    assert exit_code == 0
+    assert bytes(out) == b"from the shell\n"
+    assert os.environ.get("CORE_CHILD_VAR") is None
+
+    # Changes after a launch are picked up by the next one
+    shell.unsetenv("CORE_CHILD_VAR")
+    shell.setenv("CORE_OTHER_VAR", "x")
+    exit_code, _, out = shell.execute_pipeline([["env"], ["grep", "^CORE_"]], capture=True)
+    assert bytes(out) == b"CORE_OTHER_VAR=x\n"
+
+def test_env_many_vars(shell):
+    """Test the table grows and keeps every variable reachable"""
+    for i in range(500):
+        assert shell.setenv(f"CORE_BULK_{i}", str(i)) == 0
+    for i in range(0, 500, 2):
+        shell.unsetenv(f"CORE_BULK_{i}")
+    for i in range(500):
+        assert shell.getenv(f"CORE_BULK_{i}") == (None if i % 2 == 0 else str(i))
+    exit_code, _, out = shell.execute(["sh", "-c", "env | grep -c ^CORE_BULK_"], capture=True)
+    assert bytes(out) == b"250\n"
+
+def test_which_follows_shell_path(shell, tmp_path):
+    """Test command lookup uses the shell's PATH and notices changes"""
+    assert shell.which("sh") is not None
+    assert shell.which("sh") == shell.which("sh") # Cached
+    assert shell.which("no_such_command_core_test") is None
+    assert shell.which("./relative") is None
+
+    first = tmp_path / "first"
+    second = tmp_path / "second"
+    first.mkdir()
+    second.mkdir()
+    tool = second / "core_test_tool"
+    tool.write_text("#!/bin/sh\necho second\n")
+    tool.chmod(0o755)
+
+    shell.setenv("PATH", f"{first}:{second}:{shell.getenv('PATH')}")
+    assert shell.which("core_test_tool") == str(tool)
+    exit_code, _, out = shell.execute(["core_test_tool"], capture=True)
+    assert exit_code == 0 and bytes(out) == b"second\n"
+
+    # A new file in an earlier directory shadows the cached one
+    time.sleep(0.01)
+    shadow = first / "core_test_tool"
+    shadow.write_text("#!/bin/sh\necho first\n")
+    shadow.chmod(0o755)
+    assert shell.which("core_test_tool") == str(shadow)
+    shell.spawn_engine = "posix_spawn"
+    exit_code, _, out = shell.execute(["core_test_tool"], capture=True)
+    assert bytes(out) == b"first\n"
+
+    # Removal is noticed too
+    time.sleep(0.01)
+    shadow.unlink()
+    assert shell.which("core_test_tool") == str(tool)
+
+def test_path_commands(shell, tmp_path):
+    """Test listing PATH executables for completion"""
+    (tmp_path / "core_listed").write_text("#!/bin/sh\n")
+    (tmp_path / "core_listed").chmod(0o755)
+    (tmp_path / "core_not_executable").write_text("")
+    (tmp_path / "core_subdir").mkdir()
+    shell.setenv("PATH", f"{tmp_path}:{shell.getenv('PATH')}")
+
+    names = shell.path_commands()
+    assert names == sorted(set(names))
+    assert "core_listed" in names and "sh" in names
+    assert "core_not_executable" not in names and "core_subdir" not in names
+
+    time.sleep(0.01)
+    (tmp_path / "core_listed_later").write_text("#!/bin/sh\n")
+    (tmp_path / "core_listed_later").chmod(0o755)
+    assert "core_listed_later" in shell.path_commands()
+
+def test_command_index(shell, tmp_path):
+    """Test prefix queries on command index snapshots"""
+    index = core.CommandIndex(["git", "grep", "gzip", "git", "ls", "g"])
+    assert (len(index), index.complete("g")) == (5, ["g", "git", "grep", "gzip"])
+    assert index.complete("gi") == ["git"] and index.complete("x") == [] and index.complete("zz") == []
+    assert index.complete() == ["g", "git", "grep", "gzip", "ls"] and index.complete("g", limit=2) == ["g", "git"]
+    assert "git" in index and "gi" not in index and "lsx" not in index
+    (tmp_path / "core_indexed").write_text("#!/bin/sh\n")
+    (tmp_path / "core_indexed").chmod(0o755)
+    shell.setenv("PATH", f"{tmp_path}:{shell.getenv('PATH')}")
+    index = shell.command_index(extra=["core_builtin_name"])
+    assert index.complete("core_") == ["core_builtin_name", "core_indexed"]
+    assert "sh" in index and len(index) == len(set(shell.path_commands()) | {"core_builtin_name"})
+
+def test_parse_words_and_pipes():
+    """Test the native parser's quoting and pipeline splitting"""
+    stages, background = core.parse("ls -la | grep 'a|b' | wc -l")
+    assert [argv for argv, _, _ in stages] == [["ls", "-la"], ["grep", "a|b"], ["wc", "-l"]]
+    assert background is False
+
+    stages, _ = core.parse('echo "x \\"y\\" $HOME" a\\ b \'\' "it\'s"')
+    assert stages[0][0] == ["echo", 'x "y" $HOME', "a b", "", "it's"]
+    assert core.parse("   ") == ([], False)
+    assert core.parse("sleep 1 &") == ([(["sleep", "1"], None, [])], True)
+
+def test_parse_globs_and_redirects():
+    """Test wildcard markers and redirections"""
+    stages, _ = core.parse("ls *.py 'lit*'x? [ab] [ plain")
+    argv, globs, redirects = stages[0]
+    assert argv == ["ls", "*.py", "lit*x?", "[ab]", "[", "plain"]
+    assert globs == [None, "*.py", "lit\\*x?", "[ab]", None, None]
+    assert redirects == []
+
+    stages, _ = core.parse("cat < in > out 2>&1 | tee -a log &>> all")
+    assert stages[0] == (["cat"], None, [(0, "<", "in"), (1, ">", "out"), (2, ">&", 1)])
+    assert stages[1] == (["tee", "-a", "log"], None, [(1, ">>", "all"), (2, ">&", 1)])
+    assert core.parse("echo 2 >x")[0][0][0] == ["echo", "2"] # Not glued to '>': a word
+
+@pytest.mark.parametrize("line", ["a || b", "a && b", "a | | b", "| a", "a |", "a & b",
+                                  "echo 'open", 'echo "open', "a >", "echo \\",
+                                  "echo hi >&-", "echo hi 2>&-", "cat <&-"])
+def test_parse_errors(line):
+    """Test syntax errors raise ValueError"""
+    with pytest.raises(ValueError):
+        core.parse(line)
+
+def test_bench_parse():
+    """Test the parser benchmark reports steady-state arena use"""
+    stats = core.bench_parse("ls -la *.py | grep -v 'foo bar' | wc -l > out 2>&1", 1000)
+    assert stats["ns_per_line"] > 0
+    assert stats["mallocs_per_line"] <= 0.001 # The reused arena block is enough
+    assert stats["bytes_per_line"] > 0
+
+def test_execute_any_sequence(shell):
+    """Test execute accepts tuples and other sequences, not just lists"""
+    assert shell.execute(("true",)) == (0, None)
+    exit_code, _, out = shell.execute(argv=("echo", "a", "b"), capture=True)
+    assert bytes(out) == b"a b\n"
+    exit_code, _, out = shell.execute_pipeline((("echo", "x y"), ["wc", "-w"]), capture=True)
+    assert bytes(out).strip() == b"2"
+    exit_code, _, out = shell.execute_pipeline([iter(["echo", "gen"]), ("cat",)], capture=True)
+    assert bytes(out) == b"gen\n"
+    assert shell.execute_pipeline(()) == (0, None)
+
+def test_execute_argument_errors(shell):
+    """Test bad arguments raise instead of running anything"""
+    with pytest.raises(TypeError):
+        shell.execute(["echo", 1])
+    with pytest.raises(TypeError):
+        shell.execute(5)
+    with pytest.raises(TypeError):
+        shell.execute(["true"], bogus=True)
+    with pytest.raises(TypeError):
+        shell.execute()
+    with pytest.raises(ValueError):
+        shell.execute(["echo", "nul\0byte"])
+    with pytest.raises(TypeError):
+        shell.execute_pipeline([["true"], 3])
+    assert shell.execute(["true"]) == (0, None) # Lock released after errors
+
+def test_argv_arena_steady_state(shell):
+    """Test repeated launches stop allocating argv memory"""
+    argv = ["true"] + ["argument-%d" % i for i in range(50)]
+    shell.execute(argv)
+    warm = shell.argv_arena_mallocs
+    for _ in range(100):
+        shell.execute(argv)
+        shell.execute_pipeline([tuple(argv), argv])
+    assert shell.argv_arena_mallocs == warm
+
+def test_glob(shell, tmp_path):
+    """Test native glob expansion: sorting, hidden files, escapes"""
+    for name in ["b.txt", "a.txt", ".hidden.txt", "c.log", "[x].txt"]:
+        (tmp_path / name).write_text("")
+    (tmp_path / "sub").mkdir()
+    (tmp_path / "sub" / "d.txt").write_text("")
+    shell.cd(str(tmp_path))
+
+    assert shell.glob("*.txt") == ["[x].txt", "a.txt", "b.txt"]
+    assert shell.glob(".*.txt") == [".hidden.txt"]
+    assert shell.glob("*/*.txt") == ["sub/d.txt"]
+    assert shell.glob("*/") == ["sub/"]
+    assert shell.glob(f"{tmp_path}/?.log") == [f"{tmp_path}/c.log"]
+    assert shell.glob("\\[x].txt") == ["[x].txt"]
+    assert shell.glob("*.none") == []
+
+def test_glob_cache(shell, tmp_path):
+    """Test that unchanged directories are listed once and changes are seen"""
+    (tmp_path / "one.txt").write_text("")
+    time.sleep(0.15) # Older than the racy window, so the listing can be cached
+    shell.cd(str(tmp_path))
+
+    assert shell.glob("*.txt") == ["one.txt"]
+    before = shell.glob_cache_info()
+    assert shell.glob("*.txt") == ["one.txt"]
+    after = shell.glob_cache_info()
+    assert after["hits"] == before["hits"] + 1 and after["misses"] == before["misses"]
+
+    (tmp_path / "two.txt").write_text("")
+    assert shell.glob("*.txt") == ["one.txt", "two.txt"]
+
+def test_execute_line(shell, tmp_path):
+    """Test running whole command lines with native parsing and globbing"""
+    (tmp_path / "x1").write_text("")
+    (tmp_path / "x2").write_text("")
+    shell.cd(str(tmp_path))
+
+    exit_code, error, out = shell.execute_line("echo x* 'x*' nomatch* | tr x y", capture=True)
+    assert (exit_code, error) == (0, None)
+    assert bytes(out) == b"y1 y2 y* nomatch*\n"
+    assert shell.execute_line("   ") == (0, None)
+
+    async def run_async():
+        return await shell.execute_line_async("false")
+    assert asyncio.run(run_async())[0] == 1
+    with pytest.raises(ValueError, match="No closing quotation"):
+        shell.execute_line("echo 'open")
+
+@pytest.mark.parametrize("engine", ["fork", "posix_spawn", "server"])
+def test_redirections(shell, tmp_path, engine):
+    """Test redirections applied in the spawn path and for in-process builtins"""
+    shell.spawn_engine = engine
+    shell.cd(str(tmp_path))
+    out_txt = tmp_path / "out.txt"
+
+    assert shell.execute(["echo", "one"], redirects=[(1, ">", "out.txt")]) == (0, None)
+    assert shell.execute(["/bin/echo", "two"], redirects=[(1, ">>", "out.txt")]) == (0, None)
+    assert out_txt.read_text() == "one\ntwo\n"
+    exit_code, error, out = shell.execute(["cat"], capture=True, redirects=[(0, "<", "out.txt")])
+    assert bytes(out) == b"one\ntwo\n"
+
+    # Order matters: 2>&1 after >file sends both to the file
+    both = ["sh", "-c", "echo out; echo err >&2"]
+    assert shell.execute(both, redirects=[(1, ">", "out.txt"), (2, ">&", 1)]) == (0, None)
+    assert out_txt.read_text() == "out\nerr\n"
+    exit_code, error, out = shell.execute(both, capture=True, redirects=[(2, ">&", 1)])
+    assert (error, bytes(out)) == (None, b"out\nerr\n")
+
+    # Bad targets fail the command like bash, without launching it
+    assert shell.execute(["cat"], redirects=[(0, "<", "missing")]) == (1, "missing: No such file or directory")
+    assert shell.execute(["echo"], redirects=[(1, ">&", 5)]) == (1, "5: Bad file descriptor")
+    assert shell.execute(["cd", "/nonexistent"], redirects=[(2, ">", "/dev/null")]) == (1, None)
+
+    # Per stage, after the pipes
+    exit_code, error, out = shell.execute_pipeline([["echo", "ignored"], ["wc", "-l"]], capture=True,
+                                                   redirects=[None, [(0, "<", "out.txt")]])
+    assert bytes(out).strip() == b"2"
+    exit_code, error, out = shell.execute_line("cat < missing | wc -l", capture=True)
+    assert (exit_code, shell.pipestatus, bytes(out).strip()) == (0, (1, 0), b"0")
+    assert shell.execute_line("ls /nonexistent &> out.txt")[0] != 0
+    assert "nonexistent" in out_txt.read_text()
+
+    with pytest.raises(ValueError):
+        shell.execute(["true"], redirects=[(1, "<>", "x")])
+    with pytest.raises(TypeError):
+        shell.execute(["true"], redirects=[(1, ">", 3)])
+
+@pytest.mark.parametrize("engine", ["fork", "posix_spawn", "server"])
+def test_background_jobs(shell, engine):
+    """Test background jobs: own process group, reaping, kill and wait"""
+    shell.spawn_engine = engine
+    assert shell.execute_line("sh -c 'exit 4' | cat &") == (0, None)
+    done_id = shell.last_job
+    sleeper = shell.start_job([["sleep", "30"]], command="sleeper")
+
+    jobs = {job["id"]: job for job in shell.jobs()}
+    assert jobs[done_id]["command"] == "sh -c 'exit 4' | cat"
+    assert jobs[sleeper]["pgid"] == jobs[sleeper]["pids"][0] != os.getpgid(0)
+    assert not jobs[sleeper]["done"]
+
+    for _ in range(100):
+        finished = shell.reap_jobs()
+        if finished:
+            break
+        time.sleep(0.01)
+    assert [(job["id"], job["exit_code"]) for job in finished] == [(done_id, 0)]
+    assert [job["id"] for job in shell.jobs()] == [sleeper]
+
+    shell.kill_job(sleeper)
+    async def wait():
+        return await shell.wait_job_async(sleeper)
+    assert asyncio.run(wait())[0] == -1
+    assert shell.jobs() == []
+    with pytest.raises(ValueError):
+        shell.wait_job(sleeper)
+
+def test_job_stage_leaves_group(shell):
+    """Test a job stage that moves to its own process group is still reaped"""
+    job = shell.start_job([["/bin/true"], ["setsid", "sh", "-c", "sleep 0.3; exit 3"]])
+    pid = next(j for j in shell.jobs() if j["id"] == job)["pids"][1]
+    for _ in range(200):
+        finished = shell.reap_jobs()
+        if finished:
+            break
+        time.sleep(0.01)
+    assert [(j["id"], j["done"], j["exit_code"]) for j in finished] == [(job, True, 3)]
+    with pytest.raises(ChildProcessError):
+        os.waitpid(pid, os.WNOHANG)  # Reaped, not left a zombie
+
+def test_execute_many(shell):
+    """Test batch execution: bounded parallelism, results in input order"""
+    argvs = [["sh", "-c", f"sleep 0.{3 - i % 3}; echo err{i} >&2; exit {i}"] for i in range(6)]
+    start = time.monotonic()
+    results = shell.execute_many(argvs, max_parallel=3)
+    elapsed = time.monotonic() - start
+    assert results == [(i, f"err{i}\n" if i else None) for i in range(6)]
+    # Two rounds of three, not six one after another
+    assert 0.4 <= elapsed < 1.2
+
+    results = shell.execute_many([["true"], ["thiscommandshouldnotexistanywhere"]], max_parallel=0)
+    assert results[0] == (0, None)
+    assert results[1][0] == 127
+    assert shell.execute_many([]) == []
+    with pytest.raises(TypeError):
+        shell.execute_many([["echo", 1]])
+
+def test_execute_usage_and_stats(shell):
+    """Test wait4 resource usage in results and the rolling stats table"""
+    exit_code, error, (usage,) = shell.execute(["sh", "-c", "sleep 0.1"], usage=True)
+    assert exit_code == 0 and error is None
+    assert 0.1 <= usage["wall_time"] < 2
+    assert usage["max_rss"] > 0
+    assert usage["voluntary_switches"] >= 1
+
+    exit_code, error, out, stages = shell.execute_pipeline([["echo", "x"], ["cat"]], capture=True, usage=True)
+    assert bytes(out) == b"x\n" and len(stages) == 2
+    assert shell.execute(["cd", "."], usage=True) == (0, None, ())
+
+    assert shell.stats_size == 0
+    shell.execute(["true"])
+    assert shell.stats() == []
+    shell.stats_size = 2
+    shell.execute(["true"])
+    shell.execute_line("sh -c 'exit 3' | cat")
+    assert shell.execute_many([["sleep", "0.05"]], usage=True)[0][2]["wall_time"] >= 0.05
+    stats = shell.stats()
+    # Oldest entry dropped, pipelines counted once
+    assert [(s["command"], s["exit_code"], s["stages"]) for s in stats] == [
+        ("sh -c 'exit 3' | cat", 0, 2), ("sleep 0.05", 0, 1)]
+    assert stats[1]["wall_time"] >= 0.05
+    shell.clear_stats()
+    assert shell.stats() == [] and shell.stats_size == 2
+
+def test_trace_events(shell):
+    """Test the trace ring records each stage's spawn and reap while tracing is on"""
+    assert not shell.tracing
+    shell.trace_events(clear=True)
+    shell.execute(["true"])
+    assert shell.trace_events() == []
+
+    shell.tracing = True
+    try:
+        shell.execute_pipeline([["sh", "-c", "echo oops >&2"], ["cat"]])
+        shell.spawn_engine = "posix_spawn"
+        shell.execute(["thiscommandshouldnotexistanywhere"])
+    finally:
+        shell.tracing = False
+        shell.spawn_engine = "fork"
+    events = shell.trace_events(clear=True)
+    assert shell.trace_events() == []
+    assert [e["ns"] for e in events] == sorted(e["ns"] for e in events)
+
+    pipeline, missing = sorted({e["run"] for e in events})
+    spawns = {e["stage"]: e["pid"] for e in events if e["run"] == pipeline and e["event"] == "spawn"}
+    reaps = {e["stage"]: e["pid"] for e in events if e["run"] == pipeline and e["event"] == "reap"}
+    assert len(spawns) == 2 and spawns == reaps
+    assert any(e["event"] == "stderr_read" and e["stage"] == 0 and e["value"] == 5 for e in events)
+    # Then the "cmd: No such file or directory" message is read back as stderr
+    failed = [(e["event"], e["value"]) for e in events if e["run"] == missing]
+    assert [event for event, _ in failed] == ["stage_start", "spawn", "exec_failed", "stderr_read"]
+    assert failed[2][1] == errno.ENOENT
+
+def test_builtins_in_process(shell):
+    """Test echo/printf/test/export/... run without a child process"""
+    # No stages in the usage tuple: nothing was spawned
+    exit_code, error, out, stages = shell.execute(["echo", "-e", "a\\tb"], capture=True, usage=True)
+    assert (exit_code, error, bytes(out), stages) == (0, None, b"a\tb\n", ())
+    assert bytes(shell.execute(["printf", "%s=%03d\\n", "a", "7", "b"], capture=True)[2]) == b"a=007\nb=000\n"
+    assert bytes(shell.execute(["pwd"], capture=True)[2]).decode() == shell.get_cwd() + "\n"
+
+    assert shell.execute(["test", "2", "-gt", "1", "-a", "-d", "/"]) == (0, None)
+    assert shell.execute(["[", "a", "=", "b", "]"]) == (1, None)
+    assert shell.execute(["[", "x", "-lt", "1", "]"]) == (2, "[: x: integer expression expected\n")
+    assert shell.execute(["false"]) == (1, None)
+
+    assert shell.execute(["export", "BUILTIN_VAR=one", "2bad"]) == (1, "export: `2bad': not a valid identifier\n")
+    assert shell.getenv("BUILTIN_VAR") == "one"
+    assert bytes(shell.execute(["sh", "-c", "echo $BUILTIN_VAR"], capture=True)[2]) == b"one\n"
+    assert shell.execute(["unset", "BUILTIN_VAR"]) == (0, None)
+    assert shell.getenv("BUILTIN_VAR") is None
+
+    out = bytes(shell.execute(["type", "echo", "sh"], capture=True)[2]).decode()
+    assert out == f"echo is a shell builtin\nsh is {shell.which('sh')}\n"
+    assert shell.execute(["type", "nosuchcommandhere"]) == (1, "type: nosuchcommandhere: not found\n")
+
+    # Inside a pipeline the real commands run, one process per stage
+    exit_code, error, out = shell.execute_pipeline([["echo", "hi"], ["tr", "a-z", "A-Z"]], capture=True)
+    assert bytes(out) == b"HI\n" and len(shell.pipestatus) == 2
+
+def test_spawn_engine_switch(shell):
+    """Test selecting the process launch engine"""
+    assert shell.spawn_engine == "fork"
+    shell.spawn_engine = "posix_spawn"
+    assert shell.spawn_engine == "posix_spawn"
+    with pytest.raises(ValueError):
+        shell.spawn_engine = "clone3"
+    assert core.Shell(spawn_engine="posix_spawn").spawn_engine == "posix_spawn"
+
+def test_posix_spawn_execute(shell):
+    """Test commands launched through posix_spawn behave like fork+exec"""
+    shell.spawn_engine = "posix_spawn"
+    exit_code, error = shell.execute(shlex.split("echo Hello from posix_spawn"))
+    assert exit_code == 0
+    assert error is None
+
+    exit_code, error = shell.execute(["thiscommandshouldnotexistanywhere"])
+    assert exit_code == 127
+    assert "thiscommandshouldnotexistanywhere: No such file or directory" in error
+
+def test_posix_spawn_pipeline(shell):
+    """Test pipelines launched through posix_spawn"""
+    shell.spawn_engine = "posix_spawn"
+    exit_code, error = shell.execute_pipeline([["echo", "Hello"], ["tr", "a-z", "A-Z"], ["wc", "-c"]])
+    assert exit_code == 0
+
+    # A stage that can't be executed counts as exit 127, like under fork
+    exit_code, error = shell.execute_pipeline([["echo", "Hello"], ["thiscommandshouldnotexistanywhere"]])
+    assert exit_code == 127
+
+def test_spawn_server(shell):
+    """Test commands launched by the spawn server helper"""
+    assert shell.spawn_server_pid is None
+    shell.spawn_engine = "server"
+    server = shell.spawn_server_pid
+    assert server is not None
+
+    # Children are the helper's, in our cwd, with our stdin/stdout/stderr layout
+    exit_code, error, out = shell.execute(["sh", "-c", "echo $PPID; pwd"], capture=True)
+    assert bytes(out).decode().split() == [str(server), shell.get_cwd()]
+    assert shell.execute(["sh", "-c", "echo oops >&2; exit 3"]) == (3, "oops\n")
+    exit_code, error = shell.execute(["thiscommandshouldnotexistanywhere"])
+    assert exit_code == 127 and "No such file or directory" in error
+    exit_code, error, out = shell.execute_pipeline([["printf", "a\nb\n"], ["sh", "-c", "cat; exit 2"], ["wc", "-l"]],
+                                                   capture=True)
+    assert (exit_code, shell.pipestatus, bytes(out).strip()) == (0, (0, 2, 0), b"2")
+    assert shell.execute_many([["/bin/true"], ["/bin/false"]] * 4, max_parallel=3) == [(0, None), (1, None)] * 4
+    # wait4() figures come back from the helper
+    exit_code, error, (usage,) = shell.execute(["sh", "-c", "sleep 0.05"], usage=True)
+    assert usage["wall_time"] >= 0.05 and usage["max_rss"] > 0
+
+    async def run_async():
+        return await asyncio.gather(*[shell.execute_async(["sh", "-c", "exit %d" % i]) for i in range(8)])
+    assert [r[0] for r in asyncio.run(run_async())] == list(range(8))
+
+    # An exit the helper died before reporting is a failure, not exit 0. The
+    # helper is replaced the next time the engine is chosen; until then
+    # commands are launched directly
+    async def run_orphan():
+        future = shell.execute_async(["sh", "-c", "sleep 0.3"])
+        await asyncio.sleep(0.1)
+        os.kill(server, signal.SIGKILL)
+        return await future
+    exit_code, error = asyncio.run(run_orphan())
+    assert exit_code == 127 and "exit status lost" in error
+    assert shell.execute(["/bin/echo"]) == (0, None)
+    assert shell.spawn_server_pid is None
+    shell.spawn_engine = "server"
+    assert shell.spawn_server_pid not in (None, server)
+
+def test_execute_releases_gil(shell):
+    """Test that other Python threads run while a command executes"""
+    ticks = []
+    def ticker():
+        deadline = time.monotonic() + 0.3
+        while time.monotonic() < deadline:
+            ticks.append(1)
+            time.sleep(0.01)
+    t = threading.Thread(target=ticker)
+    t.start()
+    exit_code, error = shell.execute(["sleep", "0.3"])
+    t.join()
+    assert exit_code == 0
+    assert len(ticks) > 5
+
+def test_command_result(shell):
+    """Test CommandResult reads like the old tuple and names every field"""
+    result = shell.execute(["sh", "-c", "echo oops >&2; exit 3"])
+    assert isinstance(result, core.CommandResult)
+    assert result == (3, "oops\n") and tuple(result) == (3, "oops\n") and result[-1] == "oops\n"
+    assert (result.exit_code, result.error, result.signal, result.output, result.usage) == (3, "oops\n", 0, None, None)
+    exit_code, error, out, usage = shell.execute_pipeline([["echo", "x"], ["cat"]], capture=True, usage=True)
+    assert (bytes(out), len(usage)) == (b"x\n", 2)
+    result = shell.execute_pipeline([["sh", "-c", "exit 0"], ["sh", "-c", "kill -9 $$"]], capture=True)
+    assert (result.exit_code, result.signal, result.pipestatus, len(result)) == (-1, 9, (0, -1), 3)
+    assert result[:2] == (-1, "Pipeline command terminated abnormally")
+    assert shell.execute(["cd", "/"]).pipestatus == (0,)
+
+def test_concurrent_executes_share_one_shell(shell):
+    """Test one Shell running commands from a thread pool: waits overlap, results don't mix"""
+    from concurrent.futures import ThreadPoolExecutor
+    def run(i):
+        return shell.execute(["sh", "-c", "sleep 0.3; echo err%d >&2; exit %d" % (i, i)])
+    start = time.monotonic()
+    with ThreadPoolExecutor(4) as pool:
+        results = list(pool.map(run, range(1, 5)))
+    assert time.monotonic() - start < 1.0 # 4 x 0.3s if they ran one at a time
+    assert results == [(i, "err%d\n" % i) for i in range(1, 5)]
+
+def test_response_cache(tmp_path):
+    """Test the response cache persists, survives a torn append and rebuilds a lost index"""
+    import hashlib
+    path = tmp_path / "cache"
+    key = hashlib.sha256(b"explain|ls").hexdigest()
+    cache = core.ResponseCache(str(path))
+    assert cache.get(key) is None
+    cache.put(key, b'"first"')
+    cache.put(key, b'"lists files"')
+    cache.put(bytes.fromhex(key)[::-1], b"{}")
+    assert (cache.get(key), cache.get(bytes.fromhex(key)), len(cache)) == (b'"lists files"', b'"lists files"', 2)
+    with pytest.raises(ValueError):
+        cache.get("not a digest")
+    cache.close()
+    with open(path, "ab") as f:
+        f.write(b"\x40\0\0\0 half a record")  # A crash mid-append
+    size = path.stat().st_size
+    cache = core.ResponseCache(str(path))
+    assert cache.get(key) == b'"lists files"' and path.stat().st_size < size
+    cache.put("ab" * 32, b"after")
+    cache.close()
+    os.unlink(str(path) + ".idx")
+    cache = core.ResponseCache(str(path))
+    assert (len(cache), cache.get("ab" * 32)) == (3, b"after")
+    cache.compact()
+    info = cache.info()
+    assert info["entries"] == 3 and info["log_bytes"] == 32 + info["live_bytes"]
+    assert core.ResponseCache(str(path)).get(key) == b'"lists files"'
+
+def test_response_cache_evicts_least_recently_used(tmp_path):
+    """Test a capped cache compacts down to its most recently used entries"""
+    cache = core.ResponseCache(str(tmp_path / "cache"), max_bytes=128 * 1024)
+    keys = ["%064x" % i for i in range(140)]
+    for k in keys[:100]:
+        cache.put(k, b"x" * 1000)
+    assert cache.get(keys[0]) is not None # Recently used now
+    for k in keys[100:]:
+        cache.put(k, b"x" * 1000)
+    info = cache.info()
+    assert info["compactions"] == 1 and info["log_bytes"] <= 128 * 1024
+    assert cache.get(keys[0]) is not None and cache.get(keys[1]) is None
+    assert cache.get(keys[-1]) == b"x" * 1000
+
+def test_history(tmp_path):
+    """Test indexed history reads FileHistory's format and answers prefix queries newest first"""
+    path = tmp_path / "history"
+    path.write_text("\n# 2024-01-01 10:00:00.000000\n+git status\n"
+                    "\n# 2024-01-01 10:00:01.000000\n+for f in *; do\n+  echo $f\n+done\n"
+                    "\n# 2024-01-01 10:00:02.000000\n+git stash\n")
+    hist = core.History(str(path))
+    assert hist.strings() == ["git stash", "for f in *; do\n  echo $f\ndone", "git status"]
+    assert hist.suggest("git st") == "git stash" and hist.suggest("svn") is None
+    # Any line of a multi-line entry can be suggested, like AutoSuggestFromHistory does
+    assert hist.suggest("for f") == "for f in *; do" and hist.suggest("  e") == "  echo $f"
+    assert hist.suggest("do") == "done"
+    assert (hist[0], hist[-1], len(hist)) == ("git status", "git stash", 3)
+    hist.append("git status")
+    hist.append("git log\n--oneline")
+    assert hist.suggest("git st") == "git status" and hist.suggest("--o") == "--oneline"
+    assert hist.search("git") == ["git log\n--oneline", "git status", "git stash"]
+    assert hist.search("git", limit=1) == ["git log\n--oneline"] and len(hist) == 5
+    with open(path, "a") as f:
+        f.write("\n# 2024-01-01 10:00:03.000000\n+git push\n")  # Another shell
+        f.write("\n# 2024-01-01 10:00:04.000000\n+half writ") # Still being written
+    assert core.History(str(path)).strings()[0] == "git push"
+    with open(path, "a") as f:
+        f.write("ten\n")
+    hist.append("ls")
+    assert hist.suggest("git") == "git push" and hist.strings()[:3] == ["ls", "half written", "git push"]
+    reopened = core.History(str(path))
+    assert reopened.strings() == hist.strings() and reopened.search("g") == hist.search("g")
+
+def test_execute_async(shell):
+    """Test awaitable execution returns the same result shape as execute"""
+    async def run():
+        ok = await shell.execute_async(["echo", "async hello"])
+        bad = await shell.execute_async(["cat", "non_existent_file_should_fail"])
+        missing = await shell.execute_async(["thiscommandshouldnotexistanywhere"])
+        return ok, bad, missing
+    ok, bad, missing = asyncio.run(run())
+    assert ok == (0, None)
+    assert bad[0] != 0 and "No such file or directory" in bad[1]
+    assert missing[0] == 127
+
+def test_execute_async_keeps_loop_responsive(shell):
+    """Test the event loop keeps running while an async command is in flight"""
+    async def run():
+        ticks = 0
+        task = asyncio.ensure_future(shell.execute_async(["sleep", "0.3"]))
+        while not task.done():
+            ticks += 1
+            await asyncio.sleep(0.01)
+        return ticks, task.result()
+    ticks, result = asyncio.run(run())
+    assert result == (0, None)
+    assert ticks > 5
+
+def test_execute_pipeline_async(shell):
+    """Test awaitable pipelines, including concurrent runs on one Shell"""
+    async def run():
+        return await asyncio.gather(
+            shell.execute_pipeline_async([["echo", "one two"], ["wc", "-w"]]),
+            shell.execute_pipeline_async([["echo", "x"], ["false"]]),
+            shell.execute_pipeline_async([["sh", "-c", "echo oops >&2; exit 3"], ["cat"]]),
+            shell.execute_async(["cd", "/"]),
+        )
+    piped, failed, stage_error, cd = asyncio.run(run())
+    assert piped == (0, None)
+    assert failed == (1, "Pipeline command failed")
+    assert stage_error == (0, "oops\n")
+    assert cd == (0, None)
+    assert shell.get_cwd() == "/"
+
+def test_execute_async_on_stderr(shell):
+    """Test on_stderr sees a stage's stderr tail before the run is over"""
+    async def run():
+        seen = []
+        future = shell.execute_pipeline_async(
+            [["true"], ["sh", "-c", "echo 'cc: not found' >&2; sleep 0.3; echo more >&2; exit 1"]],
+            on_stderr=lambda stage, tail: seen.append((stage, tail, future.done())))
+        return await future, seen
+    result, seen = asyncio.run(run())
+    assert result[0] == 1 and result[1] == "cc: not found\nmore\n"
+    assert seen[0] == (1, "cc: not found\n", False)
+    assert all(stage == 1 and not done for stage, _, done in seen)
+    with pytest.raises(TypeError):
+        shell.execute_async(["true"], on_stderr=1)
+
+def test_exit_status_lost(shell):
+    """Test a child reaped by someone else fails instead of reading as exit 0"""
+    previous = signal.signal(signal.SIGCHLD, signal.SIG_IGN) # The kernel reaps children itself
+    try:
+        exit_code, error = shell.execute(["sh", "-c", "exit 0"])
+        pipeline_code, _ = shell.execute_pipeline([["sh", "-c", "exit 0"], ["cat"]])
+    finally:
+        signal.signal(signal.SIGCHLD, previous)
+    assert exit_code == 127 and "exit status lost" in error
+    assert pipeline_code == 127
+
 def test_get_cwd(shell):
     """Test getting the current working directory"""
     # Compare with os.getcwd() as a sanity check
     assert shell.get_cwd() == os.getcwd()
 
+def test_cwd_generation(shell):
+    """Test get_cwd() returns one cached object until cd bumps cwd_generation"""
+    generation = shell.cwd_generation
+    assert shell.get_cwd() is shell.get_cwd()
+    assert shell.execute(["cd", "/nonexistent_dir_for_generation"])[0] != 0
+    assert shell.cwd_generation == generation
+    assert shell.last_exit_code != 0
+    assert shell.execute(["cd", "/tmp"]) == (0, None)
+    assert shell.cwd_generation == generation + 1
+    assert shell.last_exit_code == 0
+    assert shell.get_cwd() == os.path.realpath("/tmp") and shell.get_cwd() is shell.get_cwd()
+
+def test_snapshot(shell, tmp_path):
+    """Test a snapshot's cd and setenv stay its own and never move the process"""
+    (tmp_path / "sub").mkdir()
+    (tmp_path / "sub" / "f").write_text("x")
+    shell.setenv("SNAP_VAR", "parent")
+    process_cwd = os.getcwd()
+    snap = shell.snapshot()
+    assert snap.get_cwd() == shell.get_cwd()
+
+    assert snap.execute(["cd", str(tmp_path)]) == (0, None)
+    assert snap.execute(["cd", "sub"]) == (0, None)
+    assert snap.execute(["cd", "missing"])[0] != 0
+    assert os.getcwd() == process_cwd and shell.get_cwd() == process_cwd
+    assert snap.get_cwd() == str(tmp_path / "sub")
+    for engine in ("fork", "posix_spawn"):
+        snap.spawn_engine = engine
+        assert bytes(snap.execute(["/bin/pwd"], capture=True)[2]) == str(tmp_path / "sub").encode() + b"\n"
+    # The spawn server only knows paths, so its children start from the fd too
+    snap.spawn_engine = "server"
+    (tmp_path / "sub").rename(tmp_path / "moved")
+    assert bytes(snap.execute(["/bin/pwd"], capture=True)[2]) == str(tmp_path / "moved").encode() + b"\n"
+    (tmp_path / "moved").rename(tmp_path / "sub")
+    # Relative redirections and test operands resolve against the snapshot's cwd
+    assert snap.execute_line("cat f > g") == (0, None)
+    assert snap.execute_line("test -f g") == (0, None)
+    assert (tmp_path / "sub" / "g").read_text() == "x"
+
+    # The environment is shared until one side changes it
+    snap.setenv("SNAP_VAR", "child")
+    assert shell.getenv("SNAP_VAR") == "parent" and snap.getenv("SNAP_VAR") == "child"
+    shell.unsetenv("SNAP_VAR")
+    assert bytes(snap.execute(["sh", "-c", "echo $SNAP_VAR"], capture=True)[2]) == b"child\n"
+    nested = snap.snapshot()
+    assert nested.get_cwd() == snap.get_cwd() and nested.getenv("SNAP_VAR") == "child"
+
+def test_limits(shell):
+    """Test limits= placement and rlimits are applied in the child, per stage"""
+    cpu = min(os.sched_getaffinity(0))
+    # Field 19 of /proc/self/stat is the niceness
+    probe = ["sh", "-c", "grep Cpus_allowed_list /proc/self/status; ulimit -n; cut -d' ' -f19 /proc/self/stat"]
+    result = shell.execute(probe, capture=True, limits={"cpus": [cpu], "rlimit_nofile": 64, "nice": 19})
+    assert bytes(result[2]).split() == [b"Cpus_allowed_list:", str(cpu).encode(), b"64", b"19"]
+    # Limits need code between fork and exec, so they override posix_spawn. It
+    # would trace a missing command as exec_failed; a forked child just exits 127.
+    shell.spawn_engine = "posix_spawn"
+    shell.tracing = True
+    try:
+        result = shell.execute(["thiscommandshouldnotexistanywhere"], limits={"nice": 19})
+    finally:
+        shell.tracing = False
+        shell.spawn_engine = "fork"
+    events = [e["event"] for e in shell.trace_events(clear=True)]
+    assert result.exit_code == 127 and "spawn" in events and "exec_failed" not in events
+    # One dict (or None) per stage
+    result = shell.execute_pipeline([["sh", "-c", "ulimit -n >&2"], ["sh", "-c", "ulimit -n"]], capture=True,
+                                    limits=[{"rlimit_nofile": (32, 48)}, None])
+    assert result.pipestatus == (0, 0) and shell.last_stages()[0]["error"] == "32\n"
+    assert bytes(result[2]) != b"32\n"
+    assert shell.execute_many([["sh", "-c", "test $(ulimit -n) = 40"]] * 2, limits={"rlimit_nofile": 40}) == [(0, None)] * 2
+    # Failures are the child's, reported like any startup error
+    result = shell.execute(["true_is_not_run"], limits={"cgroup": "/nonexistent_cgroup"})
+    assert result.exit_code == 1 and result.error.startswith("/nonexistent_cgroup/cgroup.procs:")
+    for bad in ({"cpu": [0]}, {"cpus": []}, {"numa": "bind"}, {"ioprio": "fast"}, {"rlimit_as": "big"}):
+        with pytest.raises(ValueError):
+            shell.execute(["/bin/true"], limits=bad)
+    with pytest.raises(TypeError):
+        shell.execute(["/bin/true"], limits=[{}])
+
 # Example of how to run using pytest:
 # 1. pip install pytest
 # 2. Run `pytest test_core.py` in the terminal 
\ No newline at end of file
@@ -0,0 +1,144 @@
+import io
+import json
+import asyncio
+import pytest
+from rich.console import Console
+import llm
+from error_handler import ErrorHandler, SolutionStream
+
+def test_legacy_cache_imported_once(tmp_path, monkeypatch):
+    """Test the old JSON cache is imported, set aside, and not re-imported after clear_cache"""
+    monkeypatch.setenv("HOME", str(tmp_path))
+    key = "ab" * 32
+    legacy = tmp_path / ".llm_shell_cache.json"
+    legacy.write_text(json.dumps({key: {"command": "ls"}}))
+    client = llm.LLMClient("test-key")
+    assert client._get_from_cache(key) == {"command": "ls"}
+    assert not legacy.exists() and (tmp_path / ".llm_shell_cache.json.migrated").exists()
+
+    client.clear_cache()
+    assert client._get_from_cache(key) is None
+    assert llm.LLMClient("test-key")._get_from_cache(key) is None
+
+# Fixture for a client whose persistent cache lives in a temporary HOME
+@pytest.fixture
+def client(tmp_path, monkeypatch):
+    monkeypatch.setenv("HOME", str(tmp_path))
+    return llm.LLMClient("test-key")
+
+# Fixture replacing the model with a slow stream that counts its calls
+@pytest.fixture
+def backend(client):
+    calls = []
+    async def generate_stream(contents):
+        calls.append(contents)
+        await asyncio.sleep(0.05)
+        if len(calls) == 1 and getattr(client, "fail_first", False):
+            raise RuntimeError("backend down")
+        yield '{"problem": "it broke", '
+        yield '"solution": ["fix it"]}'
+    client._generate_stream = generate_stream
+    return calls
+
+def test_memory_cache_evicts_least_recently_used(client):
+    """Test the memory tier drops its least recently used entry at capacity"""
+    client.cache = None  # Memory tier only
+    client.memory_max_entries = 2
+    client._add_to_cache("a", "first")
+    client._add_to_cache("b", "second")
+    assert client._get_from_cache("a") == "first"  # Now newer than b
+    client._add_to_cache("c", "third")
+    assert list(client._memory) == ["a", "c"] and client._get_from_cache("b") is None
+    client.memory_max_bytes = len(json.dumps("third"))
+    client._add_to_cache("c", "third")
+    assert list(client._memory) == ["c"] and client._memory_bytes == client.memory_max_bytes
+
+def test_concurrent_requests_share_one_call(client, backend):
+    """Test identical requests in flight together make one backend call"""
+    async def run():
+        return await asyncio.gather(*[client.explain_error("boom") for _ in range(3)])
+    results = asyncio.run(run())
+    assert len(backend) == 1 and results == [results[0]] * 3
+    assert json.loads(results[0])["problem"] == "it broke" and not client._inflight
+    assert asyncio.run(client.explain_error("boom")) == results[0] and len(backend) == 1
+
+def test_cancelled_waiter_leaves_shared_request_running(client, backend):
+    """Test one caller's cancellation doesn't cancel the request others wait on"""
+    async def run():
+        first = asyncio.ensure_future(client.explain_error("boom"))
+        second = asyncio.ensure_future(client.explain_error("boom"))
+        await asyncio.sleep(0.01)
+        first.cancel()
+        with pytest.raises(asyncio.CancelledError):
+            await first
+        return await second
+    assert json.loads(asyncio.run(run()))["solution"] == ["fix it"]
+    assert len(backend) == 1
+
+def test_failed_request_is_not_cached(client, backend):
+    """Test an error reaches every waiter and the next request calls the backend again"""
+    client.fail_first = True
+    async def run():
+        return await asyncio.gather(client.explain_error("boom"), client.explain_error("boom"),
+                                    return_exceptions=True)
+    results = asyncio.run(run())
+    assert all(isinstance(r, RuntimeError) for r in results) and len(backend) == 1
+    assert not client._inflight and client._get_from_cache(client._cache_key("error", "boom")) is None
+    assert json.loads(asyncio.run(client.explain_error("boom")))["problem"] == "it broke"
+    assert len(backend) == 2
+
+def feed_in_pieces(text, size):
+    """A SolutionStream fed text size characters at a time."""
+    parser = SolutionStream()
+    for i in range(0, len(text), size):
+        parser.feed(text[i:i + size])
+    return parser
+
+def test_solution_stream_chunk_splits():
+    """Test strings and escapes split anywhere across chunks parse as json would"""
+    reply = json.dumps({"problem": 'Quote "x" and café \\ done',
+                        "solution": ["**Step 1**: run `echo \"hi\"`", "- Step 2: ✓"]})
+    assert '\\"' in reply and "\\u00e9" in reply
+    for size in range(1, 8):
+        parser = feed_in_pieces(reply, size)
+        assert parser.problem == 'Quote "x" and café \\ done'
+        assert parser.solution == ["**Step 1**: run `echo \"hi\"`", "Step 2: ✓"]
+
+def test_solution_stream_nested():
+    """Test problem and solution are found inside nested objects, across chunks"""
+    reply = ('```json\n{"error_explanation": {"meta": {"model": "x"}, '
+             '"problem": "p", "solution": ["a", {"note": "skipped"}, ["b"], "c\\nd"]}}\n```')
+    for size in (1, 3, len(reply)):
+        parser = feed_in_pieces(reply, size)
+        assert parser.problem == "p" and parser.solution == ["a", "b", "c\nd"]
+    # A string solution is split into steps, one per line
+    assert feed_in_pieces('{"solution": "- one\\n- two"}', 2).solution == ["one", "two"]
+
+def test_solution_stream_truncated_and_invalid():
+    """Test partial or non-JSON replies keep what was complete and fall back when rendered"""
+    handler = ErrorHandler(Console(file=io.StringIO()), lambda: None)
+    reply = '{"problem": "disk full", "solution": ["free space", "retr'
+    parser = feed_in_pieces(reply, 4)
+    assert parser.problem == "disk full" and parser.solution == ["free space"]
+    assert "Could not parse explanation data." in handler._explanation_markdown(reply)
+
+    parser = SolutionStream()
+    assert not parser.feed("Sorry, I can't help with that.")
+    assert parser.problem is None and parser.solution == []
+    assert handler._explanation_markdown("Sorry, I can't help with that.").startswith("**Problem:**\nExplanation")
+
+def test_stream_replays_cached_response(client, backend):
+    """Test a cached or in-flight response is streamed again in one piece"""
+    async def collect():
+        return [chunk async for chunk in client.explain_error_stream("boom")]
+    async def run():
+        first = asyncio.ensure_future(collect())
+        await asyncio.sleep(0.01)
+        joined = await collect()  # Joins the stream in flight
+        return await first, joined
+    chunks, joined = asyncio.run(run())
+    assert len(chunks) == 2 and joined == ["".join(chunks).strip()]
+    replay = asyncio.run(collect())
+    assert replay == joined and len(backend) == 1
+    parser = feed_in_pieces(replay[0], len(replay[0]))
+    assert (parser.problem, parser.solution) == ("it broke", ["fix it"])
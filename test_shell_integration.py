@@ -78,6 +78,28 @@ async def test_integration_pipeline(llm_shell, capsys):
     assert "pipeline test" not in captured.err
     assert "wc" not in captured.err
 
+async def test_integration_quoted_pipe(llm_shell, mocker):
+    """Test a '|' inside quotes is an argument, not a pipeline"""
+    mock_error_handle = mocker.patch('shell.ErrorHandler.handle_error', new_callable=mocker.AsyncMock)
+    await llm_shell.handle_command("grep -c 'a|b' /dev/null")
+    # grep -c prints 0 and exits 1 for no match; a split pipeline would fail differently
+    mock_error_handle.assert_awaited_once()
+    args, kwargs = mock_error_handle.call_args
+    assert "exit code 1" in args[0]
+
+async def test_integration_background_job(llm_shell, mocker):
+    """Test a trailing '&' starts a job that wait collects"""
+    mock_error_handle = mocker.patch('shell.ErrorHandler.handle_error', new_callable=mocker.AsyncMock)
+    await llm_shell.handle_command("sh -c 'exit 3' &")
+    job_id = llm_shell.core_shell.last_job
+    assert job_id is not None
+    mock_error_handle.assert_not_awaited()
+    await llm_shell.handle_command(f"wait %{job_id}")
+    mock_error_handle.assert_awaited_once()
+    args, kwargs = mock_error_handle.call_args
+    assert "exit code 3" in args[0]
+    assert llm_shell.core_shell.jobs() == []
+
 async def test_integration_cd_builtin(llm_shell, tmp_path):
     """Test the cd built-in handling"""
     original_cwd = llm_shell.core_shell.get_cwd()
@@ -110,15 +132,50 @@ async def test_integration_shlex_error(llm_shell, mocker):
     assert "Parsing error" in args[0]
     assert "No closing quotation" in args[0]
 
-async def test_integration_redirection_as_args(llm_shell, capsys):
-    """Test that redirection chars are treated as args (current limitation)"""
-    # This test confirms current behavior, NOT desired shell behavior
-    cmd = "echo hello > output.txt"
-    await llm_shell.handle_command(cmd)
+async def test_integration_redirection(llm_shell, tmp_path, capsys):
+    """Test that redirections are applied natively, without an extra shell"""
+    target = tmp_path / "output.txt"
+    await llm_shell.handle_command(f"echo hello > {target}")
+    await llm_shell.handle_command(f"printf 'a\\nb\\n' | tr a-z A-Z >> {target}")
     captured = capsys.readouterr()
-    # Check that '>' wasn't interpreted and no error occurred immediately
-    # (unless echo itself errors on '>' as an arg)
-    assert ">" not in captured.err # crude check
-    # Clean up dummy file if echo happens to create it (unlikely)
-    if os.path.exists("output.txt"):
-        os.remove("output.txt")
+    assert "hello" not in captured.out
+    assert target.read_text() == "hello\nA\nB\n"
+
+async def test_integration_speculative_explanation(llm_shell, monkeypatch, tmp_path):
+    """Test a prefetched explanation is joined, not repeated, when more stderr follows"""
+    import re
+    import llm
+    monkeypatch.setenv("HOME", str(tmp_path))
+    client = llm.LLMClient("test-key")
+    calls = []
+    async def generate_stream(contents):
+        calls.append(contents)
+        await asyncio.sleep(0.5)  # Still in flight when the command ends
+        yield '{"problem": "p", "solution": ["s"]}'
+    client._generate_stream = generate_stream
+    prefetched = []
+    prefetch_error = client.prefetch_error
+    def record_prefetch(text):
+        prefetched.append(prefetch_error(text))
+        return prefetched[-1]
+    client.prefetch_error = record_prefetch
+    handled = []
+    async def handle_error(error_msg, explain=None):
+        handled.append((error_msg, explain))
+        await client.explain_error(explain)
+    llm_shell._llm_client = client
+    llm_shell.failure_signatures = re.compile("No such file or directory")
+    monkeypatch.setattr(llm_shell.error_handler, "handle_error", handle_error)
+
+    # Matched on the first line; the rest arrives later and the prefix is explained
+    await llm_shell.handle_command("sh -c 'cat /nonexistent_a; sleep 0.2; echo more >&2; exit 1'")
+    (error, explain), = handled
+    assert error.endswith("more") and explain == "cat: /nonexistent_a: No such file or directory"
+    assert len(calls) == 1 and len(prefetched) == 1 and not prefetched[0].cancelled()
+
+    # The result reports the earlier stage, so its later match replaces the first guess
+    handled.clear()
+    await llm_shell.handle_command("sh -c 'sleep 0.2; cat /nonexistent_b' | sh -c 'cat /nonexistent_c; sleep 0.4; exit 1'")
+    (error, explain), = handled
+    assert explain == error == "cat: /nonexistent_b: No such file or directory"
+    assert len(calls) == 3 and prefetched[1].cancelled() and not prefetched[2].cancelled()
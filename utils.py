@@ -4,6 +4,7 @@ Utility functions for the LLM shell assistant.
 
 import os
 import subprocess
+import time
 from typing import Tuple, Optional
 
 def execute_command(command: str) -> Tuple[str, Optional[str]]:
@@ -51,6 +52,32 @@ def get_command_history(limit: int = 10) -> list[str]:
     except Exception:
         return []
 
+class StartupProfile:
+    """
+    Wall-clock time of each startup phase, for --profile-startup.
+    
+    Args:
+        start: perf_counter() value the first phase is measured from
+    """
+    
+    def __init__(self, start: Optional[float] = None):
+        self.start = time.perf_counter() if start is None else start
+        self.last = self.start
+        self.phases = []
+    
+    def mark(self, phase: str) -> None:
+        """End a phase: it took the time since the previous mark."""
+        now = time.perf_counter()
+        self.phases.append((phase, now - self.last))
+        self.last = now
+    
+    def report(self) -> str:
+        """One line per phase, then the total, in milliseconds."""
+        width = max([len(phase) for phase, _ in self.phases] + [5])
+        lines = [f"{phase:<{width}}  {seconds * 1000:8.1f} ms" for phase, seconds in self.phases]
+        lines.append(f"{'total':<{width}}  {(self.last - self.start) * 1000:8.1f} ms")
+        return "\n".join(lines)
+
 def get_environment_context() -> dict:
     """
     Get relevant environment information for context.